@@ -265,7 +265,12 @@ contains(CONFIG, config_endian_big) {
 # - Try and detect jemalloc and if not, don't use jemalloc.
 # - User can override auto-detection by specifying "LIBS+=-ljemaloc..." on the
 #   CLI when they invoked qmake.
-!contains(LIBS, -ljemalloc) {
+# - User can instead opt-in to mimalloc by specifying "LIBS+=-lmimalloc" on the
+#   CLI (jemalloc is then not used). See also src/Allocator.h.
+contains(LIBS, -lmimalloc) {
+    DEFINES += HAVE_MIMALLOC
+    message("mimalloc: using CLI override")
+} else:!contains(LIBS, -ljemalloc) {
     # Test if jemalloc is installed
     qtCompileTest(jemalloc)
     contains(CONFIG, config_jemalloc) {
@@ -292,11 +297,13 @@ INCLUDEPATH += src/
 
 SOURCES += \
     AbstractConnection.cpp \
+    Allocator.cpp \
     App.cpp \
     BTC.cpp \
     BTC_Address.cpp \
     BitcoinD.cpp \
     BitcoinD_RPCInfo.cpp \
+    BlockedBloomFilter.cpp \
     BlockProc.cpp \
     CityHash.cpp \
     Common.cpp \
@@ -304,15 +311,20 @@ SOURCES += \
     Controller_SynchDSPsTask.cpp \
     CoTask.cpp \
     DSProof.cpp \
+    EliasFano.cpp \
     Json/Json.cpp \
     Json/Json_Parser.cpp \
     Json/tests.cpp \
+    LoadGen.cpp \
+    LockStats.cpp \
     Logger.cpp \
     main.cpp \
     Mempool.cpp \
     Merkle.cpp \
+    Metrics.cpp \
     Mixins.cpp \
     Mgr.cpp \
+    MockBitcoinD.cpp \
     Options.cpp \
     PeerMgr.cpp \
     RecordFile.cpp \
@@ -327,6 +339,7 @@ SOURCES += \
     SubsMgr.cpp \
     SubStatus.cpp \
     ThreadPool.cpp \
+    Tracing.cpp \
     TXO.cpp \
     Util.cpp \
     VarInt.cpp \
@@ -337,11 +350,13 @@ SOURCES += \
 
 HEADERS += \
     AbstractConnection.h \
+    Allocator.h \
     App.h \
     BTC.h \
     BTC_Address.h \
     BitcoinD.h \
     BitcoinD_RPCInfo.h \
+    BlockedBloomFilter.h \
     BlockProc.h \
     BlockProcTypes.h \
     ByteView.h \
@@ -353,10 +368,14 @@ HEADERS += \
     CostCache.h \
     CoTask.h \
     DSProof.h \
+    EliasFano.h \
+    Hash256.h \
     Json/Json.h \
+    LockStats.h \
     Logger.h \
     Mempool.h \
     Merkle.h \
+    Metrics.h \
     Mgr.h \
     Mixins.h \
     Options.h \
@@ -375,6 +394,7 @@ HEADERS += \
     SubStatus.h \
     ThreadPool.h \
     ThreadSafeHashTable.h \
+    Tracing.h \
     TXO.h \
     TXO_Compact.h \
     Util.h \
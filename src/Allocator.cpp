@@ -0,0 +1,286 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "Allocator.h"
+
+#include "Common.h"
+#include "Util.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QVariantList>
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+#if HAVE_MIMALLOC
+#include <mimalloc.h>
+#elif HAVE_JEMALLOC_HEADERS
+#define JEMALLOC_NO_DEMANGLE
+#include <jemalloc/jemalloc.h>
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+namespace Allocator {
+
+    namespace {
+        std::atomic_bool periodicPurge{false};
+
+        [[maybe_unused]] double ratio(double num, double den) { return den > 0. && num > 0. ? num / den : 0.; }
+
+#if !HAVE_MIMALLOC && HAVE_JEMALLOC_HEADERS
+        template <typename T>
+        bool jeGet(const char *name, T &out) {
+            size_t sz = sizeof(T);
+            return je_mallctl(name, &out, &sz, nullptr, 0) == 0 && sz == sizeof(T);
+        }
+        template <typename T>
+        bool jeSet(const char *name, T val) {
+            return je_mallctl(name, nullptr, nullptr, &val, sizeof(T)) == 0;
+        }
+        unsigned jeNArenas() {
+            unsigned n = 0;
+            jeGet("arenas.narenas", n);
+            return n;
+        }
+#endif
+    } // namespace
+
+#if HAVE_MIMALLOC
+    QString name() { return QStringLiteral("mimalloc"); }
+
+    void configure(unsigned purgeMSec)
+    {
+        if (!purgeMSec) return;
+#if MI_MALLOC_VERSION >= 210 || (MI_MALLOC_VERSION >= 180 && MI_MALLOC_VERSION < 200)
+        mi_option_set(mi_option_purge_delay, long(purgeMSec));
+#else
+        mi_option_set(mi_option_reset_delay, long(purgeMSec));
+#endif
+        DebugM("mimalloc: purge delay set to ", purgeMSec, " msec");
+    }
+
+    void purge() { mi_collect(true); }
+
+    QVariantMap stats(bool)
+    {
+        size_t elapsed{}, user{}, sys{}, rss{}, peakRss{}, commit{}, peakCommit{}, faults{};
+        mi_process_info(&elapsed, &user, &sys, &rss, &peakRss, &commit, &peakCommit, &faults);
+        return {
+            { "allocator", name() },
+            { "version", mi_version() },
+            { "resident", qulonglong(rss) },
+            { "resident_peak", qulonglong(peakRss) },
+            { "committed", qulonglong(commit) },
+            { "committed_peak", qulonglong(peakCommit) },
+            { "page_faults", qulonglong(faults) },
+        };
+    }
+
+    QString dumpHeapProfile(const QString &pathPrefix)
+    {
+        // mimalloc has no heap profiler; its detailed statistics are the closest thing
+        const QString path = pathPrefix + ".txt";
+        QByteArray buf;
+        mi_stats_print_out([](const char *msg, void *arg){ *static_cast<QByteArray *>(arg) += msg; }, &buf);
+        if (QFile f(path); !f.open(QIODevice::WriteOnly|QIODevice::Truncate) || f.write(buf) != buf.size())
+            throw Exception(QString("Failed to write %1: %2").arg(path, f.errorString()));
+        return path;
+    }
+
+#elif HAVE_JEMALLOC_HEADERS
+    QString name() { return QStringLiteral("jemalloc"); }
+
+    void configure(unsigned purgeMSec)
+    {
+        if (!purgeMSec) return;
+        // Without the background thread, jemalloc only purges from within allocation calls, so an idle arena
+        // can sit on its dirty pages indefinitely.
+        if (!jeSet("background_thread", true))
+            Debug() << "jemalloc: failed to enable background_thread (unsupported on this platform?)";
+        const ssize_t decay = ssize_t(purgeMSec);
+        bool ok = jeSet("arenas.dirty_decay_ms", decay) && jeSet("arenas.muzzy_decay_ms", decay); // new arenas
+        for (unsigned i = 0, n = jeNArenas(); i < n; ++i) { // existing arenas
+            const auto prefix = "arena." + std::to_string(i);
+            jeSet((prefix + ".dirty_decay_ms").c_str(), decay);
+            jeSet((prefix + ".muzzy_decay_ms").c_str(), decay);
+        }
+        if (ok) DebugM("jemalloc: background purging enabled, decay time ", purgeMSec, " msec");
+        else Debug() << "jemalloc: failed to set the decay time";
+    }
+
+    void purge()
+    {
+#ifdef MALLCTL_ARENAS_ALL
+        const auto cmd = "arena." + std::to_string(MALLCTL_ARENAS_ALL) + ".purge";
+#else
+        const auto cmd = "arena." + std::to_string(jeNArenas()) + ".purge"; // older jemalloc: narenas means "all"
+#endif
+        je_mallctl(cmd.c_str(), nullptr, nullptr, nullptr, 0);
+    }
+
+    QVariantMap stats(bool perArena)
+    {
+        uint64_t epoch = 1;
+        size_t esz = sizeof(epoch);
+        je_mallctl("epoch", &epoch, &esz, &epoch, esz); // refresh the cached stats
+        QVariantMap ret{{ "allocator", name() }};
+        if (const char *v = nullptr; jeGet("version", v) && v)
+            ret["version"] = QString(v);
+        size_t allocated{}, active{}, resident{}, mapped{}, retained{}, metadata{};
+        if (!jeGet("stats.allocated", allocated)) {
+            ret["error"] = "jemalloc was built without --enable-stats";
+            return ret;
+        }
+        jeGet("stats.active", active); jeGet("stats.resident", resident); jeGet("stats.mapped", mapped);
+        jeGet("stats.retained", retained); jeGet("stats.metadata", metadata);
+        ret["allocated"] = qulonglong(allocated);
+        ret["active"] = qulonglong(active);
+        ret["resident"] = qulonglong(resident);
+        ret["mapped"] = qulonglong(mapped);
+        ret["retained"] = qulonglong(retained);
+        ret["metadata"] = qulonglong(metadata);
+        ret["fragmentation"] = ratio(double(resident) - double(allocated), resident);
+        bool bgThread = false;
+        ret["background_thread"] = jeGet("background_thread", bgThread) && bgThread;
+        if (ssize_t decay{}; jeGet("arenas.dirty_decay_ms", decay))
+            ret["dirty_decay_ms"] = qlonglong(decay);
+        const unsigned nArenas = jeNArenas();
+        ret["narenas"] = nArenas;
+        if (perArena) {
+            size_t page = 4096;
+            jeGet("arenas.page", page);
+            QVariantList arenas;
+            for (unsigned i = 0; i < nArenas; ++i) {
+                const auto prefix = "stats.arenas." + std::to_string(i) + ".";
+                unsigned nthreads{};
+                size_t pactive{}, pdirty{}, pmuzzy{}, aresident{};
+                if (!jeGet((prefix + "nthreads").c_str(), nthreads)) continue; // uninitialized arena
+                jeGet((prefix + "pactive").c_str(), pactive); jeGet((prefix + "pdirty").c_str(), pdirty);
+                jeGet((prefix + "pmuzzy").c_str(), pmuzzy); jeGet((prefix + "resident").c_str(), aresident);
+                if (!nthreads && !pactive && !pdirty && !pmuzzy) continue;
+                arenas.push_back(QVariantMap{
+                    { "arena", i },
+                    { "nthreads", nthreads },
+                    { "active", qulonglong(pactive * page) },
+                    { "dirty", qulonglong(pdirty * page) },
+                    { "muzzy", qulonglong(pmuzzy * page) },
+                    { "resident", qulonglong(aresident) },
+                });
+            }
+            ret["arenas"] = arenas;
+        }
+        return ret;
+    }
+
+    QString dumpHeapProfile(const QString &pathPrefix)
+    {
+        if (bool prof = false; !jeGet("opt.prof", prof) || !prof)
+            throw Exception("jemalloc heap profiling is not enabled. Restart with MALLOC_CONF=prof:true (this requires"
+                            " a jemalloc built with --enable-prof)");
+        const QString path = pathPrefix + ".heap";
+        const QByteArray pathBytes = path.toLocal8Bit();
+        if (!jeSet("prof.dump", pathBytes.constData()))
+            throw Exception(QString("jemalloc failed to write a heap profile to %1").arg(path));
+        return path;
+    }
+
+#else // system allocator
+    QString name() { return QStringLiteral("system"); }
+
+    void configure(unsigned purgeMSec) { periodicPurge = purgeMSec > 0; }
+
+    void purge()
+    {
+#if defined(__GLIBC__)
+        malloc_trim(0);
+#endif
+    }
+
+    QVariantMap stats(bool)
+    {
+        QVariantMap ret{{ "allocator", name() }};
+        ret["resident"] = qulonglong(Util::getProcessMemoryUsage().phys);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+        const auto mi = mallinfo2();
+        // arena = bytes obtained via sbrk (and non-mmapped arena heaps), hblkhd = bytes in mmapped chunks
+        ret["allocated"] = qulonglong(mi.uordblks + mi.hblkhd);
+        ret["mapped"] = qulonglong(mi.arena + mi.hblkhd);
+        ret["free"] = qulonglong(mi.fordblks);
+        ret["releasable"] = qulonglong(mi.keepcost);
+        ret["fragmentation"] = ratio(mi.fordblks, mi.arena);
+#endif
+        return ret;
+    }
+
+    QString dumpHeapProfile(const QString &pathPrefix)
+    {
+#if defined(__GLIBC__)
+        // glibc has no heap profiler; malloc_info()'s per-arena XML dump is the closest thing
+        const QString path = pathPrefix + ".xml";
+        std::FILE *f = std::fopen(path.toLocal8Bit().constData(), "w");
+        if (!f)
+            throw Exception(QString("Failed to open %1 for writing").arg(path));
+        const int res = malloc_info(0, f);
+        if (std::fclose(f) != 0 || res != 0)
+            throw Exception(QString("Failed to write %1").arg(path));
+        return path;
+#else
+        Q_UNUSED(pathPrefix)
+        throw Exception("Heap profiles are not supported with the system allocator on this platform");
+#endif
+    }
+#endif
+
+    bool needsPeriodicPurge() { return periodicPurge; }
+
+} // namespace Allocator
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include <memory>
+#include <vector>
+
+namespace {
+    void test()
+    {
+        const auto st0 = Allocator::stats(true);
+        Log() << "Allocator: " << st0.value("allocator").toString();
+        if (st0.value("allocator").toString() != Allocator::name())
+            throw Exception("stats() does not report the allocator name");
+        {
+            std::vector<std::unique_ptr<char[]>> blocks;
+            for (int i = 0; i < 4096; ++i)
+                blocks.emplace_back(new char[4096]{});
+            const auto st1 = Allocator::stats();
+            if (st1.contains("allocated") && st1.value("allocated").toULongLong() < 4096u * 4096u)
+                throw Exception(QString("Expected at least 16 MiB allocated, got %1").arg(st1.value("allocated").toULongLong()));
+        }
+        Allocator::purge(); // should not crash
+        const auto fr = Allocator::stats().value("fragmentation");
+        if (!fr.isNull() && (fr.toDouble() < 0. || fr.toDouble() > 1.))
+            throw Exception(QString("Bad fragmentation ratio: %1").arg(fr.toDouble()));
+        Log() << "Allocator: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("allocator", &test);
+} // namespace
+#endif
@@ -0,0 +1,62 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <QString>
+#include <QVariantMap>
+
+/// A thin, allocator-agnostic facade over whichever malloc implementation this binary was linked against: jemalloc
+/// (the default if found at build time), mimalloc (if qmake was invoked with LIBS+=-lmimalloc), or the system
+/// allocator (glibc's ptmalloc on Linux).
+///
+/// Long-running servers tend to see RSS creep due to freed memory lingering in the allocator's caches and arenas
+/// (see test/heap_frag_test.cpp). This module lets us tune how eagerly that memory is handed back to the OS, and
+/// lets operators see where the memory is going.
+namespace Allocator {
+
+    /// Returns "jemalloc", "mimalloc", or "system"
+    QString name();
+
+    /// Tunes the allocator for a long-running process, so that freed memory is returned to the OS after roughly
+    /// `purgeMSec` milliseconds. For jemalloc this enables its background purging thread and sets the dirty/muzzy
+    /// decay times of all arenas. For mimalloc it sets the purge delay. The system allocator has no such knob, so
+    /// for it needsPeriodicPurge() returns true and the caller should call purge() periodically. 0 leaves the
+    /// allocator's own defaults alone. Call once at startup.
+    void configure(unsigned purgeMSec);
+
+    /// True if the allocator can't purge on its own and configure() was called with a nonzero value.
+    bool needsPeriodicPurge();
+
+    /// Returns as much memory as possible to the OS right now. Thread-safe, but may briefly stall other threads'
+    /// allocations.
+    void purge();
+
+    /// Returns a summary of the allocator's memory usage: bytes allocated (live data), resident, mapped,
+    /// and a "fragmentation" ratio (the fraction of resident memory that is not holding live allocations), where the
+    /// allocator makes these available. If `perArena` is true, a breakdown per arena is included too (jemalloc only).
+    /// Thread-safe.
+    QVariantMap stats(bool perArena = false);
+
+    /// Writes a heap profile to `pathPrefix` + a suitable extension, and returns the full path written. For jemalloc
+    /// this is a jeprof-compatible profile, which requires that the process was started with profiling enabled
+    /// (MALLOC_CONF=prof:true, and a jemalloc built with --enable-prof). For mimalloc and glibc, which have no heap
+    /// profiler, their detailed statistics dump is written instead. Throws Exception on failure. Thread-safe.
+    QString dumpHeapProfile(const QString &pathPrefix);
+
+} // namespace Allocator
@@ -16,16 +16,20 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "Allocator.h"
 #include "App.h"
 #include "BTC.h"
 #include "Compat.h"
 #include "Controller.h"
 #include "Json/Json.h"
+#include "LockStats.h"
 #include "Logger.h"
+#include "Metrics.h"
 #include "Servers.h"
 #include "Storage.h"
 #include "SSLCertMonitor.h"
 #include "ThreadPool.h"
+#include "Tracing.h"
 #include "Util.h"
 #include "ZmqSubNotifier.h"
 
@@ -45,6 +49,7 @@
 #include <array>
 #include <cassert>
 #include <clocale>
+#include <cmath>
 #include <csignal>
 #include <cstdlib>
 #include <iostream>
@@ -87,6 +92,7 @@ App::App(int argc, char *argv[])
     if (options->syslogMode) {
         _logger = std::make_unique<SysLogger>(this);
     }
+    _logger->startAsync(options->logQueue); // no-op if log_queue = 0
 
     connect(this, &App::aboutToQuit, this, &App::cleanup);
     connect(this, &App::setVerboseDebug, this, &App::on_setVerboseDebug);
@@ -102,6 +108,7 @@ App::~App()
 {
     Debug() << "App d'tor";
     Log() << "Shutdown complete";
+    if (_logger) _logger->stopAsync(); // flush any queued lines; from here on logging is synchronous
     _globalInstance = nullptr;
     /// child objects will be auto-deleted, however most are already gone in cleanup() at this point.
 }
@@ -247,6 +254,14 @@ void App::startup()
         } else // error
             Warning() << "Failed to raise max open file limit: " << res.errMsg;
     }
+    Allocator::configure(options->allocatorPurgeMS);
+    if (Allocator::needsPeriodicPurge()) {
+        // The system allocator only gives memory back to the OS from the top of the heap, and only when freeing, so
+        // we periodically ask it to trim. Not too often, since this walks every arena while holding its lock.
+        constexpr int minInterval = 10'000;
+        callOnTimerSoon(std::max(int(options->allocatorPurgeMS), minInterval), "allocator_purge",
+                        []{ Allocator::purge(); return true; }, false, Qt::TimerType::VeryCoarseTimer);
+    }
     try {
         BTC::CheckBitcoinEndiannessAndOtherSanityChecks();
 
@@ -1157,6 +1172,24 @@ void App::parseArgs()
         // log this later in case we are in syslog mode
         Util::AsyncOnObject(this, [val]{ Debug() << "config: db_use_fsync = " << (val ? "true" : "false"); });
     }
+    if (conf.hasValue("db_compression")) {
+        bool ok;
+        const bool val = conf.boolValue("db_compression", options->db.defaultCompression, &ok);
+        if (!ok)
+            throw BadArgs("db_compression: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->db.compression = val;
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [val]{ Debug() << "config: db_compression = " << (val ? "true" : "false"); });
+    }
+    if (conf.hasValue("db_stats")) {
+        bool ok;
+        const bool val = conf.boolValue("db_stats", options->db.defaultStats, &ok);
+        if (!ok)
+            throw BadArgs("db_stats: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->db.stats = val;
+        // log this later in case we are in syslog mode
+        Util::AsyncOnObject(this, [val]{ Debug() << "config: db_stats = " << (val ? "true" : "false"); });
+    }
 
     // warn user that no hostname was specified if they have peerDiscover turned on
     if (!options->hostName.has_value() && options->peerDiscovery && options->peerAnnounceSelf) {
@@ -1257,6 +1290,51 @@ void App::parseArgs()
         Util::AsyncOnObject(this, [val=val/1e6]{ DebugM("config: txhash_cache = ", val); });
     }
 
+    // conf: txhash_index_bytes
+    if (conf.hasValue("txhash_index_bytes")) {
+        bool ok{};
+        const int val = conf.intValue("txhash_index_bytes", Options::defaultTxHashIndexBytes, &ok);
+        if (!ok || val < int(options->txHashIndexBytesMin) || val > int(options->txHashIndexBytesMax))
+            throw BadArgs(QString("txhash_index_bytes: please specify a value in the range [%1, %2]")
+                          .arg(options->txHashIndexBytesMin).arg(options->txHashIndexBytesMax));
+        options->txHashIndexBytes = unsigned(val);
+        Util::AsyncOnObject(this, [val]{ DebugM("config: txhash_index_bytes = ", val); });
+    }
+
+    // conf: txhash_filter
+    if (conf.hasValue("txhash_filter")) {
+        bool ok;
+        const bool val = conf.boolValue("txhash_filter", Options::defaultTxHashFilter, &ok);
+        if (!ok)
+            throw BadArgs("txhash_filter: bad value. Specify a boolean value such as 0, 1, true, false, yes, no");
+        options->txHashFilter = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: txhash_filter = ", (val ? "true" : "false")); });
+    }
+
+    // conf: history_cache
+    if (conf.hasValue("history_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double dval = conf.doubleValue("history_cache", Options::defaultHistoryCacheBytes / 1e6, &ok) * 1e6;
+        if (!ok || dval < 0. || dval > options->historyCacheBytesMax) // check as double to avoid overflow when casting
+            throw BadArgs(QString("history_cache: please specify a value in the range [0, %1]")
+                          .arg(options->historyCacheBytesMax/1e6));
+        options->historyCacheBytes = unsigned(dval);
+        Util::AsyncOnObject(this, [val=dval/1e6]{ DebugM("config: history_cache = ", val); });
+    }
+
+    // conf: address_cache
+    if (conf.hasValue("address_cache")) {
+        bool ok{};
+        // NB: units in conf file are in MB (1e6), but we store them in bytes internally.
+        const double dval = conf.doubleValue("address_cache", Options::defaultAddressCacheBytes / 1e6, &ok) * 1e6;
+        if (!ok || dval < 0. || dval > options->addressCacheBytesMax) // check as double to avoid overflow when casting
+            throw BadArgs(QString("address_cache: please specify a value in the range [0, %1]")
+                          .arg(options->addressCacheBytesMax/1e6));
+        options->addressCacheBytes = unsigned(dval);
+        Util::AsyncOnObject(this, [val=dval/1e6]{ DebugM("config: address_cache = ", val); });
+    }
+
     // CLI: --compact-dbs
     if (parser.isSet("compact-dbs")) {
         options->compactDBs = true;
@@ -1274,6 +1352,56 @@ void App::parseArgs()
         Util::AsyncOnObject(this, [val]{ DebugM("config: max_batch = ", val); });
     }
 
+    // conf: lock_sample_rate
+    if (conf.hasValue("lock_sample_rate")) {
+        bool ok{};
+        const int val = conf.intValue("lock_sample_rate", Options::defaultLockSampleRate, &ok);
+        if (!ok || val < 0 || unsigned(val) > options->lockSampleRateMax)
+            throw BadArgs(QString("lock_sample_rate: please specify a value in the range [0, %1]").arg(options->lockSampleRateMax));
+        options->lockSampleRate = unsigned(val);
+        LockStats::setSampleRate(options->lockSampleRate);
+        Util::AsyncOnObject(this, [val]{ DebugM("config: lock_sample_rate = ", val); });
+    }
+
+    // conf: log_queue
+    if (conf.hasValue("log_queue")) {
+        bool ok{};
+        const int val = conf.intValue("log_queue", Options::defaultLogQueue, &ok);
+        if (!ok || val < 0 || unsigned(val) > options->logQueueMax)
+            throw BadArgs(QString("log_queue: please specify a value in the range [0, %1]").arg(options->logQueueMax));
+        options->logQueue = unsigned(val);
+        Util::AsyncOnObject(this, [val]{ DebugM("config: log_queue = ", val); });
+    }
+
+    // conf: trace_slow_ms, trace_sample_rate
+    if (conf.hasValue("trace_slow_ms")) {
+        bool ok{};
+        const double val = conf.doubleValue("trace_slow_ms", Options::defaultTraceSlowMS, &ok);
+        if (!ok || val < 0. || !std::isfinite(val))
+            throw BadArgs("trace_slow_ms: please specify a non-negative number of milliseconds");
+        options->traceSlowMS = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: trace_slow_ms = ", val); });
+    }
+    if (conf.hasValue("trace_sample_rate")) {
+        bool ok{};
+        const double val = conf.doubleValue("trace_sample_rate", Options::defaultTraceSampleRate, &ok);
+        if (!ok || !(val >= 0. && val <= 1.))
+            throw BadArgs("trace_sample_rate: please specify a value in the range [0.0, 1.0]");
+        options->traceSampleRate = val;
+        Util::AsyncOnObject(this, [val]{ DebugM("config: trace_sample_rate = ", val); });
+    }
+    Tracing::configure(options->traceSlowMS, options->traceSampleRate);
+
+    // conf: allocator_purge_ms
+    if (conf.hasValue("allocator_purge_ms")) {
+        bool ok{};
+        const int val = conf.intValue("allocator_purge_ms", Options::defaultAllocatorPurgeMS, &ok);
+        if (!ok || val < 0 || unsigned(val) > options->allocatorPurgeMSMax)
+            throw BadArgs(QString("allocator_purge_ms: please specify a value in the range [0, %1]").arg(options->allocatorPurgeMSMax));
+        options->allocatorPurgeMS = unsigned(val);
+        Util::AsyncOnObject(this, [val]{ DebugM("config: allocator_purge_ms = ", val); });
+    }
+
     // parse --dump-*
     if (const auto outFile = parser.value("dump-sh"); !outFile.isEmpty()) {
         options->dumpScriptHashes = outFile; // we do no checking here, but Controller::startup will throw BadArgs if it cannot open this file for writing.
@@ -1316,7 +1444,7 @@ void App::start_httpServer(const Options::Interface &iface)
     std::shared_ptr<SimpleHttpServer> server(new SimpleHttpServer(iface.first, iface.second, 16384));
     httpServers.push_back(server);
     server->tryStart(); // may throw, waits for server to start
-    server->set404Message("Error: Unknown endpoint. /stats & /debug are the only valid endpoint I understand.\r\n");
+    server->set404Message("Error: Unknown endpoint. /stats, /debug & /metrics are the only valid endpoints I understand.\r\n");
     static const auto CRLF = QByteArrayLiteral("\r\n");
     server->addEndpoint("/stats",[this](SimpleHttpServer::Request &req){
         req.response.contentType = "application/json; charset=utf-8";
@@ -1331,6 +1459,19 @@ void App::start_httpServer(const Options::Interface &iface)
         stats = stats.isNull() ? QVariantList{QVariant()} : stats;
         req.response.data = Json::toUtf8(stats, false) + CRLF; // may throw -- caller will handle exception
     });
+    server->addEndpoint("/traces",[](SimpleHttpServer::Request &req){
+        // e.g. /traces?limit=10; requires trace_sample_rate and/or trace_slow_ms to be set in the conf file
+        req.response.contentType = "application/json; charset=utf-8";
+        const auto params = ParseParams(req);
+        bool ok;
+        const unsigned limit = params.value("limit").toUInt(&ok);
+        req.response.data = Json::toUtf8(QVariant(Tracing::recentSpans(ok && limit ? limit : 100)), false) + CRLF; // may throw
+    });
+    server->addEndpoint("/metrics",[](SimpleHttpServer::Request &req){
+        // Prometheus text exposition format; the histograms are thread-safe so we needn't go through the Controller
+        req.response.contentType = "text/plain; version=0.0.4; charset=utf-8";
+        req.response.data = Metrics::prometheusText();
+    });
 }
 
 /* static */ App::QtLogSuppressionList App::qlSuppressions;
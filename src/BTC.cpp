@@ -87,6 +87,16 @@ namespace BTC
         return ret;
     }
 
+    Hash256 HashRev256(const ByteView &bv, bool once)
+    {
+        bitcoin::CHash256 h(once);
+        static_assert(bitcoin::CHash256::OUTPUT_SIZE == Hash256::size());
+        Hash256 ret;
+        h.Write(bv.ucharData(), bv.size());
+        h.Finalize(ret.data());
+        return ret.reverse();
+    }
+
     QByteArray HashTwo(const QByteArray &a, const QByteArray &b)
     {
         bitcoin::CHash256 h(/* once = */false);
@@ -234,5 +244,22 @@ namespace BTC
         }
     }
 
+#ifdef ENABLE_TESTS
+    bitcoin::CBlock MakeTestBlock(const bitcoin::uint256 &prevHash, unsigned height) {
+        bitcoin::CBlock block;
+        block.nVersion = 1;
+        block.hashPrevBlock = prevHash;
+        block.nTime = 1'600'000'000u + height * 600u;
+        block.nBits = 0x207fffff;
+        block.nNonce = height;
+        return block;
+    }
+
+    bitcoin::CMutableTransaction MakeTestCoinbase(unsigned height) {
+        bitcoin::CMutableTransaction cb;
+        cb.vin.emplace_back(bitcoin::COutPoint(), bitcoin::CScript() << int64_t(height));
+        return cb;
+    }
+#endif
 
 } // end namespace BTC
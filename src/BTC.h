@@ -18,6 +18,7 @@
 //
 #pragma once
 
+#include "Hash256.h"
 #include "Util.h"
 
 #include "bitcoin/block.h"
@@ -164,6 +165,8 @@ namespace BTC
     /// Identical to the above except it returns the REVERSED hash (which is what bitcoind gives you via JSON RPC or
     /// when doing uint256.ToString()). That is, this hash is in big-endian byte order.
     extern QByteArray HashRev(const QByteArray &, bool once = false);
+    /// Identical to the above except it returns a Hash256 (which avoids a heap allocation).
+    extern Hash256 HashRev256(const ByteView &, bool once = false);
     /// sha256d of the concatenation of a and b. This is faster than but equivalent to doing: Hash(a + b, false).
     extern QByteArray HashTwo(const QByteArray &a, const QByteArray &b);
     /// Convenient alias for Hash(b, true)
@@ -182,6 +185,15 @@ namespace BTC
         return ret;
     };
 
+    /// Like the above, but returns a Hash256 (no heap allocation).
+    template <class BitcoinHashT>
+    Hash256 Hash2Hash256Rev(const BitcoinHashT &hash) {
+        static_assert(BitcoinHashT::width() == Hash256::size(), "Assumption here is that BitcoinHashT is 32 bytes");
+        Hash256 ret;
+        std::reverse_copy(hash.begin(), hash.end(), ret.data());
+        return ret;
+    }
+
     /// returns true iff cscript is OP_RETURN, false otherwise
     inline bool IsOpReturn(const bitcoin::CScript &cs) {
         return cs.size() > 0 && *cs.begin() == bitcoin::opcodetype::OP_RETURN;
@@ -190,6 +202,10 @@ namespace BTC
     inline QByteArray HashXFromCScript(const bitcoin::CScript &cs) {
         return QByteArray(BTC::HashRev(QByteArray::fromRawData(reinterpret_cast<const char *>(cs.data()), int(cs.size())), true));
     }
+    /// Like the above, but returns a Hash256 (no heap allocation).
+    inline Hash256 HashX256FromCScript(const bitcoin::CScript &cs) {
+        return BTC::HashRev256(ByteView{cs}, true);
+    }
 
     /// Header Chain Verifier -
     /// To use: Basically keep calling operator() on it with subsequent headers and it will make sure
@@ -273,6 +289,15 @@ namespace BTC
     /// as reported by the bitcoin daemon (bchd uses different net names than bitcoind).
     inline const QString & NetNameNormalize(const QString &name) noexcept { return NetName(NetFromName(name)); }
 
+#ifdef ENABLE_TESTS
+    /// Test support: returns an (unmined, regtest-difficulty) block header at `height` on top of `prevHash`, with no
+    /// transactions. Callers push their txs onto .vtx, the first of which should be from MakeTestCoinbase().
+    bitcoin::CBlock MakeTestBlock(const bitcoin::uint256 &prevHash, unsigned height);
+    /// Test support: returns a coinbase for the block at `height`, with no outputs. Its scriptSig pushes `height` so
+    /// that each coinbase has a unique txid.
+    bitcoin::CMutableTransaction MakeTestCoinbase(unsigned height);
+#endif
+
 } // end namespace
 
 
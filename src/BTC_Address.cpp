@@ -19,6 +19,7 @@
 #include "BTC.h"
 #include "BTC_Address.h"
 #include "Common.h"
+#include "CostCache.h"
 #include "Util.h"
 
 #include "bitcoin/base58.h"
@@ -28,6 +29,7 @@
 #include <QHash>
 #include <QHashFunctions>
 
+#include <atomic>
 #include <mutex>
 #include <utility>
 
@@ -155,7 +157,9 @@ namespace BTC
         };
         Address a;
         std::vector<Byte> dec;
-        if (const auto ss = legacyOrCash.toStdString(); bitcoin::DecodeBase58Check(ss, dec)) {
+        const auto ss = legacyOrCash.toStdString();
+        // ':' is not in the base58 alphabet, so a prefixed cashaddr need not take the (doomed) legacy decode first.
+        if (ss.find(':') == ss.npos && bitcoin::DecodeBase58Check(ss, dec)) {
             // Legacy address
             if (const auto decsize = dec.size(); !(decsize == 1 + H160Len || decsize == 1 + H256Len)) {
 #ifdef QT_DEBUG
@@ -312,6 +316,54 @@ namespace BTC
         return a.isValid() && a._net == net;
     }
 
+    struct AddressHashXCache::Pvt
+    {
+        struct Entry {
+            QByteArray hashX;
+            Net net = Net::Invalid;
+        };
+        explicit Pvt(unsigned maxBytes) : cache(maxBytes) {}
+
+        CostCache<QString, Entry> cache;
+        std::atomic_size_t hits{0}, misses{0};
+
+        static unsigned costOf(const QString &key, const QByteArray &hashX) {
+            return unsigned(decltype(cache)::itemOverheadBytes() + 2u * Util::qByteArrayPvtDataSize()
+                            + size_t(key.size() + 1) * sizeof(QChar) + size_t(hashX.size() + 1));
+        }
+    };
+
+    AddressHashXCache::AddressHashXCache(unsigned maxBytes) : p(std::make_unique<Pvt>(maxBytes)) {}
+    AddressHashXCache::~AddressHashXCache() {}
+
+    QByteArray AddressHashXCache::get(const QString &legacyOrCash, Net net) const
+    {
+        // The net is part of the cached entry rather than the key, since in practice all lookups use the same net.
+        if (const auto e = p->cache.object(legacyOrCash); e && e->net == net) {
+            ++p->hits;
+            return e->hashX;
+        }
+        ++p->misses;
+        const Address a(legacyOrCash);
+        if (!a.isValid() || !a.isCompatibleWithNet(net))
+            return {};
+        QByteArray hashX = a.toHashX();
+        if (!hashX.isEmpty())
+            p->cache.insert(legacyOrCash, Pvt::Entry{hashX, net}, Pvt::costOf(legacyOrCash, hashX));
+        return hashX;
+    }
+
+    QVariantMap AddressHashXCache::stats() const
+    {
+        QVariantMap m;
+        m["Size bytes"] = qlonglong(p->cache.totalCost());
+        m["max bytes"] = qlonglong(p->cache.maxCost());
+        m["nItems"] = qlonglong(p->cache.size());
+        m["~hits"] = qlonglong(p->hits.load());
+        m["~misses"] = qlonglong(p->misses.load());
+        return m;
+    }
+
 #ifdef ENABLE_TESTS
     namespace {
         struct ThreadSafeLogger {
@@ -336,8 +388,9 @@ namespace BTC
         std::condition_variable cond;
         std::mutex mut;
         std::atomic_bool start{false};
+        const AddressHashXCache cache(64'000'000); // shared by all threads, as it would be by all clients in the server
 
-        const auto Bench = [&cond, &mut, &start](size_t id){
+        const auto Bench = [&cond, &mut, &start, &cache](size_t id){
             while (!start) {
                 std::unique_lock g(mut);
                 if (!start)
@@ -413,6 +466,28 @@ namespace BTC
                     throw Exception(QString("Address index %1 mistmatch").arg(long(i)));
             }
             Print() << id << ": All ok!";
+
+            // Model wallets hitting the blockchain.address.* RPCs: a working set of addresses, each looked up many times
+            constexpr size_t hotSet = 10'000;
+            Print() << id << ": Parsing + hashing " << count << " cashaddr strings (" << hotSet << " distinct), uncached ...";
+            std::vector<QByteArray> hashXsUncached(count);
+            const auto t0hu = Util::getTimeNS();
+            for (size_t i = 0; i < count; ++i)
+                hashXsUncached[i] = Address(caStrings[i % hotSet]).toHashX();
+            const auto elapsedhu = Util::getTimeNS() - t0hu;
+            Print() << id << ": Took: " << QString::number(elapsedhu/1e6, 'f', 6).toUtf8().constData() << " msec";
+
+            Print() << id << ": Same, via AddressHashXCache ...";
+            std::vector<QByteArray> hashXsCached(count);
+            const auto t0hc = Util::getTimeNS();
+            for (size_t i = 0; i < count; ++i)
+                hashXsCached[i] = cache.get(caStrings[i % hotSet], MyNet);
+            const auto elapsedhc = Util::getTimeNS() - t0hc;
+            Print() << id << ": Took: " << QString::number(elapsedhc/1e6, 'f', 6).toUtf8().constData() << " msec ("
+                    << QString::number(double(elapsedhu) / std::max(elapsedhc, qint64(1)), 'f', 2).toUtf8().constData()
+                    << "x)";
+            if (hashXsCached != hashXsUncached)
+                throw Exception("Cached HashX mismatch");
         };
 
         const size_t N = std::max(std::min(7u, std::thread::hardware_concurrency()), 2u);
@@ -429,6 +504,7 @@ namespace BTC
         for (auto & thr : threads) {
             thr.join();
         }
+        Log() << "AddressHashXCache: " << Json::toUtf8(cache.stats(), true).constData();
     }
 
     namespace { const auto b1 = App::registerBench("address", Address::bench); }
@@ -781,6 +857,60 @@ namespace BTC
         }
         Print() << vectors.size() << " test vectors passed";
 
+        Print() << "Testing base58 round-trips ...";
+        for (int i = 0; i < 2000; ++i) {
+            std::vector<Byte> data(size_t(QRandomGenerator::global()->bounded(80)), 0), dec;
+            // leave the first nZeroes bytes as 0, to exercise the leading '1's handling
+            const size_t nZeroes = std::min(data.size(), size_t(QRandomGenerator::global()->bounded(4)));
+            for (size_t j = nZeroes; j < data.size(); ++j)
+                data[j] = Byte(QRandomGenerator::global()->bounded(256));
+            const std::string enc = bitcoin::EncodeBase58(data);
+            if (!bitcoin::DecodeBase58(" " + enc + "  ", dec) || dec != data) {
+                Error() << "Base58 round-trip failed for: " << enc;
+                return false;
+            }
+            if (!enc.empty() && bitcoin::DecodeBase58(enc + "0", dec)) { // '0' is not in the base58 alphabet
+                Error() << "Base58 decode of a bad string unexpectedly succeeded: " << enc << "0";
+                return false;
+            }
+        }
+        Print() << "base58 ok";
+
+        Print() << "Testing AddressHashXCache ...";
+        {
+            const AddressHashXCache cache(1'000'000);
+            for (const auto addr : { anAddress, anAddress_leg, anAddress2, anAddress2_leg, anAddress32, anAddress32_tok }) {
+                const QByteArray expected = Address(addr).toHashX();
+                for (int i = 0; i < 2; ++i) { // miss, then hit
+                    if (const auto hx = cache.get(addr, Net::MainNet); hx != expected || hx.length() != int(H256Len)) {
+                        Error() << "AddressHashXCache returned the wrong HashX for " << addr;
+                        return false;
+                    }
+                }
+                // same string, different net: must not be served the mainnet entry
+                if (!cache.get(addr, Net::TestNet).isEmpty()) {
+                    Error() << "AddressHashXCache accepted a mainnet address for testnet: " << addr;
+                    return false;
+                }
+            }
+            for (const auto addr : { badAddress, reg2, "", "bitcoincash:" }) {
+                if (!cache.get(addr, Net::MainNet).isEmpty()) {
+                    Error() << "AddressHashXCache accepted a bad address: " << addr;
+                    return false;
+                }
+            }
+            if (cache.get(reg2, Net::RegTestNet).isEmpty()) {
+                Error() << "AddressHashXCache rejected a regtest address";
+                return false;
+            }
+            const auto st = cache.stats();
+            if (st["~hits"].toLongLong() != 6 || st["nItems"].toLongLong() != 7) {
+                Error() << "AddressHashXCache has unexpected stats: " << Json::toUtf8(st, true).constData();
+                return false;
+            }
+        }
+        Print() << "AddressHashXCache ok";
+
         Print() << "------------------------------------";
         Print() << "address test success";
         return true;
@@ -27,10 +27,12 @@
 #include <QByteArray>
 #include <QMetaType>
 #include <QString>
+#include <QVariantMap>
 
 #include <algorithm>
 #include <array>
 #include <cstring>
+#include <memory>
 #include <optional>
 #include <vector>
 
@@ -150,6 +152,27 @@ namespace BTC {
 #endif
     };
 
+    /// A memory-bounded, thread-safe LRU cache of address string -> Address::toHashX(). Wallets send the same
+    /// addresses over and over to the blockchain.address.* RPCs, and this saves re-decoding and re-hashing them each
+    /// time. Only valid addresses are cached, so that garbage input can't evict the useful entries.
+    class AddressHashXCache
+    {
+    public:
+        /// May throw BadArgs if maxBytes is 0
+        explicit AddressHashXCache(unsigned maxBytes);
+        ~AddressHashXCache();
+
+        /// Returns the HashX for `legacyOrCash` if it is a valid address that is compatible with `net`, or an empty
+        /// QByteArray otherwise.
+        QByteArray get(const QString &legacyOrCash, Net net) const;
+
+        QVariantMap stats() const;
+
+    private:
+        struct Pvt;
+        const std::unique_ptr<Pvt> p;
+    };
+
 } // end namespace BTC
 
 /// for std::hash support of type BTC::Address -- just take middle 4 or 8 bytes of a.hash()
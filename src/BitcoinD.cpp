@@ -18,6 +18,7 @@
 //
 
 #include "BitcoinD.h"
+#include "Metrics.h"
 #include "ZmqSubNotifier.h"
 
 #include "bitcoin/rpc/protocol.h"
@@ -588,9 +589,13 @@ void BitcoinDMgr::submitRequest(QObject *sender, const RPC::Message::Id &rid, co
         context->deleteLater(); // thread-safe
     });
     context->setObjectName(QStringLiteral("context for '%1' request id: %2").arg(sender ? sender->objectName() : QString{}, rid.toString()));
+    // latency is measured from submission until the results or error handler runs in the sender's thread
+    auto * const latency = &Metrics::histogram("fulcrum_bitcoind_rpc_seconds", "bitcoind RPC latency, from submission"
+                                               " of the request until its reply is handled", "method", method);
+    const qint64 tSubmit = Util::getTimeNS();
 
     // result handler (runs in sender thread), captures context and keeps it alive as long as signal/slot connection is alive
-    connect(context.get(), &ReqCtxObj::results, sender, [context, resf, sender/*, method, params, timeout*/](const RPC::Message &response) {
+    connect(context.get(), &ReqCtxObj::results, sender, [context, resf, sender, latency, tSubmit/*, method, params, timeout*/](const RPC::Message &response) {
         // Debug code for troubleshooting the extent of bitcoind backlogs in servicing requests
         /*
         const auto now = Util::getTime();
@@ -599,15 +604,19 @@ void BitcoinDMgr::submitRequest(QObject *sender, const RPC::Message::Id &rid, co
                               << "), method: " << method << ", params: " << Json::serialize(params);
         }
         */
-        if (!context->replied.exchange(true) && resf)
-            resf(response);
+        if (!context->replied.exchange(true)) {
+            latency->observeSince(tSubmit);
+            if (resf) resf(response);
+        }
         // kill lambdas and shared_ptr captures, should cause deleter to execute
         context->disconnect(nullptr, sender); // thread-safe
     });
     // error handler (runs in sender thread), captures context and keeps it alive as long as signal/slot connection is alive
-    connect(context.get(), &ReqCtxObj::error, sender, [context, errf, sender](const RPC::Message &response) {
-        if (!context->replied.exchange(true) && errf)
-            errf(response);
+    connect(context.get(), &ReqCtxObj::error, sender, [context, errf, sender, latency, tSubmit](const RPC::Message &response) {
+        if (!context->replied.exchange(true)) {
+            latency->observeSince(tSubmit);
+            if (errf) errf(response);
+        }
         // kill lambdas and shared_ptr captures, should cause deleter to execute
         context->disconnect(nullptr, sender); // thread-safe
     });
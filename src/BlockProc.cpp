@@ -39,7 +39,7 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
     header = b.GetBlockHeader();
     estimatedThisSizeBytes = sizeof(*this) + size_t(BTC::GetBlockHeaderSize());
     txInfos.reserve(b.vtx.size());
-    std::unordered_map<TxHash, unsigned, HashHasher> txHashToIndex; // since we know the size ahead of time here, we can set max_load_factor to 1.0 and avoid over-allocating the hash table
+    std::unordered_map<Hash256, unsigned, Hash256Hasher> txHashToIndex; // since we know the size ahead of time here, we can set max_load_factor to 1.0 and avoid over-allocating the hash table
     txHashToIndex.max_load_factor(1.0);
     txHashToIndex.reserve(b.vtx.size());
 
@@ -52,7 +52,7 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
         info.nInputs = IONum(tx->vin.size());
         info.nOutputs = IONum(tx->vout.size());
         // remember the tx hash -> index association for use later in this function
-        txHashToIndex[info.hash] = unsigned(txIdx); // cheap copy + cheap hash func. should make this fast.
+        txHashToIndex[Hash256{info.hash}] = unsigned(txIdx); // cheap copy + cheap hash func. should make this fast.
 
         // process outputs for this tx
         if (!tx->vout.empty())
@@ -70,7 +70,7 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
             if (const auto cscript = out.scriptPubKey;
                     !BTC::IsOpReturn(cscript))  ///< skip OP_RETURN
             {
-                const HashX hashX = BTC::HashXFromCScript(cscript);
+                const Hash256 hashX = BTC::HashX256FromCScript(cscript);
                 // add this output to the hashX -> outputs association for later
                 auto & ag = hashXAggregated[ hashX ];
                 ag.outs.emplace_back( outputIdx );
@@ -105,7 +105,7 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
             // note we do place the coinbase tx here even though we ignore it later on -- we keep it to have accurate indices
             inputs.emplace_back(InputPt{
                     unsigned(txIdx),
-                    BTC::Hash2ByteArrayRev(in.prevout.GetTxId()),  // .prevoutHash
+                    BTC::Hash2Hash256Rev(in.prevout.GetTxId()),  // .prevoutHash
                     IONum(in.prevout.GetN()), // .prevoutN
                     {}, // .parentTxOutIdx (start out undefined)
             });
@@ -133,8 +133,6 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
 
     // at this point we have a partially constructed object. we must run through all the inputs again
     // and figure out which if any refer to tx's in this block, and assign those to our hashXIns.
-    // Also: to save memory on txhash's for such inputs, we make sure the txhash refers to the same underlying
-    // QByteArray data.
     size_t inIdx = 0;
     for (auto & inp : inputs) {
         if (const auto it = txHashToIndex.find(inp.prevoutHash); it != txHashToIndex.end()) {
@@ -142,7 +140,6 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
             const auto prevTxIdx = it->second;
             assert(prevTxIdx < txInfos.size() && prevTxIdx < b.vtx.size());
             const TxInfo & prevInfo = txInfos[prevTxIdx];
-            inp.prevoutHash = prevInfo.hash; //<--- ensure shallow copy that points to same underlying data (saves memory)
             if (prevInfo.output0Index.has_value())
                 inp.parentTxOutIdx.emplace( *prevInfo.output0Index + inp.prevoutN ); // save the index into the `outputs` array where the parent tx to this spend occurred
             else
@@ -156,7 +153,7 @@ void PreProcessedBlock::fill(BlockHeight blockHeight, size_t blockSize, const bi
                     !BTC::IsOpReturn(cscript))
             {
                 // mark this input as involving this hashX
-                const HashX hashX = BTC::HashXFromCScript(cscript);
+                const Hash256 hashX = BTC::HashX256FromCScript(cscript);
                 auto & ag = hashXAggregated[ hashX ];
                 ag.ins.emplace_back(inIdx);
                 if (auto & vec = ag.txNumsInvolvingHashX; vec.empty() || vec.back() != inp.txIdx)
@@ -197,7 +194,7 @@ QString PreProcessedBlock::toDebugString() const
             for (size_t j = 0; j < ag.ins.size(); ++j) {
                 const auto idx = ag.ins[j];
                 const auto & theInput [[maybe_unused]] = inputs[idx];
-                assert(theInput.parentTxOutIdx.has_value() && txHashForOutputIdx(*theInput.parentTxOutIdx) == theInput.prevoutHash);
+                assert(theInput.parentTxOutIdx.has_value() && Hash256{txHashForOutputIdx(*theInput.parentTxOutIdx)} == theInput.prevoutHash);
                 ts << " {in# " << j << " - " << inputs[idx].prevoutHash.toHex() << ":" << inputs[idx].prevoutN
                    << ", spent in " << txHashForInputIdx(idx).toHex() << ":" << numForInputIdx(idx).value_or(999999) << " }";
             }
@@ -240,11 +237,11 @@ PreProcessedBlock::hashXsByTx() const
     for (const auto & [hashX, ag] : hashXAggregated) {
         // scan all outputs and add this hashX
         for (const auto outIdx : ag.outs) {
-            ret[outputs[outIdx].txIdx].insert(hashX); // cheap shallow copy
+            ret[outputs[outIdx].txIdx].insert(hashX.toByteArray());
         }
         // scan all inputs and add this hashX
         for (const auto inIdx : ag.ins) {
-            ret[inputs[inIdx].txIdx].insert(hashX);
+            ret[inputs[inIdx].txIdx].insert(hashX.toByteArray());
         }
     }
     return ret;
@@ -70,7 +70,7 @@ struct PreProcessedBlock
 
     struct InputPt {
         unsigned txIdx = 0; ///< index into the `txInfos` vector above for the tx where this input appears
-        TxHash prevoutHash; ///< 32-byte prevoutHash.  In *reversed* memory order (hex-encoding ready!) (May be a shallow copy of a byte array in `txInfos` if the prevout tx was in this block.). May be empty if coinbase
+        Hash256 prevoutHash; ///< 32-byte prevoutHash.  In *reversed* memory order (hex-encoding ready!). Held by value since there is one of these per input. All zeroes if coinbase
         IONum prevoutN = 0; ///< the index in the prevout tx for this input (again, tx's can't have more than ~111k inputs -- if that changes, fixme!)
         std::optional<unsigned> parentTxOutIdx; ///< if the input's prevout was in this block, the index into the `outputs` array declared in BlockProcBase, otherwise undefined.
     };
@@ -94,12 +94,17 @@ struct PreProcessedBlock
         /// down the block processing pipeline (in addBlock) to be a list of globally-mapped TxNums involving this
         /// HashX.
         std::vector<TxNum> txNumsInvolvingHashX;
+
+        /// The map key as a QByteArray. Left empty by the preprocessor; addBlock materializes it once and shares it
+        /// (implicitly) among the TXOInfos, undo info, notifications and the hot history cache.
+        QByteArray hashX;
     };
 
     /// Node map preferable here. Even though a flat map uses move construction, it would still have to move ~72
     /// bytes around (3 pointers per std::vector * 3 vectors * 8 bytes per pointer), so the Node* of the node map is
     /// preferred here.
-    std::unordered_map<HashX, AggregatedOutsIns, HashHasher> hashXAggregated;
+    /// The HashX keys are held by value as a Hash256 (rather than as a QByteArray) to spare the allocator.
+    std::unordered_map<Hash256, AggregatedOutsIns, Hash256Hasher> hashXAggregated;
 
     /*
     // If we decide to track OpReturn:
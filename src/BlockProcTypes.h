@@ -19,6 +19,7 @@
 #pragma once
 
 #include "BTC.h" // for BTC::QByteArrayHashHasher
+#include "Hash256.h"
 
 #include "bitcoin/amount.h"  // for bitcoin::Amount
 #include "bitcoin/uint256.h"
@@ -28,6 +29,7 @@
 #include <limits>
 
 using HashHasher = BTC::QByteArrayHashHasher;
+using Hash256Hasher = BTC::GenericTrivialHashHasher<Hash256>;
 
 using BlockHeight = std::uint32_t;
 using TxNum = std::uint64_t; ///< this is used by the storage subsystem and also CompactTXO
@@ -0,0 +1,137 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "BlockedBloomFilter.h"
+#include "CityHash.h"
+#include "Util.h"
+
+#include <QRandomGenerator>
+
+#include <algorithm>
+
+namespace {
+    /// Odd constants used to derive the 8 per-word bit positions from a single 32-bit hash (from the Parquet
+    /// split block Bloom filter spec).
+    constexpr uint32_t kSalt[8] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+    };
+}
+
+BlockedBloomFilter::BlockedBloomFilter(std::size_t nElements, unsigned bitsPerElement)
+{
+    bitsPerElement = std::max(bitsPerElement, 8u);
+    nCapacity = std::max<std::size_t>(nElements, 1);
+    nBlocks = std::max<std::size_t>((nCapacity * bitsPerElement + sizeof(Block) * 8 - 1) / (sizeof(Block) * 8), 1);
+    blocks.reset(new Block[nBlocks]()); // value-initialized: all bits 0
+    seed = QRandomGenerator::global()->generate64();
+}
+
+uint64_t BlockedBloomFilter::hash(const ByteView &bv) const noexcept
+{
+    return CityHash::CityHash64WithSeed(bv.charData(), bv.size(), seed);
+}
+
+/* static */ uint32_t BlockedBloomFilter::mask(uint32_t h, unsigned i) noexcept
+{
+    return uint32_t{1} << ((h * kSalt[i]) >> 27);
+}
+
+void BlockedBloomFilter::insert(const ByteView &bv) noexcept
+{
+    if (UNLIKELY(!nBlocks)) return;
+    const uint64_t h = hash(bv);
+    Block & b = blockFor(h);
+    for (unsigned i = 0; i < kWordsPerBlock; ++i)
+        b.words[i].fetch_or(mask(uint32_t(h), i), std::memory_order_relaxed);
+    nInserted.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool BlockedBloomFilter::contains(const ByteView &bv) const noexcept
+{
+    if (UNLIKELY(!nBlocks)) return true;
+    const uint64_t h = hash(bv);
+    const Block & b = blockFor(h);
+    for (unsigned i = 0; i < kWordsPerBlock; ++i) {
+        const uint32_t m = mask(uint32_t(h), i);
+        if ((b.words[i].load(std::memory_order_relaxed) & m) != m)
+            return false;
+    }
+    return true;
+}
+
+void BlockedBloomFilter::reset()
+{
+    for (std::size_t i = 0; i < nBlocks; ++i)
+        for (auto & w : blocks[i].words)
+            w.store(0, std::memory_order_relaxed);
+    nInserted = 0;
+}
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+#include "Common.h"
+
+#include <QByteArray>
+
+#include <thread>
+#include <vector>
+
+namespace {
+    void test()
+    {
+        constexpr std::size_t N = 200'000;
+        BlockedBloomFilter f(N);
+        if (!f.isValid() || f.memoryUsage() < N * 12 / 8)
+            throw Exception("Filter has the wrong size");
+        std::vector<QByteArray> items(2 * N);
+        for (auto & item : items) {
+            item.resize(32);
+            Util::getRandomBytes(item.data(), item.size());
+        }
+        // insert the first half from 4 threads at once
+        std::vector<std::thread> threads;
+        for (unsigned t = 0; t < 4; ++t)
+            threads.emplace_back([&, t]{
+                for (std::size_t i = t; i < N; i += 4)
+                    f.insert(ByteView{items[i]});
+            });
+        for (auto & th : threads) th.join();
+        if (f.count() != N)
+            throw Exception(QString("Expected count %1, got %2").arg(N).arg(f.count()));
+        for (std::size_t i = 0; i < N; ++i)
+            if (!f.contains(ByteView{items[i]}))
+                throw Exception("False negative!");
+        std::size_t fps = 0;
+        for (std::size_t i = N; i < 2 * N; ++i)
+            fps += f.contains(ByteView{items[i]});
+        const double fpRate = double(fps) / N;
+        Log() << "BlockedBloomFilter: " << N << " items in " << f.memoryUsage() << " bytes, false positive rate: "
+              << QString::number(fpRate * 100., 'f', 3) << "%";
+        if (fpRate > 0.01)
+            throw Exception("False positive rate is too high");
+        f.reset();
+        if (f.count() || f.contains(ByteView{items[0]}))
+            throw Exception("reset() did not clear the filter");
+        if (!BlockedBloomFilter{}.contains(ByteView{items[0]}))
+            throw Exception("An invalid filter should always return true");
+        Log() << "BlockedBloomFilter: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("blockedbloom", &test);
+} // namespace
+#endif
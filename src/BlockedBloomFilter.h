@@ -0,0 +1,82 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "ByteView.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+/**
+ * An insert-only, cache-friendly Bloom filter for very large sets (hundreds of millions of items), such as all of the
+ * confirmed txids on a chain.
+ *
+ * This is a "split block" Bloom filter: the bit array is divided into 32-byte blocks, and each item sets exactly 8
+ * bits in a single block (one in each of the block's 32-bit words). A lookup therefore touches one cache line, rather
+ * than k random ones as in a classic Bloom filter. At 12 bits per item the false positive rate is roughly 0.5%.
+ *
+ * insert() and contains() may be called concurrently from any number of threads without locks: bits are only ever
+ * set (with atomic OR), never cleared, so a reader can see a stale view but never a torn one. As with any Bloom
+ * filter, items cannot be removed, and contains() never returns false for an item that was inserted (before the
+ * call to contains(), in the happens-before sense).
+ *
+ * Inserting more than capacity() items is allowed, but the false positive rate rises quickly beyond that.
+ */
+class BlockedBloomFilter {
+public:
+    /// Constructs an invalid filter. Invalid filters are no-ops on insert(), and contains() always returns true.
+    BlockedBloomFilter() = default;
+
+    /// Constructs a filter sized for `nElements` items at `bitsPerElement` bits each (min 8). The hash seed is
+    /// random, so that the filter's false positives can't be targeted by e.g. grinding txids.
+    BlockedBloomFilter(std::size_t nElements, unsigned bitsPerElement = 12);
+
+    void insert(const ByteView &bv) noexcept;
+    /// Returns false only if `bv` was definitely never inserted.
+    bool contains(const ByteView &bv) const noexcept;
+
+    /// Clears all insertions (but keeps the filter valid). Not thread-safe.
+    void reset();
+
+    bool isValid() const { return nBlocks > 0; }
+
+    /// The number of times insert() was called (including for duplicate items).
+    std::size_t count() const { return nInserted.load(std::memory_order_relaxed); }
+    /// The number of items this filter was sized for.
+    std::size_t capacity() const { return nCapacity; }
+    /// Returns the number of bytes taken by this filter.
+    std::size_t memoryUsage() const { return nBlocks * sizeof(Block); }
+
+private:
+    static constexpr unsigned kWordsPerBlock = 8;
+    struct Block { std::atomic<uint32_t> words[kWordsPerBlock]; };
+
+    std::unique_ptr<Block[]> blocks;
+    std::size_t nBlocks = 0, nCapacity = 0;
+    uint64_t seed = 0;
+    std::atomic<std::size_t> nInserted{0};
+
+    uint64_t hash(const ByteView &bv) const noexcept;
+    /// Maps the high 32 bits of `h` uniformly onto [0, nBlocks) without a division.
+    Block & blockFor(uint64_t h) const noexcept { return blocks[std::size_t(((h >> 32) * uint64_t(nBlocks)) >> 32)]; }
+    /// The bit to set/test in word `i` of the block, derived from the low 32 bits of `h`.
+    static uint32_t mask(uint32_t h, unsigned i) noexcept;
+};
@@ -16,12 +16,15 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "Allocator.h"
 #include "App.h"
 #include "BlockProc.h"
 #include "BTC.h"
 #include "Controller.h"
 #include "Controller_SynchDSPsTask.h"
 #include "DSProof.h"
+#include "LockStats.h"
+#include "Logger.h"
 #include "Mempool.h"
 #include "Merkle.h"
 #include "SubsMgr.h"
@@ -1659,9 +1662,19 @@ void Controller::process_DownloadingBlocks()
 }
 
 namespace {
-    const QString inconsistentStateSorry("\n\nThe database is now likely in an inconsistent state. "
-                                         "To recover, you will need to delete the datadir and do a full resynch. "
-                                         "Sorry!\n");
+    /// Appended to the fatal error when addBlock or undoLatestBlock throws. Each block is added (or undone) in one atomic
+    /// WriteBatch, so the db is still at the previous block -- unless the --fast-sync UTXO cache held UTXO updates that
+    /// were not yet in the db (in which case the db is flagged "dirty").
+    QString inconsistentStateSorry(const Storage &storage) {
+        bool dirty = true; // if we can't even read the flag, assume the worst
+        try { dirty = storage.isDirty(); } catch (...) {}
+        if (dirty)
+            return "\n\nThe --fast-sync UTXO cache holds updates that were never written to the db, so the UTXO set in"
+                   " the db is now incomplete. To recover, you will need to delete the datadir and do a full resynch."
+                   " Sorry!\n";
+        return "\n\nEach block is written to the db atomically, so the db was left intact at the previous block."
+               " Restarting " APPNAME " should be all that is needed to recover.\n";
+    }
 }
 
 bool Controller::process_VerifyAndAddBlock(PreProcessedBlockPtr ppb)
@@ -1680,8 +1693,8 @@ bool Controller::process_VerifyAndAddBlock(PreProcessedBlockPtr ppb)
         process_DoUndoAndRetry();
         return false;
     } catch (const std::exception & e) {
-        // TODO: see about more graceful error and not a fatal exit. (although if we do get an error here it's pretty non-recoverable!)
-        Fatal() << e.what() << inconsistentStateSorry;
+        // TODO: see about more graceful error and not a fatal exit. (the db is left at the previous block, so a retry may succeed)
+        Fatal() << e.what() << inconsistentStateSorry(*storage);
         sm->state = StateMachine::State::Failure;
         // app will shut down after return to event loop.
         return false;
@@ -1701,7 +1714,7 @@ void Controller::process_DoUndoAndRetry()
         sm->state = StateMachine::State::Retry;
         AGAIN(); // schedule us again to do cleanup
     } catch (const std::exception & e) {
-        Fatal() << "Failed to rewind: " << e.what() << inconsistentStateSorry;
+        Fatal() << "Failed to rewind: " << e.what() << inconsistentStateSorry(*storage);
         sm->state = StateMachine::State::Failure;
         // upon return to event loop, will shut down
     }
@@ -1854,6 +1867,16 @@ auto Controller::stats() const -> Stats
     st["Storage"] = storage->statsSafe();
     QVariantMap misc;
     misc["Job Queue (Thread Pool)"] = ::AppThreadPool()->stats();
+    if (const Logger *logger = ::app() ? ::app()->logger() : nullptr) {
+        const auto ls = logger->asyncStats();
+        misc["Logger"] = QVariantMap{
+            { "async", logger->isAsync() },
+            { "queue capacity", qulonglong(ls.capacity) },
+            { "queued", qulonglong(ls.queued) },
+            { "lines written", qulonglong(ls.written) },
+            { "lines dropped", qulonglong(ls.dropped) },
+        };
+    }
     st["Misc"] = misc;
     st["SubsMgr"] = storage->subs()->statsSafe(kDefaultTimeout/2);
     st["SubsMgr (DSPs)"] = storage->dspSubs()->statsSafe(kDefaultTimeout/4);
@@ -1868,6 +1891,9 @@ auto Controller::stats() const -> Stats
         };
     }
 
+    // allocator summary: allocated vs. resident, fragmentation
+    st["Allocator"] = Allocator::stats();
+
     // grab jemalloc stats, if any
     st["Jemalloc"] = App::jemallocStats();
 
@@ -1926,6 +1952,17 @@ auto Controller::debug(const StatsParams &p) const -> Stats // from StatsMixin
         m["shunspent_db_shasum"] = QString::fromLatin1(stats.shunspent_db_shasum.toHex());
         ret["utxo_stats"] = m;
     }
+    if (p.contains("locks")) {
+        // e.g. /debug?locks=20 for the top 20; requires lock_sample_rate to be set in the conf file
+        bool ok;
+        const unsigned limit = p.value("locks").toUInt(&ok);
+        QVariantMap m;
+        m["sample_rate"] = LockStats::sampleRate();
+        m["top_contended"] = LockStats::report(ok && limit ? limit : 10);
+        ret["locks"] = m;
+    }
+    if (p.contains("alloc")) // e.g. /debug?alloc -- allocator stats including the per-arena breakdown
+        ret["allocator"] = Allocator::stats(true);
     if (p.contains("mempool")) {
         auto [mempool, lock] = storage->mempool();
         ret["mempool_debug"] = mempool.dump();
@@ -2066,3 +2103,310 @@ void Controller::dumpScriptHashes(const QString &fileName)
           <<" (" << QString::number(outFile.size()/1e6, 'f', 3) << " MB)";
     emit dumpScriptHashesComplete();
 }
+
+#ifdef ENABLE_TESTS
+#include "Metrics.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QTemporaryDir>
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+namespace {
+    /// Locates the raw blocks to replay, in height order starting from genesis. Supports 2 formats:
+    ///  - bitcoind's blk?????.dat files (a single file, or a directory containing them). Records are <magic:4><size:4>
+    ///    <block>, and blocks are not stored in height order, so we index the headers and follow the best chain.
+    ///  - a "dump" file of <size:4><block> records, already in height order starting from genesis.
+    /// All integers are little endian.
+    class BlockSource
+    {
+        struct Loc { int file; qint64 offset; quint32 size; };
+        QStringList files;
+        std::vector<Loc> chain; ///< chain[height] is where block `height` lives
+        qint64 nBytesRead = 0;
+
+        static quint32 readLE32(QFile &f, bool *ok) {
+            std::array<char, 4> buf;
+            *ok = f.read(buf.data(), 4) == 4;
+            return *ok ? ReadLE32(reinterpret_cast<const uint8_t *>(buf.data())) : 0u;
+        }
+
+        void indexDump(const QString &path, size_t maxBlocks) {
+            QFile f(path);
+            if (!f.open(QIODevice::ReadOnly)) throw Exception(QString("Unable to open %1: %2").arg(path, f.errorString()));
+            files.push_back(path);
+            bool ok;
+            for (quint32 size; chain.size() < maxBlocks && (size = readLE32(f, &ok), ok); ) {
+                chain.push_back({0, f.pos(), size});
+                if (!f.seek(f.pos() + size) || f.pos() > f.size())
+                    throw Exception(QString("%1: truncated record at offset %2").arg(path).arg(chain.back().offset - 4));
+            }
+        }
+
+        void indexBlkFiles(const QStringList &blkFiles, size_t maxBlocks) {
+            static constexpr long kUnknown = -1, kOrphan = -2;
+            struct Entry { QByteArray prevHash; Loc loc; long height = kUnknown; };
+            std::unordered_map<QByteArray, Entry, HashHasher> byHash;
+            for (const auto & path : blkFiles) {
+                QFile f(path);
+                if (!f.open(QIODevice::ReadOnly)) throw Exception(QString("Unable to open %1: %2").arg(path, f.errorString()));
+                const int fileIdx = files.size();
+                files.push_back(path);
+                bool ok;
+                // a zero magic means we hit the preallocated (unused) tail of the file
+                for (quint32 magic; (magic = readLE32(f, &ok), ok) && magic; ) {
+                    const quint32 size = readLE32(f, &ok);
+                    const qint64 offset = f.pos();
+                    const QByteArray header = f.read(BTC::GetBlockHeaderSize());
+                    if (!ok || header.size() != BTC::GetBlockHeaderSize() || !f.seek(offset + size))
+                        throw Exception(QString("%1: truncated record at offset %2").arg(path).arg(offset - 8));
+                    byHash.try_emplace(BTC::Hash(header), Entry{header.mid(4, HashLen), Loc{fileIdx, offset, size}});
+                }
+                Debug() << "Indexed " << path << ", blocks so far: " << byHash.size();
+            }
+            // compute the height of every block, then walk back from the highest one to get the best chain
+            const QByteArray nullHash(HashLen, '\0');
+            std::vector<Entry *> path;
+            Entry *best = nullptr;
+            for (auto & [hash, entry] : byHash) {
+                // walk back until we hit a block whose height is known, then assign heights on the way forward
+                path.clear();
+                long h = kOrphan;
+                for (Entry *e = &entry; ; ) {
+                    if (e->height != kUnknown) { h = e->height; break; }
+                    path.push_back(e);
+                    if (e->prevHash == nullHash) { h = -1; break; } // genesis
+                    const auto it = byHash.find(e->prevHash);
+                    if (it == byHash.end()) break; // orphan: parent is not in the files we read
+                    e = &it->second;
+                }
+                for (auto rit = path.rbegin(); rit != path.rend(); ++rit)
+                    (*rit)->height = h = (h == kOrphan ? kOrphan : h + 1);
+                if (entry.height >= 0 && (!best || entry.height > best->height)) best = &entry;
+            }
+            if (!best) throw Exception("No genesis block found in the blk files");
+            chain.resize(size_t(best->height) + 1);
+            for (Entry *e = best; ; e = &byHash.at(e->prevHash)) {
+                chain[size_t(e->height)] = e->loc;
+                if (!e->height) break;
+            }
+            if (chain.size() > maxBlocks) chain.resize(maxBlocks);
+        }
+
+    public:
+        BlockSource(const QString &path, size_t maxBlocks) {
+            const QFileInfo fi(path);
+            const auto isBlk = [](const QString &name) { return name.startsWith("blk") && name.endsWith(".dat"); };
+            if (fi.isDir()) {
+                QStringList blkFiles;
+                for (const auto & name : QDir(path).entryList({"blk*.dat"}, QDir::Files, QDir::Name))
+                    blkFiles.push_back(QDir(path).filePath(name));
+                if (blkFiles.isEmpty()) throw Exception(QString("No blk*.dat files found in %1").arg(path));
+                indexBlkFiles(blkFiles, maxBlocks);
+            } else if (isBlk(fi.fileName())) {
+                indexBlkFiles({path}, maxBlocks);
+            } else {
+                indexDump(path, maxBlocks);
+            }
+        }
+
+        size_t size() const { return chain.size(); }
+        qint64 bytesRead() const { return nBytesRead; }
+
+        /// Must be called with increasing heights, from 1 thread only.
+        QByteArray read(size_t height) {
+            const Loc & loc = chain.at(height);
+            if (!curFile || curFileIdx != loc.file) {
+                curFile = std::make_unique<QFile>(files.at(loc.file));
+                curFileIdx = loc.file;
+                if (!curFile->open(QIODevice::ReadOnly)) throw Exception(QString("Unable to open %1").arg(curFile->fileName()));
+            }
+            QByteArray ret;
+            if (!curFile->seek(loc.offset) || (ret = curFile->read(loc.size)).size() != qsizetype(loc.size))
+                throw Exception(QString("Short read for block %1 from %2").arg(height).arg(curFile->fileName()));
+            nBytesRead += ret.size();
+            return ret;
+        }
+    private:
+        std::unique_ptr<QFile> curFile;
+        int curFileIdx = -1;
+    };
+
+    /// Returns {read_bytes, write_bytes} from /proc/self/io, i.e. the bytes that actually hit the storage layer,
+    /// or {-1, -1} if not available on this platform.
+    std::pair<qint64, qint64> procIO() {
+        qint64 r = -1, w = -1;
+        QFile f("/proc/self/io");
+        if (f.open(QIODevice::ReadOnly))
+            for (const auto & line : f.readAll().split('\n')) {
+                if (line.startsWith("read_bytes:")) r = line.mid(11).trimmed().toLongLong();
+                else if (line.startsWith("write_bytes:")) w = line.mid(12).trimmed().toLongLong();
+            }
+        return {r, w};
+    }
+
+    /// Replays raw blocks from disk through the same steps as the Controller's initial sync: deserialization and
+    /// PreProcessedBlock::fill (in a reader thread, as the download tasks do) then Storage::addBlock (in this thread),
+    /// and reports the throughput and where the time went. Environment variables:
+    ///   REPLAY    - (required) a blk?????.dat file, a directory of them, or a <size:4><block> dump file
+    ///   NBLOCKS   - max. number of blocks to replay (default: all)
+    ///   COIN      - BCH, BTC or LTC, selects the block deserialization rules (default: BCH)
+    ///   FAST_SYNC - UTXO cache size in MB, as per the `fast-sync` option (default: 0, disabled)
+    ///   DB_MEM    - the `db_mem` option, in MB (default: the option's default)
+    ///   BENCH_DIR - datadir to use and keep, must be empty or not exist (default: a temp dir that is deleted after)
+    void benchReplay() {
+        const auto envStr = [](const char *name) { return QString::fromLocal8Bit(std::getenv(name)); };
+        const auto envMB = [&envStr](const char *name, size_t def) -> size_t {
+            if (const auto v = envStr(name); !v.isEmpty()) {
+                bool ok;
+                const double d = v.toDouble(&ok);
+                if (!ok || d < 0.) throw BadArgs(QString("Bad value for env var %1: %2").arg(name, v));
+                return size_t(d * 1e6);
+            }
+            return def;
+        };
+        const QString src = envStr("REPLAY");
+        if (src.isEmpty())
+            throw BadArgs("Please set the REPLAY env var to a blk?????.dat file, a directory of them, or a block dump file");
+        const size_t maxBlocks = envStr("NBLOCKS").isEmpty() ? std::numeric_limits<size_t>::max() : envStr("NBLOCKS").toULongLong();
+        const QString coinName = envStr("COIN").isEmpty() ? QString("BCH") : envStr("COIN").toUpper();
+        const auto coin = BTC::coinFromName(coinName);
+        if (coin == BTC::Coin::Unknown) throw BadArgs(QString("Unknown COIN: %1").arg(coinName));
+        const bool allowSegWit = coin != BTC::Coin::BCH, allowMimble = coin == BTC::Coin::LTC,
+                   allowCashTokens = coin == BTC::Coin::BCH;
+
+        std::unique_ptr<QTemporaryDir> tmpDir; // declared before `storage` so that it outlives it
+        QString datadir = envStr("BENCH_DIR");
+        if (datadir.isEmpty()) {
+            tmpDir = std::make_unique<QTemporaryDir>();
+            if (!tmpDir->isValid()) throw InternalError("Unable to create a temporary directory");
+            datadir = tmpDir->path();
+        } else if (QDir d(datadir); d.exists() && !d.isEmpty()) {
+            throw BadArgs(QString("BENCH_DIR %1 must be empty or not exist").arg(datadir));
+        } else if (!QDir().mkpath(datadir)) {
+            throw BadArgs(QString("Unable to create BENCH_DIR %1").arg(datadir));
+        }
+
+        Tic tIndex;
+        BlockSource source(src, maxBlocks);
+        const size_t nBlocks = source.size();
+        Log() << "Replaying " << nBlocks << " " << coinName << " blocks from " << src << " (indexed in "
+              << tIndex.secsStr(2) << " secs), datadir: " << datadir;
+
+        auto opts = std::make_shared<Options>();
+        opts->datadir = datadir;
+        opts->utxoCache = envMB("FAST_SYNC", 0);
+        opts->db.maxMem = std::max(envMB("DB_MEM", opts->db.maxMem), Options::DBOpts::maxMemMin);
+        auto storage = std::make_shared<Storage>(opts);
+        storage->startup();
+        storage->setCoin(coinName);
+
+        // reader thread: read + deserialize + fill, a bounded number of blocks ahead of addBlock
+        struct Stages { qint64 read{}, deser{}, fill{}; } stages;
+        std::mutex mut;
+        std::condition_variable cond;
+        std::deque<PreProcessedBlockPtr> queue;
+        constexpr size_t kMaxQueue = 64;
+        QString readerErr;
+        std::atomic_bool stop{false};
+        std::thread reader([&] {
+            size_t h = 0;
+            try {
+                for ( ; h < nBlocks && !stop; ++h) {
+                    auto t = Util::getTimeNS();
+                    const QByteArray raw = source.read(h);
+                    auto t2 = Util::getTimeNS(); stages.read += t2 - t; t = t2;
+                    const auto cblock = BTC::Deserialize<bitcoin::CBlock>(raw, 0, allowSegWit, allowMimble, allowCashTokens, allowMimble);
+                    t2 = Util::getTimeNS(); stages.deser += t2 - t; t = t2;
+                    auto ppb = PreProcessedBlock::makeShared(unsigned(h), size_t(raw.size()), cblock);
+                    stages.fill += Util::getTimeNS() - t;
+                    std::unique_lock g(mut);
+                    cond.wait(g, [&] { return queue.size() < kMaxQueue || stop; });
+                    queue.push_back(std::move(ppb));
+                    cond.notify_all();
+                }
+            } catch (const std::exception &e) {
+                std::unique_lock g(mut);
+                readerErr = QString("Block %1: %2").arg(h).arg(e.what());
+                cond.notify_all();
+            }
+        });
+        Defer joinReader([&] {
+            stop = true;
+            { std::unique_lock g(mut); cond.notify_all(); }
+            reader.join();
+        });
+
+        static const QStringList stageNames = {"locks", "mempool", "txnums", "utxo", "history", "blkinfo_undo", "commit", "post_commit"};
+        const auto stageHist = [](const QString &name) -> Metrics::Histogram & {
+            return Metrics::histogram("fulcrum_addblock_stage_seconds", {}, "stage", name);
+        };
+        std::vector<double> stageSums0;
+        for (const auto & name : stageNames) stageSums0.push_back(stageHist(name).snapshot().sumSecs);
+        const auto [ioRead0, ioWrite0] = procIO();
+
+        size_t nTx = 0, nIns = 0, nOuts = 0;
+        qint64 addNS = 0, waitNS = 0;
+        const Tic t0;
+        {
+            auto initialSync = storage->setInitialSync(); // enables the fast-sync UTXO cache, if FAST_SYNC was set
+            const unsigned undoDepth = storage->configuredUndoDepth();
+            for (size_t h = 0; h < nBlocks; ++h) {
+                PreProcessedBlockPtr ppb;
+                {
+                    const auto tw = Util::getTimeNS();
+                    std::unique_lock g(mut);
+                    cond.wait(g, [&] { return !queue.empty() || !readerErr.isEmpty(); });
+                    if (queue.empty()) throw Exception(readerErr);
+                    ppb = std::move(queue.front());
+                    queue.pop_front();
+                    cond.notify_all();
+                    waitNS += Util::getTimeNS() - tw;
+                }
+                nTx += ppb->txInfos.size(); nIns += ppb->inputs.size(); nOuts += ppb->outputs.size();
+                // same as Controller::process_VerifyAndAddBlock, with the tip being the last block we will replay
+                const bool saveUndo = h + undoDepth >= nBlocks;
+                const auto ta = Util::getTimeNS();
+                storage->addBlock(ppb, saveUndo, unsigned(nBlocks - h - 1), false);
+                addNS += Util::getTimeNS() - ta;
+                if (nBlocks >= 20 && (h + 1) % (nBlocks / 20) == 0)
+                    Log() << "Replayed " << (h + 1) << "/" << nBlocks << " blocks, "
+                          << QString::number((h + 1) / t0.secs(), 'f', 1) << " blocks/sec ...";
+            }
+        } // <-- ends the initial sync; flushes the UTXO cache (if any), which we count as part of the replay
+        const double secs = t0.secs();
+        const auto [ioRead1, ioWrite1] = procIO();
+
+        Log() << "Replayed " << nBlocks << " blocks (" << nTx << " txs, " << nIns << " inputs, " << nOuts << " outputs) in "
+              << QString::number(secs, 'f', 3) << " secs: " << QString::number(nBlocks / secs, 'f', 1) << " blocks/sec, "
+              << QString::number(nTx / secs, 'f', 1) << " txs/sec";
+        const auto pct = [secs](double s) { return QString::number(100. * s / secs, 'f', 1) + "%"; };
+        Log() << "Reader thread: read " << QString::number(stages.read / 1e9, 'f', 3) << " secs, deserialize "
+              << QString::number(stages.deser / 1e9, 'f', 3) << " secs, fill " << QString::number(stages.fill / 1e9, 'f', 3)
+              << " secs; addBlock waited for the reader: " << QString::number(waitNS / 1e9, 'f', 3) << " secs ("
+              << pct(waitNS / 1e9) << ")";
+        Log() << "addBlock: " << QString::number(addNS / 1e9, 'f', 3) << " secs (" << pct(addNS / 1e9) << ")";
+        for (int i = 0; i < stageNames.size(); ++i) {
+            const double s = stageHist(stageNames[i]).snapshot().sumSecs - stageSums0[size_t(i)];
+            Log() << "    " << stageNames[i] << ": " << QString::number(s, 'f', 3) << " secs (" << pct(s) << ")";
+        }
+        qint64 dbBytes = 0;
+        for (QDirIterator it(datadir, QDir::Files, QDirIterator::Subdirectories); it.hasNext(); ) {
+            it.next();
+            dbBytes += it.fileInfo().size();
+        }
+        Log() << "I/O: " << QString::number(source.bytesRead() / 1e6, 'f', 1) << " MB of blocks read, datadir size "
+              << QString::number(dbBytes / 1e6, 'f', 1) << " MB"
+              << (ioRead0 >= 0 && ioRead1 >= 0
+                  ? QString(", storage layer I/O: %1 MB read, %2 MB written").arg((ioRead1 - ioRead0) / 1e6, 0, 'f', 1)
+                                                                              .arg((ioWrite1 - ioWrite0) / 1e6, 0, 'f', 1)
+                  : QString());
+    }
+    const auto b1 = App::registerBench("replay", benchReplay);
+} // namespace
+#endif
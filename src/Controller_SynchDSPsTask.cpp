@@ -16,14 +16,17 @@
 // along with this program (see LICENSE.txt).  If not, see
 // <https://www.gnu.org/licenses/>.
 //
+#include "App.h"
 #include "Controller_SynchDSPsTask.h"
 #include "SubsMgr.h"
+#include "ThreadPool.h"
 #include "Util.h"
 
+#include <algorithm>
 #include <utility>
 
 SynchDSPsTask::SynchDSPsTask(Controller *ctl_, std::shared_ptr<Storage> storage, const std::atomic_bool & notifyFlag)
-    : CtlTask(ctl_, "SynchDSPs"), storage(storage), notifyFlag(notifyFlag)
+    : CtlTask(ctl_, "SynchDSPs"), storage(storage), notifyFlag(notifyFlag), downloads(std::make_shared<Downloads>())
 {
     // force emit of success or errored to lead to immediate state=End assignment as a side-effect
     connect(this, &CtlTask::success, this, [this]{state = End;});
@@ -33,8 +36,8 @@ SynchDSPsTask::SynchDSPsTask(Controller *ctl_, std::shared_ptr<Storage> storage,
 SynchDSPsTask::~SynchDSPsTask() {
     stop();
 
-    if (!dspsDownloaded.empty() || !downloadsFailed.empty() || !txsAffected.empty()) {
-        DebugM(objectName(), ": downloaded: ", dspsDownloaded.size(),", failed: ", downloadsFailed.size(),
+    if (!downloads->empty() || !txsAffected.empty()) {
+        DebugM(objectName(), ": downloaded: ", downloads->size(), ", added: ", nAdded, ", failed: ", nFailed,
                ", txsAffecteed: ", txsAffected.size(), ", dsp count now: ", storage->mempool().first.dsps.size(),
                ", elapsed: ", elapsed.msecStr(), " msec");
     } else if (elapsed.msec() >= 50) {
@@ -54,10 +57,12 @@ void SynchDSPsTask::process()
     case WaitingForDSPList: // this state is suprious, ignore
         DebugM("spurious WaitingForDSPList wakeup in ", __PRETTY_FUNCTION__);
         [[fallthrough]];
+    case WaitingForProcessing: // replies & AGAIN() calls still queued from the download phase may land here, ignore
     case End: return; // end state means ignore further process() events coming in
     case GetDSPList: doGetDSPList(); break;
     case DownloadingNewDSPs: doDownloadNewDSPs(); break;
     case ProcessDownloads: doProcessDownloads(); break;
+    case AddToMempool: doAddToMempool(); break;
     }
 }
 
@@ -70,6 +75,7 @@ void SynchDSPsTask::doGetDSPList()
             return;
         }
         const auto knownDSPs = Util::keySet<DSPs::DspHashSet>(storage->mempool().first.dsps.getAll()); // this is guarded access, lock held until statement end (C++ temporary lifetime rules)
+        DSPs::DspHashSet seen;
         // scan thru all downloaded dsp hashes and figure out what's new and what needs refresh
         for (const auto & var : resp.result().toList()) {
             const DspHash hash = DspHash::fromHex(var.toString());
@@ -79,20 +85,17 @@ void SynchDSPsTask::doGetDSPList()
                 continue;
             }
             if (!knownDSPs.count(hash)) {
-                auto [it, inserted] = dspsNeedingDownload.emplace(std::piecewise_construct, std::forward_as_tuple(hash), std::forward_as_tuple());
-                if (!inserted) {
+                if (!seen.insert(hash).second) {
                     // should never happen
                     Warning() << "Got dupe dsp hash in results from bitcoin for dsp: " << hash.toHex();
                     continue;
                 }
-                DSProof & dspNew = it->second;
-                dspNew.hash = it->first; // re-use same QByteArray memory (copy-on-write)
+                downloads->emplace_back().proof.hash = hash;
             }
         }
         // if we have any new dsps needing download, proceed to download state
-        if (!dspsNeedingDownload.empty()) {
-            //DebugM("new dsps: ", dspsNeedingDownload.size());
-            dspDlsExpected = dspsNeedingDownload.size();
+        if (!downloads->empty()) {
+            //DebugM("new dsps: ", downloads->size());
             state = DownloadingNewDSPs;
             AGAIN();
         } else {
@@ -102,15 +105,15 @@ void SynchDSPsTask::doGetDSPList()
     });
 }
 
-void SynchDSPsTask::dlNext(bool phase2, std::shared_ptr<DSPs::DspMap::node_type> node)
+void SynchDSPsTask::dlNext(std::size_t index, bool phase2)
 {
-    const auto &hash = node->key();
-    submitRequest("getdsproof", {hash.toHex(), !phase2 ? 0 : 2}, [this, node, phase2](const RPC::Message &reply)  {
-        const auto &hash = node->key();
-        auto &proof = node->mapped();
+    const QByteArray hashHex = (*downloads)[index].proof.hash.toHex();
+    submitRequest("getdsproof", {hashHex, !phase2 ? 0 : 2}, [this, index, phase2](const RPC::Message &reply)  {
+        // Note: `downloads` is never resized once we are in the download phase, so `dl` is stable
+        Download &dl = (*downloads)[index];
+        auto &proof = dl.proof;
+        const auto &hash = proof.hash;
         try {
-            if (UNLIKELY(proof.hash != hash)) // paranoia to enforce invariant
-                throw InternalError("INTERNAL ERROR: dsproof hash in proof doesn't match its onw map key! FIXME!");
             const QVariantMap vm = reply.result().toMap();
             if (!phase2) {
                 // keys we are reading: "hex", "txid"
@@ -119,100 +122,198 @@ void SynchDSPsTask::dlNext(bool phase2, std::shared_ptr<DSPs::DspMap::node_type>
                 const DspHash chk = DspHash::fromSerializedProof(serdata);
                 if (chk != hash || !chk.isValid() || txid.length() != HashLen)
                     throw Exception("basic phase 1 sanity checks failed");
-                // data ok, keep going to phase2
-                dlNext(true, node);
-            } else {
-                // phase 2: keys we are reading: "dspid", "txid", "outpoint", "descendants"
-                const DspHash chk = DspHash::fromHex(vm.value("dspid").toString());
-                const TxHash txidChk = Util::ParseHexFast(vm.value("txid").toString().toUtf8());
-                const auto op = vm.value("outpoint").toMap();
-                proof.txo.txHash = Util::ParseHexFast(op.value("txid").toString().toUtf8());
-                bool ok{};
-                proof.txo.outN = op.value("vout").toUInt(&ok);;
-                const auto descs = vm.value("descendants").toStringList();
-                if (!ok || chk != hash || txidChk != proof.txHash || proof.txo.txHash.length() != HashLen || descs.isEmpty())
-                    throw Exception(QString("basic phase 2 sanity checks failed: ok: %1, chk: %2, hash: %3, proofTxHash: %4, "
-                                            "txidChk: %5, txoTxHash: %6, descs: %7")
-                                    .arg(int(ok)).arg(QString(chk.toHex())).arg(QString(hash.toHex())).arg(QString(proof.txHash.toHex()))
-                                    .arg(QString(txidChk.toHex())).arg(QString(proof.txo.txHash.toHex())).arg(descs.size()));
-                // build descendants set
-                for (const auto &desc : descs) {
-                    const auto txid = Util::ParseHexFast(desc.toUtf8());
-                    if (txid.length() != HashLen)
-                        throw Exception(QString("bad txid \"%1\" in descendants set").arg(desc));
-                    proof.descendants.insert(txid);
-                }
-                if (!proof.descendants.count(proof.txHash))
-                    throw Exception(QString("missing proof's associated txid \"%1\" in the descendants set").arg(QString(proof.txHash.toHex())));
-                DebugM("dsp ", hash.toHex(), " downloaded ok, descendants: ", proof.descendants.size());
-                dspsDownloaded.insert(std::move(*node)); // success! phase2 complete...
-                AGAIN();
+                // data ok, keep going to phase2 (re-using this request's slot)
+                dlNext(index, true);
+                return;
             }
+            // phase 2: keys "dspid", "txid", "outpoint", "descendants" are parsed later, by processDownload()
+            dl.verbose = vm;
+            dl.status = Download::Downloaded;
         } catch (const std::exception &e) {
             Warning() << "bad dsp " << hash.toHex() << ", (exc: " << e.what() << "), ignoring dsp ...";
-            downloadsFailed.insert(hash);
-            AGAIN();
+            dl.status = Download::Failed;
         }
+        --inFlight;
+        AGAIN();
     },
-    [this, hash, phase2](const RPC::Message &){
+    [this, index, hashHex, phase2](const RPC::Message &){
         // ignore errors, keep going
-        DebugM("failed to download dsp ", hash.toHex(), " phase ", 1+int(phase2), ", ignoring dsp ...");
-        downloadsFailed.insert(hash);
+        DebugM("failed to download dsp ", hashHex, " phase ", 1+int(phase2), ", ignoring dsp ...");
+        (*downloads)[index].status = Download::Failed;
+        --inFlight;
         AGAIN();
     });
 }
 
 void SynchDSPsTask::doDownloadNewDSPs()
 {
-    if (!dspsNeedingDownload.empty())
-        dlNext(false, dspsNeedingDownload.extract(dspsNeedingDownload.begin()));
-    else if (const auto sum = dspsDownloaded.size() + downloadsFailed.size(); sum == dspDlsExpected) {
+    // keep the pipeline full
+    for ( ; inFlight < kMaxInFlight && nextDownload < downloads->size(); ++inFlight)
+        dlNext(nextDownload++, false);
+    if (!inFlight && nextDownload == downloads->size()) {
         // end this state, move on to next
         state = ProcessDownloads;
         AGAIN();
-    } else {
-        // should never happen
-        Error() << "INTERNAL ERROR: expceted to download " << dspDlsExpected << " dsps, instead downloaded: " << sum;
-        emit errored();
     }
 }
 
+/* static */
+void SynchDSPsTask::processDownload(Download &dl, const Mempool &mempool)
+{
+    auto &proof = dl.proof;
+    const auto &hash = proof.hash;
+    try {
+        // keys we are reading: "dspid", "txid", "outpoint", "descendants"
+        const QVariantMap &vm = dl.verbose;
+        const DspHash chk = DspHash::fromHex(vm.value("dspid").toString());
+        const TxHash txidChk = Util::ParseHexFast(vm.value("txid").toString().toUtf8());
+        const auto op = vm.value("outpoint").toMap();
+        proof.txo.txHash = Util::ParseHexFast(op.value("txid").toString().toUtf8());
+        bool ok{};
+        proof.txo.outN = op.value("vout").toUInt(&ok);
+        const auto descs = vm.value("descendants").toStringList();
+        if (!ok || chk != hash || txidChk != proof.txHash || proof.txo.txHash.length() != HashLen || descs.isEmpty())
+            throw Exception(QString("basic phase 2 sanity checks failed: ok: %1, chk: %2, hash: %3, proofTxHash: %4, "
+                                    "txidChk: %5, txoTxHash: %6, descs: %7")
+                            .arg(int(ok)).arg(QString(chk.toHex())).arg(QString(hash.toHex())).arg(QString(proof.txHash.toHex()))
+                            .arg(QString(txidChk.toHex())).arg(QString(proof.txo.txHash.toHex())).arg(descs.size()));
+        // build descendants set
+        proof.descendants.reserve(std::size_t(descs.size()));
+        for (const auto &desc : descs) {
+            const auto txid = Util::ParseHexFast(desc.toUtf8());
+            if (txid.length() != HashLen)
+                throw Exception(QString("bad txid \"%1\" in descendants set").arg(desc));
+            proof.descendants.insert(txid);
+        }
+        if (!proof.descendants.count(proof.txHash))
+            throw Exception(QString("missing proof's associated txid \"%1\" in the descendants set").arg(QString(proof.txHash.toHex())));
+    } catch (const std::exception &e) {
+        Warning() << "bad dsp " << hash.toHex() << ", (exc: " << e.what() << "), ignoring dsp ...";
+        dl.status = Download::Failed;
+        return;
+    }
+    dl.verbose.clear(); // no longer needed, free memory
+    const TxHash *txHash = mempool.internTxHash(proof.txHash);
+    if (!txHash) {
+        // unknown txid (it's new and we haven't seen it in SynchMempoolTask yet!)
+        dl.status = Download::UnknownTx;
+        return;
+    }
+    proof.txHash = *txHash;
+    // Only "known" txids may ever be linked to a dsp (Mempool::addNewTxs relies on this invariant). We also swap in
+    // the mempool's own copies of the hashes, so that the proof and its links share their data.
+    DSProof::TxHashSet interned;
+    interned.reserve(proof.descendants.size());
+    for (const auto & txid : proof.descendants) {
+        if (const TxHash *p = mempool.internTxHash(txid))
+            interned.insert(*p);
+        else
+            ++dl.nSkipped;
+    }
+    proof.descendants = std::move(interned);
+    dl.status = Download::Ok;
+}
+
+/* static */
+auto SynchDSPsTask::processDownloads(Downloads &dls, std::size_t begin, std::size_t end, const Storage &storage) -> MempoolSizes
+{
+    auto [mempool, lock] = storage.mempool(); // shared lock: clients may still read the mempool as we do this
+    for (std::size_t i = begin; i < end; ++i)
+        if (dls[i].status == Download::Downloaded)
+            processDownload(dls[i], mempool);
+    return {mempool.txs.size(), mempool.hashXTxs.size()};
+}
+
 void SynchDSPsTask::doProcessDownloads()
 {
-    unsigned ctr = 0, notAdded = 0;
-    {
-        auto [mempool, lock] = storage->mutableMempool();
-        for (auto & [hash, proof] : dspsDownloaded) {
-            if (!mempool.txs.count(proof.txHash)) {
-                // unknown txid (it's new and we haven't seen it in SynchMempoolTask yet!)
-                DebugM("skipping dsp ", hash.toHex(), " because its associated txid ", proof.txHash.toHex(),
-                       " is not yet known to us");
-                ++notAdded;
-                continue;
-            }
+    state = WaitingForProcessing;
+    const std::size_t n = downloads->size();
+    if (n < kMinParallel) {
+        // the common case: just a few proofs, don't bother with the thread pool
+        jobSizes = std::make_shared<std::vector<MempoolSizes>>(1, processDownloads(*downloads, 0, n, *storage));
+        state = AddToMempool;
+        AGAIN();
+        return;
+    }
+    const std::size_t nJobs = std::min<std::size_t>(n / (kMinParallel / 2), std::max(::AppThreadPool()->maxThreadCount(), 1));
+    jobSizes = std::make_shared<std::vector<MempoolSizes>>(nJobs);
+    jobsPending = nJobs;
+    for (std::size_t j = 0; j < nJobs; ++j) {
+        const std::size_t begin = n * j / nJobs, end = n * (j + 1) / nJobs;
+        // the work lambda must not touch `this`, since this task may be deleted before it runs
+        ::AppThreadPool()->submitWork(this,
+            [dls = downloads, sizes = jobSizes, st = storage, j, begin, end]{
+                (*sizes)[j] = processDownloads(*dls, begin, end, *st);
+            },
+            [this]{
+                if (state != WaitingForProcessing) return; // another job failed
+                if (--jobsPending == 0) {
+                    state = AddToMempool;
+                    AGAIN();
+                }
+            },
+            [this](const QString &msg){
+                if (state != WaitingForProcessing) return; // another job failed
+                Error() << objectName() << ": failed to process dsp downloads: " << msg;
+                emit errored();
+            });
+    }
+}
 
-            decltype(proof.descendants) skipped;
-            for (const auto & txid : proof.descendants) {
-                if (!mempool.txs.count(txid))
-                    skipped.insert(txid);
-                else
-                    ctr += txsAffected.insert(txid).second; // flag txids affected
-            }
-            if (!skipped.empty()) {
-                DebugM("skipped ", skipped.size(), " descendant txs for dsp ", hash.toHex(), " (unknown txids)");
-                for (const auto &txid: skipped)
-                    proof.descendants.erase(txid);
+void SynchDSPsTask::doAddToMempool()
+{
+    std::size_t ctr = 0, nUnknown = 0, nOk = 0;
+    for (const auto & dl : *downloads) {
+        nOk += dl.status == Download::Ok;
+        nUnknown += dl.status == Download::UnknownTx;
+        nFailed += dl.status == Download::Failed;
+    }
+    if (nOk) {
+        auto [mempool, lock] = storage->mutableMempool();
+        const MempoolSizes now{mempool.txs.size(), mempool.hashXTxs.size()};
+        // The mempool can only shrink between the time the jobs released the shared lock and now (other subsystems can
+        // only drop or clear), so a size change is enough to tell us whether the jobs' view of it is stale.
+        const bool stale = std::any_of(jobSizes->begin(), jobSizes->end(), [&now](const auto &sz){ return sz != now; });
+        if (stale)
+            DebugM(objectName(), ": mempool changed while processing dsps, re-checking descendants");
+        std::size_t nLinks = 0;
+        for (const auto & dl : *downloads)
+            if (dl.status == Download::Ok) nLinks += dl.proof.descendants.size();
+        mempool.dsps.reserve(mempool.dsps.size() + nOk, nLinks);
+        for (auto & dl : *downloads) {
+            if (dl.status != Download::Ok) continue;
+            auto & proof = dl.proof;
+            if (stale) {
+                if (!mempool.txs.count(proof.txHash)) {
+                    ++nUnknown;
+                    continue;
+                }
+                for (auto it = proof.descendants.begin(); it != proof.descendants.end(); ) {
+                    if (!mempool.txs.count(*it)) {
+                        it = proof.descendants.erase(it);
+                        ++dl.nSkipped;
+                    } else
+                        ++it;
+                }
             }
+            if (dl.nSkipped)
+                DebugM("skipped ", dl.nSkipped, " descendant txs for dsp ", proof.hash.toHex(), " (unknown txids)");
+            for (const auto & txid : proof.descendants)
+                ctr += txsAffected.insert(txid).second; // flag txids affected
+            const DspHash hash = proof.hash;
             try {
                 if (! mempool.dsps.add(std::move(proof)) ) // this itself may throw
                     throw InternalError("DSPs::add() returned false"); // but also we will throw if it returns false since it indicates a bug in code
+                ++nAdded;
             } catch (const std::exception &e) {
                 // this should never happen, but since the above can throw, it's best to guard against it.
                 Error() << "INTERNAL ERROR: failed to add dsp " << hash.toHex() << ", exception: " << e.what();
             }
         }
     }
-    if (auto total = long(dspsDownloaded.size()) - long(notAdded); total > 0)
-        DebugM("added ", total, " new dsps with ", ctr, " newly affected txs");
+    if (nUnknown)
+        DebugM("skipped ", nUnknown, " dsps because their associated txids are not yet known to us");
+    if (nAdded)
+        DebugM("added ", nAdded, " new dsps with ", ctr, " newly affected txs");
     emit success(); // final state
 }
@@ -24,12 +24,20 @@
 #include "Storage.h"
 
 #include <atomic>
+#include <cstddef>
 #include <memory>
 #include <utility>
+#include <vector>
 
 /// This runs after the SynchMempoolTask to download new DSProofs and also update existing proofs
 /// with new descendant info. This task is only run if the bitcoind we are connected to supports
 /// the `getdsprooflist` and `getdsproof` RPC methods.
+///
+/// New proofs are downloaded with up to kMaxInFlight `getdsproof` requests outstanding at once (spread across all of
+/// the bitcoind connections), so that a burst of thousands of proofs (e.g. during a double-spend attack) costs a
+/// handful of round trips rather than 2 per proof. The descendant sets are then parsed and checked against the mempool
+/// in parallel on the app thread pool with only the shared mempool lock held, and the exclusive lock is taken just to
+/// add the resulting proofs.
 class SynchDSPsTask : public CtlTask {
 public:
     SynchDSPsTask(Controller *ctl_, std::shared_ptr<Storage> storage, const std::atomic_bool & notifyFlag);
@@ -45,20 +53,53 @@ private:
     enum State {
         GetDSPList, WaitingForDSPList,
         DownloadingNewDSPs,
-        ProcessDownloads,
+        ProcessDownloads, WaitingForProcessing,
+        AddToMempool,
         End,
     };
 
     State state = GetDSPList;
 
+    /// Max. number of `getdsproof` requests we keep outstanding at once.
+    static constexpr unsigned kMaxInFlight = 64;
+    /// Below this many downloads, we process them in this thread rather than farming them out to the thread pool.
+    static constexpr std::size_t kMinParallel = 16;
+
+    /// A proof being downloaded. Phase 1 (`getdsproof <hash> 0`) fills in `proof`'s hash, serialized data & txHash,
+    /// and phase 2 (`getdsproof <hash> 2`) gives us `verbose`, which is parsed later by processDownload().
+    struct Download {
+        DSProof proof;
+        QVariantMap verbose;
+        enum Status { Pending, Downloaded, Failed, UnknownTx, Ok } status = Pending;
+        std::size_t nSkipped = 0; ///< number of descendants dropped because they are not (yet) in our mempool
+    };
+    using Downloads = std::vector<Download>;
+    /// Shared with the thread pool jobs, which may outlive this task.
+    std::shared_ptr<Downloads> downloads;
+    std::size_t nextDownload = 0;
+    unsigned inFlight = 0;
+
+    /// The mempool size as seen by each processing job, to detect changes before we take the exclusive lock.
+    struct MempoolSizes {
+        std::size_t nTxs = 0, nHashXs = 0;
+        bool operator==(const MempoolSizes &o) const { return nTxs == o.nTxs && nHashXs == o.nHashXs; }
+        bool operator!=(const MempoolSizes &o) const { return !(*this == o); }
+    };
+    std::shared_ptr<std::vector<MempoolSizes>> jobSizes;
+    std::size_t jobsPending = 0;
+
     Mempool::TxHashSet txsAffected;
-    DSPs::DspMap dspsNeedingDownload, dspsDownloaded;
-    unsigned dspDlsExpected = 0;
-    DSPs::DspHashSet downloadsFailed;
+    std::size_t nAdded = 0, nFailed = 0;
 
     void doGetDSPList();
     void doDownloadNewDSPs();
-    void dlNext(bool phase2, std::shared_ptr<DSPs::DspMap::node_type> node);
-    void dlNext(bool phase2, DSPs::DspMap::node_type && node) { dlNext(phase2, std::make_shared<DSPs::DspMap::node_type>(std::move(node))); }
+    void dlNext(std::size_t index, bool phase2);
     void doProcessDownloads();
+    void doAddToMempool();
+
+    /// Parses `dl.verbose` into `dl.proof`, and then drops the descendants not in `mempool`. Sets dl.status.
+    /// Runs in a thread pool thread with the shared mempool lock held.
+    static void processDownload(Download &dl, const Mempool &mempool);
+    /// Processes downloads [begin, end) with the shared mempool lock held, returning the mempool sizes seen.
+    static MempoolSizes processDownloads(Downloads &dls, std::size_t begin, std::size_t end, const Storage &storage);
 };
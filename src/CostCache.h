@@ -19,6 +19,7 @@
 #pragma once
 
 #include "Common.h" // for BadArgs
+#include "LockStats.h"
 
 #include <QCache>
 #include <QList>
@@ -60,10 +61,10 @@ template <typename Key, typename Value>
 class CostCache : protected QCache<Key, Value>
 {
     using Base = QCache<Key, Value>;
-    using RWLock = std::shared_mutex;
+    using RWLock = LockStats::Sampled<std::shared_mutex>;
     using ExclusiveLockGuard = std::lock_guard<RWLock>;
     using SharedLockGuard = std::shared_lock<RWLock>;
-    mutable RWLock lock;
+    mutable RWLock lock{"CostCache::lock"};
 
     static constexpr unsigned kCostLimit = unsigned(std::numeric_limits<int>::max());
 
@@ -30,11 +30,27 @@ void DSPs::shrink_to_fit() {
     dsproofs.rehash(0);
 }
 
-std::size_t DSPs::numTxDspLinks() const {
-    std::size_t ret{};
-    for (const auto & [txhash, hashset] : txDspsMap)
-        ret += hashset.size();
-    return ret;
+namespace {
+    /// Removes `hash` from `vec`, not preserving order. Returns true if it was found.
+    bool unorderedErase(DSPs::DspHashVec &vec, const DspHash &hash) {
+        const auto it = std::find(vec.begin(), vec.end(), hash);
+        if (it == vec.end()) return false;
+        if (it != vec.end() - 1) *it = std::move(vec.back());
+        vec.pop_back();
+        return true;
+    }
+}
+
+bool DSPs::operator==(const DSPs &o) const
+{
+    if (nLinks != o.nLinks || dsproofs != o.dsproofs || txDspsMap.size() != o.txDspsMap.size())
+        return false;
+    for (const auto & [txHash, vec] : txDspsMap) {
+        const auto it = o.txDspsMap.find(txHash);
+        if (it == o.txDspsMap.end() || !std::is_permutation(vec.begin(), vec.end(), it->second.begin(), it->second.end()))
+            return false;
+    }
+    return true;
 }
 
 bool DSPs::add(DSProof && dspIn)
@@ -48,7 +64,8 @@ bool DSPs::add(DSProof && dspIn)
         return false;
     const auto &dsp = it->second;
     for (const auto & txHash : dsp.descendants)
-        txDspsMap[txHash].insert(dsp.hash);
+        txDspsMap[txHash].push_back(dsp.hash); // dsp is new, so it can't be in any of the vectors already
+    nLinks += dsp.descendants.size();
     return true;
 }
 DSProof * DSPs::getMutable(const DspHash &hash) // private
@@ -68,7 +85,8 @@ std::size_t DSPs::rm(const DspHash &hash)
     for (const auto &txHash : dsp.descendants) {
         auto it2 = txDspsMap.find(txHash);
         if (it2 == txDspsMap.end()) continue; // may happen if we are called from rmTx()
-        it2->second.erase(hash);
+        if (unorderedErase(it2->second, hash))
+            --nLinks;
         if (it2->second.empty())
             // no more dsps linked to this tx, remove from map
             txDspsMap.erase(it2);
@@ -83,7 +101,11 @@ bool DSPs::addTx(const DspHash &dspHash, const TxHash &txHash)
     if (txHash.size() != HashLen || !(dsp = getMutable(dspHash)))
         return false;
     int ct = 0;
-    ct += txDspsMap[txHash].insert(dsp->hash).second;
+    if (auto & vec = txDspsMap[txHash]; std::find(vec.begin(), vec.end(), dsp->hash) == vec.end()) {
+        vec.push_back(dsp->hash);
+        ++nLinks;
+        ++ct;
+    }
     ct += dsp->descendants.insert(txHash).second; // this is how calling code adds new descendants it learns about
     if (UNLIKELY(ct == 1))
         // this indicates a bug in this code -- invariant not maintained
@@ -97,8 +119,9 @@ std::size_t DSPs::rmTx(const TxHash &txHash)
 {
     auto it = txDspsMap.find(txHash);
     if (it == txDspsMap.end()) return 0;
-    const DspHashSet dspHashes{std::move(it->second)};
+    const DspHashVec dspHashes{std::move(it->second)};
     txDspsMap.erase(it);
+    nLinks -= dspHashes.size();
     // remove from descendant set for all associated dsps
     std::size_t ret{};
     for (const auto &dspHash : dspHashes) {
@@ -122,7 +145,7 @@ std::size_t DSPs::rmTx(const TxHash &txHash)
     return ret;
 }
 
-auto DSPs::dspHashesForTx(const TxHash &txHash) const -> const DspHashSet *
+auto DSPs::dspHashesForTx(const TxHash &txHash) const -> const DspHashVec *
 {
     if (auto it = txDspsMap.find(txHash); it != txDspsMap.end())
         return &it->second;
@@ -198,3 +221,71 @@ bool DSProof::isEmpty() const {
     static const DSProof null;
     return *this == null;
 }
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+namespace {
+    void test()
+    {
+        const auto randHash = [] {
+            QByteArray ret(HashLen, Qt::Uninitialized);
+            Util::getRandomBytes(ret.data(), ret.size());
+            return ret;
+        };
+        const auto countLinks = [](const DSPs &dsps) {
+            std::size_t ret{};
+            for (const auto & [txHash, vec] : dsps.getTxDspsMap())
+                ret += vec.size();
+            return ret;
+        };
+        const auto mkProof = [&randHash](const TxHash &txHash, const std::vector<TxHash> &descs) {
+            DSProof p;
+            p.hash = DspHash{randHash()};
+            p.txHash = txHash;
+            p.descendants.insert(txHash);
+            p.descendants.insert(descs.begin(), descs.end());
+            return p;
+        };
+        // a chain: t0 <- t1 <- t2 <- t3, with a proof for t0 and another for t1 (so t1..t3 are linked to both)
+        std::vector<TxHash> t;
+        for (int i = 0; i < 4; ++i) t.push_back(randHash());
+        DSPs dsps;
+        const DSProof p0 = mkProof(t[0], {t[1], t[2], t[3]}), p1 = mkProof(t[1], {t[2]});
+        if (!dsps.add(DSProof(p0)) || !dsps.add(DSProof(p1)) || dsps.add(DSProof(p1)))
+            throw Exception("add() returned the wrong value");
+        if (dsps.numTxDspLinks() != 6 || countLinks(dsps) != 6)
+            throw Exception(QString("Expected 6 links, got %1").arg(dsps.numTxDspLinks()));
+        // t3 learned about later
+        if (!dsps.addTx(p1.hash, t[3]) || dsps.addTx(p1.hash, t[3]) || dsps.addTx(p0.hash, t[3]))
+            throw Exception("addTx() returned the wrong value");
+        if (dsps.numTxDspLinks() != 7 || countLinks(dsps) != 7 || dsps.dspHashesForTx(t[3])->size() != 2)
+            throw Exception("addTx() did not link the tx");
+        if (dsps.bestProofForTx(t[1])->hash != p1.hash || dsps.bestProofForTx(t[2])->hash != p1.hash)
+            throw Exception("bestProofForTx() returned the wrong proof");
+        if (dsps.txsLinkedToTxs({t[3]}).size() != 4)
+            throw Exception("txsLinkedToTxs() returned the wrong set");
+        // the same contents, added in a different order, should compare equal
+        DSPs dsps2;
+        DSProof p1b = p1;
+        p1b.descendants.insert(t[3]);
+        dsps2.add(std::move(p1b));
+        dsps2.add(DSProof(p0));
+        if (dsps != dsps2)
+            throw Exception("operator== should not depend on insertion order");
+        // dropping a descendant unlinks it from both proofs
+        if (dsps.rmTx(t[2]) != 2 || dsps.dspHashesForTx(t[2]) || dsps.numTxDspLinks() != 5 || countLinks(dsps) != 5
+                || dsps.get(p0.hash)->descendants.count(t[2]))
+            throw Exception("rmTx() of a descendant failed");
+        // dropping a proof's own tx removes the proof
+        if (dsps.rmTx(t[1]) != 2 || dsps.get(p1.hash) || dsps.size() != 1 || dsps.numTxDspLinks() != 2
+                || countLinks(dsps) != 2)
+            throw Exception("rmTx() of a proof's tx failed");
+        if (dsps.rm(p0.hash) != 2 || !dsps.empty() || dsps.numTxDspLinks() || !dsps.getTxDspsMap().empty())
+            throw Exception("rm() failed");
+        Log() << "DSPs: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("dsps", &test);
+} // namespace
+#endif
@@ -81,14 +81,21 @@ struct DSProof {
 
 /// Maintains association between DSProofs and their descendant tx's for quick lookup. Ideally we would use a boost
 /// multi-indexed container here, but since we don't want to bring in boost as a dependency, we must roll our own.
+///
+/// Memory: during a double-spend attack there may be thousands of proofs, each linked to the same long chains of
+/// descendant txs. To keep that cheap, the reverse links are small vectors rather than hash sets (almost every tx is
+/// linked to just 1 or 2 proofs), and callers are expected to pass TxHashes that share their data with the mempool's
+/// own copies (see Mempool::internTxHash), so that a link costs a pointer rather than a copy of the hash.
 struct DSPs {
     using DspHashSet = std::unordered_set<DspHash, DspHash::Hasher>;
+    using DspHashVec = std::vector<DspHash>; ///< no duplicates, unordered
     using DspMap = std::unordered_map<DspHash, DSProof, DspHash::Hasher>;
-    using TxDspsMap = std::unordered_map<TxHash, DspHashSet, HashHasher>;
+    using TxDspsMap = std::unordered_map<TxHash, DspHashVec, HashHasher>;
 
 private:
-    TxDspsMap txDspsMap; ///< set of dsproofs that affect a particular tx (we call it "linked" below)
+    TxDspsMap txDspsMap; ///< the dsproofs that affect a particular tx (we call it "linked" below)
     DspMap dsproofs;
+    std::size_t nLinks = 0; ///< total number of entries in all of the txDspsMap vectors
 
     DSProof * getMutable(const DspHash &hash);
 
@@ -102,11 +109,18 @@ public:
     void clear() { *this = DSPs(); /* <--- this clears & rehashes both tables to default bucket_count */ }
     void shrink_to_fit(); ///< reclaim memory (causes a rehash, invalidates iterators, pointers, etc)
     float load_factor() const { return (txDspsMap.load_factor() + dsproofs.load_factor()) / 2.f; }
+    /// Pre-sizes the tables for `nDsps` proofs in total, and for `nMoreTxs` more linked txs than there are now (an upper
+    /// bound is fine), so that adding a burst of proofs in a row does not repeatedly rehash them.
+    void reserve(std::size_t nDsps, std::size_t nMoreTxs) {
+        dsproofs.reserve(nDsps);
+        txDspsMap.reserve(txDspsMap.size() + nMoreTxs);
+    }
 
-    /// @returns the total number of TxHash <-> DSProof "links" or associations in this data-structure.
-    std::size_t numTxDspLinks() const;
+    /// @returns the total number of TxHash <-> DSProof "links" or associations in this data-structure. Constant-time.
+    std::size_t numTxDspLinks() const { return nLinks; }
 
-    bool operator==(const DSPs &o) const { return std::tie(txDspsMap, dsproofs) == std::tie(o.txDspsMap, o.dsproofs); }
+    /// Note: the order of the DspHashes linked to a tx is not significant for the purposes of this comparison.
+    bool operator==(const DSPs &o) const;
     bool operator!=(const DSPs &o) const { return !(*this == o); }
 
     /// Adds a dsp by move construction. All of the descendants in its descendant set are also added to the txDspsMap.
@@ -128,9 +142,9 @@ public:
     /// @returns The number of dsps that were associated with this tx, or 0 if not found.
     std::size_t rmTx(const TxHash &txHash);
 
-    /// @returns a pointer to the internal set of all of the DspHashes linked to a TxHash, or nullptr if txHash has
+    /// @returns a pointer to the internal vector of all of the DspHashes linked to a TxHash, or nullptr if txHash has
     /// no associated dsps. The complexity of this call is constant-time.
-    const DspHashSet * dspHashesForTx(const TxHash &txHash) const;
+    const DspHashVec * dspHashesForTx(const TxHash &txHash) const;
 
     /// @returns a vector of pointers to all the actual proofs linked with a txHash, or an empty vector if none were found.
     std::vector<const DSProof *> proofsLinkedToTx(const TxHash &txHash) const;
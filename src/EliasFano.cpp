@@ -0,0 +1,220 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "EliasFano.h"
+
+#include <QtAlgorithms>
+
+#include <stdexcept>
+
+namespace {
+    /// Returns the bit position of the rank-th (0-based) set bit in `word`. Precondition: rank < popcount(word).
+    inline unsigned selectInWord(uint64_t word, unsigned rank) {
+        for ( ; rank; --rank)
+            word &= word - 1u; // clear lowest set bit
+        return qCountTrailingZeroBits(word);
+    }
+}
+
+EliasFano::EliasFano(const std::vector<uint64_t> &vals)
+    : n(vals.size())
+{
+    if (!n) return;
+    for (size_t i = 1; i < n; ++i)
+        if (vals[i] < vals[i-1])
+            throw std::invalid_argument("EliasFano: input is not sorted");
+    const uint64_t maxVal = vals.back();
+    if (const uint64_t ratio = maxVal / n; ratio)
+        lowBits = 63u - qCountLeadingZeroBits(quint64(ratio)); // floor(log2(universe / n))
+    const uint64_t lowMask = lowBits ? (uint64_t(1) << lowBits) - 1u : 0u;
+
+    // +1 word of padding so that low() may always read 2 adjacent words
+    lows.assign(lowBits ? (n * lowBits + 63u) / 64u + 1u : 0u, 0u);
+    nHighBits = n + size_t(maxVal >> lowBits) + 1u;
+    highs.assign((nHighBits + 63u) / 64u, 0u);
+
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t v = vals[i];
+        if (lowBits) {
+            const size_t pos = i * lowBits, w = pos / 64u;
+            const unsigned off = pos % 64u;
+            lows[w] |= (v & lowMask) << off;
+            if (off + lowBits > 64u)
+                lows[w + 1] |= (v & lowMask) >> (64u - off);
+        }
+        const size_t hpos = size_t(v >> lowBits) + i;
+        highs[hpos / 64u] |= uint64_t(1) << (hpos % 64u);
+    }
+
+    // sample the positions of every kSampleRate-th 1-bit and 0-bit, to accelerate select1() and select0()
+    size_t ones = 0, zeros = 0;
+    for (size_t pos = 0; pos < nHighBits; ++pos) {
+        if (highBit(pos)) {
+            if (ones++ % kSampleRate == 0) onesSamples.push_back(pos);
+        } else {
+            if (zeros++ % kSampleRate == 0) zerosSamples.push_back(pos);
+        }
+    }
+    onesSamples.shrink_to_fit();
+    zerosSamples.shrink_to_fit();
+}
+
+uint64_t EliasFano::low(size_t i) const
+{
+    if (!lowBits) return 0;
+    const size_t pos = i * lowBits, w = pos / 64u;
+    const unsigned off = pos % 64u;
+    uint64_t v = lows[w] >> off;
+    if (off + lowBits > 64u)
+        v |= lows[w + 1] << (64u - off);
+    return v & ((uint64_t(1) << lowBits) - 1u);
+}
+
+size_t EliasFano::select1(size_t rank) const
+{
+    size_t pos = onesSamples[rank / kSampleRate];
+    rank %= kSampleRate;
+    size_t w = pos / 64u;
+    uint64_t word = highs[w] & (~uint64_t(0) << (pos % 64u)); // ignore bits before the sampled position
+    for (;;) {
+        const unsigned cnt = qPopulationCount(quint64(word));
+        if (rank < cnt)
+            return w * 64u + selectInWord(word, unsigned(rank));
+        rank -= cnt;
+        word = highs[++w];
+    }
+}
+
+size_t EliasFano::select0(size_t rank) const
+{
+    size_t pos = zerosSamples[rank / kSampleRate];
+    rank %= kSampleRate;
+    size_t w = pos / 64u;
+    uint64_t word = ~highs[w] & (~uint64_t(0) << (pos % 64u));
+    for (;;) {
+        const unsigned cnt = qPopulationCount(quint64(word));
+        if (rank < cnt)
+            return w * 64u + selectInWord(word, unsigned(rank));
+        rank -= cnt;
+        word = ~highs[++w]; // note: padding bits past nHighBits are never reached since rank is always in range
+    }
+}
+
+uint64_t EliasFano::at(size_t i) const
+{
+    return (uint64_t(select1(i) - i) << lowBits) | low(i);
+}
+
+size_t EliasFano::countLE(uint64_t x) const
+{
+    if (!n) return 0;
+    const uint64_t h = x >> lowBits;
+    if (const size_t maxHigh = nHighBits - n - 1u; h > maxHigh)
+        return n; // x is past the last bucket
+    const uint64_t xLow = lowBits ? x & ((uint64_t(1) << lowBits) - 1u) : 0u;
+    // Bucket h's 1-bits start right after the (h-1)-th 0-bit. Everything before them is < x.
+    size_t pos = h ? select0(size_t(h) - 1u) + 1u : 0u;
+    size_t idx = pos - size_t(h);
+    for ( ; pos < nHighBits && highBit(pos) && low(idx) <= xLow; ++pos)
+        ++idx;
+    return idx;
+}
+
+std::vector<uint64_t> EliasFano::decode(size_t count) const
+{
+    std::vector<uint64_t> ret;
+    if (count > n) count = n;
+    ret.reserve(count);
+    for (size_t w = 0, i = 0; i < count; ++w) {
+        for (uint64_t word = highs[w]; word && i < count; word &= word - 1u, ++i) {
+            const size_t pos = w * 64u + qCountTrailingZeroBits(quint64(word));
+            ret.push_back((uint64_t(pos - i) << lowBits) | low(i));
+        }
+    }
+    return ret;
+}
+
+size_t EliasFano::memoryUsage() const noexcept
+{
+    return sizeof(*this) + lows.capacity() * sizeof(uint64_t) + highs.capacity() * sizeof(uint64_t)
+            + (onesSamples.capacity() + zerosSamples.capacity()) * sizeof(size_t);
+}
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+#include "Util.h"
+
+#include <QRandomGenerator>
+
+#include <algorithm>
+
+namespace {
+    void test()
+    {
+        auto * const rgen = QRandomGenerator::global();
+        const auto check = [](const std::vector<uint64_t> &vals, const std::vector<uint64_t> &probes) {
+            const EliasFano ef(vals);
+            if (ef.size() != vals.size())
+                throw Exception(QString("Size mismatch: %1 != %2").arg(ef.size()).arg(vals.size()));
+            if (ef.decode() != vals)
+                throw Exception("decode() mismatch");
+            for (size_t i = 0; i < vals.size(); ++i)
+                if (const auto v = ef.at(i); v != vals[i])
+                    throw Exception(QString("at(%1) mismatch: %2 != %3").arg(i).arg(v).arg(vals[i]));
+            for (const auto x : probes) {
+                const size_t expected = size_t(std::upper_bound(vals.begin(), vals.end(), x) - vals.begin());
+                if (const auto c = ef.countLE(x); c != expected)
+                    throw Exception(QString("countLE(%1) mismatch: %2 != %3").arg(x).arg(c).arg(expected));
+            }
+            return ef.memoryUsage();
+        };
+        // edge cases
+        check({}, {0, 1, 100});
+        check({0}, {0, 1});
+        check({0, 0, 0, 5, 5}, {0, 1, 4, 5, 6});
+        check({~uint64_t(0)}, {0, ~uint64_t(0) - 1, ~uint64_t(0)});
+        check({1, 2, 3, ~uint64_t(0) - 1, ~uint64_t(0)}, {0, 3, 4, ~uint64_t(0) - 1, ~uint64_t(0)});
+        // random sequences with varying density
+        for (const uint32_t maxGap : {1u, 2u, 7u, 300u, 5000u, 1u << 20}) {
+            for (const size_t n : {1u, 63u, 64u, 65u, 257u, 10'000u, 200'000u}) {
+                std::vector<uint64_t> vals(n);
+                uint64_t v = rgen->bounded(maxGap);
+                for (auto &x : vals) {
+                    x = v;
+                    v += rgen->bounded(maxGap + 1u); // may repeat
+                }
+                std::vector<uint64_t> probes;
+                for (size_t i = 0; i < std::min<size_t>(n, 20'000u); ++i) {
+                    const auto &x = vals[rgen->bounded(quint32(n))];
+                    probes.push_back(x);
+                    probes.push_back(x + 1u);
+                    if (x) probes.push_back(x - 1u);
+                }
+                probes.push_back(0);
+                probes.push_back(v + 1u);
+                const size_t mem = check(vals, probes);
+                Log() << "n: " << n << ", max gap: " << maxGap << ", memory: " << mem << " bytes ("
+                      << QString::number(mem * 8.0 / n, 'f', 2) << " bits/value) ... ok";
+            }
+        }
+        Log() << "EliasFano: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("eliasfano", &test);
+} // namespace
+#endif
@@ -0,0 +1,64 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// An immutable, compressed, non-decreasing sequence of unsigned integers, using the Elias-Fano encoding. Each value
+/// takes 2 + log2(universe / size) bits. Supports random access (select) and counting the values <= x (rank) in
+/// (almost) constant time, via sampled positions in the high-bits bitvector.
+///
+/// Instances are never modified after construction, so they are safe to share between threads without locks.
+class EliasFano
+{
+public:
+    EliasFano() = default;
+    /// `vals` must be sorted in non-decreasing order, otherwise std::invalid_argument is thrown.
+    explicit EliasFano(const std::vector<uint64_t> &vals);
+
+    size_t size() const noexcept { return n; }
+    bool empty() const noexcept { return !n; }
+
+    /// Returns the i-th value. Precondition: i < size().
+    uint64_t at(size_t i) const;
+    /// Returns the number of values that are <= x.
+    size_t countLE(uint64_t x) const;
+    /// Decodes the first `count` values (all of them by default), which is much faster than calling at() for each.
+    std::vector<uint64_t> decode(size_t count = size_t(-1)) const;
+
+    /// Approximate heap memory used, in bytes.
+    size_t memoryUsage() const noexcept;
+
+private:
+    static constexpr size_t kSampleRate = 256; ///< we remember the position of every 256th 1-bit and 0-bit
+
+    size_t n = 0;
+    unsigned lowBits = 0; ///< the number of low bits of each value that are stored verbatim in `lows`
+    std::vector<uint64_t> lows; ///< packed lowBits-wide low parts of each value
+    std::vector<uint64_t> highs; ///< the high parts, unary coded: value i sets bit (value_i >> lowBits) + i
+    size_t nHighBits = 0; ///< the number of valid bits in `highs`
+    std::vector<size_t> onesSamples, zerosSamples; ///< position of the (k*kSampleRate)-th 1-bit/0-bit, respectively
+
+    uint64_t low(size_t i) const;
+    size_t select1(size_t rank) const;
+    size_t select0(size_t rank) const;
+    bool highBit(size_t pos) const { return highs[pos / 64u] >> (pos % 64u) & 1u; }
+};
@@ -0,0 +1,70 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "ByteView.h"
+
+#include <QByteArray>
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+/// A 32-byte hash (a txid, a block hash, or a HashX), held by value.
+///
+/// Unlike the QByteArray we otherwise use for hashes (see TxHash, HashX, BlockHash in BlockProcTypes.h), this is
+/// trivially copyable and involves no heap allocation or refcounting, so it is preferred for hashes held in large
+/// in-memory data structures.  Convert to a QByteArray only at the boundaries (db, network, JSON, etc).
+///
+/// Like our QByteArray hashes, the bytes are normally in *reversed* memory order (hex-encoding ready).
+struct Hash256 {
+    static constexpr std::size_t Size = 32;
+
+    std::array<uint8_t, Size> bytes{}; ///< defaults to all zeroes
+
+    Hash256() noexcept = default;
+    /// Copies the bytes pointed to by `bv`, which must be exactly Size bytes long. If it is not, the resulting
+    /// Hash256 isNull().
+    explicit Hash256(const ByteView &bv) noexcept { if (bv.size() == Size) std::memcpy(bytes.data(), bv.data(), Size); }
+
+    static constexpr std::size_t size() noexcept { return Size; }
+    const uint8_t *data() const noexcept { return bytes.data(); }
+    uint8_t *data() noexcept { return bytes.data(); }
+
+    /// Returns true if this hash is all zeroes (e.g. it was default-constructed)
+    bool isNull() const noexcept { return std::all_of(bytes.begin(), bytes.end(), [](uint8_t b){ return b == 0; }); }
+
+    /// Reverses the byte order of this hash in-place
+    Hash256 &reverse() noexcept { std::reverse(bytes.begin(), bytes.end()); return *this; }
+
+    /// Returns a deep copy of this hash's bytes
+    QByteArray toByteArray() const { return ByteView{*this}.toByteArray(true); }
+    /// Returns a shallow QByteArray view of this hash's bytes. It must not outlive this object.
+    QByteArray toByteArrayShallow() const { return ByteView{*this}.toByteArray(false); }
+    QByteArray toHex() const { return toByteArrayShallow().toHex(); }
+
+    bool operator==(const Hash256 &o) const noexcept { return bytes == o.bytes; }
+    bool operator!=(const Hash256 &o) const noexcept { return bytes != o.bytes; }
+    bool operator<(const Hash256 &o) const noexcept { return bytes < o.bytes; }
+};
+
+static_assert(std::is_trivially_copyable_v<Hash256> && sizeof(Hash256) == Hash256::Size);
@@ -0,0 +1,455 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#ifdef ENABLE_TESTS
+// This whole translation unit is the `--bench loadgen` Electrum-protocol load generator. It is test-only code, so it
+// is only compiled into builds having ENABLE_TESTS defined.
+#include "App.h"
+#include "BTC_Address.h"
+#include "BlockProcTypes.h"
+#include "Compat.h"
+#include "RPC.h"
+#include "ServerMisc.h"
+#include "Util.h"
+#include "WebSocket.h"
+
+#include <QEventLoop>
+#include <QFile>
+#include <QHash>
+#include <QMap>
+#include <QRandomGenerator>
+#include <QSslSocket>
+#include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
+#include <QUrl>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace {
+
+    enum class Proto { TCP, SSL, WS, WSS };
+
+    /// The workload parameters. Read-only once the run starts; shared by all clients in all threads.
+    struct Workload {
+        Proto proto = Proto::TCP;
+        QString host;
+        quint16 port = 0;
+        QStringList scripthashes; ///< hex, byte-reversed as per the Electrum protocol
+        int gap = 20; ///< scripthashes subscribed per "window", as a wallet does up to its gap limit
+        int maxWindows = 3; ///< a wallet subscribes another window for as long as the previous one had a used scripthash
+        int maxMerkle = 5; ///< max. blockchain.transaction.get_merkle requests per session
+        int holdMS = 1000; ///< how long to stay connected after all of a session's requests were answered
+    };
+
+    /// Updated from all client threads, read by the progress reporter in the main thread.
+    struct Counters {
+        std::atomic<uint64_t> requests{0}, errors{0}, notifications{0}, sessions{0}, connectFails{0}, dropped{0};
+        std::atomic<int> connected{0};
+    };
+
+    /// Latency samples in nanoseconds. There is one of these per client thread; each is only ever touched by that
+    /// thread while the run is in progress, and they are merged once all the threads have stopped.
+    struct Samples {
+        std::map<QString, std::vector<qint64>> byMethod;
+        std::map<QString, uint64_t> errorsByMethod;
+    };
+
+    /// The server sends us notifications for these; anything else unsolicited is a protocol error.
+    const RPC::MethodMap & notificationMethods() {
+        static const RPC::MethodMap methods = [] {
+            RPC::MethodMap ret;
+            for (const auto & name : {"blockchain.headers.subscribe", "blockchain.scripthash.subscribe"})
+                ret[name] = RPC::Method{name, false, true};
+            return ret;
+        }();
+        return methods;
+    }
+
+    /// Simulates one wallet session after another. A session connects, negotiates the protocol version, subscribes to
+    /// headers, then subscribes to "windows" of scripthashes the way a wallet probes its gap limit, fetching the
+    /// history (and a few merkle proofs) of every used one. Once everything has been answered it stays connected
+    /// for Workload::holdMS, disconnects, and starts over.
+    class Client : public RPC::ElectrumConnection
+    {
+    public:
+        Client(const Workload &wl, Counters &ctr, Samples &samples)
+            : RPC::ElectrumConnection(&notificationMethods(), newId()), wl(wl), ctr(ctr), samples(samples)
+        {
+            setObjectName(QStringLiteral("LoadGen.%1").arg(id));
+            connect(this, &RPC::ConnectionBase::gotMessage, this, &Client::handleMessage);
+            connect(this, &RPC::ConnectionBase::gotErrorMessage, this, &Client::handleError);
+            connect(this, &AbstractConnection::lostConnection, this, [this] {
+                --this->ctr.connected;
+                if (!sessionDone) ++this->ctr.dropped;
+                if (!stopping) reconnectSoon(kReconnectMS);
+            });
+        }
+
+        void start() { connectToServer(); }
+
+        /// Must be called in this object's thread before deleting it.
+        void stop() {
+            stopping = true;
+            stopTimer(kHoldTimer);
+            stopTimer(kReconnectTimer);
+            if (socket) do_disconnect();
+        }
+
+    protected:
+        void on_connected() override {
+            RPC::ElectrumConnection::on_connected();
+            isConnected = true;
+            ++ctr.connected;
+            samples.byMethod["(connect)"].push_back(Util::getTimeNS() - tStart);
+            cursor = wl.scripthashes.isEmpty() ? 0 : int(QRandomGenerator::global()->bounded(wl.scripthashes.size()));
+            windowsLeft = wl.maxWindows;
+            merkleLeft = wl.maxMerkle;
+            request("server.version", {QStringLiteral("LoadGen"), ServerMisc::MaxProtocolVersion.toString()});
+        }
+
+        void do_ping() override {} // sessions are short-lived, there is never a need to ping
+
+    private:
+        static constexpr int kReconnectMS = 10, kConnectFailRetryMS = 1000;
+        static constexpr auto kHoldTimer = "hold", kReconnectTimer = "reconnect";
+
+        const Workload &wl;
+        Counters &ctr;
+        Samples &samples;
+
+        struct Pending { QString method, arg; qint64 t0; };
+        QHash<qint64, Pending> pending; ///< keyed on request id
+        qint64 tStart = 0; ///< when the current session started connecting
+        bool stopping = false, isConnected = false, sessionDone = false, windowUsed = false;
+        int cursor = 0, windowLeft = 0, windowsLeft = 0, merkleLeft = 0;
+
+        void reconnectSoon(int ms) { callOnTimerSoonNoRepeat(ms, kReconnectTimer, [this]{ connectToServer(); }); }
+
+        void connectToServer() {
+            if (socket) {
+                for (auto *s : socket->findChildren<QTcpSocket *>()) s->disconnect(this); // the raw socket of a WebSocket::Wrapper
+                socket->disconnect(this);
+                socket->deleteLater();
+                socket = nullptr;
+            }
+            pending.clear();
+            isConnected = sessionDone = false;
+            tStart = Util::getTimeNS();
+            const bool isSsl = wl.proto == Proto::SSL || wl.proto == Proto::WSS,
+                       isWs = wl.proto == Proto::WS || wl.proto == Proto::WSS;
+            QTcpSocket *raw;
+            if (isSsl) {
+                auto *ssl = new QSslSocket(this);
+                auto conf = ssl->sslConfiguration();
+                conf.setPeerVerifyMode(QSslSocket::PeerVerifyMode::VerifyNone); // test servers typically use self-signed certs
+                ssl->setSslConfiguration(conf);
+                connect(ssl, qOverload<const QList<QSslError> &>(&QSslSocket::sslErrors), ssl, [ssl](auto) { ssl->ignoreSslErrors(); });
+                raw = ssl;
+            } else {
+                raw = new QTcpSocket(this);
+            }
+            connect(raw, Compat::SocketErrorSignalFunctionPtr(), this, [this](QAbstractSocket::SocketError) {
+                if (isConnected || stopping) return; // once connected, lostConnection takes care of reconnecting
+                ++ctr.connectFails;
+                reconnectSoon(kConnectFailRetryMS);
+            });
+            if (isWs) {
+                // the WebSocket::Wrapper takes ownership of `raw`, and becomes our socket once the handshake succeeds
+                auto startHandshake = [this, raw] {
+                    auto *ws = new WebSocket::Wrapper(raw, this);
+                    socket = ws;
+                    connect(ws, &WebSocket::Wrapper::handshakeSuccess, this, [this] {
+                        socketConnectSignals();
+                        on_connected();
+                    });
+                    connect(ws, &WebSocket::Wrapper::handshakeFailed, this, [this](const QString &) {
+                        ++ctr.connectFails;
+                        if (!stopping) reconnectSoon(kConnectFailRetryMS);
+                    });
+                    ws->startClientHandshake(QStringLiteral("/"), wl.host);
+                };
+                socket = raw;
+                if (auto *ssl = dynamic_cast<QSslSocket *>(raw)) {
+                    connect(ssl, &QSslSocket::encrypted, this, startHandshake);
+                    ssl->connectToHostEncrypted(wl.host, wl.port);
+                } else {
+                    connect(raw, &QTcpSocket::connected, this, startHandshake);
+                    raw->connectToHost(wl.host, wl.port);
+                }
+            } else {
+                socket = raw;
+                socketConnectSignals();
+                if (auto *ssl = dynamic_cast<QSslSocket *>(raw))
+                    ssl->connectToHostEncrypted(wl.host, wl.port);
+                else
+                    raw->connectToHost(wl.host, wl.port);
+            }
+        }
+
+        void request(const QString &method, const QVariantList &params = {}) {
+            const auto reqId = newId();
+            pending.insert(qint64(reqId), Pending{method, params.isEmpty() ? QString() : params.front().toString(), Util::getTimeNS()});
+            emit sendRequest(reqId, method, params);
+        }
+
+        void subscribeWindow() {
+            windowUsed = false;
+            windowLeft = std::min(wl.gap, int(wl.scripthashes.size()));
+            for (int i = 0; i < windowLeft; ++i)
+                request("blockchain.scripthash.subscribe", {wl.scripthashes[(cursor + i) % wl.scripthashes.size()]});
+            cursor = (cursor + windowLeft) % std::max(1, int(wl.scripthashes.size()));
+        }
+
+        void subscribeAnswered(bool used) {
+            windowUsed = windowUsed || used;
+            if (--windowLeft == 0 && windowUsed && --windowsLeft > 0)
+                subscribeWindow(); // the window had a used scripthash, so probe further, as a wallet would
+        }
+
+        std::optional<Pending> takePending(const RPC::Message &m) {
+            const auto it = pending.find(m.id.toInt());
+            if (it == pending.end()) return std::nullopt; // can't happen: ConnectionBase rejects replies with unknown ids
+            Pending ret = it.value();
+            pending.erase(it);
+            samples.byMethod[ret.method].push_back(Util::getTimeNS() - ret.t0);
+            ++ctr.requests;
+            return ret;
+        }
+
+        void handleMessage(IdMixin::Id, RPC::BatchId, const RPC::Message &m) {
+            if (m.isNotif()) {
+                ++ctr.notifications;
+                return;
+            }
+            const auto p = takePending(m);
+            if (!p) return;
+            if (p->method == "server.version") {
+                request("blockchain.headers.subscribe");
+                subscribeWindow();
+            } else if (p->method == "blockchain.scripthash.subscribe") {
+                const bool used = !m.result().isNull();
+                if (used) request("blockchain.scripthash.get_history", {p->arg});
+                subscribeAnswered(used);
+            } else if (p->method == "blockchain.scripthash.get_history") {
+                const auto items = m.result().toList();
+                for (const auto & var : items) {
+                    if (merkleLeft <= 0) break;
+                    const auto item = var.toMap();
+                    if (const int height = item.value("height").toInt(); height > 0) {
+                        --merkleLeft;
+                        request("blockchain.transaction.get_merkle", {item.value("tx_hash"), height});
+                    }
+                }
+            }
+            maybeSessionDone();
+        }
+
+        void handleError(IdMixin::Id, const RPC::Message &m) {
+            const auto p = takePending(m);
+            if (!p) return;
+            ++ctr.errors;
+            ++samples.errorsByMethod[p->method];
+            if (p->method == "server.version") {
+                do_disconnect(); // the server won't talk to us; lostConnection will start a new session
+                return;
+            }
+            if (p->method == "blockchain.scripthash.subscribe")
+                subscribeAnswered(false);
+            maybeSessionDone();
+        }
+
+        void maybeSessionDone() {
+            if (!pending.isEmpty() || sessionDone) return;
+            sessionDone = true;
+            ++ctr.sessions;
+            samples.byMethod["(session)"].push_back(Util::getTimeNS() - tStart);
+            callOnTimerSoonNoRepeat(wl.holdMS, kHoldTimer, [this]{ do_disconnect(true); });
+        }
+    };
+
+    /// Opens NCONN connections to a running Fulcrum server and replays a wallet-like workload on each (see class
+    /// Client above), then reports the throughput, error rate, and latency percentiles per method. Point it at a
+    /// server synched to a regtest node or a mock bitcoind. Environment variables:
+    ///   TARGET    - proto://host:port, where proto is one of tcp, ssl, ws, wss (default: tcp://127.0.0.1:50001)
+    ///   NCONN     - number of concurrent connections (default: 100)
+    ///   NTHREADS  - number of client threads (default: the number of cores)
+    ///   DURATION  - length of the run in seconds (default: 30)
+    ///   RAMP      - spread the initial connects over this many seconds (default: 5)
+    ///   SEED      - a file of addresses and/or hex scripthashes, one per line, to query. Wallets take consecutive
+    ///               runs of these, so list them in "derivation order" if that matters. If not specified, random
+    ///               (and thus unused) scripthashes are queried.
+    ///   GAP       - scripthashes subscribed per window (default: 20)
+    ///   WINDOWS   - max. windows per session (default: 3)
+    ///   MERKLE    - max. get_merkle requests per session (default: 5)
+    ///   HOLD_MS   - time to stay connected after a session's last reply (default: 1000)
+    void bench()
+    {
+        const auto env = [](const char *name, const QString &def = {}) {
+            const auto val = QString::fromLocal8Bit(std::getenv(name)).trimmed();
+            return val.isEmpty() ? def : val;
+        };
+        const auto envInt = [&env](const char *name, int def, int min) {
+            bool ok = true;
+            const int ret = env(name).isEmpty() ? def : env(name).toInt(&ok);
+            if (!ok || ret < min) throw BadArgs(QString("Env var %1 must be an integer >= %2").arg(name).arg(min));
+            return ret;
+        };
+
+        Workload wl;
+        {
+            static const QMap<QString, std::pair<Proto, quint16>> schemes = {
+                {"tcp", {Proto::TCP, 50001}}, {"ssl", {Proto::SSL, 50002}}, {"ws", {Proto::WS, 50003}}, {"wss", {Proto::WSS, 50004}},
+            };
+            const QString target = env("TARGET", "tcp://127.0.0.1:50001");
+            const QUrl url(target);
+            const auto it = schemes.find(url.scheme().toLower());
+            if (!url.isValid() || url.host().isEmpty() || it == schemes.end())
+                throw BadArgs(QString("Bad TARGET: \"%1\", expected e.g. tcp://127.0.0.1:50001 (protocols: tcp, ssl, ws, wss)").arg(target));
+            wl.proto = it->first;
+            wl.host = url.host();
+            wl.port = quint16(url.port(it->second));
+        }
+        const int nConn = envInt("NCONN", 100, 1), nThreads = std::min(nConn, envInt("NTHREADS", std::max(QThread::idealThreadCount(), 1), 1));
+        const int durationSecs = envInt("DURATION", 30, 1), rampSecs = envInt("RAMP", 5, 0);
+        wl.gap = envInt("GAP", wl.gap, 1);
+        wl.maxWindows = envInt("WINDOWS", wl.maxWindows, 1);
+        wl.maxMerkle = envInt("MERKLE", wl.maxMerkle, 0);
+        wl.holdMS = envInt("HOLD_MS", wl.holdMS, 0);
+
+        if (const QString seed = env("SEED"); !seed.isEmpty()) {
+            QFile f(seed);
+            if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+                throw BadArgs(QString("Unable to open SEED file %1: %2").arg(seed, f.errorString()));
+            int lineNo = 0;
+            for (const auto & rawLine : f.readAll().split('\n')) {
+                ++lineNo;
+                const QString line = QString::fromUtf8(rawLine).trimmed();
+                if (line.isEmpty() || line.startsWith('#')) continue;
+                if (const QByteArray sh = QByteArray::fromHex(line.toLatin1()); sh.size() == HashLen && sh.toHex() == line.toLower().toLatin1()) {
+                    wl.scripthashes.push_back(line.toLower());
+                } else if (const auto addr = BTC::Address::fromString(line); addr.isValid()) {
+                    wl.scripthashes.push_back(QString::fromLatin1(Util::ToHexFast(Util::reversedCopy(addr.toHashX()))));
+                } else {
+                    throw BadArgs(QString("SEED file %1, line %2: not an address or a scripthash: %3").arg(seed).arg(lineNo).arg(line));
+                }
+            }
+            if (wl.scripthashes.isEmpty()) throw BadArgs(QString("SEED file %1 is empty").arg(seed));
+        } else {
+            Warning() << "SEED not specified, will query random (unused) scripthashes";
+            auto *rgen = QRandomGenerator::global();
+            for (int i = 0; i < 100'000; ++i) {
+                QByteArray sh(HashLen, Qt::Uninitialized);
+                rgen->fillRange(reinterpret_cast<quint32 *>(sh.data()), HashLen / int(sizeof(quint32)));
+                wl.scripthashes.push_back(QString::fromLatin1(Util::ToHexFast(sh)));
+            }
+        }
+
+        Log() << "Load test: " << nConn << " connections to " << env("TARGET", "tcp://127.0.0.1:50001") << " from "
+              << nThreads << " threads for " << durationSecs << " secs, " << wl.scripthashes.size() << " scripthashes, "
+              << "gap: " << wl.gap << ", windows: " << wl.maxWindows << ", merkle: " << wl.maxMerkle
+              << ", hold: " << wl.holdMS << " msec";
+
+        Counters ctr;
+        std::vector<Samples> samples(size_t(nThreads)); // not resized after this, so references to elements stay valid
+        std::vector<std::unique_ptr<QThread>> threads;
+        std::vector<std::unique_ptr<QObject>> threadCtx; // one per thread, to run the teardown in that thread
+        std::vector<std::vector<Client *>> clients(size_t(nThreads));
+        for (int t = 0; t < nThreads; ++t) {
+            auto & thr = threads.emplace_back(std::make_unique<QThread>());
+            thr->setObjectName(QStringLiteral("LoadGen %1").arg(t));
+            threadCtx.emplace_back(std::make_unique<QObject>())->moveToThread(thr.get());
+            thr->start();
+        }
+        for (int i = 0; i < nConn; ++i) {
+            const size_t t = size_t(i % nThreads);
+            auto *c = new Client(wl, ctr, samples[t]);
+            c->moveToThread(threads[t].get());
+            clients[t].push_back(c);
+            Util::AsyncOnObject(c, [c]{ c->start(); }, unsigned(qint64(rampSecs) * 1000 * i / nConn));
+        }
+
+        const Tic t0;
+        {
+            QEventLoop loop;
+            QTimer progress;
+            uint64_t lastReqs = 0;
+            double lastSecs = 0.;
+            QObject::connect(&progress, &QTimer::timeout, &loop, [&] {
+                const uint64_t reqs = ctr.requests;
+                const double secs = t0.secs();
+                Log() << t0.secsStr(0) << "s: " << ctr.connected.load() << " connected, " << reqs << " requests ("
+                      << QString::number((reqs - lastReqs) / (secs - lastSecs), 'f', 1) << "/sec), " << ctr.errors.load()
+                      << " errors, " << ctr.sessions.load() << " sessions, " << ctr.connectFails.load() << " connect failures";
+                lastReqs = reqs;
+                lastSecs = secs;
+            });
+            progress.start(5000);
+            QTimer::singleShot(durationSecs * 1000, &loop, &QEventLoop::quit);
+            loop.exec();
+        }
+        const double secs = t0.secs();
+
+        for (int t = 0; t < nThreads; ++t) {
+            Util::VoidFuncOnObjectNoThrow(threadCtx[size_t(t)].get(), [&clients, t] {
+                for (auto *c : clients[size_t(t)]) {
+                    c->stop();
+                    delete c;
+                }
+            });
+            threads[size_t(t)]->quit();
+            threads[size_t(t)]->wait();
+        }
+
+        // merge & report
+        Samples all;
+        for (auto & s : samples) {
+            for (auto & [method, lats] : s.byMethod)
+                all.byMethod[method].insert(all.byMethod[method].end(), lats.begin(), lats.end());
+            for (const auto & [method, n] : s.errorsByMethod)
+                all.errorsByMethod[method] += n;
+        }
+        const uint64_t nReqs = ctr.requests, nErrs = ctr.errors;
+        Log() << "Ran for " << QString::number(secs, 'f', 2) << " secs: " << nReqs << " requests ("
+              << QString::number(nReqs / secs, 'f', 1) << "/sec), " << nErrs << " errors ("
+              << QString::number(nReqs ? 100. * nErrs / nReqs : 0., 'f', 2) << "%), " << ctr.sessions.load()
+              << " sessions (" << QString::number(ctr.sessions / secs, 'f', 1) << "/sec), " << ctr.connectFails.load()
+              << " connect failures, " << ctr.dropped.load() << " dropped sessions, " << ctr.notifications.load()
+              << " notifications";
+        for (auto & [method, lats] : all.byMethod) {
+            if (lats.empty()) continue;
+            std::sort(lats.begin(), lats.end());
+            const auto pct = [&lats](double p) {
+                return QString::number(lats[std::min(lats.size() - 1, size_t(p * double(lats.size())))] / 1e6, 'f', 3);
+            };
+            Log() << method << ": " << lats.size() << " (" << QString::number(lats.size() / secs, 'f', 1) << "/sec), "
+                  << all.errorsByMethod[method] << " errors, msec p50: " << pct(.5) << ", p90: " << pct(.9)
+                  << ", p99: " << pct(.99) << ", max: " << QString::number(lats.back() / 1e6, 'f', 3);
+        }
+    }
+
+    const auto bench_ = App::registerBench("loadgen", &bench);
+
+} // namespace
+#endif
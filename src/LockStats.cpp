@@ -0,0 +1,163 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "LockStats.h"
+
+#include <QVariantMap>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace LockStats {
+
+    namespace detail { std::atomic<unsigned> sampleRate{0}; }
+
+    void setSampleRate(unsigned n) noexcept { detail::sampleRate.store(n, std::memory_order_relaxed); }
+    unsigned sampleRate() noexcept { return detail::sampleRate.load(std::memory_order_relaxed); }
+
+    Site::Site(const QString &name)
+        : name(name),
+          wait(Metrics::histogram("fulcrum_lock_wait_seconds", "Sampled time spent waiting to acquire a lock", "lock", name)),
+          hold(Metrics::histogram("fulcrum_lock_hold_seconds", "Sampled time an exclusive lock was held", "lock", name))
+    {}
+
+    namespace {
+        struct Registry {
+            std::mutex mut;
+            std::map<QString, std::unique_ptr<Site>> sites;
+        };
+
+        Registry & registry() {
+            static Registry r; // constructed on first use, since locks may be constructed from static initializers
+            return r;
+        }
+    } // namespace
+
+    Site & site(const QString &name)
+    {
+        auto & r = registry();
+        std::unique_lock g(r.mut);
+        auto & ptr = r.sites[name];
+        if (!ptr)
+            ptr = std::make_unique<Site>(name);
+        return *ptr;
+    }
+
+    QVariantList report(size_t limit)
+    {
+        struct Row {
+            const Site *site;
+            Metrics::Histogram::Snapshot wait, hold;
+        };
+        std::vector<Row> rows;
+        {
+            auto & r = registry();
+            std::unique_lock g(r.mut);
+            for (const auto & [name, site] : r.sites)
+                if (site->nSampled.load(std::memory_order_relaxed))
+                    rows.push_back({site.get(), site->wait.snapshot(), site->hold.snapshot()});
+        }
+        std::sort(rows.begin(), rows.end(), [](const Row &a, const Row &b) { return a.wait.sumSecs > b.wait.sumSecs; });
+        if (rows.size() > limit) rows.resize(limit);
+
+        QVariantList ret;
+        const auto ms = [](double secs) { return secs * 1e3; };
+        for (const auto & row : rows) {
+            const auto nSampled = row.site->nSampled.load(std::memory_order_relaxed),
+                       nContended = row.site->nContended.load(std::memory_order_relaxed);
+            ret.push_back(QVariantMap{
+                {"name", row.site->name},
+                {"sampled", qulonglong(nSampled)},
+                {"contended", qulonglong(nContended)},
+                {"contended_pct", nSampled ? nContended * 100.0 / nSampled : 0.},
+                {"wait_total_ms", ms(row.wait.sumSecs)},
+                {"wait_p50_ms", ms(row.wait.quantileSecs(0.5))},
+                {"wait_p99_ms", ms(row.wait.quantileSecs(0.99))},
+                {"hold_p50_ms", ms(row.hold.quantileSecs(0.5))},
+                {"hold_p99_ms", ms(row.hold.quantileSecs(0.99))},
+            });
+        }
+        return ret;
+    }
+
+} // namespace LockStats
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+#include "Json/Json.h"
+
+#include <chrono>
+#include <shared_mutex>
+#include <thread>
+
+namespace {
+    void test()
+    {
+        const auto prevRate = LockStats::sampleRate();
+        Defer restore([prevRate]{ LockStats::setSampleRate(prevRate); });
+
+        LockStats::Sampled<std::shared_mutex> lock("test_lock");
+        auto & site = LockStats::site("test_lock");
+        if (&site != &LockStats::site("test_lock"))
+            throw Exception("site() should return the same instance for the same name");
+
+        // disabled: nothing is sampled
+        LockStats::setSampleRate(0);
+        for (int i = 0; i < 100; ++i) { std::unique_lock g(lock); }
+        for (int i = 0; i < 100; ++i) { std::shared_lock g(lock); }
+        if (site.nSampled != 0 || site.hold.snapshot().count != 0)
+            throw Exception("Nothing should be sampled when sampling is disabled");
+
+        // 1-in-4 sampling on this thread: 40 exclusive + 40 shared acquisitions -> 10 + 10 samples, 10 hold times
+        LockStats::setSampleRate(4);
+        for (int i = 0; i < 40; ++i) { std::unique_lock g(lock); }
+        for (int i = 0; i < 40; ++i) { std::shared_lock g(lock); }
+        if (site.nSampled != 20 || site.nContended != 0 || site.hold.snapshot().count != 10)
+            throw Exception(QString("Unexpected counts: sampled %1, contended %2, holds %3").arg(qulonglong(site.nSampled))
+                            .arg(qulonglong(site.nContended)).arg(site.hold.snapshot().count));
+
+        // contended: another thread holds the lock for ~50 msec while we wait for it
+        LockStats::setSampleRate(1);
+        std::atomic_bool held = false;
+        std::thread holder([&] {
+            std::unique_lock g(lock);
+            held = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        });
+        while (!held) std::this_thread::yield();
+        { std::unique_lock g(lock); }
+        holder.join();
+        if (site.nContended != 1)
+            throw Exception("Expected exactly 1 contended acquisition");
+
+        const auto rows = LockStats::report(1000);
+        const auto it = std::find_if(rows.begin(), rows.end(), [](const QVariant &v) { return v.toMap().value("name") == "test_lock"; });
+        if (it == rows.end())
+            throw Exception("test_lock missing from report()");
+        const auto row = it->toMap();
+        if (row.value("wait_total_ms").toDouble() < 40. || row.value("hold_p99_ms").toDouble() < 40.)
+            throw Exception(QString("Unexpected report row: %1").arg(Json::toUtf8(row, true).constData()));
+        Log() << "LockStats: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("lockstats", &test);
+} // namespace
+#endif
@@ -0,0 +1,128 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "Metrics.h"
+#include "Util.h"
+
+#include <QString>
+#include <QVariantList>
+
+#include <atomic>
+#include <cstdint>
+
+/// Sampled lock contention statistics, for finding out which of the app's hot locks actually hurt.
+///
+/// Locks wrapped in LockStats::Sampled time 1-in-N of their acquisitions (N being the "lock_sample_rate" config
+/// setting; 0 = off, the default): the time spent waiting to acquire the lock, and (for exclusive acquisitions) the
+/// time it was held. Observations go into the "fulcrum_lock_wait_seconds" and "fulcrum_lock_hold_seconds" histogram
+/// families (labeled by lock name) and are summarized, worst first, in the /debug?locks output.
+///
+/// When sampling is off, the only overhead is a relaxed atomic load and a well-predicted branch per acquisition.
+namespace LockStats {
+
+    /// 0 disables sampling, otherwise 1 in `n` acquisitions (counted per-thread) are timed. Thread-safe.
+    void setSampleRate(unsigned n) noexcept;
+    unsigned sampleRate() noexcept;
+
+    /// Per-lock-name statistics. Several lock instances may share a name (e.g. every CostCache), in which case
+    /// their observations are aggregated.
+    struct Site {
+        const QString name;
+        Metrics::Histogram &wait, &hold;
+        std::atomic<uint64_t> nSampled{0}, nContended{0}; ///< "contended" = the sampled acquisition had to wait
+        Site(const QString &name);
+    };
+
+    /// Returns the Site for `name`, creating it on first use. The returned reference is valid for the lifetime of
+    /// the process. Thread-safe.
+    Site & site(const QString &name);
+
+    /// Returns a summary of up to `limit` locks, sorted by total sampled wait time, descending. Each entry is a
+    /// QVariantMap with the lock's name, sample & contention counts, and its p50/p99 wait & hold times in msec.
+    /// Percentiles are the upper bounds of the histogram buckets they fall in, so they are accurate to within 2x.
+    QVariantList report(size_t limit);
+
+    namespace detail {
+        extern std::atomic<unsigned> sampleRate;
+        inline bool shouldSample() noexcept {
+            const unsigned n = sampleRate.load(std::memory_order_relaxed);
+            if (LIKELY(!n)) return false;
+            thread_local unsigned ctr = 0;
+            if (++ctr < n) return false;
+            ctr = 0;
+            return true;
+        }
+    } // namespace detail
+
+    /// A drop-in replacement for a std::mutex or std::shared_mutex (or any other Lockable `Mutex`) that samples
+    /// wait and hold times, as described above. Usable with std::unique_lock, std::shared_lock, std::scoped_lock,
+    /// etc. The try_lock*() methods are never sampled. Shared acquisitions record only their wait time, since
+    /// there may be many concurrent shared holders.
+    template <typename Mutex>
+    class Sampled
+    {
+        Mutex mut;
+        Site &st;
+        qint64 holdT0 = 0; ///< nonzero if the current exclusive acquisition was sampled; only touched by the owner
+
+        template <typename Acquire, typename TryAcquire>
+        qint64 timedAcquire(const Acquire &acquire, const TryAcquire &tryAcquire) {
+            qint64 now;
+            if (tryAcquire()) {
+                now = Util::getTimeNS();
+                st.wait.observeNS(0);
+            } else {
+                const auto t0 = Util::getTimeNS();
+                acquire();
+                now = st.wait.observeSince(t0);
+                st.nContended.fetch_add(1, std::memory_order_relaxed);
+            }
+            st.nSampled.fetch_add(1, std::memory_order_relaxed);
+            return now;
+        }
+
+    public:
+        explicit Sampled(const QString &name) : st(site(name)) {}
+        Sampled(const Sampled &) = delete;
+        Sampled &operator=(const Sampled &) = delete;
+
+        void lock() {
+            if (LIKELY(!detail::shouldSample())) mut.lock();
+            else holdT0 = timedAcquire([this]{ mut.lock(); }, [this]{ return mut.try_lock(); });
+        }
+        bool try_lock() { return mut.try_lock(); }
+        void unlock() {
+            if (LIKELY(!holdT0)) { mut.unlock(); return; }
+            const auto t0 = holdT0, t1 = Util::getTimeNS();
+            holdT0 = 0;
+            mut.unlock();
+            st.hold.observeNS(t1 - t0);
+        }
+
+        // The below are only instantiated if used, so Mutex need only support them if they are called.
+        void lock_shared() {
+            if (LIKELY(!detail::shouldSample())) mut.lock_shared();
+            else timedAcquire([this]{ mut.lock_shared(); }, [this]{ return mut.try_lock_shared(); });
+        }
+        bool try_lock_shared() { return mut.try_lock_shared(); }
+        void unlock_shared() { mut.unlock_shared(); }
+    };
+
+} // namespace LockStats
@@ -17,12 +17,16 @@
 // <https://www.gnu.org/licenses/>.
 //
 #include <QCoreApplication>
+#include <QDateTime>
 #include <QTimer>
 
+#include <chrono>
 #include <cstdlib>
 
 #include "Common.h"
 #include "Logger.h"
+#include "Options.h"
+#include "Util.h"
 
 namespace {
     void loggerCommon(int level, const QString &)
@@ -46,6 +50,210 @@ Logger::Logger(QObject *parent) : QObject(parent)
 
 Logger::~Logger() {}
 
+/* static */
+QString Logger::formatLine(const Line &l, bool colorize)
+{
+    // [timestamp]
+    // Note: we always want to log the timestamp, even in syslog mode.
+    // This is because if logging from a thread, log lines may be out-of-order.
+    // The timestamp is the only record of the actual order in which things
+    // occurred. Currently the timestamp is to 4 decimal places (hundreds of micros) in Uptime mode only.
+    // We do offer LogTimestampMode::None for users really wishing to suppress timestamp logging.
+    using LTS = Options::LogTimestampMode;
+    QString tsStr;
+    switch (LTS(l.tsMode)) {
+    case LTS::None:
+        break;
+    case LTS::Uptime: {
+        const auto unow = l.uptimeNS/1000LL;
+        tsStr = QString::asprintf("[%lld.%04d] ", unow/1000000LL, int((unow/100LL)%10000));
+    }
+        break;
+    case LTS::UTC:
+    case LTS::Local: {
+        const auto when = LTS(l.tsMode) == LTS::UTC ? QDateTime::fromMSecsSinceEpoch(l.epochMSec).toUTC()
+                                                     : QDateTime::fromMSecsSinceEpoch(l.epochMSec);
+        tsStr = when.toString(u"[yyyy-MM-dd hh:mm:ss.zzz] ");
+    }
+        break;
+    }
+    // /[timestamp]
+    QString thrdStr;
+    if (!l.thread.isEmpty())
+        thrdStr = QStringLiteral("<%1> ").arg(l.thread);
+
+    return tsStr + thrdStr + (colorize ? Log::colorize(l.text, Log::Color(l.color)) : l.text);
+}
+
+void Logger::writeLine(const Line &l)
+{
+    gotLine(l.level, formatLine(l, isaTTY()));
+    nWritten.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Logger::submit(Line && line)
+{
+    if (!asyncActive.load(std::memory_order_relaxed)) {
+        emit log(line.level, formatLine(line, isaTTY()));
+        return;
+    }
+    if (line.level == Fatal) {
+        // Flush everything ahead of us and write synchronously, since the app is about to exit.
+        std::unique_lock g(writeMut);
+        drain();
+        writeLine(line);
+        return;
+    }
+    if (!ring->tryPush(std::move(line))) {
+        if (line.level == Info || line.level == Debug) {
+            nDropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        // Warnings and errors are never dropped. They may appear out of order with respect to queued lines, however
+        // the timestamp is captured at the time of logging so the true order can still be reconstructed.
+        std::unique_lock g(writeMut);
+        writeLine(line);
+        return;
+    }
+    if (writerSleeping.load()) {
+        std::unique_lock g(wakeMut);
+        wakeCond.notify_one();
+    }
+}
+
+void Logger::startAsync(size_t queueSize)
+{
+    if (ring || !queueSize) return; // may only be started once
+    size_t cap = 1;
+    while (cap < queueSize) cap <<= 1;
+    ring = std::make_unique<Ring>(cap);
+    writer = std::make_unique<std::thread>([this]{ writerThreadFunc(); });
+    asyncActive = true;
+}
+
+void Logger::stopAsync()
+{
+    if (!writer) return;
+    asyncActive = false; // new lines from here on are written synchronously
+    {
+        std::unique_lock g(wakeMut);
+        stopFlag = true;
+        wakeCond.notify_one();
+    }
+    if (writer->joinable()) writer->join();
+    writer.reset();
+    // catch anything pushed by threads that saw asyncActive == true just before we cleared it
+    std::unique_lock g(writeMut);
+    drain();
+    // Note: `ring` is kept around since a racing submit() may still be touching it.
+}
+
+auto Logger::asyncStats() const -> AsyncStats
+{
+    AsyncStats ret;
+    if (isAsync()) {
+        ret.capacity = ring->capacity();
+        ret.queued = ring->size();
+    }
+    ret.written = nWritten.load(std::memory_order_relaxed);
+    ret.dropped = nDropped.load(std::memory_order_relaxed);
+    return ret;
+}
+
+size_t Logger::drain()
+{
+    size_t ct = 0;
+    Line line;
+    while (ring->tryPop(line)) {
+        writeLine(line);
+        lastTsMode = line.tsMode;
+        ++ct;
+    }
+    return ct;
+}
+
+void Logger::writerThreadFunc()
+{
+    using namespace std::chrono_literals;
+    for (;;) {
+        {
+            std::unique_lock g(writeMut);
+            drain();
+            if (const auto nd = nDropped.load(std::memory_order_relaxed); nd != nDroppedReported) {
+                Line l;
+                l.level = Warning;
+                l.color = Log::Yellow;
+                l.tsMode = lastTsMode;
+                l.uptimeNS = Util::getTimeNS();
+                l.epochMSec = QDateTime::currentMSecsSinceEpoch();
+                l.text = QString("Logger: queue full, dropped %1 log %2").arg(nd - nDroppedReported)
+                             .arg(Util::Pluralize("line", nd - nDroppedReported));
+                writeLine(l);
+                nDroppedReported = nd;
+            }
+        }
+        std::unique_lock g(wakeMut);
+        if (stopFlag) break;
+        writerSleeping = true;
+        // Producers only take wakeMut if they see writerSleeping, so re-check the queue now to avoid a lost wakeup.
+        // The timeout is a backstop and also bounds how long a "dropped" notice may be delayed.
+        if (!ring->size())
+            wakeCond.wait_for(g, 250ms, [this]{ return stopFlag.load() || ring->size() > 0; });
+        writerSleeping = false;
+        if (stopFlag) break;
+    }
+    std::unique_lock g(writeMut);
+    drain();
+}
+
+Logger::Ring::Ring(size_t capacityPow2)
+    : cells(std::make_unique<Cell[]>(capacityPow2)), mask(capacityPow2 - 1)
+{
+    for (size_t i = 0; i < capacityPow2; ++i)
+        cells[i].seq.store(i, std::memory_order_relaxed);
+}
+
+size_t Logger::Ring::size() const
+{
+    const auto e = enqPos.load(std::memory_order_relaxed), d = deqPos.load(std::memory_order_relaxed);
+    return e > d ? e - d : 0;
+}
+
+bool Logger::Ring::tryPush(Line &&line)
+{
+    size_t pos = enqPos.load(std::memory_order_relaxed);
+    Cell *cell;
+    for (;;) {
+        cell = &cells[pos & mask];
+        const size_t seq = cell->seq.load(std::memory_order_acquire);
+        const auto dif = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+        if (dif == 0) {
+            if (enqPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (dif < 0)
+            return false; // full
+        else
+            pos = enqPos.load(std::memory_order_relaxed);
+    }
+    cell->line = std::move(line);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool Logger::Ring::tryPop(Line &out)
+{
+    const size_t pos = deqPos.load(std::memory_order_relaxed);
+    Cell &cell = cells[pos & mask];
+    const size_t seq = cell.seq.load(std::memory_order_acquire);
+    if (static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1) < 0)
+        return false; // empty (or the producer that claimed this cell hasn't finished writing it yet)
+    out = std::move(cell.line);
+    cell.line = Line{};
+    cell.seq.store(pos + mask + 1, std::memory_order_release);
+    deqPos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+}
+
 #include <iostream>
 #include <stdio.h>
 #ifdef Q_OS_UNIX
@@ -56,6 +264,8 @@ ConsoleLogger::ConsoleLogger(QObject *p, bool stdOut)
     : Logger(p), stdOut(stdOut)
 {}
 
+ConsoleLogger::~ConsoleLogger() { stopAsync(); }
+
 void ConsoleLogger::gotLine(int level, const QString &l) {
     (stdOut ? std::cout : std::cerr)
             << l.toUtf8().constData()
@@ -21,6 +21,14 @@
 #include <QObject>
 #include <QString>
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+
 /** Abstract base class for a line-based logger */
 class Logger : public QObject
 {
@@ -36,17 +44,88 @@ public:
     /// returns true if the logger is logging to a tty (and thus supports ANSI color codes, etc)
     virtual bool isaTTY() const { return false; }
 
+    /// A log line as captured by Log::~Log(). Only the cheap parts are filled-in on the logging thread; the timestamp
+    /// and thread name prefix, the colorization, and the final UTF-8 encoding are done by formatLine() and gotLine(), which (when
+    /// async logging is active) runs on the writer thread.
+    struct Line {
+        int level = Info;
+        int color = 0; ///< a Log::Color
+        int tsMode = 0; ///< an Options::LogTimestampMode
+        qint64 uptimeNS = 0; ///< Util::getTimeNS() at the time the line was logged
+        qint64 epochMSec = 0; ///< wall clock time at the time the line was logged (only set for Local & UTC tsMode)
+        QString thread; ///< empty if the line was logged from the main thread
+        QString text;
+    };
+
+    /// Called by Log::~Log(). If async logging is active, queues the line for the writer thread, otherwise formats
+    /// it and emits log(). Warning, Critical, and Fatal lines are never dropped: if the queue is full they are written
+    /// synchronously. Fatal lines always flush the queue and are written synchronously. Thread-safe.
+    void submit(Line && line);
+
+    /// Starts the writer thread, with a queue of `queueSize` lines (rounded up to a power of 2). Must be called from
+    /// the main thread. No-op if already started.
+    void startAsync(size_t queueSize);
+    /// Writes out all queued lines and joins the writer thread, reverting to synchronous logging. Must be called before
+    /// the derived class is destroyed since the writer thread calls gotLine().
+    void stopAsync();
+    bool isAsync() const { return asyncActive.load(std::memory_order_relaxed); }
+
+    struct AsyncStats {
+        size_t capacity = 0, queued = 0;
+        uint64_t written = 0, dropped = 0;
+    };
+    AsyncStats asyncStats() const;
+
+    /// Returns the final text of `line`, with the timestamp and thread name prefix and (optionally) ANSI color codes
+    static QString formatLine(const Line &line, bool colorize);
+
 signals:
     void log(int level, const QString & line); ///< call this or emit it to log a line
 
 public slots:
     virtual void gotLine(int level, const QString &) = 0;
+
+private:
+    /// Bounded lock-free multi-producer, single-consumer queue of Lines (after Vyukov's bounded MPMC queue).
+    /// A single queue (rather than one per thread) keeps the lines in the order in which they were logged.
+    class Ring {
+        struct Cell {
+            std::atomic<size_t> seq;
+            Line line;
+        };
+        const std::unique_ptr<Cell[]> cells;
+        const size_t mask;
+        alignas(64) std::atomic<size_t> enqPos{0};
+        alignas(64) std::atomic<size_t> deqPos{0}; ///< only ever written by the consumer
+    public:
+        explicit Ring(size_t capacityPow2);
+        size_t capacity() const { return mask + 1; }
+        size_t size() const;
+        bool tryPush(Line &&); ///< returns false if full, in which case the line is left untouched
+        bool tryPop(Line &); ///< consumer only
+    };
+
+    void writerThreadFunc();
+    /// Pops and writes everything currently in the queue. Returns the number of lines written.
+    size_t drain();
+    void writeLine(const Line &);
+
+    std::unique_ptr<Ring> ring;
+    std::unique_ptr<std::thread> writer;
+    mutable std::mutex writeMut; ///< serializes calls to gotLine() and drain() between the writer and synchronous paths
+    std::mutex wakeMut;
+    std::condition_variable wakeCond;
+    std::atomic_bool asyncActive{false}, writerSleeping{false}, stopFlag{false};
+    std::atomic<uint64_t> nWritten{0}, nDropped{0};
+    uint64_t nDroppedReported = 0; ///< writer thread only
+    int lastTsMode = 0; ///< guarded by writeMut; used for the writer's own "dropped" notices
 };
 
 class ConsoleLogger : public Logger
 {
 public:
     explicit ConsoleLogger(QObject *parent = nullptr, bool stdOut = true);
+    ~ConsoleLogger() override;
 
     bool isaTTY() const override;
 
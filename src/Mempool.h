@@ -129,6 +129,13 @@ struct Mempool
     HashXTxMap hashXTxs;
     DSPs dsps;
 
+    /// @returns a pointer to our own copy of `txHash` (the key in `txs`), or nullptr if it's not in the mempool.
+    /// Storing the returned copy elsewhere (e.g. in DSPs) shares its data with ours, rather than duplicating it.
+    const TxHash * internTxHash(const TxHash &txHash) const {
+        const auto it = txs.find(txHash);
+        return it != txs.end() ? &it->first : nullptr;
+    }
+
 
     // -- Add to mempool
 
@@ -20,6 +20,7 @@
 
 #include "BlockProcTypes.h"
 #include "BTC.h"
+#include "LockStats.h"
 
 #include <QByteArray>
 
@@ -109,11 +110,11 @@ namespace Merkle
         size_t size() const { SharedLockGuard g(lock); return level.size(); }
 
     private:
-        using RWLock = std::shared_mutex;
+        using RWLock = LockStats::Sampled<std::shared_mutex>;
         using SharedLockGuard = std::shared_lock<RWLock>;
         using ExclusiveLockGuard = std::lock_guard<RWLock>;
 
-        mutable RWLock lock;
+        mutable RWLock lock{"Merkle::Cache::lock"};
         const GetHashesFunc getHashesFunc;
         unsigned length = 0, depthHigher = 0;
         HashVec level;
@@ -0,0 +1,211 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "Metrics.h"
+
+#include <QTextStream>
+#include <QtAlgorithms>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace Metrics {
+
+    unsigned Histogram::bucketForNS(qint64 nanos) noexcept
+    {
+        const uint64_t usec = (uint64_t(std::max<qint64>(nanos, 0)) + 999u) / 1000u; // round up
+        if (usec <= 1u) return 0;
+        const unsigned b = 64u - qCountLeadingZeroBits(quint64(usec - 1u)); // ceil(log2(usec))
+        return std::min(b, kNumBuckets);
+    }
+
+    auto Histogram::snapshot() const noexcept -> Snapshot
+    {
+        Snapshot ret;
+        for (unsigned i = 0; i < ret.counts.size(); ++i) {
+            ret.counts[i] = buckets[i].load(std::memory_order_relaxed);
+            ret.count += ret.counts[i];
+        }
+        ret.sumSecs = sumNS.load(std::memory_order_relaxed) / 1e9;
+        return ret;
+    }
+
+    double Histogram::Snapshot::quantileSecs(double q) const noexcept
+    {
+        if (!count) return 0.;
+        const uint64_t rank = std::max<uint64_t>(1u, uint64_t(std::ceil(std::clamp(q, 0., 1.) * double(count))));
+        uint64_t cum = 0;
+        for (unsigned i = 0; i < kNumBuckets; ++i)
+            if ((cum += counts[i]) >= rank)
+                return bucketUpperBoundSecs(i);
+        return bucketUpperBoundSecs(kNumBuckets - 1u);
+    }
+
+    namespace {
+        struct Family {
+            QString help;
+            std::map<QString, std::unique_ptr<Histogram>> byLabels; ///< keyed on the rendered labels e.g.: method="foo"
+        };
+
+        struct Registry {
+            std::mutex mut;
+            std::map<QString, Family> families; ///< std::map so that the output of prometheusText() has a stable order
+            std::map<QString, Collector> collectors;
+        };
+
+        Registry & registry() {
+            static Registry r; // constructed on first use, so that histograms may be looked up from static initializers
+            return r;
+        }
+
+        QString escapeHelp(QString s) {
+            s.replace('\\', QStringLiteral("\\\\"));
+            s.replace('\n', QStringLiteral("\\n"));
+            return s;
+        }
+    } // namespace
+
+    QString escapeLabelValue(QString s) {
+        s.replace('\\', QStringLiteral("\\\\"));
+        s.replace('"', QStringLiteral("\\\""));
+        s.replace('\n', QStringLiteral("\\n"));
+        return s;
+    }
+
+    QString familyHeader(const QString &name, const QString &help, const QString &type)
+    {
+        return QStringLiteral("# HELP %1 %2\n# TYPE %1 %3\n").arg(name, escapeHelp(help), type);
+    }
+
+    void setCollector(const QString &name, Collector collector)
+    {
+        auto & r = registry();
+        std::unique_lock g(r.mut);
+        if (collector)
+            r.collectors[name] = std::move(collector);
+        else
+            r.collectors.erase(name);
+    }
+
+    Histogram & histogram(const QString &family, const QString &help, const QString &labelName, const QString &labelValue)
+    {
+        QString labels;
+        if (!labelName.isEmpty())
+            labels = QStringLiteral("%1=\"%2\"").arg(labelName, escapeLabelValue(labelValue));
+        auto & r = registry();
+        std::unique_lock g(r.mut);
+        auto & fam = r.families[family];
+        if (fam.help.isEmpty())
+            fam.help = help;
+        auto & ptr = fam.byLabels[labels];
+        if (!ptr)
+            ptr = std::make_unique<Histogram>();
+        return *ptr;
+    }
+
+    QByteArray prometheusText()
+    {
+        QString out;
+        std::vector<Collector> collectors;
+        {
+            QTextStream ts(&out);
+            auto & r = registry();
+            std::unique_lock g(r.mut);
+            for (const auto & [name, collector] : r.collectors)
+                collectors.push_back(collector); // copy; these are called below without the lock held
+            for (const auto & [name, fam] : r.families) {
+                ts << "# HELP " << name << " " << escapeHelp(fam.help) << "\n"
+                   << "# TYPE " << name << " histogram\n";
+                for (const auto & [labels, hist] : fam.byLabels) {
+                    const auto snap = hist->snapshot();
+                    const QString sep = labels.isEmpty() ? QString() : QStringLiteral(",");
+                    uint64_t cum = 0;
+                    for (unsigned i = 0; i < Histogram::kNumBuckets; ++i) {
+                        cum += snap.counts[i];
+                        ts << name << "_bucket{" << labels << sep << "le=\""
+                           << QString::number(Histogram::bucketUpperBoundSecs(i), 'g', 6) << "\"} " << cum << "\n";
+                    }
+                    ts << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << snap.count << "\n";
+                    const QString braced = labels.isEmpty() ? QString() : QStringLiteral("{%1}").arg(labels);
+                    ts << name << "_sum" << braced << " " << QString::number(snap.sumSecs, 'g', 12) << "\n"
+                       << name << "_count" << braced << " " << snap.count << "\n";
+                }
+            }
+        }
+        for (const auto & collector : collectors)
+            out += collector();
+        return out.toUtf8();
+    }
+
+} // namespace Metrics
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+#include <limits>
+#include <vector>
+
+namespace {
+    void test()
+    {
+        using Metrics::Histogram;
+        // bucket boundaries: bucket i holds (2^(i-1), 2^i] usec
+        const std::vector<std::pair<qint64, unsigned>> expected = {
+            {-5, 0}, {0, 0}, {1, 0}, {1000, 0}, {1001, 1}, {2000, 1}, {2001, 2}, {4000, 2}, {4001, 3},
+            {1'000'000, 10}, {1'048'576'000, 20}, {1'048'577'000, 21}, {(qint64(1) << 26) * 1000, 26},
+            {(qint64(1) << 26) * 1000 + 1, Histogram::kNumBuckets}, {std::numeric_limits<qint64>::max(), Histogram::kNumBuckets},
+        };
+        for (const auto & [ns, b] : expected)
+            if (const auto got = Histogram::bucketForNS(ns); got != b)
+                throw Exception(QString("bucketForNS(%1) = %2, expected %3").arg(ns).arg(got).arg(b));
+
+        auto & h = Metrics::histogram("fulcrum_test_seconds", "Test \"histogram\"\nhelp", "method", "a\"b\\c");
+        if (&h != &Metrics::histogram("fulcrum_test_seconds", "ignored", "method", "a\"b\\c"))
+            throw Exception("histogram() should return the same instance for the same family & labels");
+        h.observeNS(500);
+        h.observeNS(3'000);
+        h.observeNS(100'000'000'000); // 100 secs -> +Inf bucket
+        const auto snap = h.snapshot();
+        if (snap.count != 3 || snap.counts[0] != 1 || snap.counts[2] != 1 || snap.counts[Histogram::kNumBuckets] != 1)
+            throw Exception("Unexpected snapshot counts");
+        if (snap.quantileSecs(0.) != 1e-6 || snap.quantileSecs(0.5) != 4e-6 || snap.quantileSecs(1.)
+                != Histogram::bucketUpperBoundSecs(Histogram::kNumBuckets - 1) || Histogram::Snapshot{}.quantileSecs(0.5) != 0.)
+            throw Exception("Unexpected quantiles");
+
+        const QString text = QString::fromUtf8(Metrics::prometheusText());
+        for (const auto & line : { "# HELP fulcrum_test_seconds Test \"histogram\"\\nhelp",
+                                   "# TYPE fulcrum_test_seconds histogram",
+                                   "fulcrum_test_seconds_bucket{method=\"a\\\"b\\\\c\",le=\"1e-06\"} 1",
+                                   "fulcrum_test_seconds_bucket{method=\"a\\\"b\\\\c\",le=\"4e-06\"} 2",
+                                   "fulcrum_test_seconds_bucket{method=\"a\\\"b\\\\c\",le=\"67.1089\"} 2",
+                                   "fulcrum_test_seconds_bucket{method=\"a\\\"b\\\\c\",le=\"+Inf\"} 3",
+                                   "fulcrum_test_seconds_sum{method=\"a\\\"b\\\\c\"} 100.0000035",
+                                   "fulcrum_test_seconds_count{method=\"a\\\"b\\\\c\"} 3" }) {
+            if (!text.split('\n').contains(QString(line)))
+                throw Exception(QString("Missing expected line in output: %1\n\nOutput:\n%2").arg(line, text));
+        }
+        Log() << "Metrics: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("metrics", &test);
+} // namespace
+#endif
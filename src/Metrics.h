@@ -0,0 +1,104 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "Util.h"
+
+#include <QByteArray>
+#include <QString>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+/// App-wide latency metrics, exported in Prometheus text format on the stats server's /metrics endpoint.
+namespace Metrics {
+
+    /// A log2-bucketed latency histogram. Bucket i counts observations <= 2^i microseconds (1 usec ... ~67 secs),
+    /// plus a final overflow (+Inf) bucket. Recording is lock-free and safe to do from any thread.
+    class Histogram
+    {
+    public:
+        static constexpr unsigned kNumBuckets = 27; ///< not counting the +Inf bucket
+
+        void observeNS(qint64 nanos) noexcept {
+            if (nanos < 0) nanos = 0;
+            buckets[bucketForNS(nanos)].fetch_add(1, std::memory_order_relaxed);
+            sumNS.fetch_add(uint64_t(nanos), std::memory_order_relaxed);
+        }
+        /// Observes the time elapsed since `t0` (a Util::getTimeNS() timestamp). Returns the current timestamp.
+        qint64 observeSince(qint64 t0) noexcept { const auto now = Util::getTimeNS(); observeNS(now - t0); return now; }
+
+        struct Snapshot {
+            std::array<uint64_t, kNumBuckets + 1> counts{}; ///< per-bucket (not cumulative), last one is +Inf
+            uint64_t count = 0;
+            double sumSecs = 0.;
+            /// Returns the upper bound, in seconds, of the bucket holding the q-th quantile (0 <= q <= 1), or 0 if
+            /// there are no observations. The +Inf bucket reports the largest finite bound.
+            double quantileSecs(double q) const noexcept;
+        };
+        /// Not an atomic snapshot across buckets, but each bucket is read atomically (this is fine for scraping).
+        Snapshot snapshot() const noexcept;
+
+        static unsigned bucketForNS(qint64 nanos) noexcept;
+        /// The inclusive upper bound of bucket i, in seconds. i must be < kNumBuckets.
+        static double bucketUpperBoundSecs(unsigned i) noexcept { return double(uint64_t(1) << i) / 1e6; }
+
+    private:
+        std::array<std::atomic<uint64_t>, kNumBuckets + 1> buckets{};
+        std::atomic<uint64_t> sumNS{0};
+    };
+
+    /// Returns the histogram for `family` (a Prometheus metric name, e.g. "fulcrum_rpc_request_seconds") having
+    /// the label `labelName`="`labelValue`" (or no labels if labelName is empty), creating it on first use.
+    /// `help` is only used when the family is first created. The returned reference is valid for the lifetime of
+    /// the process, so callers on hot paths should look it up once and cache it. Thread-safe.
+    Histogram & histogram(const QString &family, const QString &help,
+                          const QString &labelName = {}, const QString &labelValue = {});
+
+    /// A callback that renders metrics owned by some other subsystem (e.g. counters & gauges it already keeps) in the
+    /// Prometheus text exposition format, for inclusion in the output of prometheusText(). It is called from the stats
+    /// server's thread, so it must be thread-safe.
+    using Collector = std::function<QString()>;
+    /// Registers the collector `name`, replacing any existing one of the same name. An empty `collector` unregisters
+    /// it. Collectors are rendered after the histograms, in name order. Thread-safe.
+    void setCollector(const QString &name, Collector collector);
+
+    /// Helper for Collectors: renders the "# HELP" and "# TYPE" lines for metric family `name`
+    QString familyHeader(const QString &name, const QString &help, const QString &type);
+    /// Helper for Collectors: escapes a label value (backslash, double-quote and newline)
+    QString escapeLabelValue(QString s);
+
+    /// Renders all histograms in the Prometheus text exposition format (version 0.0.4), followed by the output of
+    /// each registered Collector. Thread-safe.
+    QByteArray prometheusText();
+
+    /// Records the time between successive calls to lap() into the given histograms. Used to time the stages of a
+    /// multi-step operation without having to manage a timestamp for each stage.
+    class LapTimer
+    {
+        qint64 t0 = Util::getTimeNS(), tLap = t0;
+    public:
+        void lap(Histogram &h) noexcept { tLap = h.observeSince(tLap); }
+        /// Records the time since construction
+        void total(Histogram &h) noexcept { h.observeSince(t0); }
+    };
+
+} // namespace Metrics
@@ -0,0 +1,516 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#ifdef ENABLE_TESTS
+// This whole translation unit is the mock bitcoind (`--bench mockbitcoind`) plus its test. It is test-only code, so
+// it is only compiled into builds having ENABLE_TESTS defined.
+#include "App.h"
+#include "BTC.h"
+#include "Json/Json.h"
+#include "Servers.h"
+#include "Util.h"
+
+#include "bitcoin/block.h"
+#include "bitcoin/crypto/common.h"  // ReadLE32
+#include "bitcoin/rpc/protocol.h"
+#include "bitcoin/transaction.h"
+
+#if defined(ENABLE_ZMQ)
+#define ZMQ_CPP11
+#include "zmq/zmq.hpp"
+#endif
+
+#include <QEventLoop>
+#include <QFile>
+#include <QHash>
+#include <QHostAddress>
+#include <QRandomGenerator>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace {
+
+    /// Thrown by MockNode::call; becomes a JSON-RPC error reply.
+    struct MockError : Exception {
+        const int code;
+        MockError(int code, const QString &msg) : Exception(msg), code(code) {}
+    };
+
+    /// The chain and mempool served by the mock bitcoind, built from a fixture. Only the fixture blocks up to the
+    /// current tip are visible; mine() reveals the next one. The mempool is fed from a separate pool of fixture txs,
+    /// and churn() rotates it. The HTTP server thread reads this while timers in the main thread advance it, so all
+    /// access is under a lock.
+    class MockNode
+    {
+    public:
+        MockNode(BTC::Coin coin, const QString &chain, int zmqPort, std::vector<QByteArray> &&rawBlocks,
+                 std::vector<QByteArray> &&rawPoolTxs, size_t initialTip, size_t initialMempoolSize)
+            : coin(coin), chain(chain), zmqPort(zmqPort), segWit(coin != BTC::Coin::BCH),
+              mimble(coin == BTC::Coin::LTC), cashTokens(coin == BTC::Coin::BCH), blocks(std::move(rawBlocks))
+        {
+            if (blocks.empty()) throw BadArgs("The mock bitcoind needs at least 1 block (the genesis block)");
+            for (size_t h = 0; h < blocks.size(); ++h) {
+                const auto block = deserializeBlock(h);
+                if (h && block.hashPrevBlock.GetHex() != hashes.back().toStdString())
+                    throw BadArgs(QString("Fixture block %1 does not connect to block %2").arg(h).arg(h - 1));
+                hashes.push_back(QString::fromStdString(block.GetHash().GetHex()));
+                heightByHash[hashes.back()] = unsigned(h);
+                for (const auto & tx : block.vtx)
+                    txHeights[QString::fromStdString(tx->GetId().GetHex())] = unsigned(h);
+            }
+            for (auto & raw : rawPoolTxs) {
+                const auto tx = BTC::Deserialize<bitcoin::CTransaction>(raw, 0, segWit, mimble, cashTokens);
+                pool.emplace_back(QString::fromStdString(tx.GetId().GetHex()), std::move(raw));
+            }
+            tip = std::min(initialTip, blocks.size() - 1);
+            addToMempool(initialMempoolSize);
+        }
+
+        size_t nBlocks() const { return blocks.size(); }
+        size_t height() const { std::unique_lock g(mut); return tip; }
+        size_t mempoolSize() const { std::unique_lock g(mut); return mempool.size(); }
+
+        /// Reveals the next fixture block and drops its txs from the mempool. Returns the new tip's hash (hex), or
+        /// an empty string if there are no more fixture blocks.
+        QString mine() {
+            std::unique_lock g(mut);
+            if (tip + 1 >= blocks.size()) return {};
+            ++tip;
+            for (auto it = mempool.begin(); it != mempool.end(); )
+                it = txHeights.value(it.key(), UINT_MAX) <= tip ? mempool.erase(it) : std::next(it);
+            return hashes[tip];
+        }
+
+        /// Evicts up to `n` of the oldest mempool txs, then adds up to `n` more from the pool. Returns {evicted, added}.
+        std::pair<size_t, size_t> churn(size_t n) {
+            std::unique_lock g(mut);
+            size_t evicted = 0;
+            while (evicted < n && !mempoolOrder.empty()) {
+                evicted += mempool.remove(mempoolOrder.front());
+                mempoolOrder.pop_front();
+            }
+            return {evicted, addToMempool(n)};
+        }
+
+        /// Serves one bitcoind RPC. Throws MockError on bad params, unknown objects, or unknown methods.
+        QVariant call(const QString &method, const QVariantList &params) {
+            const auto param = [&params](int i) { return i < params.size() ? params[i] : QVariant(); };
+            std::unique_lock g(mut);
+            ++callCounts[method];
+            if (method == "getblockchaininfo") {
+                return QVariantMap{
+                    {"chain", chain}, {"blocks", qulonglong(tip)}, {"headers", qulonglong(tip)},
+                    {"bestblockhash", hashes[tip]}, {"difficulty", 1.0},
+                    {"mediantime", qulonglong(ReadLE32(reinterpret_cast<const uint8_t *>(blocks[tip].constData()) + 68))},
+                    {"verificationprogress", 1.0}, {"initialblockdownload", false},
+                    {"chainwork", QString(64, '0')}, {"size_on_disk", 0}, {"pruned", false}, {"warnings", ""},
+                };
+            } else if (method == "getnetworkinfo") {
+                static const QMap<BTC::Coin, std::pair<int, QString>> versions = {
+                    {BTC::Coin::BCH, {27000000, "/Bitcoin Cash Node:27.0.0(MockBitcoinD)/"}},
+                    {BTC::Coin::BTC, {250000, "/Satoshi:25.0.0(MockBitcoinD)/"}},
+                    {BTC::Coin::LTC, {210200, "/LitecoinCore:0.21.2(MockBitcoinD)/"}},
+                };
+                const auto & [version, subversion] = versions.value(coin);
+                return QVariantMap{{"version", version}, {"subversion", subversion}, {"relayfee", 0.00001}, {"warnings", ""}};
+            } else if (method == "getblockhash") {
+                bool ok;
+                const qlonglong h = param(0).toLongLong(&ok);
+                if (!ok || h < 0 || size_t(h) > tip) throw MockError(bitcoin::RPC_INVALID_PARAMETER, "Block height out of range");
+                return hashes[size_t(h)];
+            } else if (method == "getblock") {
+                const auto it = heightByHash.find(param(0).toString());
+                if (it == heightByHash.end() || it.value() > tip) throw MockError(bitcoin::RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+                if (param(1).toInt() != 0) throw MockError(bitcoin::RPC_INVALID_PARAMETER, "Only verbosity 0 is supported by this mock");
+                return QString::fromLatin1(Util::ToHexFast(blocks[it.value()]));
+            } else if (method == "getrawmempool") {
+                if (param(0).toBool()) throw MockError(bitcoin::RPC_INVALID_PARAMETER, "Only verbose=false is supported by this mock");
+                return QVariant(QStringList(mempool.keys()));
+            } else if (method == "getrawtransaction") {
+                const QString txid = param(0).toString();
+                if (param(1).toBool()) throw MockError(bitcoin::RPC_INVALID_PARAMETER, "Only verbose=false is supported by this mock");
+                if (const auto it = mempool.find(txid); it != mempool.end())
+                    return QString::fromLatin1(Util::ToHexFast(it.value()));
+                if (const unsigned h = txHeights.value(txid, UINT_MAX); h <= tip) {
+                    const auto block = deserializeBlock(h);
+                    for (const auto & tx : block.vtx)
+                        if (QString::fromStdString(tx->GetId().GetHex()) == txid)
+                            return QString::fromLatin1(Util::ToHexFast(BTC::Serialize(*tx, segWit, mimble)));
+                }
+                throw MockError(bitcoin::RPC_INVALID_ADDRESS_OR_KEY, "No such mempool or blockchain transaction");
+            } else if (method == "getdsprooflist") {
+                if (coin != BTC::Coin::BCH) throw MockError(bitcoin::RPC_METHOD_NOT_FOUND, "Method not found");
+                return QVariantList{}; // the fixtures have no double-spends
+            } else if (method == "getdsproof") {
+                if (coin != BTC::Coin::BCH) throw MockError(bitcoin::RPC_METHOD_NOT_FOUND, "Method not found");
+                throw MockError(bitcoin::RPC_INVALID_PARAMETER, "dsproof not found");
+            } else if (method == "getzmqnotifications") {
+                if (!zmqPort) return QVariantList{};
+                return QVariantList{QVariantMap{{"type", "pubhashblock"}, {"address", QString("tcp://127.0.0.1:%1").arg(zmqPort)},
+                                                {"hwm", 1000}}};
+            } else if (method == "uptime") {
+                return qlonglong(tStart.secs());
+            } else if (method == "help") {
+                return QString("MockBitcoinD: serves a fixture chain for testing Fulcrum");
+            } else if (method == "estimatefee") {
+                return 0.00001;
+            } else if (method == "estimatesmartfee") {
+                return QVariantMap{{"feerate", 0.00001}, {"blocks", 2}};
+            } else if (method == "sendrawtransaction") {
+                throw MockError(bitcoin::RPC_MISC_ERROR, "Broadcasting is not supported by this mock");
+            }
+            throw MockError(bitcoin::RPC_METHOD_NOT_FOUND, "Method not found");
+        }
+
+        /// Returns the number of calls made to each RPC method so far.
+        std::map<QString, uint64_t> calls() const { std::unique_lock g(mut); return callCounts; }
+
+    private:
+        const BTC::Coin coin;
+        const QString chain;
+        const int zmqPort;
+        const bool segWit, mimble, cashTokens;
+        const Tic tStart;
+
+        mutable std::mutex mut;
+        std::map<QString, uint64_t> callCounts;
+        const std::vector<QByteArray> blocks; ///< raw, by height
+        std::vector<QString> hashes; ///< hex, by height
+        QHash<QString, unsigned> heightByHash, txHeights; ///< keyed on hex hashes, as bitcoind displays them
+        size_t tip = 0;
+        std::vector<std::pair<QString, QByteArray>> pool; ///< txid hex -> raw tx; mempool txs are taken from here in order
+        size_t poolNext = 0;
+        QHash<QString, QByteArray> mempool; ///< txid hex -> raw tx
+        std::deque<QString> mempoolOrder; ///< oldest first; may have stale entries for txs that were since mined
+
+        bitcoin::CBlock deserializeBlock(size_t h) const {
+            return BTC::Deserialize<bitcoin::CBlock>(blocks[h], 0, segWit, mimble, cashTokens);
+        }
+
+        /// Call with the lock held. Adds the next `n` unconfirmed txs from the pool, wrapping around. Returns how many.
+        size_t addToMempool(size_t n) {
+            size_t added = 0;
+            for (size_t tries = 0; added < n && tries < pool.size(); ++tries) {
+                const auto & [txid, raw] = pool[poolNext];
+                poolNext = (poolNext + 1) % pool.size();
+                if (mempool.contains(txid) || txHeights.value(txid, UINT_MAX) <= tip) continue;
+                mempool.insert(txid, raw);
+                mempoolOrder.push_back(txid);
+                ++added;
+            }
+            return added;
+        }
+    };
+
+    /// Handles one HTTP request to the mock: a JSON-RPC 1.0 call, or a batch of them, answered the way bitcoind
+    /// does (including its HTTP status codes for errors). Auth is not checked.
+    void serve(MockNode &node, SimpleHttpServer::Request &req, int latencyMS, int jitterMS)
+    {
+        auto & resp = req.response;
+        resp.contentType = "application/json";
+        resp.delayMS = latencyMS + (jitterMS > 0 ? int(QRandomGenerator::global()->bounded(jitterMS + 1)) : 0);
+        const auto callOne = [&node](const QVariant &var, int *httpStatus) -> QVariant {
+            const auto m = var.toMap();
+            const QVariant id = m.value("id");
+            try {
+                if (m.isEmpty() || !m.value("method").canConvert<QString>())
+                    throw MockError(bitcoin::RPC_INVALID_REQUEST, "Invalid request object");
+                const auto result = node.call(m.value("method").toString(), m.value("params").toList());
+                return QVariantMap{{"result", result}, {"error", QVariant()}, {"id", id}};
+            } catch (const MockError &e) {
+                if (httpStatus)
+                    *httpStatus = e.code == bitcoin::RPC_METHOD_NOT_FOUND ? 404 : e.code == bitcoin::RPC_INVALID_REQUEST ? 400 : 500;
+                return QVariantMap{{"result", QVariant()}, {"error", QVariantMap{{"code", e.code}, {"message", e.what()}}}, {"id", id}};
+            }
+        };
+        QVariant out;
+        int status = 200;
+        try {
+            const QVariant in = Json::parseUtf8(req.body, Json::ParseOption::AcceptAnyValue);
+            if (Compat::IsMetaType(in, QMetaType::QVariantList)) {
+                QVariantList results; // batch: always HTTP 200, errors are per-item
+                for (const auto & item : in.toList())
+                    results.push_back(callOne(item, nullptr));
+                out = results;
+            } else {
+                out = callOne(in, &status);
+            }
+        } catch (const Json::Error &e) {
+            status = 500;
+            out = QVariantMap{{"result", QVariant()}, {"error", QVariantMap{{"code", bitcoin::RPC_PARSE_ERROR}, {"message", e.what()}}},
+                              {"id", QVariant()}};
+        }
+        resp.status = status;
+        resp.statusText = status == 200 ? "OK" : status == 404 ? "Not Found" : status == 400 ? "Bad Request" : "Internal Server Error";
+        resp.data = Json::toUtf8(out, true);
+        resp.data += '\n';
+    }
+
+    /// Starts `node` listening on `addr`:`port` (port 0 picks a free port). The returned server runs in its own thread.
+    std::unique_ptr<SimpleHttpServer> startServer(MockNode &node, const QHostAddress &addr, quint16 port, int latencyMS, int jitterMS)
+    {
+        // bitcoind request bodies are small, except for sendrawtransaction which we don't support anyway
+        auto srv = std::make_unique<SimpleHttpServer>(addr, port, 4'000'000, 0 /* no time limit */);
+        srv->setKeepAlive(true);
+        srv->addEndpoint("*", [&node, latencyMS, jitterMS](SimpleHttpServer::Request &req) { serve(node, req, latencyMS, jitterMS); });
+        srv->tryStart();
+        return srv;
+    }
+
+    /// Reads a fixture of raw blocks: <size:4><block> records (size is little endian), in height order from genesis.
+    /// This is the same "dump" format the `replay` bench reads.
+    std::vector<QByteArray> readBlocks(const QString &path)
+    {
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly)) throw BadArgs(QString("Unable to open %1: %2").arg(path, f.errorString()));
+        std::vector<QByteArray> ret;
+        for (QByteArray sizeBytes; (sizeBytes = f.read(4)).size() == 4; ) {
+            const auto size = ReadLE32(reinterpret_cast<const uint8_t *>(sizeBytes.constData()));
+            if (ret.emplace_back(f.read(size)).size() != qsizetype(size))
+                throw BadArgs(QString("%1: truncated block %2").arg(path).arg(ret.size() - 1));
+        }
+        return ret;
+    }
+
+    /// Reads a fixture of raw txs, hex encoded, one per line.
+    std::vector<QByteArray> readTxs(const QString &path)
+    {
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly | QIODevice::Text)) throw BadArgs(QString("Unable to open %1: %2").arg(path, f.errorString()));
+        std::vector<QByteArray> ret;
+        for (const auto & line : f.readAll().split('\n'))
+            if (const auto hex = line.trimmed(); !hex.isEmpty())
+                if (ret.push_back(Util::ParseHexFast(hex)); ret.back().isEmpty())
+                    throw BadArgs(QString("%1: bad hex on line %2").arg(path).arg(ret.size()));
+        return ret;
+    }
+
+    /// Runs a mock bitcoind until DURATION elapses (or forever), for offline integration tests and reproducible
+    /// benchmarks of the block download, mempool, and DSProof pipelines. Point Fulcrum at it with
+    /// `bitcoind = <LISTEN>` (any rpcuser/rpcpassword). Environment variables:
+    ///   BLOCKS        - (required) fixture blocks, in the format the `replay` bench reads: <size:4><block> records
+    ///   MEMPOOL       - fixture mempool txs, hex, one per line (default: none)
+    ///   COIN          - BCH, BTC or LTC; selects the deserialization rules and what getnetworkinfo reports (default: BCH)
+    ///   CHAIN         - what getblockchaininfo reports for "chain" (default: regtest)
+    ///   LISTEN        - host:port to listen on (default: 127.0.0.1:18443)
+    ///   TIP           - height of the initial tip (default: the last fixture block)
+    ///   BLOCK_SECS    - reveal the next fixture block every this many seconds (default: 0, never)
+    ///   MEMPOOL_SIZE  - initial number of mempool txs (default: all of MEMPOOL)
+    ///   CHURN         - mempool txs to evict and add every second (default: 0)
+    ///   LATENCY_MS    - delay every response by this much (default: 0)
+    ///   JITTER_MS     - plus a random delay of up to this much (default: 0)
+    ///   ZMQ_PORT      - publish "hashblock" notifications on tcp://127.0.0.1:ZMQ_PORT (default: 0, disabled)
+    ///   DURATION      - seconds to run for (default: 0, forever)
+    void bench()
+    {
+        const auto env = [](const char *name, const QString &def = {}) {
+            const auto val = QString::fromLocal8Bit(std::getenv(name)).trimmed();
+            return val.isEmpty() ? def : val;
+        };
+        const auto envInt = [&env](const char *name, qlonglong def) {
+            bool ok = true;
+            const qlonglong ret = env(name).isEmpty() ? def : env(name).toLongLong(&ok);
+            if (!ok || ret < 0) throw BadArgs(QString("Env var %1 must be a non-negative integer").arg(name));
+            return ret;
+        };
+        const QString blocksFile = env("BLOCKS");
+        if (blocksFile.isEmpty()) throw BadArgs("Please set the BLOCKS env var to a fixture file of raw blocks");
+        const auto coin = BTC::coinFromName(env("COIN", "BCH").toUpper());
+        if (coin == BTC::Coin::Unknown) throw BadArgs(QString("Unknown COIN: %1").arg(env("COIN")));
+        const auto [host, port] = Util::ParseHostPortPair(env("LISTEN", "127.0.0.1:18443"));
+        const int latencyMS = int(envInt("LATENCY_MS", 0)), jitterMS = int(envInt("JITTER_MS", 0)),
+                  zmqPort = int(envInt("ZMQ_PORT", 0));
+        const qlonglong blockSecs = envInt("BLOCK_SECS", 0), churn = envInt("CHURN", 0), duration = envInt("DURATION", 0);
+#if !defined(ENABLE_ZMQ)
+        if (zmqPort) throw BadArgs("ZMQ_PORT was specified, but this build lacks ZMQ support");
+#endif
+
+        auto blocks = readBlocks(blocksFile);
+        auto poolTxs = env("MEMPOOL").isEmpty() ? std::vector<QByteArray>{} : readTxs(env("MEMPOOL"));
+        const size_t nPool = poolTxs.size();
+        MockNode node(coin, env("CHAIN", "regtest"), zmqPort, std::move(blocks), std::move(poolTxs),
+                      size_t(envInt("TIP", std::numeric_limits<qlonglong>::max())), size_t(envInt("MEMPOOL_SIZE", qlonglong(nPool))));
+        const auto srv = startServer(node, QHostAddress(host), port, latencyMS, jitterMS);
+        Log() << "Mock bitcoind listening on " << host << ":" << port << ", " << node.nBlocks() << " fixture blocks, tip: "
+              << node.height() << ", mempool: " << node.mempoolSize() << " txs (pool: " << nPool << "), latency: "
+              << latencyMS << "+" << jitterMS << " msec";
+
+#if defined(ENABLE_ZMQ)
+        zmq::context_t zctx;
+        std::optional<zmq::socket_t> zpub;
+        uint32_t zseq = 0;
+        if (zmqPort) {
+            zpub.emplace(zctx, zmq::socket_type::pub);
+            zpub->bind(QString("tcp://127.0.0.1:%1").arg(zmqPort).toStdString());
+        }
+#endif
+        QEventLoop loop;
+        QTimer mineTimer, churnTimer, statsTimer;
+        QObject::connect(&mineTimer, &QTimer::timeout, &loop, [&] {
+            const QString hash = node.mine();
+            if (hash.isEmpty()) {
+                Log() << "No more fixture blocks to reveal";
+                mineTimer.stop();
+                return;
+            }
+            Log() << "New tip: " << node.height() << " " << hash << ", mempool: " << node.mempoolSize() << " txs";
+#if defined(ENABLE_ZMQ)
+            if (zpub) {
+                const QByteArray topic = "hashblock", body = QByteArray::fromHex(hash.toLatin1());
+                std::array<char, 4> seq;
+                WriteLE32(reinterpret_cast<uint8_t *>(seq.data()), zseq++);
+                zpub->send(zmq::buffer(topic.constData(), size_t(topic.size())), zmq::send_flags::sndmore);
+                zpub->send(zmq::buffer(body.constData(), size_t(body.size())), zmq::send_flags::sndmore);
+                zpub->send(zmq::buffer(seq), zmq::send_flags::none);
+            }
+#endif
+        });
+        QObject::connect(&churnTimer, &QTimer::timeout, &loop, [&] {
+            const auto [evicted, added] = node.churn(size_t(churn));
+            DebugM("Mempool churn: ", evicted, " evicted, ", added, " added, size: ", node.mempoolSize());
+        });
+        const auto logStats = [&node] {
+            QStringList parts;
+            for (const auto & [method, n] : node.calls()) parts.push_back(QString("%1: %2").arg(method).arg(n));
+            Log() << "Calls so far: " << (parts.isEmpty() ? QString("none") : parts.join(", "));
+        };
+        QObject::connect(&statsTimer, &QTimer::timeout, &loop, logStats);
+        if (blockSecs) mineTimer.start(int(blockSecs * 1000));
+        if (churn) churnTimer.start(1000);
+        statsTimer.start(30'000);
+        if (duration) QTimer::singleShot(int(duration * 1000), &loop, &QEventLoop::quit);
+        loop.exec();
+        logStats(); // final tally
+        srv->stop();
+    }
+
+    const auto bench_ = App::registerBench("mockbitcoind", &bench);
+
+    void test()
+    {
+        // a tiny synthetic chain: genesis + 4 blocks, each with just a coinbase; plus 2 mempool txs spending coinbases
+        std::vector<QByteArray> blocks, poolTxs;
+        std::vector<bitcoin::CTransactionRef> coinbases;
+        bitcoin::uint256 prevHash;
+        for (int h = 0; h < 5; ++h) {
+            auto block = BTC::MakeTestBlock(prevHash, unsigned(h));
+            auto cb = BTC::MakeTestCoinbase(unsigned(h));
+            cb.vout.emplace_back(50 * bitcoin::COIN, bitcoin::CScript() << bitcoin::OP_TRUE);
+            block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(cb)));
+            coinbases.push_back(block.vtx.back());
+            prevHash = block.GetHash();
+            blocks.push_back(BTC::Serialize(block));
+        }
+        for (int i = 0; i < 2; ++i) {
+            bitcoin::CMutableTransaction mtx;
+            mtx.vin.emplace_back(bitcoin::COutPoint(coinbases[size_t(i)]->GetId(), 0));
+            mtx.vout.emplace_back(49 * bitcoin::COIN, bitcoin::CScript() << bitcoin::OP_TRUE);
+            poolTxs.push_back(BTC::Serialize(bitcoin::CTransaction(mtx)));
+        }
+        const QString tipHash = QString::fromStdString(prevHash.GetHex());
+        const QByteArray lastBlock = blocks.back();
+        MockNode node(BTC::Coin::BCH, "regtest", 0, std::move(blocks), std::move(poolTxs), 3, 100);
+        constexpr int kLatencyMS = 50;
+        const auto srv = startServer(node, QHostAddress::LocalHost, 0, kLatencyMS, 0);
+        const quint16 port = Util::LambdaOnObject<quint16>(srv.get(), [&srv]{ return srv->serverPort(); });
+
+        QTcpSocket sock;
+        sock.connectToHost(QHostAddress::LocalHost, port);
+        if (!sock.waitForConnected(5000)) throw Exception("Unable to connect to the mock bitcoind");
+        const auto post = [&sock](const QByteArray &json) {
+            sock.write("POST / HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/json\r\nContent-Length: "
+                       + QByteArray::number(json.size()) + "\r\n\r\n" + json);
+        };
+        const auto readResponse = [&sock]() -> std::pair<int, QVariant> {
+            const auto readLine = [&sock] {
+                while (!sock.canReadLine())
+                    if (!sock.waitForReadyRead(5000)) throw Exception("Timed out waiting for a response");
+                return sock.readLine().trimmed();
+            };
+            const int status = readLine().split(' ').value(1).toInt();
+            qint64 len = -1;
+            for (QByteArray line; !(line = readLine()).isEmpty(); )
+                if (line.toLower().startsWith("content-length:")) len = line.mid(15).trimmed().toLongLong();
+            if (len < 0) throw Exception("Response lacks a Content-Length");
+            while (sock.bytesAvailable() < len)
+                if (!sock.waitForReadyRead(5000)) throw Exception("Timed out waiting for a response body");
+            return {status, Json::parseUtf8(sock.read(len))};
+        };
+        const auto rpc = [&](const QString &method, const QVariantList &params = {}) {
+            post(Json::toUtf8(QVariantMap{{"method", method}, {"params", params}, {"id", 1}}, true));
+            return readResponse();
+        };
+        const auto expect = [](bool ok, const QString &what) { if (!ok) throw Exception(QString("Failed: %1").arg(what)); };
+
+        // requests are answered in order on 1 keep-alive connection, after the injected latency
+        const Tic t0;
+        auto [status, resp] = rpc("getblockchaininfo");
+        expect(t0.msec<int>() >= kLatencyMS, "latency injection");
+        expect(status == 200 && resp.toMap().value("error").isNull(), "getblockchaininfo succeeds");
+        expect(resp.toMap().value("result").toMap().value("blocks").toInt() == 3, "the initial tip is TIP");
+        std::tie(status, resp) = rpc("getblockhash", {4});
+        expect(status == 500 && resp.toMap().value("error").toMap().value("code").toInt() == bitcoin::RPC_INVALID_PARAMETER,
+               "blocks past the tip are hidden");
+        expect(node.mine() == tipHash && node.height() == 4, "mine() reveals the next block");
+        std::tie(status, resp) = rpc("getblockhash", {4});
+        expect(status == 200 && resp.toMap().value("result").toString() == tipHash, "getblockhash");
+        std::tie(status, resp) = rpc("getblock", {tipHash, false});
+        expect(Util::ParseHexFast(resp.toMap().value("result").toByteArray()) == lastBlock, "getblock");
+        std::tie(status, resp) = rpc("getrawmempool", {false});
+        expect(resp.toMap().value("result").toList().size() == 2, "getrawmempool");
+        const QString txid = resp.toMap().value("result").toList().front().toString();
+        std::tie(status, resp) = rpc("getrawtransaction", {txid, false});
+        expect(QString::fromStdString(BTC::Deserialize<bitcoin::CTransaction>(Util::ParseHexFast(resp.toMap().value("result").toByteArray()))
+                                      .GetId().GetHex()) == txid, "getrawtransaction (mempool)");
+        const QString cbTxid = QString::fromStdString(coinbases[1]->GetId().GetHex());
+        std::tie(status, resp) = rpc("getrawtransaction", {cbTxid, false});
+        expect(status == 200 && !resp.toMap().value("result").toString().isEmpty(), "getrawtransaction (confirmed)");
+        std::tie(status, resp) = rpc("nosuchmethod");
+        expect(status == 404 && resp.toMap().value("error").toMap().value("code").toInt() == bitcoin::RPC_METHOD_NOT_FOUND,
+               "unknown methods");
+        expect(node.churn(1) == std::make_pair(size_t(1), size_t(1)) && node.mempoolSize() == 2, "churn");
+
+        // pipelined: 2 requests sent back to back, and a batch
+        post(Json::toUtf8(QVariantMap{{"method", "uptime"}, {"params", QVariantList{}}, {"id", 2}}, true));
+        post(Json::toUtf8(QVariantList{QVariantMap{{"method", "getblockhash"}, {"params", QVariantList{0}}, {"id", 3}},
+                                       QVariantMap{{"method", "getblockhash"}, {"params", QVariantList{99}}, {"id", 4}}}, true));
+        std::tie(status, resp) = readResponse();
+        expect(status == 200 && resp.toMap().value("id").toInt() == 2, "pipelined request 1");
+        std::tie(status, resp) = readResponse();
+        const auto batch = resp.toList();
+        expect(status == 200 && batch.size() == 2 && batch[0].toMap().value("error").isNull()
+               && !batch[1].toMap().value("error").isNull(), "batch request");
+
+        srv->stop();
+        Log() << "MockBitcoinD: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("mockbitcoind", &test);
+
+} // namespace
+#endif
@@ -158,6 +158,8 @@ QVariantMap Options::toMap() const
     m["db_keep_log_file_num"] = qlonglong(db.keepLogFileNum);
     m["db_mem"] = double(db.maxMem / 1024.0 / 1024.0);
     m["db_use_fsync"] = db.useFsync;
+    m["db_stats"] = db.stats;
+    m["db_compression"] = db.compression;
     // ts-format
     m["ts-format"] = logTimestampModeString();
     // tls-disallow-deprecated
@@ -172,8 +174,24 @@ QVariantMap Options::toMap() const
     m["max_reorg"] = maxReorg;
     // txhash_cache
     m["txhash_cache"] = txHashCacheBytes / 1e6; // this comes in as a MB value from config, so spit it back out in the same MB unit
+    // txhash_index_bytes & txhash_filter
+    m["txhash_index_bytes"] = txHashIndexBytes;
+    m["txhash_filter"] = txHashFilter;
+    // history_cache
+    m["history_cache"] = historyCacheBytes / 1e6; // MB, same as above
+    // address_cache
+    m["address_cache"] = addressCacheBytes / 1e6; // MB, same as above
     // max_batch
     m["max_batch"] = maxBatch;
+    // lock_sample_rate
+    m["lock_sample_rate"] = lockSampleRate;
+    // log_queue
+    m["log_queue"] = logQueue;
+    // trace_slow_ms & trace_sample_rate
+    m["trace_slow_ms"] = traceSlowMS;
+    m["trace_sample_rate"] = traceSampleRate;
+    // allocator_purge_ms
+    m["allocator_purge_ms"] = allocatorPurgeMS;
     return m;
 }
 
@@ -202,6 +202,16 @@ public:
         /// db_use_fsync in conf file -- default false
         static constexpr bool defaultUseFsync = false;
         bool useFsync = defaultUseFsync;
+
+        /// db_compression in conf file -- default true. If true, the db tables whose data compresses well are stored
+        /// compressed (see Storage::startup).
+        static constexpr bool defaultCompression = true;
+        bool compression = defaultCompression;
+
+        /// db_stats in conf file -- default false. If true, rocksdb's internal statistics and our per-table I/O
+        /// counters are collected (see Storage::setDBStatsEnabled). May be toggled at runtime via FulcrumAdmin.
+        static constexpr bool defaultStats = false;
+        bool stats = defaultStats;
     };
     DBOpts db;
 
@@ -255,6 +265,33 @@ public:
     static constexpr bool isTxHashCacheBytesInRange(unsigned n) { return n >= txHashCacheBytesMin && n <= txHashCacheBytesMax; }
     unsigned txHashCacheBytes = defaultTxHashCacheBytes;
 
+    // config: txhash_index_bytes
+    /// How many bytes from the end of each txid are used as the key of the txhash2txnum index (TxHash2TxNumMgr in
+    /// Storage.cpp). With fewer than 32, each lookup must also read the full hash from the txnum2txhash file to rule
+    /// out collisions; with 32 (full hashes), lookups need no such verification read, at the cost of a larger index.
+    /// Changing this rebuilds the index on the next startup.
+    static constexpr unsigned defaultTxHashIndexBytes = 6, txHashIndexBytesMin = 6, txHashIndexBytesMax = 32;
+    unsigned txHashIndexBytes = defaultTxHashIndexBytes;
+
+    // config: txhash_filter
+    /// If true, an in-memory Bloom filter over all of the txhash2txnum index keys is kept, so that lookups of txids
+    /// that are not confirmed (mempool or unknown txs) skip the db entirely. Costs ~1.5 bytes of memory per tx.
+    static constexpr bool defaultTxHashFilter = false;
+    bool txHashFilter = defaultTxHashFilter;
+
+    // config: history_cache
+    /// The number of bytes we give the hot scripthash history cache (HotHistoryCache in Storage.cpp). 0 disables it.
+    static constexpr unsigned defaultHistoryCacheBytes = 64'000'000, ///< 64 MB default
+                              historyCacheBytesMax = 2'000'000'000; ///< 2GB max
+    unsigned historyCacheBytes = defaultHistoryCacheBytes;
+
+    // config: address_cache
+    /// The number of bytes we give the address string -> HashX cache used by the blockchain.address.* RPCs
+    /// (BTC::AddressHashXCache, owned by SrvMgr). 0 disables it.
+    static constexpr unsigned defaultAddressCacheBytes = 8'000'000, ///< 8 MB default
+                              addressCacheBytesMax = 1'000'000'000; ///< 1GB max
+    unsigned addressCacheBytes = defaultAddressCacheBytes;
+
     // CLI: --compact-dbs
     /// If specified, we compact all of the databases on startup
     bool compactDBs = false;
@@ -271,6 +308,32 @@ public:
     static constexpr bool isMaxBatchInRange(unsigned n) { return n >= maxBatchMin && n <= maxBatchMax; }
     unsigned maxBatch = defaultMaxBatch;
 
+    // config: lock_sample_rate
+    /// If nonzero, 1 in this many acquisitions of the app's hot locks (Storage, SubsMgr, and cache locks) are timed,
+    /// and the worst offenders are reported in /debug?locks (see LockStats.h). 0 (the default) disables sampling.
+    static constexpr unsigned defaultLockSampleRate = 0, lockSampleRateMax = 1'000'000;
+    unsigned lockSampleRate = defaultLockSampleRate;
+
+    // config: log_queue
+    /// The size, in lines, of the queue feeding the logger's writer thread. If 0, log lines are written synchronously
+    /// by the thread that logs them (this was the behavior in older versions). When the queue is full, normal and
+    /// debug lines are dropped (and counted) rather than blocking the logging thread.
+    static constexpr unsigned defaultLogQueue = 65'536, logQueueMax = 16'777'216;
+    unsigned logQueue = defaultLogQueue;
+
+    // config: trace_slow_ms & trace_sample_rate
+    /// Per-request tracing (see Tracing.h). Requests taking at least traceSlowMS msec are logged, along with a
+    /// breakdown of where the time went; 0 = off. A fraction traceSampleRate (0.0 - 1.0) of all requests are kept in
+    /// a ring buffer served by the stats server's /traces endpoint; 0 = off.
+    static constexpr double defaultTraceSlowMS = 0., defaultTraceSampleRate = 0.;
+    double traceSlowMS = defaultTraceSlowMS, traceSampleRate = defaultTraceSampleRate;
+
+    // config: allocator_purge_ms
+    /// Roughly how long freed memory may linger in the malloc implementation's caches before it is returned to the
+    /// OS (see Allocator::configure). 0 leaves the allocator's own defaults alone.
+    static constexpr unsigned defaultAllocatorPurgeMS = 10'000, allocatorPurgeMSMax = 3'600'000;
+    unsigned allocatorPurgeMS = defaultAllocatorPurgeMS;
+
     // CLI: --fast-sync (experimental)
     static constexpr size_t defaultUtxoCache = 0, minUtxoCache = 200ull * 1000ull * 1000ull; // 0 is off, otherwise 200 MB min
     size_t utxoCache = defaultUtxoCache;
@@ -17,6 +17,7 @@
 // <https://www.gnu.org/licenses/>.
 //
 #include "RPC.h"
+#include "Tracing.h"
 #include "WebSocket.h"
 #include <QtCore>
 
@@ -387,10 +388,15 @@ namespace RPC {
             // otherwise produce some Json right now and send it out to the client
             json = m.toJsonUtf8();
         }
+        if (tracedResponse) {
+            tracedResponse->serializedNS = Util::getTimeNS();
+            tracedResponse->responseBytes = json.size();
+        }
         TraceM("Sending json: ", Util::Ellipsify(json));
         ++nErrorsSent;
         // below send() ends up calling do_write immediately (which is connected to send)
         emit send( wrapForSend(std::move(json)) );
+        if (tracedResponse) tracedResponse->writtenNS = Util::getTimeNS();
         if (disc) {
             do_disconnect(true); // graceful disconnect
         }
@@ -420,10 +426,15 @@ namespace RPC {
             Error() << __func__ << ": Unable to generate result JSON! FIXME!";
             return;
         }
+        if (tracedResponse) {
+            tracedResponse->serializedNS = Util::getTimeNS();
+            tracedResponse->responseBytes = json.size();
+        }
         TraceM("Sending result json: ", Util::Ellipsify(json));
         ++nResultsSent;
         // below send() ends up calling do_write immediately (which is connected to send)
         emit send( wrapForSend(std::move(json)) );
+        if (tracedResponse) tracedResponse->writtenNS = Util::getTimeNS();
     }
 
     bool ConnectionBase::batchResponseFilter(BatchId batchId, const Message & msg)
@@ -453,6 +464,7 @@ namespace RPC {
             DebugM("ignoring ", json.length(), " byte incoming message from ", id);
             return;
         }
+        const qint64 recvTimeNS = Util::getTimeNS();
         Message::Id msgId;
         std::optional<ProcessObjectResult::Error> error;
         try {
@@ -464,12 +476,14 @@ namespace RPC {
 
             if (var.canConvert<QVariantMap>()) {
                 // handle immediate request
-                const auto res = processObject(var.toMap()); // may throw
+                auto res = processObject(var.toMap()); // may throw
                 var.clear(); // release unused memory immediately
                 msgId = res.parsedMsgId; // copy parsed message id so possible error-sending code below has it (if not null)
                 if (res.error) {
                     error = std::move(res.error);
                 } else if (res.message) {
+                    res.message->recvTimeNS = recvTimeNS;
+                    res.message->traceId = Tracing::newTraceId();
                     if (res.message->isError())
                         emit gotErrorMessage(id, *res.message);
                     else
@@ -482,7 +496,7 @@ namespace RPC {
                 }
             } else if (var.canConvert<QVariantList>()) {
                 // Note: This branch can only be taken if batchPermitted == true
-                enqueueNewBatch(var.toList()); // This may throw InvalidRequest (if list is empty), or BatchLimitExceeded
+                enqueueNewBatch(var.toList(), recvTimeNS); // This may throw InvalidRequest (if list is empty), or BatchLimitExceeded
                 return;
             } else {
                 // Note: This branch can only be taken if batchPermitted == true
@@ -523,14 +537,14 @@ namespace RPC {
         }
     }
 
-    void ConnectionBase::enqueueNewBatch(QVariantList && varList)
+    void ConnectionBase::enqueueNewBatch(QVariantList && varList, qint64 recvTimeNS)
     {
         // handle Batch request -- add it to the extant batches
         if (varList.empty())
             // empty batch lists are a JSON-RPC error
             throw InvalidRequest();
 
-        auto batch_exception_guard = std::make_unique<RPC::BatchProcessor>(*this, std::move(varList));
+        auto batch_exception_guard = std::make_unique<RPC::BatchProcessor>(*this, Batch{std::move(varList), recvTimeNS});
         auto *batch = batch_exception_guard.get();
         const BatchId batchId{batch->batchId()};
         if ( ! canAcceptBatch(batch) ) {
@@ -1219,6 +1233,8 @@ namespace RPC {
                     pushResponse(Message::makeError(res.error->code, (error=res.error->message)->left(120),
                                                     res.parsedMsgId, conn.isV1()));
                 } else if (res.message) {
+                    res.message->recvTimeNS = batch.recvTimeNS;
+                    res.message->traceId = Tracing::newTraceId();
                     const auto & m = *res.message;
                     if (m.isRequest()) {
                         // Ok, proceed to pass the message along to the `conn` instance. We will be notified in
@@ -37,6 +37,7 @@
 #include <utility> // for std::pair, std::move
 
 namespace WebSocket { class Wrapper; } ///< fwd decl
+namespace Tracing { struct Span; } ///< fwd decl
 
 namespace RPC {
 
@@ -116,6 +117,9 @@ namespace RPC {
                              object where we matched the id to a method we knew about in Connection::idMethodMap. */
         QVariantMap data; ///< parsed json. 'method', 'jsonrpc', 'id', 'error', 'result', and/or 'params' get put here
         bool v1 = false; ///< iff true, we parse/validate/generate based on JSON-RPC 1.0 rules, otherwise we enforce 2.0.
+        /// Util::getTimeNS() timestamp of when the JSON containing this message was received by processJson(), or 0
+        /// if not applicable. Used for the per-method latency metrics.
+        qint64 recvTimeNS = 0;
         // -- METHODS --
 
         /// may throw Exception. This factory method should be the way one of the 6 ways one constructs this object
@@ -355,6 +359,10 @@ namespace RPC {
         bool isBatchPermitted() const { return batchPermitted; }
         void setBatchPermitted(bool b) { batchPermitted = b; }
 
+        /// If not null, the next response sent by _sendResult() or _sendError() stamps its serialization and write
+        /// times into this span. Set by ServerBase around the emit of sendResult()/sendError() for traced requests.
+        Tracing::Span *tracedResponse = nullptr;
+
     signals:
         /// Call (emit) this to send a request to the peer. Note sending doesn't support batching.
         void sendRequest(const RPC::Message::Id & reqid, const QString &method, const QVariantList & params = {});
@@ -459,7 +467,7 @@ namespace RPC {
         // Precondition: Message must be either: isError() or isResponse() (this is not checked here for performance)
         [[nodiscard]] bool batchResponseFilter(RPC::BatchId batchId, const Message & msg);
         // Internally called to enqueue a new batch -- this may throw InvalidRequest if the QVariantList is empty
-        void enqueueNewBatch(QVariantList &&);
+        void enqueueNewBatch(QVariantList &&, qint64 recvTimeNS);
     };
 
     inline constexpr bool debugBatchExtra = false; ///< if true, Debug() log will print extra info for the batch processing feature
@@ -481,12 +489,17 @@ namespace RPC {
         /// Responses enqueued for sending back to the client, may also include error responses aside from results
         QVector<Message> responses;
 
+        /// Util::getTimeNS() timestamp of when the batch was received, propagated to each Message::recvTimeNS
+        qint64 recvTimeNS = 0;
+        /// Nonzero if this request is being traced (see Tracing.h). Assigned on receipt by processJson().
+        uint64_t traceId = 0;
+
         bool hasNext() const { return nextItem < items.size(); }
         QVariant getNextAndIncrement();
         bool isComplete() const { return !hasNext() && skippedCt + responses.size() >= items.size(); }
 
         Batch() = default;
-        Batch(QVariantList && items_) : items(std::move(items_)) {}
+        Batch(QVariantList && items_, qint64 recvTimeNS = 0) : items(std::move(items_)), recvTimeNS(recvTimeNS) {}
     };
 
     /// An individual batch request is managed by this object. Instances of this class are always children of
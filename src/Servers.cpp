@@ -18,6 +18,7 @@
 //
 #include "Servers.h"
 
+#include "Allocator.h"
 #include "App.h"
 #include "BitcoinD.h"
 #include "BTC.h"
@@ -30,10 +31,13 @@
 #include "Storage.h"
 #include "SubsMgr.h"
 #include "ThreadPool.h"
+#include "Tracing.h"
 #include "WebSocket.h"
 
 #include <QByteArray>
 #include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <QtNetwork>
@@ -182,14 +186,87 @@ void SimpleHttpServer::on_newConnection(QTcpSocket *sock)
     connect(sock, &QObject::destroyed, this, [sockName](QObject *){
         DebugM(sockName, " destroyed");
     });
-    connect(sock, &QAbstractSocket::readyRead, this, [sock,sockName,this] {
+    // Called once a complete request (header + body, if any) has been read. Dispatches to the endpoint and writes
+    // out the response. In keep-alive mode it also resets the per-request socket properties so that the next request
+    // on this connection can be parsed.
+    auto respond = [sock, this](const QString &loc, const QString &meth, const QString &ver, QByteArray &&body) {
+        Request req;
+        auto & response = req.response;
+        req.httpVersion = ver;
+        req.method = meth == "GET" ? Method::GET : Method::POST;
+        req.body = std::move(body);
+        auto vmap = sock->property("req-header").toMap();
+        for (auto it = vmap.begin(); it != vmap.end(); ++it)
+            // save header
+            req.header[it.key()] = it.value().toString();
+        if (auto i = loc.indexOf('?'); i > -1) {
+            req.queryString = loc.mid(i+1);
+            req.endPoint = loc.left(i);
+        } else
+            req.endPoint = loc;
+        if (auto it = endPoints.find(req.endPoint); it != endPoints.end() || (it=endPoints.find("*")) != endPoints.end()) {
+            it.value()(req); // call lambda
+        } else {
+            // could not find any enpoints that match, set up a 404 response
+            response.status = 404;
+            response.statusText = "Unknown resource";
+            response.data = err404Msg.toUtf8();
+        }
+        // setup header
+        QByteArray responseHeader;
+        {
+            QTextStream ss(&responseHeader, QIODevice::WriteOnly);
+#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
+            ss.setCodec("UTF-8");
+#else
+            ss.setEncoding(QStringConverter::Utf8);
+#endif
+            ss << "HTTP/1.1 " << response.status << " " << req.response.statusText.trimmed() << "\r\n";
+            ss << "Content-Type: " << response.contentType.trimmed() << "\r\n";
+            ss << "Content-Length: " << response.data.length() << "\r\n";
+            if (keepAlive)
+                ss << "Connection: keep-alive\r\n";
+            ss << response.headerExtra;
+            ss << "\r\n";
+        }
+        if (keepAlive) {
+            for (const char *prop : {"req-loc", "req-meth", "req-ver", "req-header", "req-body-len"})
+                sock->setProperty(prop, QVariant());
+        } else {
+            sock->setProperty("resp-len", qint64(responseHeader.length()) + response.data.length());
+        }
+        auto write = [sock, header = std::move(responseHeader), data = std::move(response.data)] {
+            // write out header
+            sock->write(header);
+            if (data.length())
+                // write out response data
+                sock->write(data);
+        };
+        if (response.delayMS > 0)
+            QTimer::singleShot(response.delayMS, sock, write);
+        else
+            write();
+    };
+    connect(sock, &QAbstractSocket::readyRead, this, [sock,sockName,respond,this] {
         try {
-            while(sock->canReadLine()) {
+            for (;;) {
+                if (const auto var = sock->property("req-body-len"); !var.isNull()) {
+                    // header was read, waiting for the body
+                    const qint64 bodyLen = var.toLongLong();
+                    if (sock->bytesAvailable() < bodyLen)
+                        break;
+                    respond(sock->property("req-loc").toString(), sock->property("req-meth").toString(),
+                            sock->property("req-ver").toString(), sock->read(bodyLen));
+                    if (!keepAlive) break;
+                    continue;
+                }
+                if (!sock->canReadLine())
+                    break;
                 auto line = QString(sock->readLine()).trimmed();
                 //DebugM(sockName, " Got line: ", line);
                 if (QString loc = sock->property("req-loc").toString(); loc.isEmpty()) {
                     auto toks = line.split(' ');
-                    if (toks.length() != 3 || (toks[0] != "GET" && toks[1] != "POST") || toks[2] != "HTTP/1.1")
+                    if (toks.length() != 3 || (toks[0] != "GET" && toks[0] != "POST") || toks[2] != "HTTP/1.1")
                         throw Exception(QString("Invalid request: %1").arg(line));
                     TraceM(sockName, " ", line);
                     sock->setProperty("req-loc", toks[1]);
@@ -199,50 +276,23 @@ void SimpleHttpServer::on_newConnection(QTcpSocket *sock)
                                 meth = sock->property("req-meth").toString(),
                                 ver = sock->property("req-ver").toString();
                             line.isEmpty() && !loc.isEmpty() && !meth.isEmpty() && !ver.isEmpty()) {
-                    // got line by itself, prepare response
-                    Request req;
-                    auto & response = req.response;
-                    req.httpVersion = ver;
-                    req.method = meth == "GET" ? Method::GET : Method::POST;
-                    auto vmap = sock->property("req-header").toMap();
-                    for (auto it = vmap.begin(); it != vmap.end(); ++it)
-                        // save header
-                        req.header[it.key()] = it.value().toString();
-                    if (auto i = loc.indexOf('?'); i > -1) {
-                        req.queryString = loc.mid(i+1);
-                        req.endPoint = loc.left(i);
-                    } else
-                        req.endPoint = loc;
-                    if (auto it = endPoints.find(req.endPoint); it != endPoints.end() || (it=endPoints.find("*")) != endPoints.end()) {
-                        it.value()(req); // call lambda
-                    } else {
-                        // could not find any enpoints that match, set up a 404 response
-                        response.status = 404;
-                        response.statusText = "Unknown resource";
-                        response.data = err404Msg.toUtf8();
+                    // got line by itself: end of header. If there is a body, read it first, otherwise respond now.
+                    qint64 bodyLen = 0;
+                    const auto vmap = sock->property("req-header").toMap();
+                    for (auto it = vmap.begin(); it != vmap.end(); ++it) {
+                        if (it.key().compare(QLatin1String("Content-Length"), Qt::CaseInsensitive) == 0) {
+                            bool ok;
+                            bodyLen = it.value().toString().trimmed().toLongLong(&ok);
+                            if (!ok || bodyLen < 0 || bodyLen > MAX_BUFFER)
+                                throw Exception(QString("Bad Content-Length: %1").arg(it.value().toString()));
+                        }
                     }
-                    // setup header
-                    QByteArray responseHeader;
-                    {
-                        QTextStream ss(&responseHeader, QIODevice::WriteOnly);
-#if QT_VERSION < QT_VERSION_CHECK(6, 0, 0)
-                        ss.setCodec("UTF-8");
-#else
-                        ss.setEncoding(QStringConverter::Utf8);
-#endif
-                        ss << "HTTP/1.1 " << response.status << " " << req.response.statusText.trimmed() << "\r\n";
-                        ss << "Content-Type: " << response.contentType.trimmed() << "\r\n";
-                        ss << "Content-Length: " << response.data.length() << "\r\n";
-                        ss << response.headerExtra;
-                        ss << "\r\n";
+                    if (bodyLen > 0) {
+                        sock->setProperty("req-body-len", bodyLen);
+                        continue;
                     }
-                    const qint64 respTotalLen = responseHeader.length() + response.data.length();
-                    sock->setProperty("resp-len", respTotalLen);
-                    // write out header
-                    sock->write(responseHeader);
-                    if (response.data.length())
-                        // write out response data
-                        sock->write(response.data);
+                    respond(loc, meth, ver, {});
+                    if (!keepAlive) break;
                 } else {
                     // save params
                     auto vmap = sock->property("req-header").toMap();
@@ -687,6 +737,25 @@ void ServerBase::onMessage(IdMixin::Id clientId, RPC::BatchId batchId, const RPC
         else {
             // indicate a good request, accepted request
             ++c->info.nRequestsRcv;
+            const qint64 tDispatch = Util::getTimeNS();
+            const qint64 tRecv = m.recvTimeNS ? m.recvTimeNS : tDispatch;
+            curReqTiming = {methodMetrics(m.method), tRecv, false, Tracing::begin(m.traceId, m.method, c->id, tRecv)};
+            Tracing::Span * const span = curReqTiming.span.get();
+            if (span) {
+                span->dispatchNS = tDispatch;
+                c->tracedResponse = span; // in case the handler responds synchronously
+            }
+            Tracing::CurrentScope traceDbReads(span);
+            Defer timingGuard([this, c, span, tDispatch] {
+                // handlers that didn't go async have already sent their response (or error) by now
+                if (!curReqTiming.async) {
+                    curReqTiming.metrics.exec->observeSince(tDispatch);
+                    curReqTiming.metrics.request->observeSince(curReqTiming.recvTimeNS);
+                    Tracing::finish(curReqTiming.span);
+                }
+                if (span) c->tracedResponse = nullptr;
+                curReqTiming = {};
+            });
             try {
                 // call ptr to member -- note member is free to throw if it wants to send an error immediately
                 (this->*member)(c, batchId, m);
@@ -746,6 +815,19 @@ namespace {
             emit c->sendError(false, RPC::Code_InternalError, QString("internal error: %1").arg(what), batchId, id);
         };
     }
+    /// For traced requests: stamps the response stage of the span, and points the client at the span while the
+    /// response is being sent so that the serialization and write times get recorded too.
+    struct TracedResponse {
+        Client * const c;
+        Tracing::Span * const span;
+        TracedResponse(Client *c, const Tracing::SpanPtr &sp) : c(c), span(sp.get()) {
+            if (!span) return;
+            span->respondNS = Util::getTimeNS();
+            if (!span->execDoneNS) span->execDoneNS = span->respondNS; // bitcoind requests: the reply just arrived
+            c->tracedResponse = span;
+        }
+        ~TracedResponse() { if (span) c->tracedResponse = nullptr; }
+    };
     BitcoinDMgr::FailF defaultBDFailFunc(Client *c, RPC::BatchId batchId, const RPC::Message::Id &id) {
         return [c, batchId, id](const RPC::Message::Id &, const QString &what) {
             c->bdReqCtr -= std::min(c->bdReqCtr, 1LL); // decrease throttle counter (per-client, owned by this thread)
@@ -758,6 +840,24 @@ namespace {
 ServerBase::RPCError::~RPCError() {}
 ServerBase::RPCErrorWithDisconnect::~RPCErrorWithDisconnect() {}
 
+auto ServerBase::methodMetrics(const QString &method) -> MethodMetrics
+{
+    if (auto it = methodMetricsCache.constFind(method); it != methodMetricsCache.cend())
+        return it.value();
+    MethodMetrics ret;
+    ret.request = &Metrics::histogram("fulcrum_rpc_request_seconds",
+                                      "Electrum RPC latency, from receipt of the request until its response is written",
+                                      "method", method);
+    ret.queueWait = &Metrics::histogram("fulcrum_rpc_queue_wait_seconds",
+                                        "Time Electrum RPC requests spent queued for a thread pool worker",
+                                        "method", method);
+    ret.exec = &Metrics::histogram("fulcrum_rpc_exec_seconds",
+                                   "Electrum RPC execution time, in the server thread, in a worker thread, or waiting"
+                                   " for bitcoind", "method", method);
+    methodMetricsCache.insert(method, ret);
+    return ret;
+}
+
 void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Message::Id &reqId,
                                   const std::function<QVariant ()> &work, int priority)
 {
@@ -770,11 +870,24 @@ void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Me
         };
 
         auto reserr = std::make_shared<ResErr>(); ///< shared with lambda for both work and completion. this is how they communicate.
+        // If called from within onMessage(), we take over timing of the request from there. Histograms are thread-safe.
+        const auto timing = takeRequestTiming();
+        const qint64 tSubmit = Util::getTimeNS();
+        if (timing.span) timing.span->enqueueNS = tSubmit;
 
         (asyncThreadPool ? asyncThreadPool : ::AppThreadPool())->submitWork(
             c, // <--- all work done in client context, so if client is deleted, completion not called
-            // runs in worker thread, must not access anything other than reserr and work
-            [reserr,work]{
+            // runs in worker thread, must not access anything other than reserr, work, and the timing histograms & span
+            [reserr, work, metrics = timing.metrics, span = timing.span, tSubmit]{
+                const qint64 tStart = metrics.queueWait ? metrics.queueWait->observeSince(tSubmit) : 0;
+                Defer recordExec([&]{
+                    if (metrics.exec) {
+                        const qint64 tDone = metrics.exec->observeSince(tStart);
+                        if (span) span->execDoneNS = tDone;
+                    }
+                });
+                if (span) span->startNS = tStart;
+                Tracing::CurrentScope traceDbReads(span.get());
                 try {
                     QVariant result = work();
                     reserr->results.swap( result ); // constant-time copy
@@ -786,7 +899,13 @@ void ServerBase::generic_do_async(Client *c, RPC::BatchId batchId, const RPC::Me
                 }
             },
             // completion: runs in client thread (only called if client not already deleted)
-            [c, batchId, reqId, reserr] {
+            [c, batchId, reqId, reserr, timing] {
+                // the response is written to the client socket synchronously by the emits below
+                Defer recordRequest([&timing]{
+                    if (timing.recvTimeNS) timing.metrics.request->observeSince(timing.recvTimeNS);
+                    Tracing::finish(timing.span);
+                });
+                TracedResponse traced(c, timing.span);
                 if (reserr->error) {
                     emit c->sendError(reserr->doDisconnect, reserr->errCode, reserr->errMsg, batchId, reqId);
                     return;
@@ -841,11 +960,23 @@ void ServerBase::generic_async_to_bitcoind(Client *c, const RPC::BatchId batchId
         }
     }
     // /Throttling support
+    // If called from within onMessage(), we take over timing of the request from there.
+    const auto timing = takeRequestTiming();
+    const qint64 tSubmit = Util::getTimeNS();
+    if (timing.span) timing.span->enqueueNS = tSubmit;
+    const auto recordTiming = [timing, tSubmit] {
+        if (!timing.recvTimeNS) return;
+        timing.metrics.exec->observeSince(tSubmit);
+        timing.metrics.request->observeSince(timing.recvTimeNS);
+        Tracing::finish(timing.span);
+    };
     bitcoindmgr->submitRequest(c, newId(), method, params,
         // success
-        [c, batchId, reqId, successFunc](const RPC::Message & reply) {
+        [c, batchId, reqId, successFunc, recordTiming, timing](const RPC::Message & reply) {
             c->bdReqCtr -= std::min(c->bdReqCtr, 1LL); // decrease throttle counter
             --c->perIPData->bdReqCtr; // decrease bitcoind request counter (per-IP, owned by multiple threads)
+            Defer recordOnScopeEnd(recordTiming);
+            TracedResponse traced(c, timing.span);
             try {
                 const QVariant result = successFunc ? successFunc(reply) : reply.result(); // if no successFunc specified, use default which just copies the result to the client.
                 emit c->sendResult(batchId, reqId, result);
@@ -856,9 +987,11 @@ void ServerBase::generic_async_to_bitcoind(Client *c, const RPC::BatchId batchId
             }
         },
         // error
-        [c, batchId, reqId, errorFunc](const RPC::Message & errorReply) {
+        [c, batchId, reqId, errorFunc, recordTiming, timing](const RPC::Message & errorReply) {
             c->bdReqCtr -= std::min(c->bdReqCtr, 1LL); // decrease throttle counter
             --c->perIPData->bdReqCtr; // decrease bitcoind request counter (per-IP, owned by multiple threads)
+            Defer recordOnScopeEnd(recordTiming);
+            TracedResponse traced(c, timing.span);
             try {
                 if (errorFunc)
                     errorFunc(errorReply); // this should throw RPCError
@@ -1403,10 +1536,9 @@ HashX Server::parseFirstAddrParamToShCommon(const RPC::Message &m, QString *addr
     const QVariantList l(m.paramsList());
     assert(!l.isEmpty());
     const QString addrStr = l.front().toString().left(kAddrLenLimit).trimmed();
-    const BTC::Address address(addrStr);
-    if (!address.isValid() || !address.isCompatibleWithNet(net))
+    const HashX sh = srvmgr->addressToHashX(addrStr); // cached
+    if (sh.isEmpty())
         throw RPCError(QString("Invalid address: %1").arg(addrStr));
-    const auto sh = address.toHashX();
     if (UNLIKELY(sh.length() != HashLen))
         throw RPCError("Invalid scripthash", RPC::ErrorCodes::Code_InternalError); // this should never happen but we must be defensive here.
     if (addrStrOut) *addrStrOut = addrStr;
@@ -2541,6 +2673,8 @@ void AdminServer::rpc_getinfo(Client *c, const RPC::BatchId batchId, const RPC::
         };
     }
 
+    res["allocator"] = Allocator::stats();
+
     { // jemalloc stats (if any), concise version
         const auto je = App::jemallocStats();
         res["jemalloc"] = je.isEmpty()
@@ -2674,6 +2808,68 @@ void AdminServer::rpc_simdjson(Client *c, const RPC::BatchId batchId, const RPC:
         emit c->sendResult(batchId, m.id, Options::setSimdJson(arg.toBool()));
     }
 }
+// write a heap profile (or the allocator's closest equivalent) to the datadir, or to the path prefix specified
+void AdminServer::rpc_heapprofile(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
+{
+    const auto l = m.paramsList();
+    QString prefix = l.isEmpty() ? QString() : l.front().toString().trimmed();
+    if (prefix.isEmpty())
+        prefix = options->datadir + QDir::separator()
+                 + "heap_" + QDateTime::currentDateTime().toString("yyyyMMdd_hhmmss");
+    generic_do_async(c, batchId, m.id, [prefix] {
+        try {
+            const QString path = Allocator::dumpHeapProfile(prefix);
+            Log() << "Heap profile written to " << path;
+            return QVariant(QVariantMap{ { "allocator", Allocator::name() }, { "path", path } });
+        } catch (const Exception &e) {
+            throw RPCError(e.what());
+        }
+    });
+}
+// list the (confirmed) holders of a CashToken category, from the token_unspent index
+void AdminServer::rpc_tokenholders(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
+{
+    if (isNonBCH())
+        throw RPCError("tokenholders is only available on BCH", RPC::ErrorCodes::Code_MethodNotFound);
+    const auto l = m.paramsList();
+    const QString catHex = l.front().toString().trimmed();
+    if (validateHashHex(catHex).isEmpty())
+        throw RPCError("Invalid token category");
+    bitcoin::token::Id category;
+    category.SetHex(catHex.toStdString()); // category hex is byte-reversed, like a txid
+    generic_do_async(c, batchId, m.id, [this, category] {
+        Storage::TokenHolders holders;
+        try {
+            holders = storage->getTokenHolders(category);
+        } catch (const HistoryTooLarge &e) {
+            throw RPCError(e.what());
+        }
+        QVariantList ret;
+        ret.reserve(int(holders.size()));
+        for (const auto & h : holders)
+            ret.push_back(QVariantMap{
+                { "scripthash", QString(Util::ToHexFast(h.hashX)) },
+                { "utxos", h.nUtxos },
+                { "nfts", h.nNFTs },
+                { "amount", QString::number(qlonglong(h.fungibleAmount)) }, // string, like the "amount" in token_data
+            });
+        return QVariant(ret);
+    });
+}
+// query or set rocksdb statistics collection at runtime
+void AdminServer::rpc_dbstats(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
+{
+    const auto l = m.paramsList();
+    if (!l.isEmpty()) {
+        // set
+        const QVariant arg = l.front();
+        if (Compat::GetVarType(arg) != QMetaType::Bool)
+            throw RPCError("Invalid argument, please specify a boolean value to enable/disable db statistics");
+        storage->setDBStatsEnabled(arg.toBool());
+        Log() << "DB statistics collection " << (arg.toBool() ? "enabled" : "disabled") << " by admin RPC";
+    }
+    emit c->sendResult(batchId, m.id, storage->isDBStatsEnabled());
+}
 void AdminServer::rpc_unban(Client *c, const RPC::BatchId batchId, const RPC::Message &m)
 {
     kickBanBoilerPlate(m, BanOp::Unban);
@@ -2710,7 +2906,9 @@ HEY_COMPILER_PUT_STATIC_HERE(AdminServer::StaticData::registry){
     { {"banpeer",                           true,               false,    PR{1,UNLIMITED},         {} },          MP(rpc_banpeer) },
     { {"bitcoind_throttle",                 true,               false,    PR{0,3},                 {} },          MP(rpc_bitcoind_throttle) },
     { {"clients",                           true,               false,    PR{0,0},                 {} },          MP(rpc_clients) },
+    { {"dbstats",                           true,               false,    PR{0,1},                 {} },          MP(rpc_dbstats) },
     { {"getinfo",                           true,               false,    PR{0,0},                 {} },          MP(rpc_getinfo) },
+    { {"heapprofile",                       true,               false,    PR{0,1},                 {} },          MP(rpc_heapprofile) },
     { {"kick",                              true,               false,    PR{1,UNLIMITED},         {} },          MP(rpc_kick) },
     { {"listbanned",                        true,               false,    PR{0,0},                 {} },          MP(rpc_listbanned) },
     { {"loglevel",                          true,               false,    PR{1,1},                 {} },          MP(rpc_loglevel) },
@@ -2720,6 +2918,7 @@ HEY_COMPILER_PUT_STATIC_HERE(AdminServer::StaticData::registry){
     { {"shutdown",                          true,               false,    PR{0,0},                 {} },          MP(rpc_shutdown) },
     { {"simdjson",                          true,               false,    PR{0,1},                 {} },          MP(rpc_simdjson) },
     { {"stop",                              true,               false,    PR{0,0},                 {} },          MP(rpc_shutdown) }, // alias for 'shutdown'
+    { {"tokenholders",                      true,               false,    PR{1,1},                 {} },          MP(rpc_tokenholders) },
     { {"unban",                             true,               false,    PR{1,UNLIMITED},         {} },          MP(rpc_unban) },
     { {"unbanpeer",                         true,               false,    PR{1,UNLIMITED},         {} },          MP(rpc_unbanpeer) },
 };
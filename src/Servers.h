@@ -19,9 +19,11 @@
 #pragma once
 
 #include "Common.h"
+#include "Metrics.h"
 #include "Mixins.h"
 #include "Options.h"
 #include "PeerMgr.h"
+#include "Tracing.h"
 #include "RollingBloomFilter.h"
 #include "RPC.h"
 #include "Util.h"
@@ -106,6 +108,7 @@ public:
         QHash<QString, QString> header; // headers that came in
         QString endPoint; // eg /stats
         QString queryString; // eg everything after the ? bla=1&foo=bar
+        QByteArray body; // the request body, if the request had a Content-Length (e.g. for POST)
 
         struct Response {
             int status = 200;
@@ -113,6 +116,7 @@ public:
             QByteArray contentType = "text/plain; charset=utf-8";
             QByteArray headerExtra = "Cache-Control: no-cache\r\n"; // make sure each line ends with \r\n, if you put response headers
             QByteArray data; ///< set this in your lambda
+            int delayMS = 0; ///< if > 0, the response is written out after this many msec (used to simulate a slow peer)
         };
         Response response;
     };
@@ -123,10 +127,17 @@ public:
                      const Lambda &callback);
     void set404Message(const QString &msg) { err404Msg = msg; }
 
+    /// If true, connections are kept open after a response is written, so that the peer may send further requests
+    /// on the same connection (HTTP/1.1 persistent connections). Default false: we disconnect after each response.
+    /// Note that with keep-alive and non-zero Response::delayMS, responses may be written out of order.
+    /// Call this before tryStart().
+    void setKeepAlive(bool b) { keepAlive = b; }
+
 protected:
     void on_newConnection(QTcpSocket *) override;
 
     QString err404Msg = "Unknown resource";
+    bool keepAlive = false;
     QHash<QString, Lambda> endPoints;
 };
 
@@ -288,6 +299,21 @@ protected:
     /// threadpool. Otherwise the app-global ::AppThreadPool()  will be used for generic_do_async().
     ThreadPool *asyncThreadPool = nullptr;
 
+    /// Per-method latency histograms (see Metrics.h). The pointed-to objects live for the lifetime of the process.
+    struct MethodMetrics {
+        Metrics::Histogram *request{}, *queueWait{}, *exec{};
+    };
+    /// Timing information for the request currently being dispatched by onMessage(). If the request handler calls
+    /// generic_do_async() or generic_async_to_bitcoind(), those functions take over the job of recording the request's
+    /// latency (via takeRequestTiming()), since the response is sent later from a completion callback.
+    struct RequestTiming {
+        MethodMetrics metrics;
+        qint64 recvTimeNS = 0; ///< 0 if not currently dispatching a request
+        bool async = false;
+        Tracing::SpanPtr span; ///< non-null if this request is being traced (see Tracing.h)
+    };
+    RequestTiming takeRequestTiming() { curReqTiming.async = true; return curReqTiming; }
+
     /// pointer to the shared Options object -- app-wide configuration settings. Owned and controlled by the App instance.
     const std::shared_ptr<const Options> options;
     /// pointer to shared Storage object -- owned and controlled by the Controller instance
@@ -297,6 +323,12 @@ protected:
 
     PeerInfoList peers;
 
+private:
+    RequestTiming curReqTiming;
+    QHash<QString, MethodMetrics> methodMetricsCache; ///< so that we don't hit the app-wide Metrics registry each time
+    MethodMetrics methodMetrics(const QString &method);
+
+protected:
     /// Default false. If true, derived classes should instead create WebSocket::Wrapper instances of the underlying
     /// QTcpSocket or QSslSocket.  See getter/setter: usesWebSockets and setUsesWebSockets.  Decided by the
     /// "ws" & "wss" config file options and/or the --ws/--wss (-w/-W) CLI args.
@@ -537,7 +569,9 @@ private:
     void rpc_banpeer(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_bitcoind_throttle(Client *, RPC::BatchId, const RPC::Message &); // getter / setter in 1 method
     void rpc_clients(Client *, RPC::BatchId, const RPC::Message &);
+    void rpc_dbstats(Client *, RPC::BatchId, const RPC::Message &); // getter / setter in 1 method
     void rpc_getinfo(Client *, RPC::BatchId, const RPC::Message &);
+    void rpc_heapprofile(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_kick(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_listbanned(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_loglevel(Client *, RPC::BatchId, const RPC::Message &);
@@ -546,6 +580,7 @@ private:
     void rpc_rmpeer(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_simdjson(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_shutdown(Client *, RPC::BatchId, const RPC::Message &);
+    void rpc_tokenholders(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_unban(Client *, RPC::BatchId, const RPC::Message &);
     void rpc_unbanpeer(Client *, RPC::BatchId, const RPC::Message &);
 
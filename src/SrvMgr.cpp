@@ -20,6 +20,7 @@
 
 #include "App.h"
 #include "BitcoinD.h"
+#include "BTC_Address.h"
 #include "Compat.h"
 #include "PeerMgr.h"
 #include "ServerMisc.h"
@@ -46,6 +47,8 @@ SrvMgr::SrvMgr(const std::shared_ptr<const Options> & options,
       perIPData(this, tableSqueezeThreshold /* initialCapacity */, tableSqueezeThreshold)
 {
     addrIdMap.reserve(tableSqueezeThreshold); // initial capacity
+    if (options->addressCacheBytes)
+        addressCache = std::make_unique<BTC::AddressHashXCache>(options->addressCacheBytes);
     perIPData.setObjectName("PerIPData");
     connect(this, &SrvMgr::banIP, this, &SrvMgr::on_banIP);
     connect(this, &SrvMgr::banID, this, &SrvMgr::on_banID);
@@ -97,6 +100,16 @@ namespace {
     }
 }
 
+HashX SrvMgr::addressToHashX(const QString &legacyOrCashAddress) const
+{
+    if (addressCache)
+        return addressCache->get(legacyOrCashAddress, _net);
+    const BTC::Address address(legacyOrCashAddress);
+    if (!address.isValid() || !address.isCompatibleWithNet(_net))
+        return {};
+    return address.toHashX();
+}
+
 // throw Exception on error
 void SrvMgr::startServers()
 {
@@ -415,6 +428,7 @@ auto SrvMgr::stats() const -> Stats
     m["PeerMgr"] = peermgr ? peermgr->statsSafe(kDefaultTimeout/2) : QVariant();
     m["transactions sent"] = qulonglong(numTxBroadcasts.load());
     m["transactions sent (bytes)"] = qulonglong(txBroadcastBytesTotal.load());
+    m["address cache"] = addressCache ? addressCache->stats() : QVariant();
     m["number of clients"] = qulonglong(Client::numClients.load());
     m["number of clients (max lifetime)"] = qulonglong(Client::numClientsMax.load());
     m["number of clients (total lifetime connections)"] = qulonglong(Client::numClientsCtr.load());
@@ -30,6 +30,7 @@
 #include <memory>
 #include <mutex>
 
+namespace BTC { class AddressHashXCache; }
 class BitcoinDMgr;
 class PeerMgr;
 class SSLCertMonitor;
@@ -59,6 +60,10 @@ public:
     /// (Used by the blockchain.address.* RPC methods to figure out which addresses to accept and which to reject.)
     BTC::Net net() const noexcept { return _net; }
 
+    /// Thread-safe. Returns the HashX for an address string, or an empty HashX if it is not a valid address for net().
+    /// Lookups go through a memory-bounded cache (see the `address_cache` config option), if enabled.
+    HashX addressToHashX(const QString &legacyOrCashAddress) const;
+
     /// Must be called in this object's thread -- does a blocking call to all the Server instances that are started
     /// (timeout_ms, specify timeout_ms <= 0 to block forever), and prepares the QVariantList RPC response appropriate
     /// to send back to the FulcrumAdmin script.  May throw Utils::TimeoutException, or Util::ThreadNotRunning if called
@@ -182,6 +187,7 @@ private:
 
     std::atomic_size_t numTxBroadcasts = 0, txBroadcastBytesTotal = 0;
     BTC::Net _net = BTC::Invalid; ///< gets set in startServers by querying storage.
+    std::unique_ptr<BTC::AddressHashXCache> addressCache; ///< will be nullptr if options->addressCacheBytes is 0
 
     // -- the below is shared with other threads and guarded by banMut.
     struct BanInfo {
@@ -17,16 +17,20 @@
 // <https://www.gnu.org/licenses/>.
 //
 #include "App.h"
+#include "BlockedBloomFilter.h"
 #include "BTC.h"
 #include "ByteView.h"
 #include "CostCache.h"
 #include "CoTask.h"
+#include "EliasFano.h"
 #include "Mempool.h"
 #include "Merkle.h"
+#include "Metrics.h"
 #include "RecordFile.h"
 #include "Span.h"
 #include "Storage.h"
 #include "SubsMgr.h"
+#include "Tracing.h"
 #include "VarInt.h"
 
 #include "bitcoin/hash.h"
@@ -34,11 +38,17 @@
 #include "robin_hood/robin_hood.h"
 
 #include <rocksdb/cache.h>
+#include <rocksdb/convenience.h>
 #include <rocksdb/db.h>
+#include <rocksdb/filter_policy.h>
 #include <rocksdb/iterator.h>
 #include <rocksdb/merge_operator.h>
 #include <rocksdb/options.h>
+#include <rocksdb/perf_context.h>
+#include <rocksdb/perf_level.h>
 #include <rocksdb/slice.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/statistics.h>
 #include <rocksdb/table.h>
 #include <rocksdb/version.h>
 #include <rocksdb/write_buffer_manager.h>
@@ -46,9 +56,11 @@
 #include <QByteArray>
 #include <QDir>
 #include <QFileInfo>
+#include <QSysInfo>
 #include <QVector> // we use this for the Height2Hash cache to save on memcopies since it's implicitly shared.
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstddef> // for std::byte, offsetof
@@ -58,6 +70,8 @@
 #include <limits>
 #include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
 #include <shared_mutex>
@@ -79,9 +93,11 @@ HistoryTooLarge::~HistoryTooLarge() {} // weak vtable warning suppression
 namespace {
     /// Encapsulates the 'meta' db table
     struct Meta {
-        static constexpr uint32_t kCurrentVersion = 0x2u;
+        static constexpr uint32_t kCurrentVersion = 0x4u;
         static constexpr uint32_t kMinSupportedVersion = 0x1u;
         static constexpr uint32_t kMinBCHUpgrade9Version = 0x2u;
+        static constexpr uint32_t kMinDeltaHistoryVersion = 0x3u; ///< scripthash_history uses the DeltaHist encoding
+        static constexpr uint32_t kMinTokenIndexVersion = 0x4u; ///< the token_unspent index is populated
 
         uint32_t magic = 0xf33db33fu, version = kCurrentVersion;
         QString chain; ///< "test", "main", etc
@@ -100,7 +116,8 @@ namespace {
 
     // some database keys we use -- todo: if this grows large, move it elsewhere
     static const bool falseMem = false, trueMem = true;
-    static const rocksdb::Slice kMeta{"meta"}, kDirty{"dirty"}, kUtxoCount{"utxo_count"},
+    static const rocksdb::Slice kMeta{"meta"}, kDirty{"dirty"}, kUtxoCount{"utxo_count"}, kTableFilters{"table_filters"},
+                                kHistoryUpgradeProgress{"shist_upgrade_progress"},
                                 kTrue(reinterpret_cast<const char *>(&trueMem), sizeof(trueMem)),
                                 kFalse(reinterpret_cast<const char *>(&falseMem), sizeof(falseMem));
 
@@ -200,12 +217,18 @@ namespace {
     template <> TXOInfo Deserialize(const QByteArray &, bool *);
     QByteArray Serialize(const bitcoin::Amount &, const bitcoin::token::OutputData *);
     template <> SHUnspentValue Deserialize(const QByteArray &, bool *);
+    /// Cheap check to see if a serialized SHUnspentValue has token data, without deserializing it. (Token data, if
+    /// any, follows the 8-byte amount).
+    inline bool SHUnspentValueHasTokenData(const rocksdb::Slice &serialized) { return serialized.size() > sizeof(int64_t); }
     // TxNumVec
     using TxNumVec = std::vector<TxNum>;
-    // this serializes a vector of TxNums to a compact representation (6 bytes, eg 48 bits per TxNum), in little endian byte order
+    // this serializes a strictly ascending vector of TxNums to the delta + VarInt encoding (see DeltaHist below)
     template <> QByteArray Serialize(const TxNumVec &);
-    // this deserializes a vector of TxNums from a compact representation (6 bytes, eg 48 bits per TxNum), assuming little endian byte order
+    // this deserializes a vector of TxNums from the delta + VarInt encoding (see DeltaHist below)
     template <> TxNumVec Deserialize(const QByteArray &, bool *);
+    // this deserializes a vector of TxNums from the format used by db versions < 3 (6 bytes, eg 48 bits per TxNum),
+    // assuming little endian byte order
+    TxNumVec DeserializeLegacyTxNumVec(const QByteArray &, bool *ok);
 
     // CompactTXO -- not currently used since we prefer toBytes() directly (TODO: remove if we end up never using this)
     //template <> QByteArray Serialize(const CompactTXO &);
@@ -228,6 +251,9 @@ namespace {
         } else if constexpr (std::is_same_v<ByteView, Thing>) {
             // ByteView conversion, return reference to data in ByteView
             return rocksdb::Slice(thing.charData(), thing.size());
+        } else if constexpr (std::is_same_v<Hash256, Thing>) {
+            // Hash256 conversion, return reference to data in Hash256
+            return rocksdb::Slice(reinterpret_cast<const char *>(thing.data()), thing.size());
         } else if constexpr (!safeScalar && std::is_scalar_v<Thing> && !std::is_pointer_v<Thing>) {
             return rocksdb::Slice(reinterpret_cast<const char *>(&thing), sizeof(thing)); // returned slice points to raw scalar memory itself
         } else {
@@ -241,8 +267,58 @@ namespace {
         }
     };
 
+    /// A non-owning reference to one of our tables. Each table lives in its own column family of the single
+    /// rocksdb::DB instance in the datadir (see the comment at the end of Storage.h).  This is cheap to copy.
+    struct DBTable {
+        rocksdb::DB *db = nullptr;
+        rocksdb::ColumnFamilyHandle *cf = nullptr;
+        /// Per-table I/O counters for our hot queries, gathered from rocksdb's PerfContext while db statistics are
+        /// enabled (see TableIOScope below). Owned by Storage::Pvt. May be null.
+        struct IOStats {
+            std::atomic<uint64_t> queries{0}, blockReads{0}, blockReadBytes{0}, blockCacheHits{0},
+                                  bloomChecked{0}, bloomUseful{0}, keysSkipped{0};
+        } *io = nullptr;
+        explicit operator bool() const { return db && cf; }
+    };
+
+    /// Set from Storage::setDBStatsEnabled(). If true, rocksdb's Statistics are on, and so are the per-table counters.
+    std::atomic_bool dbStatsEnabled{false};
+
+    /// While in scope, attributes the rocksdb I/O done by this thread to table `t`'s IOStats, if db stats are enabled.
+    /// Uses the thread-local rocksdb::PerfContext at the (cheap) kEnableCount level. Scopes don't nest: an inner scope
+    /// on the same thread is a no-op.
+    class TableIOScope {
+        DBTable::IOStats *io = nullptr;
+    public:
+        explicit TableIOScope(const DBTable &t) {
+            if (LIKELY(!dbStatsEnabled.load(std::memory_order_relaxed)) || !t.io
+                    || rocksdb::GetPerfLevel() > rocksdb::PerfLevel::kDisable)
+                return;
+            io = t.io;
+            rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+            rocksdb::get_perf_context()->Reset();
+        }
+        ~TableIOScope() {
+            if (!io) return;
+            const auto *pc = rocksdb::get_perf_context();
+            constexpr auto relaxed = std::memory_order_relaxed;
+            io->queries.fetch_add(1, relaxed);
+            io->blockReads.fetch_add(pc->block_read_count, relaxed);
+            io->blockReadBytes.fetch_add(pc->block_read_byte, relaxed);
+            io->blockCacheHits.fetch_add(pc->block_cache_hit_count, relaxed);
+            io->bloomChecked.fetch_add(pc->bloom_sst_hit_count + pc->bloom_sst_miss_count, relaxed);
+            io->bloomUseful.fetch_add(pc->bloom_sst_miss_count, relaxed);
+            io->keysSkipped.fetch_add(pc->internal_key_skipped_count, relaxed);
+            rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+        }
+        TableIOScope(const TableIOScope &) = delete;
+        TableIOScope & operator=(const TableIOScope &) = delete;
+    };
+
     /// Helper to get db name (basename of path)
     QString DBName(const rocksdb::DB *db) { return QFileInfo(QString::fromStdString(db->GetName())).baseName(); }
+    /// Helper to get a table name (its column family name)
+    QString DBName(const DBTable &t) { return t.cf ? QString::fromStdString(t.cf->GetName()) : QString(); }
     /// Helper to just get the status error string as a QString
     QString StatusString(const rocksdb::Status & status) { return QString::fromStdString(status.ToString()); }
 
@@ -256,7 +332,7 @@ namespace {
     /// DeserializeScalar<> fast function for scalars such as ints. It's important to read from the DB in the same
     /// 'safeScalar' mode as was written!
     template <typename RetType, bool safeScalar = false, typename KeyType>
-    std::optional<RetType> GenericDBGet(rocksdb::DB *db, const KeyType & keyIn, bool missingOk = false,
+    std::optional<RetType> GenericDBGet(const DBTable &db, const KeyType & keyIn, bool missingOk = false,
                                         const QString & errorMsgPrefix = QString(),  ///< used to specify a custom error message in the thrown exception
                                         bool acceptExtraBytesAtEndOfData = false,
                                         const rocksdb::ReadOptions & ropts = rocksdb::ReadOptions()) ///< if true, we are ok with extra unparsed bytes in data. otherwise we throw. (this check is only done for !safeScalar mode on basic types)
@@ -264,7 +340,12 @@ namespace {
         rocksdb::PinnableSlice datum;
         std::optional<RetType> ret;
         if (UNLIKELY(!db)) throw InternalError("GenericDBGet was passed a null pointer!");
-        const auto status = db->Get(ropts, db->DefaultColumnFamily(), ToSlice<safeScalar>(keyIn), &datum);
+        rocksdb::Status status;
+        {
+            TableIOScope ioScope(db);
+            status = db.db->Get(ropts, db.cf, ToSlice<safeScalar>(keyIn), &datum);
+        }
+        Tracing::noteDbRead(status.ok(), datum.size());
         if (status.IsNotFound()) {
             if (missingOk)
                 return ret; // optional will not has_value() to indicate missing key
@@ -318,7 +399,7 @@ namespace {
 
     /// Conveneience for above with the missingOk flag set to false. Will always throw or return a real value.
     template <typename RetType, bool safeScalar = false, typename KeyType>
-    RetType GenericDBGetFailIfMissing(rocksdb::DB * db, const KeyType &k, const QString &errMsgPrefix = QString(), bool extraDataOk = false,
+    RetType GenericDBGetFailIfMissing(const DBTable &db, const KeyType &k, const QString &errMsgPrefix = QString(), bool extraDataOk = false,
                                       const rocksdb::ReadOptions & ropts = rocksdb::ReadOptions())
     {
         return GenericDBGet<RetType, safeScalar>(db, k, false, errMsgPrefix, extraDataOk, ropts).value();
@@ -327,11 +408,11 @@ namespace {
     /// Throws on all errors. Otherwise writes to db.
     template <bool safeScalar = false, typename KeyType, typename ValueType>
     void GenericDBPut
-                (rocksdb::DB *db, const KeyType & key, const ValueType & value,
+                (const DBTable &db, const KeyType & key, const ValueType & value,
                  const QString & errorMsgPrefix = QString(),  ///< used to specify a custom error message in the thrown exception
                  const rocksdb::WriteOptions & opts = rocksdb::WriteOptions())
     {
-        auto st = db->Put(opts, ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
+        auto st = db.db->Put(opts, db.cf, ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
         if (!st.ok())
             throw DatabaseError(QString("%1: %2")
                                 .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : QString("Error writing to db %1").arg(DBName(db)))
@@ -340,10 +421,10 @@ namespace {
     /// Throws on all errors. Otherwise enqueues a write to the batch.
     template <bool safeScalar = false, typename KeyType, typename ValueType>
     void GenericBatchPut
-                (rocksdb::WriteBatch & batch, const KeyType & key, const ValueType & value,
+                (rocksdb::WriteBatch & batch, const DBTable &db, const KeyType & key, const ValueType & value,
                  const QString & errorMsgPrefix = QString())  ///< used to specify a custom error message in the thrown exception
     {
-        auto st = batch.Put(ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
+        auto st = batch.Put(db.cf, ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
         if (!st.ok())
             throw DatabaseError(QString("%1: %2")
                                 .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : "Error from WriteBatch::Put")
@@ -352,10 +433,10 @@ namespace {
     /// Throws on all errors. Otherwise enqueues a delete to the batch.
     template <bool safeScalar = false, typename KeyType>
     void GenericBatchDelete
-                (rocksdb::WriteBatch & batch, const KeyType & key,
+                (rocksdb::WriteBatch & batch, const DBTable &db, const KeyType & key,
                  const QString & errorMsgPrefix = QString())  ///< used to specify a custom error message in the thrown exception
     {
-        auto st = batch.Delete(ToSlice<safeScalar>(key));
+        auto st = batch.Delete(db.cf, ToSlice<safeScalar>(key));
         if (!st.ok())
             throw DatabaseError(QString("%1: %2")
                                 .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : "Error from WriteBatch::Delete")
@@ -372,19 +453,157 @@ namespace {
                                 .arg((!errorMsgPrefix.isEmpty() ? errorMsgPrefix : QString("Error writing batch to db %1").arg(DBName(db))),
                                      StatusString(st)));
     }
+    /// Throws on all errors. Otherwise enqueues a merge to the batch.
+    template <bool safeScalar = false, typename KeyType, typename ValueType>
+    void GenericBatchMerge
+                (rocksdb::WriteBatch & batch, const DBTable &db, const KeyType & key, const ValueType & value,
+                 const QString & errorMsgPrefix = QString())  ///< used to specify a custom error message in the thrown exception
+    {
+        auto st = batch.Merge(db.cf, ToSlice<safeScalar>(key), ToSlice<safeScalar>(value));
+        if (!st.ok())
+            throw DatabaseError(QString("%1: %2")
+                                .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : "Error from WriteBatch::Merge")
+                                .arg(StatusString(st)));
+    }
     /// Throws on all errors. Otherwise deletes a key from db. It is not an error to delete a non-existing key.
     template <bool safeScalar = false, typename KeyType>
     void GenericDBDelete
-                (rocksdb::DB *db, const KeyType & key,
+                (const DBTable &db, const KeyType & key,
                  const QString & errorMsgPrefix = QString(),  ///< used to specify a custom error message in the thrown exception
                  const rocksdb::WriteOptions & opts = rocksdb::WriteOptions())
     {
-        auto st = db->Delete(opts, ToSlice<safeScalar>(key));
+        auto st = db.db->Delete(opts, db.cf, ToSlice<safeScalar>(key));
         if (!st.ok())
             throw DatabaseError(QString("%1: %2")
                                 .arg(!errorMsgPrefix.isEmpty() ? errorMsgPrefix : QString("Error deleting a key from db %1").arg(DBName(db)))
                                 .arg(StatusString(st)));
     }
+    /// Compacts an entire table. Throws on error. If `rewriteBottommost` is true, the files in the bottommost level are
+    /// rewritten too (rocksdb normally skips those), which is what we want if the table's options have changed.
+    void CompactTable(const DBTable &t, bool rewriteBottommost = false) {
+        rocksdb::CompactRangeOptions opts;
+        opts.allow_write_stall = true;
+        opts.exclusive_manual_compaction = true;
+        opts.change_level = true;
+        if (rewriteBottommost)
+            opts.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForceOptimized;
+        if (auto s = t.db->CompactRange(opts, t.cf, nullptr, nullptr); !s.ok())
+            throw DatabaseError(QString("Error compacting %1 database: %2").arg(DBName(t), StatusString(s)));
+    }
+    /// A [lower, upper) range of keys in a table. An empty bound means unbounded on that side.
+    struct KeyRange {
+        std::string lower, upper;
+    };
+    /// Splits the whole keyspace into `n` contiguous ranges on the leading 2 bytes of the key. `n` must be a power of
+    /// 2 and at most 65536. All of the big tables we scan are keyed by a hash (a HashX, or a TXO's prevout hash), so
+    /// the ranges all end up holding about the same number of keys.
+    std::vector<KeyRange> SplitKeyspace(const unsigned n) {
+        if (n == 0 || n > 65536u || (n & (n - 1u)))
+            throw BadArgs(QString("SplitKeyspace: bad number of ranges: %1").arg(n));
+        const unsigned step = 65536u / n;
+        const auto Prefix = [](unsigned val) { return std::string{char(val >> 8u & 0xffu), char(val & 0xffu)}; };
+        std::vector<KeyRange> ret(n);
+        for (unsigned i = 1; i < n; ++i)
+            ret[i - 1].upper = ret[i].lower = Prefix(i * step);
+        return ret;
+    }
+    /// An iterator over one KeyRange of a table, positioned at the first key in the range. The range must outlive this.
+    struct RangeIter {
+        rocksdb::Slice upper;
+        rocksdb::ReadOptions ropts;
+        std::unique_ptr<rocksdb::Iterator> it;
+
+        RangeIter(const DBTable &t, const rocksdb::ReadOptions &ropts_in, const KeyRange &r) : ropts(ropts_in) {
+            if (!r.upper.empty()) {
+                upper = r.upper;
+                ropts.iterate_upper_bound = &upper;
+            }
+            it.reset(t.db->NewIterator(ropts, t.cf));
+            if (r.lower.empty()) it->SeekToFirst();
+            else it->Seek(r.lower);
+        }
+        RangeIter(const RangeIter &) = delete;
+        RangeIter &operator=(const RangeIter &) = delete;
+        rocksdb::Iterator *operator->() const { return it.get(); }
+    };
+    /// Thread-safe progress counter for parallel scans. Workers add() their counts in chunks (so as to not contend on
+    /// the atomic for every key), and `func` is called each time the total crosses a multiple of `interval`, from
+    /// whichever thread happened to cross it.
+    class ScanProgress {
+        const std::function<void(size_t)> func;
+        const size_t interval;
+        std::atomic_size_t total{0};
+    public:
+        static constexpr size_t kChunk = 4096; ///< workers should add() at least this often
+        ScanProgress(const std::function<void(size_t)> &func = {}, size_t interval = 0) : func(func), interval(interval) {}
+        void add(size_t n) {
+            if (!n) return;
+            const size_t before = total.fetch_add(n, std::memory_order_relaxed);
+            if (func && interval && before / interval != (before + n) / interval)
+                func(before + n);
+        }
+        size_t count() const { return total.load(std::memory_order_relaxed); }
+    };
+    /// Calls work(i) for each i in [0, n), spread across up to `nThreads` threads (default: one per physical core),
+    /// the calling thread being one of them. Blocks until all of the work is done. If any call throws, the work not
+    /// yet started is skipped, and the first exception is rethrown.
+    void ParallelFor(const size_t n, const std::function<void(size_t)> &work, unsigned nThreads = 0,
+                     const QString &name = "ParallelFor") {
+        if (!nThreads) nThreads = std::max(Util::getNPhysicalProcessors(), 1u);
+        nThreads = unsigned(std::min<size_t>(nThreads, n));
+        std::atomic_size_t next{0};
+        std::atomic_bool failed{false};
+        const auto Worker = [&] {
+            try {
+                for (size_t i; !failed.load(std::memory_order_relaxed) && (i = next++) < n; )
+                    work(i);
+            } catch (...) {
+                failed = true;
+                throw;
+            }
+        };
+        std::vector<std::unique_ptr<CoTask>> tasks;
+        std::vector<CoTask::Future> futs;
+        tasks.reserve(nThreads);
+        futs.reserve(nThreads);
+        for (unsigned i = 1; i < nThreads; ++i) {
+            tasks.push_back(std::make_unique<CoTask>(QString("%1 %2").arg(name).arg(i)));
+            futs.push_back(tasks.back()->submitWork(Worker));
+        }
+        std::exception_ptr exc;
+        try { Worker(); } catch (...) { exc = std::current_exception(); }
+        for (auto & f : futs) {
+            try { f.future.get(); } catch (...) { if (!exc) exc = std::current_exception(); }
+        }
+        if (exc) std::rethrow_exception(exc);
+    }
+    /// Opens the db at `path` read-only just long enough to read the version from its "meta" table. Returns an empty
+    /// optional if there is no db there yet, or it has no meta table or record. Does not throw.
+    std::optional<uint32_t> PeekDBVersion(const QString &path) {
+        if (!QFileInfo::exists(path + QDir::separator() + "CURRENT"))
+            return std::nullopt;
+        const std::vector<rocksdb::ColumnFamilyDescriptor> cfDescs = {
+            { rocksdb::kDefaultColumnFamilyName, rocksdb::ColumnFamilyOptions{} },
+            { "meta", rocksdb::ColumnFamilyOptions{} }, // read-only mode lets us open just a subset of the tables
+        };
+        std::vector<rocksdb::ColumnFamilyHandle *> handles;
+        rocksdb::DB *db = nullptr;
+        std::optional<uint32_t> ret;
+        if (const auto s = rocksdb::DB::OpenForReadOnly(rocksdb::DBOptions{}, path.toStdString(), cfDescs, &handles, &db);
+                s.ok() && db && handles.size() == cfDescs.size()) {
+            std::string val;
+            if (db->Get(rocksdb::ReadOptions{}, handles[1], kMeta, &val).ok()) {
+                bool ok;
+                const Meta m = Deserialize<Meta>(FromSlice(val), &ok);
+                if (ok) ret = m.version;
+            }
+        } else
+            Debug() << "PeekDBVersion: " << StatusString(s);
+        for (auto *h : handles)
+            db->DestroyColumnFamilyHandle(h);
+        delete db;
+        return ret;
+    }
 
     //// A helper data struct -- written to the blkinfo table. This helps localize a txnum to a specific position in
     /// a block.  The table is keyed off of block_height(uint32_t) -> serialized BlkInfo (raw bytes)
@@ -404,6 +623,103 @@ namespace {
     // deserializes as raw bytes from struct
     template <> BlkInfo Deserialize(const QByteArray &, bool *);
 
+    /// An immutable TxNum -> block height index, built from the blkInfos. The bulk of the chain lives in a succinct
+    /// EliasFano sequence of each block's txNum0 (~2.5 bytes per block on mainnet, vs ~50 for a std::map node), and the
+    /// most recent blocks live in a small `tail` vector that gets folded into a rebuilt EliasFano every kMaxTail blocks.
+    ///
+    /// Since instances are never mutated, readers just atomically grab a shared_ptr to the current one and query it
+    /// without taking any locks. Writers (addBlock, undoLatestBlock) publish a new instance.
+    struct TxNumHeightIndex {
+        static constexpr size_t kMaxTail = 1024;
+
+        std::shared_ptr<const EliasFano> base; ///< txNum0 for blocks [0, nBase); may have stale entries past nBase
+        size_t nBase = 0;
+        std::vector<TxNum> tail; ///< txNum0 for blocks [nBase, nBase + tail.size())
+        TxNum txNumEnd = 0; ///< 1 past the last TxNum of the last block
+
+        size_t numBlocks() const { return nBase + tail.size(); }
+        TxNum txNum0(size_t height) const { return height < nBase ? base->at(height) : tail[height - nBase]; }
+        TxNum txNumEndForHeight(size_t height) const { return height + 1u < numBlocks() ? txNum0(height + 1u) : txNumEnd; }
+
+        std::optional<unsigned> heightForTxNum(TxNum n) const {
+            std::optional<unsigned> ret;
+            if (n >= txNumEnd)
+                return ret;
+            if (!tail.empty() && n >= tail.front()) {
+                ret = unsigned(nBase + size_t(std::upper_bound(tail.begin(), tail.end(), n) - tail.begin()) - 1u);
+            } else if (nBase) {
+                // Note: any stale entries in base past nBase are all >= txNumEnd (or >= tail.front()) so they never
+                // get counted here, but we clamp anyway for paranoia.
+                if (const size_t ct = std::min(base->countLE(n), nBase))
+                    ret = unsigned(ct - 1u);
+            }
+            return ret;
+        }
+
+        /// Resolves the heights for an ascending-sorted range of TxNums, writing them to `out`. This is much faster
+        /// than calling heightForTxNum() for each, since consecutive TxNums tend to be in the same or nearby blocks.
+        template <typename It, typename OutIt>
+        void heightsForTxNums(It begin, const It end, OutIt out) const {
+            const size_t nBlocks = numBlocks();
+            std::optional<unsigned> h;
+            TxNum blockBegin = 0, blockEnd = 0; // TxNum range for block `h`
+            for (auto it = begin; it != end; ++it, ++out) {
+                const TxNum n = *it;
+                if (!h || n < blockBegin || n >= blockEnd) {
+                    if (h && n >= blockEnd && *h + 1u < nBlocks && n < txNumEndForHeight(*h + 1u))
+                        ++*h; // fast path: it's in the next block
+                    else if (!(h = heightForTxNum(n))) {
+                        *out = h;
+                        continue;
+                    }
+                    blockBegin = txNum0(*h);
+                    blockEnd = txNumEndForHeight(*h);
+                }
+                *out = h;
+            }
+        }
+
+        std::shared_ptr<const TxNumHeightIndex> withBlockAdded(const BlkInfo &bi) const {
+            auto ret = std::make_shared<TxNumHeightIndex>(*this);
+            ret->tail.push_back(bi.txNum0);
+            ret->txNumEnd = bi.txNum0 + bi.nTx;
+            if (ret->tail.size() > kMaxTail) {
+                // fold the tail into a new base
+                std::vector<uint64_t> vals = base ? base->decode(nBase) : std::vector<uint64_t>{};
+                vals.insert(vals.end(), ret->tail.begin(), ret->tail.end());
+                ret->nBase = vals.size();
+                ret->base = std::make_shared<const EliasFano>(vals);
+                ret->tail.clear();
+            }
+            return ret;
+        }
+
+        std::shared_ptr<const TxNumHeightIndex> withLatestBlockRemoved() const {
+            auto ret = std::make_shared<TxNumHeightIndex>(*this);
+            if (!numBlocks())
+                return ret;
+            ret->txNumEnd = txNum0(numBlocks() - 1u);
+            if (!ret->tail.empty())
+                ret->tail.pop_back();
+            else
+                --ret->nBase; // leaves a stale entry in base, which is harmless (see heightForTxNum above)
+            return ret;
+        }
+
+        static std::shared_ptr<const TxNumHeightIndex> build(const std::vector<BlkInfo> &blkInfos) {
+            auto ret = std::make_shared<TxNumHeightIndex>();
+            std::vector<uint64_t> vals;
+            vals.reserve(blkInfos.size());
+            for (const auto &bi : blkInfos)
+                vals.push_back(bi.txNum0);
+            ret->nBase = vals.size();
+            ret->base = std::make_shared<const EliasFano>(vals);
+            if (!blkInfos.empty())
+                ret->txNumEnd = blkInfos.back().txNum0 + blkInfos.back().nTx;
+            return ret;
+        }
+    };
+
     /// Block rewind/undo information. One of these is kept around in the db for the last configuredUndoDepth() blocks.
     /// It basically stores a record of all the UTXO's added and removed, as well as the set of
     /// scripthashes.
@@ -496,19 +812,144 @@ namespace {
         return true;
     }
 
+    /// The scripthash_history value encoding (db version >= 3). The TxNums in a history are always strictly ascending,
+    /// so we store them newest-first as the last TxNum followed by the (always > 0) deltas back down to the first one:
+    ///
+    ///     VarInt(x[n-1]) VarInt(x[n-1] - x[n-2]) ... VarInt(x[1] - x[0])
+    ///
+    /// Having the last TxNum up front is what lets HistoryMergeOperator append a block's TxNums to an existing history
+    /// without decoding it. Numbers use the VarInt format (see VarInt.h), whose first byte gives the length of the
+    /// number up front, so decoding needs no per-byte continuation checks, and deltas < 248 are a single byte.
+    namespace DeltaHist {
+        constexpr unsigned kMax1ByteVal = 0xf7u; ///< must match VarInt::b1max
+
+        /// Writes `val` to `out` in VarInt format, returning a pointer to just past the written bytes. `out` must have
+        /// room for VarInt::maxSize bytes.
+        inline std::byte *WriteNum(std::byte *out, uint64_t val) {
+            if (LIKELY(val <= kMax1ByteVal)) {
+                *out = std::byte(val);
+                return out + 1;
+            }
+            const VarInt vi(val);
+            std::memcpy(out, vi.data(), vi.size());
+            return out + vi.size();
+        }
+
+        /// Reads a VarInt-format number at `cur` into `val`, advancing `cur`. Returns false if the data is truncated.
+        inline bool ReadNum(const std::byte *&cur, const std::byte * const end, uint64_t &val) {
+            if (UNLIKELY(cur >= end)) return false;
+            const unsigned cbyte = unsigned(*cur++);
+            if (LIKELY(cbyte <= kMax1ByteVal)) {
+                val = cbyte;
+                return true;
+            }
+            const size_t len = cbyte - kMax1ByteVal; // 1 to 8 payload bytes follow
+            if (UNLIKELY(size_t(end - cur) < len)) return false;
+            if (QSysInfo::ByteOrder == QSysInfo::LittleEndian && size_t(end - cur) >= sizeof(val)) {
+                // read a whole (unaligned) word and mask off the bytes past the end of this number
+                std::memcpy(&val, cur, sizeof(val));
+                if (len < sizeof(val)) val &= (uint64_t{1} << len * 8u) - 1u;
+            } else {
+                val = 0;
+                for (size_t i = 0; i < len; ++i)
+                    val |= uint64_t(cur[i]) << i * 8u;
+            }
+            cur += len;
+            return true;
+        }
+
+        /// Skips the VarInt-format number at `cur`. Returns false if the data is truncated.
+        inline bool SkipNum(const std::byte *&cur, const std::byte * const end) {
+            if (UNLIKELY(cur >= end)) return false;
+            const unsigned cbyte = unsigned(*cur);
+            const size_t len = 1u + (cbyte > kMax1ByteVal ? cbyte - kMax1ByteVal : 0u);
+            if (UNLIKELY(size_t(end - cur) < len)) return false;
+            cur += len;
+            return true;
+        }
+
+        /// Returns the first and last TxNum of the encoded history [begin, end), validating it as we go, or an empty
+        /// optional if the data is empty or corrupt.
+        inline std::optional<std::pair<TxNum, TxNum>> Bounds(const std::byte *cur, const std::byte * const end) {
+            uint64_t last, first, delta;
+            if (!ReadNum(cur, end, last)) return std::nullopt;
+            first = last;
+            while (cur < end) {
+                if (!ReadNum(cur, end, delta) || UNLIKELY(delta == 0 || delta > first)) return std::nullopt;
+                first -= delta;
+            }
+            return std::pair{TxNum(first), TxNum(last)};
+        }
+    } // namespace DeltaHist
+
+    /// The merge operator for scripthash_history. A merge operand is the encoded (see DeltaHist above) run of TxNums that
+    /// a block adds to a scripthash's history. Since the existing value leads with its last TxNum, appending a run is:
+    /// the run as-is, then the delta from the existing value's last TxNum to the run's first TxNum, then the existing
+    /// value minus its leading TxNum. This costs about the same as the plain concatenation we used to do.
+    ///
+    /// Older db's used concatenated 6-byte TxNums for this table (see DeserializeLegacyTxNumVec), which we keep merging
+    /// with a plain concatenation for as long as `legacyFormat` is set (until Storage::upgradeHistoryEncoding() has run).
+    class HistoryMergeOperator : public ConcatOperator {
+    public:
+        ~HistoryMergeOperator() override;
+
+        /// Must be correct for the db before it is opened, since rocksdb may merge as soon as it is open.
+        std::atomic_bool legacyFormat = true;
+
+        bool Merge(const rocksdb::Slice& key, const rocksdb::Slice* existing_value,
+                   const rocksdb::Slice& value, std::string* new_value,
+                   rocksdb::Logger* logger) const override;
+        // NB: we keep Name() from ConcatOperator, since that is what older db's were created with
+    };
+
+    HistoryMergeOperator::~HistoryMergeOperator() {} // weak vtable warning prevention
+
+    bool HistoryMergeOperator::Merge(const rocksdb::Slice& key, const rocksdb::Slice* existing_value,
+                                     const rocksdb::Slice& value, std::string* new_value, rocksdb::Logger* logger) const
+    {
+        if (legacyFormat.load(std::memory_order_relaxed) || !existing_value || existing_value->empty() || value.empty())
+            return ConcatOperator::Merge(key, existing_value, value, new_value, logger);
+        ++merges;
+        const auto *vbegin = reinterpret_cast<const std::byte *>(value.data()), *vend = vbegin + value.size();
+        const auto *ebegin = reinterpret_cast<const std::byte *>(existing_value->data()),
+                   *ebody = ebegin, *eend = ebegin + existing_value->size();
+        uint64_t existingLast;
+        const auto bounds = DeltaHist::Bounds(vbegin, vend);
+        if (!bounds || !DeltaHist::ReadNum(ebody, eend, existingLast) || bounds->first <= existingLast)
+            return false; // corrupt data or out-of-order TxNums; rocksdb will report this as a Corruption error
+        std::array<std::byte, VarInt::maxSize> deltaBuf;
+        const size_t deltaLen = size_t(DeltaHist::WriteNum(deltaBuf.data(), bounds->first - existingLast) - deltaBuf.data());
+        const size_t eBodyLen = size_t(eend - ebody);
+        new_value->resize(value.size() + deltaLen + eBodyLen);
+        char *cur = new_value->data();
+        std::memcpy(cur, value.data(), value.size());
+        cur += value.size();
+        std::memcpy(cur, deltaBuf.data(), deltaLen);
+        cur += deltaLen;
+        std::memcpy(cur, ebody, eBodyLen);
+        return true;
+    }
+
     /// Thrown if user hits Ctrl-C / app gets a signal while we run the slow db checks
     struct UserInterrupted : public Exception { using Exception::Exception; ~UserInterrupted() override; };
     UserInterrupted::~UserInterrupted() {} // weak vtable warning suppression
 
     /// Manages the txhash2txnum rocksdb table.  The schema is:
-    /// Key: N bytes from POS position from the big-endian ordered (JSON ordered) txhash (default 6 from the End)
+    /// Key: N bytes from POS position from the big-endian ordered (JSON ordered) txhash (default 6 from the End,
+    ///     see the txhash_index_bytes config setting). The width the index was built with is stored in the table too.
     /// Value: One or more serialized VarInts. Each VarInt represents a "TxNum" (which tells us where the actual hash
     ///     lives in the txnum2txhash flat file).
     ///
+    /// If the key is a truncated hash, a lookup must read the candidate hashes back from the txnum2txhash file to rule
+    /// out collisions. If the key is the full hash, that verification read is skipped.
+    ///
+    /// Optionally, an in-memory BlockedBloomFilter over all of the keys lets lookups of txids that aren't in the index
+    /// (mempool txs, unknown txs) skip the db altogether.
+    ///
     /// This class is mainly a thin wrapper around the rocksdb and RecordFile facilities and they are both
     /// thread-safe and reentrant. It takes no locks itself.
     class TxHash2TxNumMgr {
-        rocksdb::DB * const db;
+        const DBTable db;
         const rocksdb::ReadOptions & rdOpts; // references into Storage::Pvt
         const rocksdb::WriteOptions & wrOpts;
         RecordFile * const rf;
@@ -516,58 +957,71 @@ namespace {
         ConcatOperator * concatOp;  // this is a "weak" pointer into above, dynamic casted down. always valid.
         Tic lastWarnTime; ///< this is not guarded by any locks. Assumption is calling code always holds an exclusive lock when calling truncateForUndo()
         int64_t largestTxNumSeen = -1;
+
+        std::unique_ptr<BlockedBloomFilter> filter; ///< valid after startFilter(); only consulted once filterReady
+        std::atomic_bool filterReady{false}, filterStop{false};
+        std::thread filterThread; ///< populates `filter` from the db on startup
+        mutable std::atomic<uint64_t> filterSkips{0}, filterFalsePositives{0}, verifyReads{0}; ///< for stats()
     public:
+        /// The key width used by versions of this index that predate the key width being configurable (and stored)
+        static constexpr size_t kLegacyKeyBytes = 6;
+
         const size_t keyBytes;
 
         enum KeyPos : uint8_t { Beginning=0, Middle=1, End=2, KP_Invalid=3 };
         const KeyPos keyPos;
 
-        TxHash2TxNumMgr(rocksdb::DB *db, const rocksdb::ReadOptions & rdOpts, const rocksdb::WriteOptions &wrOpts,
+        TxHash2TxNumMgr(const DBTable &db, const rocksdb::ReadOptions & rdOpts, const rocksdb::WriteOptions &wrOpts,
                      RecordFile *txnum2txhash, size_t keyBytes /*= 6*/, KeyPos keyPos /*= End*/)
             : db(db), rdOpts(rdOpts), wrOpts(wrOpts), rf(txnum2txhash), keyBytes(keyBytes), keyPos(keyPos)
         {
             if (!this->db || !rf || !this->keyBytes || this->keyBytes > HashLen || this->keyPos >= KP_Invalid)
                 throw BadArgs("Bad argumnets supplied to TxHash2TxNumMgr constructor");
-            mergeOp = db->GetOptions().merge_operator;
+            mergeOp = db.db->GetOptions(db.cf).merge_operator;
             if (!mergeOp || ! (concatOp = dynamic_cast<ConcatOperator *>(mergeOp.get())))
                 throw BadArgs("This db lacks a merge operator of type `ConcatOperator`");
             loadLargestTxNumSeen();
             Debug() << "TxHash2TxNumMgr: largestTxNumSeen = " << largestTxNumSeen;
         }
 
+        ~TxHash2TxNumMgr() { stopFilter(); }
+
+        /// If true, keys are the full tx hash, so a key match needs no verification against the txnum2txhash file.
+        bool fullKeys() const { return keyBytes == HashLen; }
+
         unsigned mergeCount() const { return concatOp->merges.load(); }
 
-        QString dbName() const { return QString::fromStdString(db->GetName()); }
+        QString dbName() const { return DBName(db); }
 
         /// Returns the largest tx num we have ever inserted into the db, or -1 if no txnums were inserted
         int64_t maxTxNumSeenInDB() const { return largestTxNumSeen; }
 
-        void insertForBlock(TxNum blockTxNum0, const std::vector<PreProcessedBlock::TxInfo> &txInfos) {
+        /// Enqueues the index updates for a block to `batch`. The caller is responsible for committing the batch.
+        void insertForBlock(rocksdb::WriteBatch &batch, TxNum blockTxNum0, const std::vector<PreProcessedBlock::TxInfo> &txInfos) {
             const Tic t0;
-            rocksdb::WriteBatch batch;
             for (TxNum i = 0; i < txInfos.size(); ++i) {
                 const ByteView key = makeKeyFromHash(txInfos[i].hash);
+                if (filter) filter->insert(key); // must happen before the batch is committed, for lookups to see it
                 const VarInt val(blockTxNum0 + i);
                 // save by appending VarInt. Note that this uses the 'ConcatOperator' class we defined in this file,
                 // which requires rocksdb be compiled with RTTI.
-                if (auto st = batch.Merge(ToSlice(key), ToSlice(val.byteView())); !st.ok())
+                if (auto st = batch.Merge(db.cf, ToSlice(key), ToSlice(val.byteView())); !st.ok())
                     throw DatabaseError(QString("%1: batch merge fail for txHash %2: %3")
                                         .arg(dbName(), QString(txInfos[i].hash.toHex()), QString::fromStdString(st.ToString())));
             }
-            if (auto st = db->Write(wrOpts, &batch) ; !st.ok())
-                throw DatabaseError(QString("%1: batch merge fail: %2").arg(dbName(), QString::fromStdString(st.ToString())));
             if (!txInfos.empty()) {
                 largestTxNumSeen = blockTxNum0 + txInfos.size() - 1;
-                saveLargestTxNumSeen();
+                saveLargestTxNumSeen(batch);
             }
             if (t0.msec() >= 50)
-                DebugM(__func__, ": inserted ", txInfos.size(), Util::Pluralize(" hash", txInfos.size()),
+                DebugM(__func__, ": enqueued ", txInfos.size(), Util::Pluralize(" hash", txInfos.size()),
                        " in ", t0.msecStr(), " msec");
         }
 
-        /// This is called during blockundo. Deletes records from the db having their TxNum >= `txNum`. Requires that
-        /// rf not yet be truncated. This is slow so don't call it with huge numbers of records beyond what fits into a block.
-        void truncateForUndo(const TxNum txNum) {
+        /// This is called during blockundo. Enqueues deletion of records from the db having their TxNum >= `txNum` to
+        /// `batch`. Requires that rf not yet be truncated. This is slow so don't call it with huge numbers of records
+        /// beyond what fits into a block.
+        void truncateForUndo(rocksdb::WriteBatch &batch, const TxNum txNum) {
             const auto rfNR = rf->numRecords();
             if (rfNR < txNum) throw DatabaseError(dbName() + ": RecordFile does not have the hashes required for the specified truncation");
             else if (rfNR == txNum) {
@@ -591,14 +1045,13 @@ namespace {
                 const auto bv = makeKeyFromHash(recs[i]);
                 keySlices.emplace_back(bv.charData(), bv.size());
             }
-            std::vector<rocksdb::Status> statuses = db->MultiGet(rdOpts, keySlices, &dbValues);
+            std::vector<rocksdb::Status> statuses = db.db->MultiGet(rdOpts, std::vector(keySlices.size(), db.cf), keySlices, &dbValues);
             DebugM(__func__, ": MultiGet on ", statuses.size(), " key(s), elapsed: ", t0.msecStr(), " msec");
             if (statuses.size() != recs.size() || dbValues.size() != recs.size())
                 throw DatabaseError(dbName() + ": RocksDB MultiGet did not return the proper number of records");
 
             // next filter out all VarInts >= txNum, deleting records that have no more VarInts left and writing
             // back records that still have VarInts in them
-            rocksdb::WriteBatch batch;
             int dels{}, keeps{}, filts{}; // for DEBUG print
             for (size_t i = 0; i < dbValues.size(); ++i) {
                 if (!statuses[i].ok()) {
@@ -630,7 +1083,7 @@ namespace {
                 }
                 if (valBackToDb.empty()) {
                     // delete, key now has no VarInts
-                    if (auto st = batch.Delete(keySlices[i]); !st.ok()) {
+                    if (auto st = batch.Delete(db.cf, keySlices[i]); !st.ok()) {
                         if (lastWarnTime.secs() >= 1.0) {
                             lastWarnTime = Tic();
                             Warning() << __func__ << ": " << dbName() << " failed to delete a key from db: "
@@ -640,19 +1093,15 @@ namespace {
                     ++dels;
                 } else {
                     // keep key, key has some VarInts left
-                    if (auto st = batch.Put(keySlices[i], valBackToDb); !st.ok())
+                    if (auto st = batch.Put(db.cf, keySlices[i], valBackToDb); !st.ok())
                         throw DatabaseError(dbName() + ": failed to write back a key to the db: " + QString::fromStdString(st.ToString()));
                 }
             }
 
-            // and, finally, commit the updates to the DB
-            if (auto st = db->Write(wrOpts, &batch) ; !st.ok())
-                throw DatabaseError(dbName() + ": batch write fail: " + QString::fromStdString(st.ToString()));
-
             const int64_t txNumI = int64_t(txNum);
              // we always add at the end and truncare at the end; this invariant should always hold
             largestTxNumSeen = std::max(txNumI - 1, int64_t{-1});
-            saveLargestTxNumSeen();
+            saveLargestTxNumSeen(batch);
 
             DebugM(__func__, ": txNum: ", txNum, ", nrecs: ", recs.size(), ", dels: ", dels, ", keeps: ", keeps, ", filts: ", filts,
                    ", elapsed: ", t0.msecStr(), " msec");
@@ -663,8 +1112,16 @@ namespace {
         std::optional<TxNum> find(const TxHash &txHash) const {
             std::optional<TxNum> ret;
             const auto key = makeKeyFromHash(txHash);
+            const bool filtered = filterReady.load(std::memory_order_acquire);
+            if (filtered && !filter->contains(key)) {
+                ++filterSkips;
+                return ret; // definitely missing
+            }
             auto optBytes = GenericDBGet<QByteArray>(db, key, true, dbName(), true, rdOpts);
-            if (!optBytes) return ret; // missing
+            if (!optBytes) { // missing
+                if (filtered) ++filterFalsePositives;
+                return ret;
+            }
             auto span = Span<const char>{*optBytes};
             std::vector<uint64_t> txNums;
             txNums.reserve(1 + span.size() / 5); // rough heuristic
@@ -672,6 +1129,13 @@ namespace {
                 while (!span.empty())
                     txNums.push_back(VarInt::deserialize(span).value<uint64_t>()); // this may throw
                 if (UNLIKELY(txNums.empty())) throw DatabaseFormatError(QString("Missing data for txHash: ") + QString(txHash.toHex()));
+                if (fullKeys()) {
+                    // the key *is* the hash; no need to verify. If there are several (pre-BIP34 dupe coinbase txs),
+                    // the first one wins, as below.
+                    ret = txNums.front();
+                    return ret;
+                }
+                ++verifyReads;
                 QString errStr;
                 // we may get more than 1 txNum for a particular key, so examine them all
                 const auto recs = rf->readRandomRecords(txNums, &errStr, true);
@@ -702,30 +1166,54 @@ namespace {
             const Tic t0;
             ret.resize(hashes.size());
             std::vector<rocksdb::Slice> keySlices;
+            std::vector<size_t> keyIdxs; // index into `hashes` for each of keySlices
             std::vector<std::string> dbResults;
             keySlices.reserve(hashes.size());
-            // build keys
-            for (const auto & hash : hashes)
-                keySlices.push_back(ToSlice(makeKeyFromHash(hash))); // shallow view into bytes in hashes
-            auto statuses = db->MultiGet(rdOpts, keySlices, &dbResults); // this should be faster than single gets..?
+            keyIdxs.reserve(hashes.size());
+            // build keys, leaving out the ones the filter (if any) says are definitely not in the db
+            const bool filtered = filterReady.load(std::memory_order_acquire);
+            for (size_t i = 0; i < hashes.size(); ++i) {
+                const ByteView key = makeKeyFromHash(hashes[i]); // shallow view into bytes in hashes
+                if (filtered && !filter->contains(key)) {
+                    ++filterSkips;
+                    continue;
+                }
+                keySlices.push_back(ToSlice(key));
+                keyIdxs.push_back(i);
+            }
+            if (keySlices.empty()) return ret; // all filtered out
+            auto statuses = db.db->MultiGet(rdOpts, std::vector(keySlices.size(), db.cf), keySlices, &dbResults); // this should be faster than single gets..?
             //DebugM(__func__, ": MultiGet of ", keySlices.size(), " items took ", t0.msecStr(), " msec");
-            if (statuses.size() != hashes.size() || dbResults.size() != hashes.size())
+            if (statuses.size() != keySlices.size() || dbResults.size() != keySlices.size())
                 throw DatabaseError(dbName() + ": db returned an unexpected number of results"); // should never happen
             std::vector<uint64_t> recNums;
             std::vector<std::optional<std::pair<size_t, size_t>>> idx2RecNums;
             idx2RecNums.resize(hashes.size());
             recNums.reserve(hashes.size());
-            for (size_t i = 0; i < statuses.size(); ++i) {
-                auto & st = statuses[i];
-                if (st.IsNotFound()) continue; // skip NotFound
+            for (size_t k = 0; k < statuses.size(); ++k) {
+                auto & st = statuses[k];
+                const size_t i = keyIdxs[k];
+                if (st.IsNotFound()) { // skip NotFound
+                    if (filtered) ++filterFalsePositives;
+                    continue;
+                }
                 if (!st.ok()) throw DatabaseError(dbName() + ": got a status that is not ok in findMany: "
                                                   + QString::fromStdString(st.ToString()));
-                auto & dataBlob = dbResults[i];
+                auto & dataBlob = dbResults[k];
                 if (dataBlob.empty()) {
                     Warning() << dbName() << ": Empty record for " << hashes[i].toHex() << ". FIXME!";
                     continue;
                 }
                 auto span = Span<const char>{dataBlob};
+                if (fullKeys()) {
+                    // the key *is* the hash, so no need to verify it against the RecordFile below
+                    try {
+                        ret[i] = VarInt::deserialize(span).value<uint64_t>();
+                    } catch (const std::exception &e) {
+                        throw DatabaseSerializationError(dbName() + ": failed to deserialize a VarInt: " + e.what());
+                    }
+                    continue;
+                }
                 std::pair<size_t, size_t> p(recNums.size(), recNums.size());
                 while (!span.empty()) {
                     try {
@@ -738,6 +1226,8 @@ namespace {
                 if (p.second > p.first)
                     idx2RecNums[i] = p;
             }
+            if (recNums.empty()) return ret; // nothing to verify
+            verifyReads += recNums.size();
             QString errStr;
             const auto recs = rf->readRandomRecords(recNums, &errStr, true);
             if (!errStr.isEmpty()) DebugM(__func__, ": ", errStr); // DEBUG TODO: Remove me
@@ -760,6 +1250,70 @@ namespace {
 
         bool exists(const TxHash &txHash) const { return bool(find(txHash)); }
 
+        /// Returns the key width this index was built with, or nullopt if it was never saved (older db's, which used
+        /// kLegacyKeyBytes, or an empty db).
+        std::optional<size_t> storedKeyBytes() const {
+            if (const auto opt = GenericDBGet<uint8_t>(db, kKeyBytesKey, true, dbName(), false, rdOpts))
+                return size_t(*opt);
+            return std::nullopt;
+        }
+        void saveKeyBytes() const { GenericDBPut(db, kKeyBytesKey, uint8_t(keyBytes), dbName(), wrOpts); }
+
+        /// Allocates the in-memory filter, sized for `expectedItems`, and populates it from the db in a background
+        /// thread. Lookups start consulting the filter once it is fully populated. Must be called after the index was
+        /// checked (and rebuilt, if needed), since it must be the only writer of the filter besides insertForBlock().
+        void startFilter(size_t expectedItems) {
+            if (filter) return;
+            filter = std::make_unique<BlockedBloomFilter>(expectedItems);
+            filterThread = std::thread([this]{
+                const Tic t0;
+                try {
+                    rocksdb::ReadOptions ro(rdOpts);
+                    ro.fill_cache = false; // don't evict the hot stuff for this one-time scan
+                    // The iterator implicitly snapshots the table: keys added after this point are put in the filter
+                    // by insertForBlock().
+                    std::unique_ptr<rocksdb::Iterator> iter(db.db->NewIterator(ro, db.cf));
+                    size_t n = 0;
+                    for (iter->SeekToFirst(); iter->Valid() && !filterStop.load(std::memory_order_relaxed); iter->Next()) {
+                        const auto key = iter->key();
+                        if (key.size() != keyBytes) continue; // skip meta entries
+                        filter->insert(ByteView{key});
+                        ++n;
+                    }
+                    if (!iter->status().ok())
+                        throw DatabaseError(QString::fromStdString(iter->status().ToString()));
+                    if (filterStop) return;
+                    filterReady.store(true, std::memory_order_release);
+                    Log() << "txhash filter: loaded " << n << " keys in " << t0.secsStr(1) << " secs, memory: "
+                          << QString::number(filter->memoryUsage() / 1024. / 1024., 'f', 1) << " MiB";
+                } catch (const std::exception &e) {
+                    Warning() << "txhash filter: failed to load, lookups will not use it: " << e.what();
+                }
+            });
+        }
+        void stopFilter() {
+            filterStop = true;
+            if (filterThread.joinable()) filterThread.join();
+        }
+
+        QVariantMap stats() const {
+            QVariantMap ret;
+            ret["key bytes"] = qulonglong(keyBytes);
+            ret["verification reads"] = qulonglong(verifyReads.load());
+            if (filter) {
+                ret["filter"] = QVariantMap{
+                    { "ready", filterReady.load() },
+                    { "items", qulonglong(filter->count()) },
+                    { "capacity", qulonglong(filter->capacity()) },
+                    { "memory bytes", qulonglong(filter->memoryUsage()) },
+                    { "lookups skipped", qulonglong(filterSkips.load()) },
+                    { "false positives", qulonglong(filterFalsePositives.load()) },
+                };
+            } else
+                ret["filter"] = QVariant(); // null: disabled
+            return ret;
+        }
+
     private:
         ByteView makeKeyFromHash(const ByteView &bv) const {
             const auto len = bv.size();
@@ -773,6 +1327,7 @@ namespace {
                 return bv.substr(0, keyBytes);
         }
         static const QByteArray kLargestTxNumSeenKeyPrefix;
+        static const QByteArray kKeyBytesKey; ///< longer than HashLen, so it can never collide with a real key
         QByteArray makeLargestTxNumSeenKey() const {
             auto ret = kLargestTxNumSeenKeyPrefix;
             if (size_t(ret.length()) <= keyBytes)
@@ -792,11 +1347,18 @@ namespace {
             else
                 GenericDBDelete(db, key, QString{}, wrOpts);
         }
+        void saveLargestTxNumSeen(rocksdb::WriteBatch &batch) const {
+            const auto key = makeLargestTxNumSeenKey();
+            if (largestTxNumSeen > -1)
+                GenericBatchPut(batch, db, key, largestTxNumSeen);
+            else
+                GenericBatchDelete(batch, db, key);
+        }
         // Deletes *all* keys from db! May throw.
         void deleteAllEntries() {
             std::string firstKey, endKey;
             {
-                std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(rdOpts));
+                std::unique_ptr<rocksdb::Iterator> iter(db.db->NewIterator(rdOpts, db.cf));
                 iter->SeekToFirst();
                 if (iter->Valid())
                     firstKey = iter->key().ToString();
@@ -811,10 +1373,10 @@ namespace {
             }
             rocksdb::FlushOptions fopts;
             fopts.wait = true; fopts.allow_write_stall = true;
-            if (auto st = db->DeleteRange(wrOpts, db->DefaultColumnFamily(), firstKey, endKey);
-                    !st.ok() || !(st = db->Flush(fopts)).ok())
+            if (auto st = db.db->DeleteRange(wrOpts, db.cf, firstKey, endKey);
+                    !st.ok() || !(st = db.db->Flush(fopts, db.cf)).ok())
                 throw DatabaseError(dbName() + ": failed to delete all keys: " + QString::fromStdString(st.ToString()));
-            std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(rdOpts));
+            std::unique_ptr<rocksdb::Iterator> iter(db.db->NewIterator(rdOpts, db.cf));
             iter->SeekToFirst();
             if (iter->Valid())
                 throw InternalError(dbName() + ": delete all keys failed -- iterator still points to a row! FIXME!");
@@ -828,7 +1390,7 @@ namespace {
         void consistencyCheck() { // this throws if the checks fail
             const Tic t0;
             Log() << "CheckDB: Verifying txhash index (this may take some time) ...";
-            std::unique_ptr<rocksdb::Iterator> iter(db->NewIterator(rdOpts));
+            std::unique_ptr<rocksdb::Iterator> iter(db.db->NewIterator(rdOpts, db.cf));
             size_t i = 0, verified = 0;
             QString err;
             constexpr size_t batchSize = 50'000;
@@ -871,8 +1433,8 @@ namespace {
                 const auto keySlice = iter->key();
                 const auto valSlice = iter->value();
                 const auto key = FromSlice(keySlice);
-                if (key.startsWith(kLargestTxNumSeenKeyPrefix))
-                    continue; // skip this meta entry
+                if (size_t(key.size()) > keyBytes)
+                    continue; // skip meta entries (these are always longer than real keys)
                 const auto val = FromSlice(valSlice);
                 Span<const std::byte> bytes(reinterpret_cast<const std::byte *>(val.constData()), val.size());
                 if (bytes.empty()) throw DatabaseFormatError("Empty db data!");
@@ -894,6 +1456,7 @@ namespace {
 
         void rebuildDB() {
             deleteAllEntries();
+            saveKeyBytes();
 
             constexpr size_t batchSize = 50'000;
             Debug() << "Using key bytes: " << keyBytes << ", batchSize: " << batchSize;
@@ -915,13 +1478,15 @@ namespace {
                 fakeInfos.resize(recs.size());
                 for (size_t j = 0; j < recs.size(); ++j)
                     fakeInfos[j].hash = recs[j];
-                insertForBlock(i, fakeInfos); // this throws on error
+                rocksdb::WriteBatch batch;
+                insertForBlock(batch, i, fakeInfos); // this throws on error
+                GenericBatchWrite(db.db, batch, dbName() + ": batch merge fail", wrOpts);
                 i += fakeInfos.size();
             }
             fakeInfos.clear();
             rocksdb::FlushOptions fopts;
             fopts.wait = true; fopts.allow_write_stall = true;
-            if (auto st = db->Flush(fopts); !st.ok())
+            if (auto st = db.db->Flush(fopts, db.cf); !st.ok())
                 Warning() << "DB Flush error: " << QString::fromStdString(st.ToString());
             Log() << "Indexed " << nrec << " txhash entries, elapsed: " << t0.secsStr(2) << " sec";
         }
@@ -967,15 +1532,166 @@ namespace {
     }; // end class TxHash2TxNumMgr
 
     /* static */ const QByteArray TxHash2TxNumMgr::kLargestTxNumSeenKeyPrefix = "+largestTxNumSeen";
+    /* static */ const QByteArray TxHash2TxNumMgr::kKeyBytesKey = QByteArray("+keyBytes").leftJustified(HashLen + 1, '-');
+
+    /// Caches the fully resolved confirmed history (TxHash + height for each TxNum) of the "hot" scripthashes: the
+    /// handful of exchange, donation and token addresses whose multi-MB histories dominate get_history and status
+    /// computation costs. Histories are only admitted if (recent access frequency) x (number of items) is large enough,
+    /// so small or rarely requested histories (which are cheap to read from the db anyway) don't churn the cache.
+    ///
+    /// Cached entries are kept up-to-date in place by addBlock (via append()) and undoLatestBlock (via truncate()),
+    /// both of which hold blocksLock exclusively. Readers must hold blocksLock (shared) while they copy out of a
+    /// returned pointer.
+    class HotHistoryCache {
+    public:
+        using HistoryPtr = std::shared_ptr<Storage::History>;
+
+        static constexpr size_t kMinItems = 32; ///< histories smaller than this are never admitted
+        static constexpr unsigned kMinFreq = 2; ///< must have been requested at least this many times recently
+        static constexpr size_t kMinScore = 1024; ///< freq * nItems must be at least this large to be admitted
+
+        explicit HotHistoryCache(unsigned maxBytes) : cache(maxBytes) {}
+
+        /// Returns the cached history for hashX (if any), and bumps hashX's access frequency.
+        HistoryPtr get(const HashX &hashX) {
+            bumpFreq(hashX);
+            auto opt = cache.object(hashX);
+            if (!opt) {
+                ++misses;
+                return {};
+            }
+            ++hits;
+            return std::move(*opt);
+        }
+
+        /// Called after a cache miss with the freshly-read confirmed history. Copies and caches it if it's hot enough.
+        void maybeAdmit(const HashX &hashX, const Storage::History &hist) {
+            if (hist.size() < kMinItems) return;
+            const unsigned f = frequency(hashX);
+            if (f < kMinFreq || f * hist.size() < kMinScore) return;
+            if (cache.insert(hashX, std::make_shared<Storage::History>(hist), costOf(hist.size())))
+                ++admits;
+        }
+
+        /// Called by addBlock after the block is committed, for each hashX in the block. No-op if hashX isn't cached.
+        template <typename Func>
+        void append(const HashX &hashX, const std::vector<TxNum> &txNums, int height, Func &&txNumToHash) {
+            auto opt = cache.object(hashX);
+            if (!opt) return;
+            HistoryPtr &hist = *opt;
+            hist->reserve(hist->size() + txNums.size());
+            for (const auto txNum : txNums)
+                hist->push_back(Storage::HistoryItem{txNumToHash(txNum), height, {}});
+            const auto cost = costOf(hist->size());
+            cache.insert(hashX, std::move(hist), cost); // re-insert to update the cost
+        }
+
+        /// Called by undoLatestBlock after the undo is committed, for each hashX in the undone block. Drops all items
+        /// at height >= `height` from the cached history (if any).
+        void truncate(const HashX &hashX, int height) {
+            auto opt = cache.object(hashX);
+            if (!opt) return;
+            HistoryPtr &hist = *opt;
+            while (!hist->empty() && hist->back().height >= height)
+                hist->pop_back();
+            if (const auto n = hist->size(); n < kMinItems)
+                cache.remove(hashX);
+            else
+                cache.insert(hashX, std::move(hist), costOf(n));
+        }
+
+        /// Returns the estimated number of recent get() calls for hashX (saturates at 256).
+        unsigned frequency(const HashX &hashX) const { return sketchMin(hashX) + unsigned(doorkeeperHas(hashX)); }
+
+        QVariantMap stats() const {
+            QVariantMap m;
+            m["Size bytes"] = qlonglong(cache.totalCost());
+            m["max bytes"] = qlonglong(cache.maxCost());
+            m["nItems"] = qlonglong(cache.size());
+            m["~hits"] = qlonglong(hits.load());
+            m["~misses"] = qlonglong(misses.load());
+            m["admits"] = qlonglong(admits.load());
+            return m;
+        }
+
+    private:
+        CostCache<HashX, HistoryPtr> cache;
+
+        /// The access frequency sketch (TinyLFU-style): a count-min sketch of saturating 8-bit counters, each row of
+        /// which is indexed by a different 4-byte range of hashX (a sha256, so the ranges are independent and
+        /// uniformly distributed), fronted by a "doorkeeper" bloom filter. The first access of a hashX only sets its
+        /// doorkeeper bits, so the many one-off lookups never inflate the counters of the hot scripthashes they collide
+        /// with. Every kAgingPeriod accesses the counters are halved and the doorkeeper is cleared, so that the
+        /// frequencies reflect recent popularity.
+        static constexpr size_t kSketchRows = 4, kSketchWidth = 1u << 14, kAgingPeriod = kSketchWidth * 4u;
+        static constexpr size_t kDoorkeeperBits = 1u << 19, kDoorkeeperProbes = 2; ///< ~5% false positives when full
+        static_assert((kSketchRows + kDoorkeeperProbes) * sizeof(uint32_t) <= size_t(HashLen));
+        std::array<std::array<std::atomic_uint8_t, kSketchWidth>, kSketchRows> sketch{};
+        std::array<std::atomic_uint64_t, kDoorkeeperBits / 64u> doorkeeper{};
+        std::atomic_size_t accesses{0}, hits{0}, misses{0}, admits{0};
+
+        /// Returns the i-th 4-byte word of hashX, which is always HashLen bytes (getHistory checks this).
+        static size_t word(const HashX &hashX, size_t i) {
+            uint32_t w;
+            std::memcpy(&w, hashX.constData() + i * sizeof(w), sizeof(w));
+            return w;
+        }
+        std::atomic_uint8_t & counter(const HashX &hashX, size_t row) { return sketch[row][word(hashX, row) % kSketchWidth]; }
+        unsigned sketchMin(const HashX &hashX) const {
+            unsigned ret = 255u;
+            for (size_t r = 0; r < kSketchRows; ++r)
+                ret = std::min<unsigned>(ret, sketch[r][word(hashX, r) % kSketchWidth].load(std::memory_order_relaxed));
+            return ret;
+        }
+        bool doorkeeperHas(const HashX &hashX) const {
+            for (size_t i = 0; i < kDoorkeeperProbes; ++i) {
+                const size_t bit = word(hashX, kSketchRows + i) % kDoorkeeperBits;
+                if (!(doorkeeper[bit / 64u].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64u))))
+                    return false;
+            }
+            return true;
+        }
+        void bumpFreq(const HashX &hashX) {
+            bool seen = true;
+            for (size_t i = 0; i < kDoorkeeperProbes; ++i) {
+                const size_t bit = word(hashX, kSketchRows + i) % kDoorkeeperBits;
+                const uint64_t mask = uint64_t(1) << (bit % 64u);
+                if (!(doorkeeper[bit / 64u].fetch_or(mask, std::memory_order_relaxed) & mask))
+                    seen = false;
+            }
+            if (seen) {
+                // conservative update: only the counters at the current minimum are bumped, which limits overestimation
+                if (const unsigned est = sketchMin(hashX); est < 255u)
+                    for (size_t r = 0; r < kSketchRows; ++r)
+                        if (auto &ctr = counter(hashX, r); ctr.load(std::memory_order_relaxed) == est)
+                            ctr.store(est + 1u, std::memory_order_relaxed); // racy increments are ok, this is approximate anyway
+            }
+            if (UNLIKELY(++accesses % kAgingPeriod == 0)) {
+                for (auto &row : sketch)
+                    for (auto &c : row)
+                        c.store(c.load(std::memory_order_relaxed) / 2u, std::memory_order_relaxed);
+                for (auto &w : doorkeeper)
+                    w.store(0u, std::memory_order_relaxed);
+            }
+        }
+        static unsigned costOf(size_t nItems) {
+            constexpr size_t kPerItem = sizeof(Storage::HistoryItem) + Util::qByteArrayPvtDataSize() + HashLen + 1;
+            return unsigned(std::min<size_t>(decltype(cache)::itemOverheadBytes() + sizeof(Storage::History)
+                                             + nItems * kPerItem, std::numeric_limits<int>::max() - 1));
+        }
+    };
 
 } // namespace
 
 struct Storage::Pvt
 {
-    Pvt(const unsigned cacheSizeBytes)
+    Pvt(const unsigned cacheSizeBytes, const unsigned historyCacheBytes)
         : lruNum2Hash(std::max(unsigned(cacheSizeBytes*kLruNum2HashCacheMemoryWeight), 1u)),
           lruHeight2Hashes_BitcoindMemOrder(std::max(unsigned(cacheSizeBytes*kLruHeight2HashesCacheMemoryWeight), 1u))
-    {}
+    {
+        if (historyCacheBytes)
+            hotHistory = std::make_unique<HotHistoryCache>(historyCacheBytes);
+    }
 
     Pvt(const Pvt &) = delete;
 
@@ -984,26 +1700,43 @@ struct Storage::Pvt
     /* NOTE: If taking multiple locks, all locks should be taken in the order they are declared, to avoid deadlocks. */
 
     Meta meta;
-    RWLock metaLock;
+    RWLock metaLock{"Storage::metaLock"};
 
     std::atomic<std::underlying_type_t<SaveItem>> pendingSaves{0};
 
     struct RocksDBs {
         const rocksdb::ReadOptions defReadOpts; ///< avoid creating this each time
         const rocksdb::WriteOptions defWriteOpts; ///< avoid creating this each time
-
-        rocksdb::Options opts, shistOpts, txhash2txnumOpts;
-        std::weak_ptr<rocksdb::Cache> blockCache; ///< shared across all dbs, caps total block cache size across all db instances
-        std::weak_ptr<rocksdb::WriteBufferManager> writeBufferManager; ///< shared across all dbs, caps total memtable buffer size across all db instances
-
-        std::shared_ptr<ConcatOperator> concatOperator, concatOperatorTxHash2TxNum;
-
-        std::unique_ptr<rocksdb::DB> meta, blkinfo, utxoset,
-                                     shist, shunspent, // scripthash_history and scripthash_unspent
-                                     undo, // undo (reorg rewind)
-                                     txhash2txnum; // new: index of txhash -> txNumsFile
-        using DBPtrRef = std::tuple<std::unique_ptr<rocksdb::DB> &>;
-        std::list<DBPtrRef> openDBs; ///< a bit of introspection to track which dbs are currently open (used by gentlyCloseAllDBs())
+        /// Use this for iterating over a whole table (or across scripthashes) in scripthash_unspent or token_unspent. Those
+        /// tables have a prefix_extractor, so iterators created with defReadOpts are only guaranteed to be correct within
+        /// a prefix.
+        const rocksdb::ReadOptions scanReadOpts = [] { rocksdb::ReadOptions r; r.total_order_seek = true; return r; }();
+
+        rocksdb::DBOptions dbOpts;
+        rocksdb::ColumnFamilyOptions opts, utxosetOpts, shistOpts, shunspentOpts, txhash2txnumOpts, tokenunspentOpts; ///< per-table options
+        std::weak_ptr<rocksdb::Cache> blockCache; ///< shared across all tables, caps total block cache size
+        std::weak_ptr<rocksdb::WriteBufferManager> writeBufferManager; ///< shared across all tables, caps total memtable buffer size
+        /// rocksdb's internal tickers & histograms. Always created, so that they may be toggled at runtime; when off,
+        /// the stats level is kDisableAll (see Storage::setDBStatsEnabled).
+        std::shared_ptr<rocksdb::Statistics> statistics;
+
+        std::shared_ptr<HistoryMergeOperator> historyOperator;
+        std::shared_ptr<ConcatOperator> concatOperatorTxHash2TxNum;
+
+        /// The one and only rocksdb instance. All of the tables below are column families in this db, so that all of
+        /// the updates for a block may be committed to all tables in one atomic WriteBatch.
+        std::unique_ptr<rocksdb::DB> rdb;
+        std::vector<rocksdb::ColumnFamilyHandle *> cfHandles; ///< owned by us; destroyed by gentlyCloseAllDBs() before rdb is closed
+
+        DBTable meta, blkinfo, utxoset,
+                shist, shunspent, // scripthash_history and scripthash_unspent
+                undo, // undo (reorg rewind)
+                txhash2txnum, // new: index of txhash -> txNumsFile
+                tokenunspent; // token_unspent: secondary index of the CashToken UTXOs by scripthash & by category
+
+        /// Returns all of the above tables, in the order they are declared
+        std::array<DBTable *, 8> tables() { return {&meta, &blkinfo, &utxoset, &shist, &shunspent, &undo, &txhash2txnum, &tokenunspent}; }
+        std::array<DBTable::IOStats, 8> ioStats; ///< one per table, in the same order as tables()
 
         std::unique_ptr<TxHash2TxNumMgr> txhash2txnumMgr; ///< provides a bit of a higher-level interface into the db
 
@@ -1022,16 +1755,21 @@ struct Storage::Pvt
     /// This is intended to be a coarse lock.  Currently the update code takes this along with headerVerifierLock and
     /// blkInfoLock at the same time, so it's (as of now) equivalent to either of those two locks.
     /// TODO: See about removing all the other locks and keeping one general RWLock for all updates?
-    mutable RWLock blocksLock;
+    mutable RWLock blocksLock{"Storage::blocksLock"};
 
     BTC::HeaderVerifier headerVerifier;
-    mutable RWLock headerVerifierLock;
+    mutable RWLock headerVerifierLock{"Storage::headerVerifierLock"};
 
     std::atomic<TxNum> txNumNext{0};
 
     std::vector<BlkInfo> blkInfos;
-    std::map<TxNum, unsigned> blkInfosByTxNum; ///< ordered map of TxNum0 for a block -> index into above blkInfo array
-    RWLock blkInfoLock; ///< locks blkInfos and blkInfosByTxNum
+    RWLock blkInfoLock{"Storage::blkInfoLock"}; ///< locks blkInfos
+
+    /// TxNum -> height lookups go through this immutable index, which is replaced (not mutated) whenever blkInfos
+    /// changes. Always access it via std::atomic_load / std::atomic_store; readers need not take blkInfoLock.
+    std::shared_ptr<const TxNumHeightIndex> txNumHeightIndex = std::make_shared<const TxNumHeightIndex>();
+    std::shared_ptr<const TxNumHeightIndex> getTxNumHeightIndex() const { return std::atomic_load(&txNumHeightIndex); }
+    void setTxNumHeightIndex(std::shared_ptr<const TxNumHeightIndex> idx) { std::atomic_store(&txNumHeightIndex, std::move(idx)); }
 
     std::atomic<int64_t> utxoCt = 0;
 
@@ -1062,6 +1800,10 @@ struct Storage::Pvt
                          + decltype(lruHeight2Hashes_BitcoindMemOrder)::itemOverheadBytes() );
     }
 
+    /// Resolved confirmed histories for the hottest scripthashes (config option: history_cache). May be nullptr if
+    /// disabled. Updated in-place by addBlock and undoLatestBlock.
+    std::unique_ptr<HotHistoryCache> hotHistory;
+
     struct LRUCacheStats {
         std::atomic_size_t num2HashHits = 0, num2HashMisses = 0,
                            height2HashesHits = 0, height2HashesMisses = 0;
@@ -1074,11 +1816,11 @@ struct Storage::Pvt
 
     Mempool mempool; ///< app-wide mempool data -- does not get saved to db. Controller.cpp writes to this
     Mempool::FeeHistogramVec mempoolFeeHistogram; ///< refreshed periodically by refreshMempoolHistogram()
-    RWLock mempoolLock;
+    RWLock mempoolLock{"Storage::mempoolLock"};
 
     Tic lastWarned; ///< to rate-limit potentially spammy warning messages (guarded by blocksLock)
 
-    std::unique_ptr<CoTask> blocksWorker; ///< work to be done in parallel can be submitted to this co-task in addBlock and undoLatestBlock
+    bool initialSync = false; ///< true while Controller is doing the initial sync (guarded by blocksLock)
 };
 
 namespace {
@@ -1119,6 +1861,47 @@ namespace {
         const CompactTXO ctxo = extractCompactTXOFromShunspentKey(key); // throws if wrong size
         return {DeepCpy(key.data(), HashLen), ctxo}; // if we get here size ok, can extract HashX
     }
+
+    /// The token_unspent table is a secondary index of the token-bearing subset of scripthash_unspent, with 2 entries
+    /// per token UTXO (both have the same value as the scripthash_unspent entry):
+    ///   'h' + HashX + category + CompactTXO  -- for token-filtered listunspent & get_balance on a scripthash
+    ///   'c' + category + HashX + CompactTXO  -- for category-level queries (e.g. token holders)
+    constexpr char kTokenByHashX = 'h', kTokenByCategory = 'c';
+    constexpr int kTokenKeyPrefixLen = 1 + HashLen + HashLen; ///< everything before the CompactTXO bytes
+    QByteArray mkTokenUnspentKey(char type, const QByteArray & hashX, const bitcoin::token::Id &category,
+                                 const CompactTXO &ctxo) {
+        if (UNLIKELY(hashX.length() != HashLen))
+            throw InternalError(QString("mkTokenUnspentKey -- scripthash is not exactly %1 bytes: %2").arg(HashLen).arg(QString(hashX.toHex())));
+        static_assert(int(bitcoin::token::Id::size()) == HashLen);
+        const auto ctxoSize = ctxo.serializedSize(false /* no force wide */);
+        QByteArray key(kTokenKeyPrefixLen + int(ctxoSize), Qt::Uninitialized);
+        char *p = key.data();
+        *p++ = type;
+        const char *cat = reinterpret_cast<const char *>(category.begin());
+        const auto [first, second] = type == kTokenByHashX ? std::pair{hashX.constData(), cat}
+                                                           : std::pair{cat, hashX.constData()};
+        std::memcpy(p, first, HashLen);
+        std::memcpy(p + HashLen, second, HashLen);
+        ctxo.toBytesInPlace(reinterpret_cast<std::byte *>(key.data() + kTokenKeyPrefixLen), ctxoSize, false);
+        return key;
+    }
+    /// Returns the prefix for iterating over either all the token UTXOs of a HashX (type == kTokenByHashX) or all the
+    /// UTXOs of a token category (type == kTokenByCategory).
+    QByteArray mkTokenUnspentPrefix(char type, const QByteArray &hashXOrCategory) {
+        return QByteArray(1, type) + hashXOrCategory;
+    }
+    /// Returns {HashX, CompactTXO} for either type of token_unspent key. Throws if the key is malformed.
+    std::pair<HashX, CompactTXO> extractTokenUnspentKey(const rocksdb::Slice &key) {
+        if (UNLIKELY(key.size() <= size_t(kTokenKeyPrefixLen) || (key[0] != kTokenByHashX && key[0] != kTokenByCategory)))
+            throw InternalError(QString("Bad token_unspent key: %1").arg(QString(FromSlice(key).toHex())));
+        const CompactTXO ctxo =
+            CompactTXO::fromBytesInPlaceExactSizeRequired(reinterpret_cast<const std::byte *>(key.data()) + kTokenKeyPrefixLen,
+                                                          key.size() - kTokenKeyPrefixLen);
+        if (UNLIKELY(!ctxo.isValid()))
+            throw InternalError(QString("Deserialized CompactTXO is invalid for token_unspent key: %1").arg(QString(FromSlice(key).toHex())));
+        const int hashXPos = key[0] == kTokenByHashX ? 1 : 1 + HashLen;
+        return {DeepCpy(key.data() + hashXPos, HashLen), ctxo};
+    }
 } // namespace
 
 class Storage::UTXOCache
@@ -1210,10 +1993,10 @@ class Storage::UTXOCache
         }
     }
     static constexpr size_t batchSize = 100'000;  // to limit the memory used for batching, we limit the batch size
-    static void commitBatch(rocksdb::DB *db, rocksdb::WriteBatch &batch, const QString &errMsg,
+    static void commitBatch(const DBTable &db, rocksdb::WriteBatch &batch, const QString &errMsg,
                             const rocksdb::WriteOptions &writeOpts, size_t &batchCount) {
         const Tic t;
-        GenericBatchWrite(db, batch, errMsg, writeOpts); // may throw
+        GenericBatchWrite(db.db, batch, errMsg, writeOpts); // may throw
         batch.Clear();
         if (t.msec<int>() >= 200) {
             const auto ct = batchCount;
@@ -1259,7 +2042,7 @@ class Storage::UTXOCache
         // do utxos in this thread since it's otherwise going to block anyway
         if ((doAdds && !adds.empty()) || !rms.empty()) {
             static const QString errMsgBatchWrite("Error issuing batch write to utxoset db for a utxo update");
-            if (!db) throw InternalError("utxoset db is nullptr! FIXME!");
+            if (!utxoset) throw InternalError("utxoset db is nullptr! FIXME!");
             size_t batchCount = 0;
             // rms first (loop in reverse to shrink vector as we loop)
             for (size_t i = rms.size(); i-- > 0; /**/) {
@@ -1268,12 +2051,12 @@ class Storage::UTXOCache
                 // enqueue delete from utxoset db -- may throw.
                 static const QString errMsgPrefix("Failed to issue a batch delete for a utxo");
                 const auto & txo = rms[i];
-                GenericBatchDelete(batch, txo, errMsgPrefix); // may throw on failure
+                GenericBatchDelete(batch, utxoset, txo, errMsgPrefix); // may throw on failure
                 rms.resize(i);
                 --rmsSize;
                 ++rmCt;
                 if (++batchCount >= batchSize)
-                    commitBatch(db.get(), batch, errMsgBatchWrite, writeOpts, batchCount);
+                    commitBatch(utxoset, batch, errMsgBatchWrite, writeOpts, batchCount);
             }
 
             // next, adds
@@ -1289,13 +2072,13 @@ class Storage::UTXOCache
                             {
                                 static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
                                 const auto & [txo, info] = **it;
-                                GenericBatchPut(batch, txo, info, errMsgPrefix); // may throw on failure
+                                GenericBatchPut(batch, utxoset, txo, info, errMsgPrefix); // may throw on failure
                             }
                             it = adds.erase(it);
                             --addsSize;
                             ++addCt;
                             if (++batchCount >= batchSize)
-                                commitBatch(db.get(), batch, errMsgBatchWrite, writeOpts, batchCount);
+                                commitBatch(utxoset, batch, errMsgBatchWrite, writeOpts, batchCount);
                         }
                     }
                     order.clear(); order.shrink_to_fit();
@@ -1308,17 +2091,17 @@ class Storage::UTXOCache
                         {
                             static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
                             const auto & [txo, info] = **it;
-                            GenericBatchPut(batch, txo, info, errMsgPrefix); // may throw on failure
+                            GenericBatchPut(batch, utxoset, txo, info, errMsgPrefix); // may throw on failure
                         }
                         it = adds.erase(it);
                         --addsSize;
                         ++addCt;
                         if (++batchCount >= batchSize)
-                            commitBatch(db.get(), batch, errMsgBatchWrite, writeOpts, batchCount);
+                            commitBatch(utxoset, batch, errMsgBatchWrite, writeOpts, batchCount);
                     }
                 }
             }
-            if (batchCount) commitBatch(db.get(), batch, errMsgBatchWrite, writeOpts, batchCount);
+            if (batchCount) commitBatch(utxoset, batch, errMsgBatchWrite, writeOpts, batchCount);
         } else {
             if (optAddsOrder) { optAddsOrder->clear(); optAddsOrder->shrink_to_fit(); }
         }
@@ -1338,7 +2121,7 @@ class Storage::UTXOCache
         rocksdb::WriteBatch shunspentBatch;
 
         static const QString errMsgBatchWrite("Error issuing batch write to scripthash_unspent db for a shunspent update");
-        if (!shunspentdb) throw InternalError("scripthash_unspent db is nullptr! FIXME!");
+        if (!shunspent) throw InternalError("scripthash_unspent db is nullptr! FIXME!");
         size_t batchCount = 0;
 
         // shunspentRms first (loop in reverse so we can shrink vector as we loop)
@@ -1348,12 +2131,12 @@ class Storage::UTXOCache
             const auto & dbKey = shunspentRms[i];
             // enqueue delete from scripthash_unspent db -- may throw.
             static const QString errMsgPrefix("Failed to issue a batch delete for a shunspent item");
-            GenericBatchDelete(shunspentBatch, dbKey, errMsgPrefix);
+            GenericBatchDelete(shunspentBatch, shunspent, dbKey, errMsgPrefix);
             shunspentRms.resize(i);
             ++shunspentRmCt;
             if (shunspentRmsSize) --*shunspentRmsSize;
             if (++batchCount >= batchSize)
-                commitBatch(shunspentdb.get(), shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
+                commitBatch(shunspent, shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
         }
 
         // next, shunspentAdds
@@ -1365,17 +2148,17 @@ class Storage::UTXOCache
                 {
                     static const QString errMsgPrefix("Failed to add an item to the shunspent batch");
                     const auto & [dbkey, dbvalue] = *it;
-                    GenericBatchPut(shunspentBatch, dbkey, dbvalue, errMsgPrefix); // may throw on failure
+                    GenericBatchPut(shunspentBatch, shunspent, dbkey, dbvalue, errMsgPrefix); // may throw on failure
                 }
                 it = shunspentAdds.erase(it);
                 ++shunspentAddCt;
                 if (shunspentAddsSize) --*shunspentAddsSize;
                 if (++batchCount >= batchSize)
-                    commitBatch(shunspentdb.get(), shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
+                    commitBatch(shunspent, shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
             }
         }
 
-        if (batchCount) commitBatch(shunspentdb.get(), shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
+        if (batchCount) commitBatch(shunspent, shunspentBatch, errMsgBatchWrite, writeOpts, batchCount);
         if (t0.msec<int>() >= 50)
             DebugM(__func__, ": added ", shunspentAddCt, " and deleted ", shunspentRmCt,
                    Util::Pluralize(" shunspent", shunspentAddCt + shunspentRmCt), " in ", t0.msecStr(3), " msec");
@@ -1546,7 +2329,7 @@ class Storage::UTXOCache
     CoTask prefetcher, flusherShunspent;
     CoTask::Future prefetcherFut, flusherShunspentFut;
 
-    const std::unique_ptr<rocksdb::DB> & db, & shunspentdb;
+    const DBTable utxoset, shunspent;
     const rocksdb::ReadOptions & readOpts;
     const rocksdb::WriteOptions & writeOpts;
 
@@ -1587,7 +2370,7 @@ class Storage::UTXOCache
                 for (const auto & in : std::as_const(ppb->inputs)) {
                     if (!inum) { /* coinbase, skip */ }
                     else if (in.parentTxOutIdx.has_value()) { /* spent in this block, skip */ }
-                    else if (TXO t{in.prevoutHash, in.prevoutN}; !contains(t)) {
+                    else if (TXO t{in.prevoutHash.toByteArray(), in.prevoutN}; !contains(t)) {
                         ++cacheMisses;
                         const unsigned index = keys.size();
                         const TXO & txo = index2TXO.try_emplace(index, std::move(t)).first->second;
@@ -1602,8 +2385,7 @@ class Storage::UTXOCache
                 }
             }
             if (keys.empty()) return; // nothing to do!
-            auto * const colfam = db->DefaultColumnFamily();
-            db->MultiGet(readOpts, colfam, keys.size(), keys.data(), values.data(), statuses.data());
+            utxoset.db->MultiGet(readOpts, utxoset.cf, keys.size(), keys.data(), values.data(), statuses.data());
             {
                 unsigned index = 0;
                 for (const auto & s : statuses) {
@@ -1619,7 +2401,7 @@ class Storage::UTXOCache
                         }
                     } else {
                         throw DatabaseError(QString("%1: Error reading TXO \"%2\" from %3 db: %4")
-                                            .arg(name, txo.toString(), DBName(db.get()), StatusString(s)));
+                                            .arg(name, txo.toString(), DBName(utxoset), StatusString(s)));
                     }
                     ++index;
                 }
@@ -1628,11 +2410,10 @@ class Storage::UTXOCache
     }
 
 public:
-    UTXOCache(const QString &name, const std::unique_ptr<rocksdb::DB> & pdb,
-              const std::unique_ptr<rocksdb::DB> & pshunspentdb, const rocksdb::ReadOptions & readOpts,
-              const rocksdb::WriteOptions & writeOpts)
+    UTXOCache(const QString &name, const DBTable & utxoset, const DBTable & shunspent,
+              const rocksdb::ReadOptions & readOpts, const rocksdb::WriteOptions & writeOpts)
         : name{name}, prefetcher{name + ".Prefetcher"}, flusherShunspent{name + ".ShunspentFlusher"},
-          db{pdb}, shunspentdb{pshunspentdb}, readOpts{readOpts}, writeOpts{writeOpts} {
+          utxoset{utxoset}, shunspent{shunspent}, readOpts{readOpts}, writeOpts{writeOpts} {
         DebugM(name, ": created");
     }
 
@@ -1733,7 +2514,7 @@ Storage::Storage(const std::shared_ptr<const Options> & options_)
       subsmgr(new ScriptHashSubsMgr(options, this)),
       dspsubsmgr(new DSProofSubsMgr(options, this)),
       txsubsmgr(new TransactionSubsMgr(options, this)),
-      p(std::make_unique<Pvt>(options->txHashCacheBytes))
+      p(std::make_unique<Pvt>(options->txHashCacheBytes, options->historyCacheBytes))
 {
     setObjectName("Storage");
     _thread.setObjectName(objectName());
@@ -1773,12 +2554,15 @@ void Storage::startup()
         p->merkleCache = std::make_unique<Merkle::Cache>(std::bind(&Storage::merkleCacheHelperFunc, this, _1, _2, _3));
     }
 
-    {   // open all db's ...
+    {   // open the db ...
         p->db.utxoCache.reset(); // this should already be nullptr, but this reset() is just here to be defensive.
 
         // Optimize RocksDB. This is the easiest way to get RocksDB to perform well
-        rocksdb::Options & opts(p->db.opts), &shistOpts(p->db.shistOpts), &txhash2txnumOpts(p->db.txhash2txnumOpts);
-        opts.IncreaseParallelism(int(Util::getNPhysicalProcessors()));
+        rocksdb::DBOptions & dbOpts(p->db.dbOpts);
+        rocksdb::ColumnFamilyOptions & opts(p->db.opts), &utxosetOpts(p->db.utxosetOpts), &shistOpts(p->db.shistOpts),
+                                     &shunspentOpts(p->db.shunspentOpts), &txhash2txnumOpts(p->db.txhash2txnumOpts),
+                                     &tokenunspentOpts(p->db.tokenunspentOpts);
+        dbOpts.IncreaseParallelism(int(Util::getNPhysicalProcessors()));
         opts.OptimizeLevelStyleCompaction();
 
         // setup shared block cache
@@ -1787,80 +2571,182 @@ void Storage::startup()
         p->db.blockCache = tableOptions.block_cache; // save shared_ptr to weak_ptr
         tableOptions.cache_index_and_filter_blocks = true; // from the docs: this may be a large consumer of memory, cost & cap its memory usage to the cache
         std::shared_ptr<rocksdb::TableFactory> tableFactory{rocksdb::NewBlockBasedTableFactory(tableOptions)};
-        // shared TableFactory for all db instances
+        // shared TableFactory for the tables that don't use bloom filters (meta, blkinfo, undo: these are small and/or
+        // only ever queried for keys that exist)
         opts.table_factory = tableFactory;
 
+        // The remaining tables use bloom filters (~1% false positive rate), which share the above block cache. Most
+        // lookups in these tables are for keys that don't exist (e.g. wallets probing unused addresses), and the filter
+        // lets us skip reading the index and data blocks at every level for those.
+        tableOptions.filter_policy.reset(rocksdb::NewBloomFilterPolicy(10, false));
+        tableOptions.format_version = 5; // faster and more accurate bloom filter implementation
+        // utxoset, scripthash_history, txhash2txnum: point lookups only, so filter on the whole key.
+        tableOptions.whole_key_filtering = true;
+        std::shared_ptr<rocksdb::TableFactory> wholeKeyFilterTableFactory{rocksdb::NewBlockBasedTableFactory(tableOptions)};
+        // scripthash_unspent: keys are HashX + CompactTXO, and we only ever seek by HashX, so filter on the 32-byte
+        // HashX prefix only.
+        tableOptions.whole_key_filtering = false;
+        std::shared_ptr<rocksdb::TableFactory> prefixFilterTableFactory{rocksdb::NewBlockBasedTableFactory(tableOptions)};
+
         // setup shared write buffer manager (for memtables memory budgeting)
         // - TODO cost this to the cache here? Or not? make sure both together don't exceed db.maxMem?!
         // - TODO right now we fix the cap of the write buffer manager's buffer size at db.maxMem / 2; tweak this.
         auto writeBufferManager = std::make_shared<rocksdb::WriteBufferManager>(options->db.maxMem / 2, tableOptions.block_cache /* cost to block cache: hopefully this caps memory better? it appears to use locks though so many this will be slow?! TODO: experiment with and without this!! */);
         p->db.writeBufferManager = writeBufferManager; // save shared_ptr to weak_ptr
-        opts.write_buffer_manager = writeBufferManager; // will be shared across all DB instances
-
-        // create the DB if it's not already present
-        opts.create_if_missing = true;
-        opts.error_if_exists = false;
-        opts.max_open_files = options->db.maxOpenFiles <= 0 ? -1 : options->db.maxOpenFiles; ///< this affects memory usage see: https://github.com/facebook/rocksdb/issues/4112
-        opts.keep_log_file_num = options->db.keepLogFileNum;
-        opts.compression = rocksdb::CompressionType::kNoCompression; // for now we test without compression. TODO: characterize what is fastest and best..
-        opts.use_fsync = options->db.useFsync; // the false default is perfectly safe, but Jt asked for this as an option, so here it is.
-
-        shistOpts = opts; // copy what we just did (will implicitly copy over the shared table_factory and write_buffer_manager)
-        shistOpts.merge_operator = p->db.concatOperator = std::make_shared<ConcatOperator>(); // this set of options uses the concat merge operator (we use this to append to history entries in the db)
-
-        txhash2txnumOpts = opts;
+        dbOpts.write_buffer_manager = writeBufferManager; // will be shared across all column families
+
+        // create the DB and any missing tables if not already present
+        dbOpts.create_if_missing = true;
+        dbOpts.create_missing_column_families = true;
+        dbOpts.error_if_exists = false;
+        dbOpts.max_open_files = options->db.maxOpenFiles <= 0 ? -1 : options->db.maxOpenFiles; ///< this affects memory usage see: https://github.com/facebook/rocksdb/issues/4112
+        dbOpts.keep_log_file_num = options->db.keepLogFileNum;
+        opts.compression = rocksdb::CompressionType::kNoCompression; // the tables that compress well override this below, see MakeCFOptions
+        dbOpts.use_fsync = options->db.useFsync; // the false default is perfectly safe, but Jt asked for this as an option, so here it is.
+        dbOpts.statistics = p->db.statistics = rocksdb::CreateDBStatistics();
+        setDBStatsEnabled(options->db.stats);
+
+        utxosetOpts = opts; // copy what we just did
+        utxosetOpts.table_factory = wholeKeyFilterTableFactory;
+        utxosetOpts.memtable_prefix_bloom_size_ratio = 0.05; // also filter lookups of recently written keys in the memtable
+        utxosetOpts.memtable_whole_key_filtering = true;
+
+        shistOpts = utxosetOpts; // scripthash_history keys are exactly a HashX, so a whole-key filter is a HashX filter
+        shistOpts.merge_operator = p->db.historyOperator = std::make_shared<HistoryMergeOperator>(); // this set of options uses the history merge operator (we use this to append to history entries in the db)
+
+        shunspentOpts = opts;
+        shunspentOpts.table_factory = prefixFilterTableFactory;
+        shunspentOpts.prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(HashLen)); // NB: see Pvt::RocksDBs::scanReadOpts
+        shunspentOpts.memtable_prefix_bloom_size_ratio = 0.05;
+
+        txhash2txnumOpts = utxosetOpts;
         txhash2txnumOpts.merge_operator = p->db.concatOperatorTxHash2TxNum = std::make_shared<ConcatOperator>();
 
-
-        using DBInfoTup = std::tuple<QString, std::unique_ptr<rocksdb::DB> &, const rocksdb::Options &, double>;
-        const std::list<DBInfoTup> dbs2open = {
-            { "meta", p->db.meta, opts, 0.0005 },
-            { "blkinfo" , p->db.blkinfo , opts, 0.02 },
-            { "utxoset", p->db.utxoset, opts, 0.27 },
-            { "scripthash_history", p->db.shist, shistOpts, 0.30 },
-            { "scripthash_unspent", p->db.shunspent, opts, 0.27 },
-            { "undo", p->db.undo, opts, 0.0395 },
-            { "txhash2txnum", p->db.txhash2txnum, txhash2txnumOpts, 0.1 },
+        // token_unspent: we only ever seek by type + HashX or by type + category (see mkTokenUnspentPrefix)
+        tokenunspentOpts = shunspentOpts;
+        tokenunspentOpts.prefix_extractor.reset(rocksdb::NewFixedPrefixTransform(1 + HashLen));
+
+
+        // The last tuple element is whether the table gets compressed. Tables keyed and/or valued by hashes compress so
+        // poorly that it's not worth the CPU, but the rest (heights, TxNum lists, amounts, etc) compress well.
+        using TableInfoTup = std::tuple<QString, DBTable &, const rocksdb::ColumnFamilyOptions &, double, bool>;
+        const std::list<TableInfoTup> tables2open = {
+            { "meta", p->db.meta, opts, 0.0005, false },
+            { "blkinfo" , p->db.blkinfo , opts, 0.02, true },
+            { "utxoset", p->db.utxoset, utxosetOpts, 0.26, false },
+            { "scripthash_history", p->db.shist, shistOpts, 0.30, true },
+            { "scripthash_unspent", p->db.shunspent, shunspentOpts, 0.26, false },
+            { "undo", p->db.undo, opts, 0.0395, true },
+            { "txhash2txnum", p->db.txhash2txnum, txhash2txnumOpts, 0.1, false },
+            { "token_unspent", p->db.tokenunspent, tokenunspentOpts, 0.02, false },
         };
+
+        // Pick the compression types for the above compressed tables from what the rocksdb library we were linked
+        // against supports: ideally LZ4 for the upper levels (fast) and ZSTD for the bottommost level (which holds most
+        // of the data, and is rewritten the least often).
+        using rocksdb::CompressionType;
+        CompressionType upperCompression = CompressionType::kNoCompression, bottomCompression = upperCompression;
+        if (options->db.compression) {
+            const auto supported = rocksdb::GetSupportedCompressions();
+            const auto PickFirstSupported = [&supported](std::initializer_list<CompressionType> prefs) {
+                for (const auto t : prefs)
+                    if (std::find(supported.begin(), supported.end(), t) != supported.end())
+                        return t;
+                return CompressionType::kNoCompression;
+            };
+            upperCompression = PickFirstSupported({CompressionType::kLZ4Compression, CompressionType::kSnappyCompression});
+            bottomCompression = PickFirstSupported({CompressionType::kZSTD, CompressionType::kZlibCompression});
+            if (bottomCompression == CompressionType::kNoCompression)
+                bottomCompression = upperCompression;
+            const auto Name = [](CompressionType t) -> QString {
+                switch (t) {
+                case CompressionType::kLZ4Compression: return "LZ4";
+                case CompressionType::kSnappyCompression: return "Snappy";
+                case CompressionType::kZSTD: return "ZSTD";
+                case CompressionType::kZlibCompression: return "Zlib";
+                default: return "None";
+                }
+            };
+            Log() << "DB compression: " << Name(upperCompression) << " (upper levels), " << Name(bottomCompression)
+                  << (bottomCompression == CompressionType::kZSTD ? " with dictionary" : "") << " (bottommost level)";
+        }
+
         std::size_t memTotal = 0;
-        const auto OpenDB = [this, &memTotal](const DBInfoTup &tup) {
-            auto & [name, uptr, opts_in, memFactor] = tup;
-            rocksdb::Options opts = opts_in;
+        const auto MakeCFOptions = [&](const QString &name, const rocksdb::ColumnFamilyOptions &opts_in, double memFactor,
+                                       bool compress) {
+            rocksdb::ColumnFamilyOptions opts = opts_in;
             const size_t mem = std::max(size_t(options->db.maxMem * memFactor), size_t(64*1024));
-            Debug() << "DB \"" << name << "\" mem: " << QString::number(mem / 1024. / 1024., 'f', 2) << " MiB";
+            Debug() << "DB table \"" << name << "\" mem: " << QString::number(mem / 1024. / 1024., 'f', 2) << " MiB";
             opts.OptimizeLevelStyleCompaction(mem);
-            for (auto & comp : opts.compression_per_level)
-                comp = rocksdb::CompressionType::kNoCompression; // paranoia -- enforce no compression since our data compresses so poorly
-            memTotal += mem;
-            rocksdb::Status s;
-            // try and open database
-            const QString path = options->datadir + QDir::separator() + name;
-            std::unique_ptr<rocksdb::DB> tmpPtr;
-            {
-                // open db, immediately placing the new'd pointer (if any) into a unique_ptr
-                rocksdb::DB *db = nullptr;
-                s = rocksdb::DB::Open( opts, path.toStdString(), &db);
-                tmpPtr.reset(db);
+            for (size_t level = 0; level < opts.compression_per_level.size(); ++level)
+                // L0 and L1 are small and their files are short-lived, so don't bother compressing those
+                opts.compression_per_level[level] = compress && level >= 2 ? upperCompression : CompressionType::kNoCompression;
+            if (compress && bottomCompression != CompressionType::kNoCompression) {
+                opts.bottommost_compression = bottomCompression;
+                if (bottomCompression == CompressionType::kZSTD) {
+                    // Train a dictionary per file from sampled blocks. Our values are small and have similar structure,
+                    // so a dictionary helps a lot since each block on its own has little redundancy to exploit.
+                    opts.bottommost_compression_opts.enabled = true;
+                    opts.bottommost_compression_opts.max_dict_bytes = 16 * 1024;
+                    opts.bottommost_compression_opts.zstd_max_train_bytes = 100 * opts.bottommost_compression_opts.max_dict_bytes;
+                }
             }
-            if (!s.ok() || !tmpPtr)
-                throw DatabaseError(QString("Error opening %1 database: %2 (path: %3)")
-                                    .arg(name, StatusString(s), path));
-            uptr = std::move(tmpPtr); // everything ok, move tmpPtr
-            p->db.openDBs.emplace_back(uptr); // mark db as open
+            memTotal += mem;
+            return opts;
         };
 
-        // open all db's defined above
-        for (auto & tup : dbs2open)
-            OpenDB(tup);
+        // rocksdb insists that the "default" column family always be opened. We don't use it, so give it minimal memory.
+        std::vector<rocksdb::ColumnFamilyDescriptor> cfDescs;
+        cfDescs.emplace_back(rocksdb::kDefaultColumnFamilyName, MakeCFOptions("default", opts, 0.0, false));
+        for (const auto & [name, table, opts_in, memFactor, compress] : tables2open)
+            cfDescs.emplace_back(name.toStdString(), MakeCFOptions(name, opts_in, memFactor, compress));
+
+        // try and open database
+        const QString path = options->datadir + QDir::separator() + "db";
+        // rocksdb may merge scripthash_history values as soon as the db is open (e.g. when flushing the recovered WAL),
+        // so the merge operator must know the history encoding beforehand. A pending migration from the old layout
+        // (see migrateLegacyDBs) is always an old encoding.
+        if (!QFileInfo::exists(options->datadir + QDir::separator() + "meta" + QDir::separator() + "CURRENT")) {
+            const auto version = PeekDBVersion(path);
+            p->db.historyOperator->legacyFormat = version && *version < Meta::kMinDeltaHistoryVersion; // new db's use the new encoding
+        }
+        Debug() << "scripthash_history encoding: " << (p->db.historyOperator->legacyFormat ? "legacy" : "delta");
+        rocksdb::Status s;
+        std::vector<rocksdb::ColumnFamilyHandle *> handles;
+        {
+            // open db, immediately placing the new'd pointer (if any) into a unique_ptr
+            rocksdb::DB *db = nullptr;
+            s = rocksdb::DB::Open(dbOpts, path.toStdString(), cfDescs, &handles, &db);
+            p->db.rdb.reset(db);
+        }
+        if (!s.ok() || !p->db.rdb || handles.size() != cfDescs.size()) {
+            for (auto *h : handles)
+                if (p->db.rdb) p->db.rdb->DestroyColumnFamilyHandle(h);
+            p->db.rdb.reset();
+            throw DatabaseError(QString("Error opening database: %1 (path: %2)").arg(StatusString(s), path));
+        }
+        p->db.cfHandles = handles; // gentlyCloseAllDBs() will destroy these
+        {
+            size_t i = 1; // skip "default"
+            for (const auto & [name, table, opts_in, memFactor, compress] : tables2open)
+                table = DBTable{p->db.rdb.get(), handles.at(i++)};
+            const auto tables = p->db.tables();
+            for (size_t j = 0; j < tables.size(); ++j)
+                tables[j]->io = &p->db.ioStats[j];
+        }
+        Metrics::setCollector("storage", [this]{ return dbStatsPrometheusText(); });
 
         Log() << "DB memory: " << QString::number(memTotal / 1024. / 1024., 'f', 2) << " MiB";
-    }  // /open db's
+
+        // if the datadir is laid out the old way (one rocksdb instance per table), move everything into the above db
+        migrateLegacyDBs();
+    }  // /open db
 
     // load/check meta
     {
         const QString errMsg1{"Incompatible database format -- delete the datadir and resynch."};
         const QString errMsg2{errMsg1 + " RocksDB error"};
-        if (const auto opt = GenericDBGet<Meta>(p->db.meta.get(), kMeta, true, errMsg2);
+        if (const auto opt = GenericDBGet<Meta>(p->db.meta, kMeta, true, errMsg2);
                 opt.has_value())
         {
             const Meta &m_db = *opt;
@@ -1877,10 +2763,15 @@ void Storage::startup()
             // ok, did not exist .. write a new one to db
             saveMeta_impl();
         }
+        if (p->db.historyOperator->legacyFormat != (p->meta.version < Meta::kMinDeltaHistoryVersion))
+            // Should never happen, but if PeekDBVersion() got it wrong, merges would have already corrupted the history
+            throw DatabaseError("Internal error: the scripthash_history encoding does not match the db version");
         if (isDirty()) {
-            throw DatabaseError("It appears that " APPNAME " was forcefully killed in the middle of committing a block to the db. "
-                                "We cannot figure out where exactly in the update process " APPNAME " was killed, so we "
-                                "cannot undo the inconsistent state caused by the unexpected shutdown. Sorry!"
+            // Block updates are atomic, so the only way to get here is if we were killed while the --fast-sync UTXO
+            // cache held UTXO updates that were not yet written to the db.
+            throw DatabaseError("It appears that " APPNAME " was forcefully killed during an initial synch while using"
+                                " --fast-sync, before the UTXO cache could be written to the db. The UTXO set in the db"
+                                " is therefore incomplete, and it cannot be recovered. Sorry!"
                                 "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n");
         }
     }
@@ -1889,19 +2780,32 @@ void Storage::startup()
     loadCheckHeadersInDB();
     // check txnums
     loadCheckTxNumsFileAndBlkInfo();
-    // construct the TxHash2TxNum manager -- depends on the above function having constructed the txNumFile
-    loadCheckTxHash2TxNumMgr();
-    // count utxos -- note this depends on "blkInfos" being filled in so it much be called after loadCheckTxNumsFileAndBlkInfo()
-    loadCheckUTXOsInDB();
-    // very slow check, only runs if -C -C (specified twice)
-    loadCheckShunspentInDB();
-    // load check earliest undo to populate earliestUndoHeight
-    loadCheckEarliestUndo();
+    // The below only depend on the above and not on each other (they each touch different tables), so run them
+    // concurrently. The slow ones (-C) also shard their own scans across cores.
+    ParallelFor(4, [this](const size_t i) {
+        switch (i) {
+        case 0:
+            // construct the TxHash2TxNum manager -- depends on the above function having constructed the txNumFile
+            loadCheckTxHash2TxNumMgr();
+            break;
+        case 1:
+            // count utxos -- note this depends on "blkInfos" being filled in so it much be called after loadCheckTxNumsFileAndBlkInfo()
+            loadCheckUTXOsInDB();
+            break;
+        case 2:
+            // very slow check, only runs if -C -C (specified twice)
+            loadCheckShunspentInDB();
+            break;
+        case 3:
+            // load check earliest undo to populate earliestUndoHeight
+            loadCheckEarliestUndo();
+            break;
+        }
+    }, 4, "StartupCheck");
     // if user specified --compact-dbs on CLI, run the compaction now before returning
     compactAllDBs();
-
-    // start up the co-task we use in addBlock and undoLatestBlock
-    p->blocksWorker = std::make_unique<CoTask>("Storage Worker");
+    // if this datadir predates the table bloom filters, compact the affected tables once so that all data gets them
+    checkUpgradeTableFilters();
 
     // Detect old DB version and see if upgrade is permitted, and maybe do a DB upgrade...
     checkUpgradeDBVersion();
@@ -1945,9 +2849,130 @@ void Storage::checkUpgradeDBVersion()
         }
 
         Log() << "DB version is older but compatible, updating version to v" << Meta::kCurrentVersion << " ...";
+        if (p->db.historyOperator->legacyFormat)
+            upgradeHistoryEncoding(); // may throw
+        if (p->meta.version < Meta::kMinTokenIndexVersion)
+            buildTokenIndex(); // may throw
+        // only now that the above succeeded may meta reflect the new version. It's written together with the removal
+        // of the history conversion progress marker (if any), so that a crash can never leave us with converted data
+        // but an old version, or vice versa
         p->meta.version = Meta::kCurrentVersion;
-        saveMeta_impl();
+        rocksdb::WriteBatch batch;
+        GenericBatchPut(batch, p->db.meta, kMeta, p->meta, "Failed to write meta to db");
+        GenericBatchDelete(batch, p->db.meta, kHistoryUpgradeProgress, "Failed to delete the history conversion marker");
+        GenericBatchWrite(p->db.rdb.get(), batch, "Failed to write meta to db", p->db.defWriteOpts);
+    }
+}
+
+void Storage::upgradeHistoryEncoding()
+{
+    // Every scripthash_history value is rewritten with a Put, in key order, and the last key written is saved in the
+    // meta table along with each batch so that an interrupted conversion can resume where it left off. Until the
+    // conversion is complete the merge operator stays in legacy mode, which is fine since nothing is merged meanwhile.
+    static const QString errPrefix("Error converting scripthash_history to the new encoding");
+    App *ourApp = app();
+    const Tic t0;
+    const auto resumeKey = GenericDBGet<QByteArray>(p->db.meta, kHistoryUpgradeProgress, true, errPrefix, false,
+                                                    p->db.defReadOpts);
+    Log() << (resumeKey ? "Resuming" : "Starting") << " the one-time conversion of scripthash_history to the new"
+             " compact encoding, this may take a while ...";
+    rocksdb::ReadOptions ropts = p->db.scanReadOpts;
+    ropts.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(ropts, p->db.shist.cf));
+    if (resumeKey) {
+        iter->Seek(ToSlice(*resumeKey));
+        if (iter->Valid() && iter->key() == ToSlice(*resumeKey))
+            iter->Next(); // this one was already converted
+    } else
+        iter->SeekToFirst();
+    rocksdb::WriteBatch batch;
+    size_t ct = 0, bytesIn = 0, bytesOut = 0;
+    QByteArray lastKey;
+    const auto Commit = [&] {
+        GenericBatchPut(batch, p->db.meta, kHistoryUpgradeProgress, lastKey, errPrefix);
+        GenericBatchWrite(p->db.rdb.get(), batch, errPrefix, p->db.defWriteOpts);
+        batch.Clear();
+    };
+    for ( ; iter->Valid(); iter->Next()) {
+        bool ok;
+        const auto nums = DeserializeLegacyTxNumVec(FromSlice(iter->value()), &ok);
+        if (!ok)
+            throw DatabaseFormatError(QString("%1: bad history data for %2").arg(errPrefix, QString(FromSlice(iter->key()).toHex())));
+        const QByteArray encoded = Serialize(nums); // may throw if the old data was not strictly ascending
+        if (auto st = batch.Put(p->db.shist.cf, iter->key(), ToSlice(encoded)); !st.ok())
+            throw DatabaseError(QString("%1: %2").arg(errPrefix, StatusString(st)));
+        bytesIn += iter->value().size();
+        bytesOut += size_t(encoded.size());
+        if (++ct % 100'000 == 0) {
+            lastKey = DeepCpy(iter->key().data(), iter->key().size());
+            Commit();
+            if (ourApp && ourApp->signalsCaught())
+                throw UserInterrupted("User interrupted, aborting conversion (it will resume on next startup)");
+            if (ct % 5'000'000 == 0)
+                Log() << "Converting scripthash_history: " << ct << " entries ...";
+        }
     }
+    if (!iter->status().ok())
+        throw DatabaseError(QString("%1: %2").arg(errPrefix, StatusString(iter->status())));
+    if (batch.Count()) {
+        iter->SeekToLast();
+        if (iter->Valid()) lastKey = DeepCpy(iter->key().data(), iter->key().size());
+        Commit();
+    }
+    iter.reset();
+    // Compacting drops all of the old values (and any unmerged old merge operands), which the new Puts shadow. Only
+    // then is it safe to start merging with the new encoding.
+    Log() << "Compacting scripthash_history ...";
+    CompactTable(p->db.shist, true); // may throw
+    p->db.historyOperator->legacyFormat = false;
+    Log() << "Converted " << ct << Util::Pluralize(" history entry", ct) << " in " << t0.secsStr(1) << " secs, "
+          << QString::number(bytesIn / 1024. / 1024., 'f', 1) << " MiB -> " << QString::number(bytesOut / 1024. / 1024., 'f', 1)
+          << " MiB";
+}
+
+void Storage::buildTokenIndex()
+{
+    // The token_unspent index is derived entirely from scripthash_unspent. We build it from scratch (after clearing out
+    // whatever a previously interrupted build may have left behind), so there is no need to track progress: the db
+    // version is only bumped once we are done.
+    if (BTC::coinFromName(p->meta.coin) != BTC::Coin::BCH)
+        return; // only BCH has tokens, nothing to index
+    static const QString errPrefix("Error building the token_unspent index");
+    App *ourApp = app();
+    const Tic t0;
+    Log() << "Building the token_unspent index, this is a one-time operation that may take a while ...";
+    if (auto st = p->db.rdb->DeleteRange(p->db.defWriteOpts, p->db.tokenunspent.cf, rocksdb::Slice(), "\xff"); !st.ok())
+        throw DatabaseError(QString("%1: %2").arg(errPrefix, StatusString(st)));
+    rocksdb::ReadOptions ropts = p->db.scanReadOpts;
+    ropts.fill_cache = false;
+    std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(ropts, p->db.shunspent.cf));
+    rocksdb::WriteBatch batch;
+    size_t ct = 0;
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+        if (!SHUnspentValueHasTokenData(iter->value()))
+            continue;
+        const auto [hashX, ctxo] = extractShunspentKey(iter->key()); // may throw
+        const QByteArray val = FromSlice(iter->value());
+        bool ok;
+        const auto shval = Deserialize<SHUnspentValue>(val, &ok);
+        if (UNLIKELY(!ok || !shval.valid || !shval.tokenDataPtr))
+            throw DatabaseFormatError(QString("%1: bad scripthash_unspent value for ctxo %2 (%3)")
+                                      .arg(errPrefix, ctxo.toString(), QString(hashX.toHex())));
+        for (const char type : {kTokenByHashX, kTokenByCategory})
+            GenericBatchPut(batch, p->db.tokenunspent, mkTokenUnspentKey(type, hashX, shval.tokenDataPtr->GetId(), ctxo), val,
+                            errPrefix);
+        if (++ct % 100'000 == 0) {
+            GenericBatchWrite(p->db.rdb.get(), batch, errPrefix, p->db.defWriteOpts);
+            batch.Clear();
+            if (ourApp && ourApp->signalsCaught())
+                throw UserInterrupted("User interrupted, aborting index build (it will restart on next startup)");
+        }
+    }
+    if (!iter->status().ok())
+        throw DatabaseError(QString("%1: %2").arg(errPrefix, StatusString(iter->status())));
+    if (batch.Count())
+        GenericBatchWrite(p->db.rdb.get(), batch, errPrefix, p->db.defWriteOpts);
+    Log() << "Indexed " << ct << Util::Pluralize(" token UTXO", ct) << " in " << t0.secsStr(1) << " secs";
 }
 
 void Storage::compactAllDBs()
@@ -1958,56 +2983,171 @@ void Storage::compactAllDBs()
     App *ourApp = app();
     Tic t0;
     Log() << "Compacting DBs, please wait ...";
-    for (const auto & [db] : p->db.openDBs) {
+    for (const DBTable *t : p->db.tables()) {
         if (ourApp->signalsCaught())
             break;
-        if (!db) continue;
-        const auto name = DBName(db.get());
-        Log() << "Compacting " << name << " ...";
-        rocksdb::CompactRangeOptions opts;
-        opts.allow_write_stall = true;
-        opts.exclusive_manual_compaction = true;
-        opts.change_level = true;
-        auto s = db->CompactRange(opts, nullptr, nullptr);
-        if (!s.ok()) {
-            throw DatabaseError(QString("Error compacting %1 database: %2")
-                                .arg(name, StatusString(s)));
-        }
+        if (!*t) continue;
+        Log() << "Compacting " << DBName(*t) << " ...";
+        CompactTable(*t, true); // may throw; also rewrites the bottommost level so that changed table options apply to all data
         ++ctr;
     }
     Log() << "Compacted " << ctr << " databases in " << t0.secsStr(1) << " seconds";
 }
 
+void Storage::checkUpgradeTableFilters()
+{
+    // The bloom filters (and the scripthash_unspent prefix extractor) only exist in table files written by a version
+    // that has them, so old data would never be filtered until rocksdb happened to compact it. Instead, we compact the
+    // affected tables once, and then note that we did so in the meta table.
+    static const QString errPrefix("Error accessing the table filters version in the meta db");
+    constexpr uint32_t kCurrentFiltersVersion = 1u;
+    if (GenericDBGet<uint32_t>(p->db.meta, kTableFilters, true, errPrefix, false, p->db.defReadOpts).value_or(0u)
+            >= kCurrentFiltersVersion)
+        return;
+    if (!p->blkInfos.empty()) { // (nothing to do for a new db)
+        App *ourApp = app();
+        const Tic t0;
+        Log() << "Adding bloom filters to the existing db tables, this is a one-time operation that may take a while ...";
+        for (const DBTable *t : {&p->db.utxoset, &p->db.shist, &p->db.shunspent, &p->db.txhash2txnum}) {
+            if (ourApp->signalsCaught())
+                return; // we will pick up where we left off on next startup
+            Log() << "Compacting " << DBName(*t) << " ...";
+            CompactTable(*t, true); // may throw
+        }
+        Log() << "Bloom filters added in " << t0.secsStr(1) << " seconds";
+    }
+    GenericDBPut(p->db.meta, kTableFilters, kCurrentFiltersVersion, errPrefix, p->db.defWriteOpts);
+}
+
+void Storage::migrateLegacyDBs()
+{
+    // Older versions kept each table in its own rocksdb instance, in a subdirectory of the datadir named after the
+    // table. If we detect that layout, we copy everything into the single db we just opened and then delete the old
+    // subdirectories. The old "meta" subdirectory is deleted first, once everything has been copied, so its presence
+    // means a migration is (still) pending. An interrupted migration just starts over, since re-copying is idempotent.
+    const auto LegacyPath = [this](const QString &name) { return options->datadir + QDir::separator() + name; };
+    const auto IsLegacyDB = [&LegacyPath](const QString &name) {
+        return QFileInfo::exists(LegacyPath(name) + QDir::separator() + "CURRENT");
+    };
+    const auto RemoveLegacyDB = [&LegacyPath](const QString &name) {
+        if (!QDir(LegacyPath(name)).removeRecursively())
+            Warning() << "Failed to remove old db directory: " << LegacyPath(name);
+    };
+    const auto tables = p->db.tables();
+
+    if (!IsLegacyDB("meta")) {
+        // No migration pending. Clean up any leftovers from a migration that was interrupted while deleting them.
+        for (const DBTable *t : tables)
+            if (const auto name = DBName(*t); IsLegacyDB(name))
+                RemoveLegacyDB(name);
+        return;
+    }
+
+    const Tic t0;
+    Log() << "Migrating the database to the new single-db format, this may take a while ...";
+    App *ourApp = app();
+    for (const DBTable *t : tables) {
+        const auto name = DBName(*t);
+        if (!IsLegacyDB(name)) {
+            Debug() << "Old db \"" << name << "\" not found, skipping";
+            continue;
+        }
+        // open the old db read-only, using the same options (and merge operator) as the new table
+        rocksdb::Options lopts = t->db->GetOptions(t->cf);
+        lopts.create_if_missing = false;
+        std::unique_ptr<rocksdb::DB> ldb;
+        {
+            rocksdb::DB *db = nullptr;
+            const auto s = rocksdb::DB::OpenForReadOnly(lopts, LegacyPath(name).toStdString(), &db);
+            ldb.reset(db);
+            if (!s.ok() || !ldb)
+                throw DatabaseError(QString("Error opening old %1 database for migration: %2").arg(name, StatusString(s)));
+        }
+        rocksdb::ReadOptions ropts = p->db.scanReadOpts; // lopts may have a prefix_extractor
+        ropts.fill_cache = false;
+        std::unique_ptr<rocksdb::Iterator> iter(ldb->NewIterator(ropts));
+        rocksdb::WriteBatch batch;
+        size_t ct = 0;
+        const auto Commit = [&] {
+            GenericBatchWrite(t->db, batch, QString("Error writing to %1 during migration").arg(name), p->db.defWriteOpts);
+            batch.Clear();
+        };
+        for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
+            // values read back here are fully merged, so a plain Put is all we need
+            if (auto st = batch.Put(t->cf, iter->key(), iter->value()); !st.ok())
+                throw DatabaseError(QString("Error from WriteBatch::Put during migration of %1: %2").arg(name, StatusString(st)));
+            if (++ct % 100'000 == 0) {
+                Commit();
+                if (ourApp && ourApp->signalsCaught())
+                    throw UserInterrupted("User interrupted, aborting migration (it will resume on next startup)");
+                if (ct % 5'000'000 == 0)
+                    Log() << "Migrating " << name << ": " << ct << " entries ...";
+            }
+        }
+        if (!iter->status().ok())
+            throw DatabaseError(QString("Error reading old %1 database during migration: %2").arg(name, StatusString(iter->status())));
+        Commit();
+        iter.reset();
+        ldb.reset();
+        Log() << "Migrated " << name << ": " << ct << Util::Pluralize(" entry", ct);
+    }
+
+    // make sure everything is on disk before we delete the old dbs
+    rocksdb::FlushOptions fopts;
+    fopts.wait = true; fopts.allow_write_stall = true;
+    if (auto st = p->db.rdb->Flush(fopts, p->db.cfHandles); !st.ok())
+        throw DatabaseError("Error flushing db after migration: " + StatusString(st));
+
+    RemoveLegacyDB("meta"); // this must go first, see comment at top of function
+    for (const DBTable *t : tables)
+        if (const auto name = DBName(*t); IsLegacyDB(name))
+            RemoveLegacyDB(name);
+    Log() << "Database migration completed in " << t0.secsStr(1) << " secs";
+}
+
 void Storage::gentlyCloseAllDBs()
 {
-    p->db.utxoCache.reset(); // if was valid, implicitly flushes UTXO Cache pending writes to DB...
+    if (p->db.utxoCache) {
+        try {
+            p->db.utxoCache.reset(); // implicitly flushes UTXO Cache pending writes to DB...
+            setDirty(false);
+        } catch (const std::exception &e) {
+            Error() << "Failed to flush the UTXO cache: " << e.what();
+        }
+    }
 
-    // do FlushWAL() and Close() to gently close the dbs
-    for (auto & [db] : p->db.openDBs) {
-        if (!db) continue;
+    p->db.txhash2txnumMgr.reset(); // holds a reference to the txhash2txnum table, which is about to go away
+
+    // do FlushWAL() and Close() to gently close the db
+    if (auto & db = p->db.rdb; db) {
         const auto name = DBName(db.get());
         Debug() << "Flushing and closing " << name << " ...";
         rocksdb::Status status;
         rocksdb::FlushOptions fopts;
         fopts.wait = true; fopts.allow_write_stall = true;
-        status = db->Flush(fopts);
+        status = db->Flush(fopts, p->db.cfHandles);
         if (!status.ok())
             Warning() << "Flush of " << name << ": " << QString::fromStdString(status.ToString());
         status = db->FlushWAL(true);
         if (!status.ok())
             Warning() << "FlushWAL of " << name << ": " << QString::fromStdString(status.ToString());
+        for (DBTable *t : p->db.tables())
+            *t = DBTable{};
+        for (auto *h : p->db.cfHandles)
+            if (status = db->DestroyColumnFamilyHandle(h); !status.ok())
+                Warning() << "DestroyColumnFamilyHandle: " << QString::fromStdString(status.ToString());
+        p->db.cfHandles.clear();
         status = db->Close();
         if (!status.ok())
             Warning() << "Close of " << name << ": " << QString::fromStdString(status.ToString());
         db.reset();
     }
-    p->db.openDBs.clear();
 }
 
 void Storage::cleanup()
 {
+    Metrics::setCollector("storage", {}); // unregister before our data goes away
     stop(); // joins our thread
-    if (p->blocksWorker) p->blocksWorker.reset(); // stop the co-task
     if (txsubsmgr) txsubsmgr->cleanup();
     if (dspsubsmgr) dspsubsmgr->cleanup();
     if (subsmgr) subsmgr->cleanup();
@@ -2016,13 +3156,150 @@ void Storage::cleanup()
 }
 
 
+namespace {
+    /// The subset of rocksdb's tickers that we report, named as rocksdb names them (e.g. "rocksdb.block.cache.hit")
+    const std::vector<rocksdb::Tickers> & reportedTickers() {
+        using namespace rocksdb;
+        static const std::vector<Tickers> ret = {
+            BLOCK_CACHE_HIT, BLOCK_CACHE_MISS,
+            BLOCK_CACHE_INDEX_HIT, BLOCK_CACHE_INDEX_MISS,
+            BLOCK_CACHE_FILTER_HIT, BLOCK_CACHE_FILTER_MISS,
+            BLOCK_CACHE_DATA_HIT, BLOCK_CACHE_DATA_MISS,
+            BLOOM_FILTER_USEFUL, BLOOM_FILTER_FULL_POSITIVE, BLOOM_FILTER_FULL_TRUE_POSITIVE,
+            BLOOM_FILTER_PREFIX_CHECKED, BLOOM_FILTER_PREFIX_USEFUL,
+            MEMTABLE_HIT, MEMTABLE_MISS,
+            GET_HIT_L0, GET_HIT_L1, GET_HIT_L2_AND_UP,
+            NUMBER_KEYS_READ, NUMBER_DB_SEEK, NUMBER_MULTIGET_KEYS_READ,
+            BYTES_READ, ITER_BYTES_READ, NUMBER_MULTIGET_BYTES_READ, BYTES_WRITTEN,
+            COMPACT_READ_BYTES, COMPACT_WRITE_BYTES, FLUSH_WRITE_BYTES,
+            STALL_MICROS,
+        };
+        return ret;
+    }
+
+    /// The rocksdb latency histograms that we report, with the short names we report them as
+    const std::vector<std::pair<rocksdb::Histograms, QString>> & reportedHistograms() {
+        using namespace rocksdb;
+        static const std::vector<std::pair<Histograms, QString>> ret = {
+            { DB_GET, "get" }, { DB_MULTIGET, "multiget" }, { DB_SEEK, "seek" }, { DB_WRITE, "write" },
+            { COMPACTION_TIME, "compaction" }, { WRITE_STALL, "write_stall" },
+        };
+        return ret;
+    }
+
+    QString tickerName(rocksdb::Tickers t) {
+        for (const auto & [ticker, name] : rocksdb::TickersNameMap)
+            if (ticker == t) return QString::fromStdString(name);
+        return QString::number(int(t));
+    }
+
+    QVariantMap dbStatisticsMap(const rocksdb::Statistics &st) {
+        QVariantMap ret, tickers, hists;
+        for (const auto t : reportedTickers())
+            tickers[tickerName(t)] = qulonglong(st.getTickerCount(t));
+        for (const auto & [h, name] : reportedHistograms()) {
+            rocksdb::HistogramData d;
+            st.histogramData(h, &d);
+            hists[name] = QVariantMap{
+                { "count", qulonglong(d.count) }, { "avg_us", d.average }, { "p50_us", d.median },
+                { "p95_us", d.percentile95 }, { "p99_us", d.percentile99 }, { "max_us", d.max },
+            };
+        }
+        ret["tickers"] = tickers;
+        ret["latency histograms"] = hists;
+        const auto hits = st.getTickerCount(rocksdb::BLOCK_CACHE_HIT), misses = st.getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+        ret["block cache hit rate"] = hits + misses ? double(hits) / double(hits + misses) : QVariant();
+        return ret;
+    }
+
+    QVariantMap ioStatsMap(const DBTable::IOStats &io) {
+        constexpr auto relaxed = std::memory_order_relaxed;
+        const auto checked = io.bloomChecked.load(relaxed), useful = io.bloomUseful.load(relaxed);
+        return QVariantMap{
+            { "queries", qulonglong(io.queries.load(relaxed)) },
+            { "block reads", qulonglong(io.blockReads.load(relaxed)) },
+            { "block read bytes", qulonglong(io.blockReadBytes.load(relaxed)) },
+            { "block cache hits", qulonglong(io.blockCacheHits.load(relaxed)) },
+            { "bloom checks", qulonglong(checked) },
+            { "bloom useful", qulonglong(useful) },
+            { "bloom useful rate", checked ? double(useful) / double(checked) : QVariant() },
+            { "internal keys skipped", qulonglong(io.keysSkipped.load(relaxed)) },
+        };
+    }
+
+    /// An estimate of the worst-case read amplification of a point lookup in table `t`: the number of sorted runs
+    /// (each L0 file, plus each non-empty level below L0) that a lookup may have to consult.
+    qulonglong sortedRuns(const DBTable &t) {
+        qulonglong ret = 0;
+        const int nLevels = t.db->NumberLevels(t.cf);
+        for (int level = 0; level < nLevels; ++level) {
+            std::string s;
+            if (!t.db->GetProperty(t.cf, "rocksdb.num-files-at-level" + std::to_string(level), &s))
+                break;
+            const qulonglong n = QString::fromStdString(s).toULongLong();
+            ret += level == 0 ? n : qulonglong(n > 0);
+        }
+        return ret;
+    }
+} // namespace
+
+bool Storage::isDBStatsEnabled() const { return dbStatsEnabled.load(std::memory_order_relaxed); }
+
+void Storage::setDBStatsEnabled(bool b)
+{
+    dbStatsEnabled = b;
+    if (p->db.statistics)
+        p->db.statistics->set_stats_level(b ? rocksdb::StatsLevel::kExceptDetailedTimers : rocksdb::StatsLevel::kDisableAll);
+}
+
+QString Storage::dbStatsPrometheusText() const
+{
+    QString out;
+    if (!isDBStatsEnabled() || !p->db.statistics) return out;
+    const auto & st = *p->db.statistics;
+    out += Metrics::familyHeader("fulcrum_rocksdb_ticker_total", "RocksDB internal ticker counts (db_stats)", "counter");
+    for (const auto t : reportedTickers())
+        out += QStringLiteral("fulcrum_rocksdb_ticker_total{ticker=\"%1\"} %2\n").arg(tickerName(t)).arg(st.getTickerCount(t));
+    out += Metrics::familyHeader("fulcrum_rocksdb_op_micros", "RocksDB operation latency in microseconds (db_stats)", "summary");
+    for (const auto & [h, name] : reportedHistograms()) {
+        rocksdb::HistogramData d;
+        st.histogramData(h, &d);
+        const std::pair<QString, double> quantiles[] = { {"0.5", d.median}, {"0.95", d.percentile95}, {"0.99", d.percentile99} };
+        for (const auto & [q, v] : quantiles)
+            out += QStringLiteral("fulcrum_rocksdb_op_micros{op=\"%1\",quantile=\"%2\"} %3\n").arg(name, q, QString::number(v, 'g', 12));
+        out += QStringLiteral("fulcrum_rocksdb_op_micros_sum{op=\"%1\"} %2\n").arg(name).arg(d.sum)
+             + QStringLiteral("fulcrum_rocksdb_op_micros_count{op=\"%1\"} %2\n").arg(name).arg(d.count);
+    }
+    // per-table counters from our hot queries
+    struct Counter { const char *name, *help; std::atomic<uint64_t> DBTable::IOStats::*member; };
+    static const Counter counters[] = {
+        { "fulcrum_db_table_queries_total", "Hot-path queries per table (db_stats)", &DBTable::IOStats::queries },
+        { "fulcrum_db_table_block_reads_total", "Blocks read from disk by hot-path queries (db_stats)", &DBTable::IOStats::blockReads },
+        { "fulcrum_db_table_block_read_bytes_total", "Bytes read from disk by hot-path queries (db_stats)", &DBTable::IOStats::blockReadBytes },
+        { "fulcrum_db_table_block_cache_hits_total", "Block cache hits of hot-path queries (db_stats)", &DBTable::IOStats::blockCacheHits },
+        { "fulcrum_db_table_bloom_checks_total", "SST bloom filter checks by hot-path queries (db_stats)", &DBTable::IOStats::bloomChecked },
+        { "fulcrum_db_table_bloom_useful_total", "SST bloom filter checks that avoided a read (db_stats)", &DBTable::IOStats::bloomUseful },
+    };
+    for (const auto & c : counters) {
+        out += Metrics::familyHeader(c.name, c.help, "counter");
+        for (const DBTable *t : p->db.tables()) {
+            if (!*t || !t->io) continue;
+            out += QStringLiteral("%1{table=\"%2\"} %3\n").arg(c.name, Metrics::escapeLabelValue(DBName(*t)))
+                                                           .arg((t->io->*c.member).load(std::memory_order_relaxed));
+        }
+    }
+    return out;
+}
+
 auto Storage::stats() const -> Stats
 {
     // TODO ... more stuff here, perhaps
     QVariantMap ret;
-    auto & c = p->db.concatOperator, & c2 = p->db.concatOperatorTxHash2TxNum;
+    auto & c = p->db.historyOperator;
+    auto & c2 = p->db.concatOperatorTxHash2TxNum;
     ret["merge calls"] = c ? c->merges.load() : QVariant();
     ret["merge calls (txhash2txnum)"] = c2 ? c2->merges.load() : QVariant();
+    ret["txhash index"] = p->db.txhash2txnumMgr ? p->db.txhash2txnumMgr->stats() : QVariant();
     QVariantMap caches;
     {
         QVariantMap m;
@@ -2046,6 +3323,8 @@ auto Storage::stats() const -> Stats
         m["~misses"] = qlonglong(p->lruCacheStats.height2HashesMisses);
         caches["LRU Cache: Block Height -> TxHashes"] = m;
     }
+    if (p->hotHistory)
+        caches["Hot Cache: ScriptHash -> History"] = p->hotHistory->stats();
     {
         const size_t nHashes = p->merkleCache->size(), bytes = nHashes * (HashLen + sizeof(HeaderHash));
         caches["merkleHeaders_Size"] = qulonglong(nHashes);
@@ -2055,16 +3334,20 @@ auto Storage::stats() const -> Stats
     {
         // db stats
         QVariantMap m;
-        for (const auto ptr : { &p->db.blkinfo, &p->db.meta, &p->db.shist, &p->db.shunspent, &p->db.undo, &p->db.utxoset,
-                                &p->db.txhash2txnum }) {
+        for (const DBTable *t : p->db.tables()) {
+            if (!*t) continue;
             QVariantMap m2;
-            const auto & db = *ptr;
-            const QString name = QFileInfo(QString::fromStdString(db->GetName())).fileName();
-            for (const auto prop : { "rocksdb.estimate-table-readers-mem", "rocksdb.cur-size-all-mem-tables"}) {
-                if (std::string s; LIKELY(db->GetProperty(prop, &s)) )
+            const QString name = DBName(*t);
+            for (const auto prop : { "rocksdb.estimate-table-readers-mem", "rocksdb.cur-size-all-mem-tables",
+                                     "rocksdb.estimate-num-keys", "rocksdb.total-sst-files-size",
+                                     "rocksdb.estimate-pending-compaction-bytes"}) {
+                if (std::string s; LIKELY(t->db->GetProperty(t->cf, prop, &s)) )
                     m2[prop] = QString::fromStdString(s);
             }
-            if (auto fact = db->GetOptions().table_factory; LIKELY(fact) ) {
+            m2["read amplification (sorted runs)"] = sortedRuns(*t);
+            if (t->io && isDBStatsEnabled())
+                m2["query I/O"] = ioStatsMap(*t->io);
+            if (auto fact = t->db->GetOptions(t->cf).table_factory; LIKELY(fact) ) {
                 // parse the table factory options string, which is of the form "     opt1: val1\n     opt2: val2\n  ... "
                 QVariantMap m3;
                 QString rocksdbOptionsString;
@@ -2086,11 +3369,12 @@ auto Storage::stats() const -> Stats
                 m2["table factory options"] = m3;
             } else
                 m2["table factory options"] = QVariant(); // explicitly state it was null (this branch should not normally happen)
-            m2["max_open_files"] = db->GetOptions().max_open_files;
-            m2["keep_log_file_num"] = qulonglong(db->GetOptions().keep_log_file_num);
+            m2["max_open_files"] = t->db->GetDBOptions().max_open_files;
+            m2["keep_log_file_num"] = qulonglong(t->db->GetDBOptions().keep_log_file_num);
             m[name] = m2;
         }
         ret["DB Stats"] = m;
+        ret["DB Statistics"] = isDBStatsEnabled() && p->db.statistics ? dbStatisticsMap(*p->db.statistics) : QVariant();
         if (const auto cache = p->db.blockCache.lock(); cache) {
             QVariantMap cmap;
             cmap["usage"] = qulonglong(cache->GetUsage());
@@ -2212,7 +3496,7 @@ void Storage::save_impl(SaveSpec override)
 void Storage::saveMeta_impl()
 {
     if (!p->db.meta) return;
-    if (auto status = p->db.meta->Put(p->db.defWriteOpts, kMeta, ToSlice(Serialize(p->meta))); !status.ok()) {
+    if (auto status = p->db.rdb->Put(p->db.defWriteOpts, p->db.meta.cf, kMeta, ToSlice(Serialize(p->meta))); !status.ok()) {
         throw DatabaseError("Failed to write meta to db");
     }
 
@@ -2298,6 +3582,22 @@ void Storage::loadCheckHeadersInDB()
     assert(p->blockHeaderSize() > 0);
     p->headersFile = std::make_unique<RecordFile>(options->datadir + QDir::separator() + "headers", size_t(p->blockHeaderSize()), 0x00f026a1); // may throw
 
+    // A header is appended before its block's db batch is committed, and it is truncated only after a block undo batch
+    // is committed. So after an unclean shutdown the headers file may be ahead of the db (by more than one block if the
+    // unsynced WAL tail was lost during initial sync). The db is authoritative here, so drop the extra header(s).
+    if (const auto n0 = p->headersFile->numRecords(); n0) {
+        auto n = n0;
+        while (n && !GenericDBGet<BlkInfo>(p->db.blkinfo, uint32_t(n - 1), true, QString(), false, p->db.defReadOpts))
+            --n;
+        if (n != n0) {
+            Warning() << (n0 - n) << Util::Pluralize(" header", n0 - n) << " past height " << (long(n) - 1)
+                      << " never made it to the db (unclean shutdown?), discarding";
+            QString err;
+            if (p->headersFile->truncate(n, &err) != n || !err.isEmpty())
+                throw DatabaseError(QString("Failed to truncate headers file: %1").arg(err));
+        }
+    }
+
     Log() << "Verifying headers ...";
     uint32_t num = unsigned(p->headersFile->numRecords());
     std::vector<QByteArray> hVec;
@@ -2319,14 +3619,24 @@ void Storage::loadCheckHeadersInDB()
             // set genesis hash
             p->genesisHash = BTC::HashRev(hVec.front());
 
-            err.clear();
-            // read db
-            for (uint32_t i = 0; i < num; ++i) {
-                auto & bytes = hVec[i];
-                if (!verif(bytes, &err))
-                    throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(err));
-                bytes = BTC::Hash(bytes); // replace the header in the vector with its hash because it will be needed below...
-            }
+            // Verify in chunks, in parallel. Each chunk gets its own verifier, seeded with the header just before the
+            // chunk, so that the links between the chunks get checked too. The hashes go into a separate vector since
+            // the neighbouring chunk still needs the raw headers.
+            constexpr uint32_t kChunk = 10'000;
+            std::vector<QByteArray> hashes(num);
+            ParallelFor((num + kChunk - 1u) / kChunk, [&hVec, &hashes, num](const size_t c) {
+                const uint32_t begin = uint32_t(c) * kChunk, end = std::min(num, begin + kChunk);
+                BTC::HeaderVerifier chunkVerif;
+                if (begin) chunkVerif.reset(begin, hVec[begin - 1u]);
+                QString chunkErr;
+                for (uint32_t i = begin; i < end; ++i) {
+                    if (!chunkVerif(hVec[i], &chunkErr))
+                        throw DatabaseFormatError(QString("%1. Possible databaase corruption. Delete the datadir and resynch.").arg(chunkErr));
+                    hashes[i] = BTC::Hash(hVec[i]);
+                }
+            }, 0, "CheckHeaders");
+            verif.reset(num, hVec.back()); // leave the verifier in the same state as if it had seen every header
+            hVec = std::move(hashes); // we need the hashes below
         }
     }
     if (num) {
@@ -2351,19 +3661,35 @@ void Storage::loadCheckTxNumsFileAndBlkInfo()
     {
         p->blkInfos.reserve(std::min(size_t(height+1), MAX_HEADERS));
         Log() << "Checking tx counts ...";
-        for (int i = 0; i <= height; ++i) {
+        // read them all in parallel first, then check them in order below
+        std::vector<BlkInfo> infos(size_t(height) + 1u);
+        constexpr size_t kChunk = 10'000;
+        ParallelFor((infos.size() + kChunk - 1u) / kChunk, [this, &infos](const size_t c) {
             static const QString errMsg("Failed to read a blkInfo from db, the database may be corrupted");
-            const auto blkInfo = GenericDBGetFailIfMissing<BlkInfo>(p->db.blkinfo.get(), uint32_t(i), errMsg, false, p->db.defReadOpts);
+            for (size_t i = c * kChunk, end = std::min(infos.size(), i + kChunk); i < end; ++i)
+                infos[i] = GenericDBGetFailIfMissing<BlkInfo>(p->db.blkinfo, uint32_t(i), errMsg, false, p->db.defReadOpts);
+        }, 0, "CheckBlkInfo");
+        for (int i = 0; i <= height; ++i) {
+            const BlkInfo &blkInfo = infos[size_t(i)];
             if (blkInfo.txNum0 != ct)
                 throw DatabaseFormatError(QString("BlkInfo for height %1 does not match computed txNum of %2."
                                                   "\n\nThe database may be corrupted. Delete the datadir and resynch it.\n")
                                           .arg(i).arg(ct));
             ct += blkInfo.nTx;
             p->blkInfos.emplace_back(blkInfo);
-            p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
         }
+        p->setTxNumHeightIndex(TxNumHeightIndex::build(p->blkInfos));
         Log() << ct << " total transactions";
     }
+    if (ct < p->txNumNext) {
+        // Like the headers file, the txNums file is appended-to before the db batch is committed, and truncated after
+        // an undo is committed, so it may be ahead of the db after an unclean shutdown. Trim it to match the db.
+        Warning() << "The txNums file has " << (p->txNumNext - ct) << " extra record(s) (unclean shutdown?), discarding them";
+        QString err;
+        if (p->txNumsFile->truncate(ct, &err) != ct || !err.isEmpty())
+            throw DatabaseError(QString("Failed to truncate txNums file: %1").arg(err));
+        p->txNumNext = ct;
+    }
     if (ct != p->txNumNext) {
         throw DatabaseFormatError(QString("BlkInfo txNums do not add up to expected value of %1 != %2."
                                           "\n\nThe database may be corrupted. Delete the datadir and resynch it.\n")
@@ -2375,13 +3701,20 @@ void Storage::loadCheckTxNumsFileAndBlkInfo()
 void Storage::loadCheckTxHash2TxNumMgr()
 {
     // the below may throw
-    p->db.txhash2txnumMgr = std::make_unique<TxHash2TxNumMgr>(p->db.txhash2txnum.get(), p->db.defReadOpts, p->db.defWriteOpts,
-                                                              p->txNumsFile.get(), 6, TxHash2TxNumMgr::KeyPos::End);
+    p->db.txhash2txnumMgr = std::make_unique<TxHash2TxNumMgr>(p->db.txhash2txnum, p->db.defReadOpts, p->db.defWriteOpts,
+                                                              p->txNumsFile.get(), options->txHashIndexBytes,
+                                                              TxHash2TxNumMgr::KeyPos::End);
+    const auto nrecs = p->txNumsFile->numRecords();
     try {
+        // if the user changed txhash_index_bytes, the index must be rebuilt with the new key width
+        if (const auto stored = p->db.txhash2txnumMgr->storedKeyBytes().value_or(TxHash2TxNumMgr::kLegacyKeyBytes);
+                nrecs && stored != p->db.txhash2txnumMgr->keyBytes)
+            throw DatabaseError(QString("The txhash index uses %1-byte keys, but txhash_index_bytes = %2.")
+                                .arg(stored).arg(p->db.txhash2txnumMgr->keyBytes));
+
         // basic sanity checks -- ensure we can read the first, middle, and last hash in the txNumsFile,
         // and that those hashes exist in the txhash2txnum db
         const QString errMsg = "The txhash index failed basic sanity checks -- it is missing some records.";
-        const auto nrecs = p->txNumsFile->numRecords();
         if (nrecs) {
             for (auto recNum : {uint64_t(0), uint64_t(nrecs/2), uint64_t(nrecs-1)}) {
                 if (!p->db.txhash2txnumMgr->exists(p->txNumsFile->readRecord(recNum)))
@@ -2389,8 +3722,10 @@ void Storage::loadCheckTxHash2TxNumMgr()
             }
         } else {
             // sanity check on empty db: if no records, db should also have no rows
-            std::unique_ptr<rocksdb::Iterator> it(p->db.txhash2txnum->NewIterator(p->db.defReadOpts));
+            std::unique_ptr<rocksdb::Iterator> it(p->db.rdb->NewIterator(p->db.defReadOpts, p->db.txhash2txnum.cf));
             for (it->SeekToFirst(); it->Valid(); it->Next()) {
+                if (it->key().size() > p->db.txhash2txnumMgr->keyBytes)
+                    continue; // skip meta entries (e.g. the saved key width), these are always longer than real keys
                 throw DatabaseFormatError(QString("Failed invariant: empty txNum file should mean empty db; ") + errMsg);
             }
         }
@@ -2414,6 +3749,11 @@ void Storage::loadCheckTxHash2TxNumMgr()
         }
         p->db.txhash2txnumMgr->rebuildDB();
     }
+    p->db.txhash2txnumMgr->saveKeyBytes(); // no-op in effect if already saved; needed for older and brand new db's
+    Debug() << "txhash index: " << p->db.txhash2txnumMgr->keyBytes << "-byte keys"
+            << (p->db.txhash2txnumMgr->fullKeys() ? " (full hashes, lookups need no verification)" : "");
+    if (options->txHashFilter) // leave headroom for this session's new blocks
+        p->db.txhash2txnumMgr->startFilter(nrecs + nrecs / 4 + 1'000'000);
 }
 
 // NOTE: this must be called *after* loadCheckTxNumsFileAndBlkInfo(), because it needs a valid p->txNumNext
@@ -2448,7 +3788,7 @@ void Storage::loadCheckUTXOsInDB()
                     continue;
                 const TxNum txNum = p->blkInfos[height].txNum0;
                 const CompactTXO ctxo(txNum, txo.outN);
-                auto opt = GenericDBGet<QByteArray>(p->db.shunspent.get(), mkShunspentKey(hashx, ctxo), true, "", false, p->db.defReadOpts);
+                auto opt = GenericDBGet<QByteArray>(p->db.shunspent, mkShunspentKey(hashx, ctxo), true, "", false, p->db.defReadOpts);
                 if (opt.has_value()) {
                     if (seenExceptions.insert(txo).second)
                         Debug() << "Seen exception: " << txo.toString() << ", height: " << height;
@@ -2460,73 +3800,82 @@ void Storage::loadCheckUTXOsInDB()
         {
             const int currentHeight = latestTip().first;
 
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.utxoset->NewIterator(p->db.defReadOpts));
-            if (!iter) throw DatabaseError("Unable to obtain an iterator to the utxo set db");
-            p->utxoCt = 0;
-            for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-                // TODO: the below checks may be too slow. See about removing them and just counting the iter.
-                const auto txo = Deserialize<TXO>(FromSlice(iter->key()));
-                if (!txo.isValid()) {
-                    throw DatabaseSerializationError("Read an invalid txo from the utxo set database."
-                                                     " This may be due to a database format mismatch."
-                                                     "\n\nDelete the datadir and resynch to bitcoind.\n");
-                }
-                auto info = Deserialize<TXOInfo>(FromSlice(iter->value()));
-                if (!info.isValid())
-                    throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
-                                                            " This may be due to a database format mismatch."
-                                                            "\n\nDelete the datadir and resynch to bitcoind.\n")
-                                                     .arg(txo.toString()));
-
-                // compensate for counts being off due to historical bugs in blockchain
-                // these outpoints actually generate 2 entries in shunspent and 1 entry here
-                // we must tolerate counts being off if we see this utxo.
-                if (auto it = fudgeDueToBitcoinBugs.find(txo);
-                        it != fudgeDueToBitcoinBugs.end() && it->second.second.count(info.confirmedHeight.value_or(0))) {
-                    if (seenExceptions.insert(txo).second)
-                        Debug() << "Seen exception: " << txo.toString();
-                }
+            std::mutex seenExceptionsMut; // guards seenExceptions while the workers below run
+            // the utxo set is keyed by prevout hash, so the scan can be sharded evenly across cores by key range
+            const auto ranges = SplitKeyspace(256);
+            ScanProgress progress([](size_t ct) { Log() << "CheckDB: Verified " << ct << " utxos ..."; }, 2'500'000);
+            ParallelFor(ranges.size(), [&](const size_t r) {
+                RangeIter iter(p->db.utxoset, p->db.scanReadOpts, ranges[r]);
+                size_t pending = 0;
+                for ( ; iter->Valid(); iter->Next()) {
+                    // TODO: the below checks may be too slow. See about removing them and just counting the iter.
+                    const auto txo = Deserialize<TXO>(FromSlice(iter->key()));
+                    if (!txo.isValid()) {
+                        throw DatabaseSerializationError("Read an invalid txo from the utxo set database."
+                                                         " This may be due to a database format mismatch."
+                                                         "\n\nDelete the datadir and resynch to bitcoind.\n");
+                    }
+                    auto info = Deserialize<TXOInfo>(FromSlice(iter->value()));
+                    if (!info.isValid())
+                        throw DatabaseSerializationError(QString("Txo %1 has invalid metadata in the db."
+                                                                " This may be due to a database format mismatch."
+                                                                "\n\nDelete the datadir and resynch to bitcoind.\n")
+                                                         .arg(txo.toString()));
+
+                    // compensate for counts being off due to historical bugs in blockchain
+                    // these outpoints actually generate 2 entries in shunspent and 1 entry here
+                    // we must tolerate counts being off if we see this utxo.
+                    if (auto it = fudgeDueToBitcoinBugs.find(txo);
+                            it != fudgeDueToBitcoinBugs.end() && it->second.second.count(info.confirmedHeight.value_or(0))) {
+                        if (std::unique_lock g(seenExceptionsMut); seenExceptions.insert(txo).second)
+                            Debug() << "Seen exception: " << txo.toString();
+                    }
 
-                // this is a deep test: only happens if -C / --checkdb is specified on CLI or in conf.
-                const CompactTXO ctxo = CompactTXO(info.txNum, txo.outN);
-                const QByteArray shuKey = mkShunspentKey(info.hashX, ctxo);
-                static const QString errPrefix("Error reading scripthash_unspent");
-                QByteArray tmpBa;
-                SHUnspentValue shval;
-                if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false, fail5 = false;
-                        (fail1 = (info.confirmedHeight.has_value() && int(*info.confirmedHeight) > currentHeight))
-                        || (fail2 = info.txNum >= p->txNumNext)
-                        || (fail3 = (tmpBa = GenericDBGet<QByteArray>(p->db.shunspent.get(), shuKey, true, errPrefix, false, p->db.defReadOpts).value_or("")).isEmpty())
-                        || (fail4 = (!(shval = Deserialize<SHUnspentValue>(tmpBa)).valid || info.amount != shval.amount))
-                        || (fail5 = (info.tokenDataPtr != shval.tokenDataPtr))) {
-                    // TODO: reorg? Inconsisent db?  FIXME
-                    QString msg;
-                    {
-                        QTextStream ts(&msg);
-                        ts << "Inconsistent database: txo " << txo.toString() << " at height: "
-                           << info.confirmedHeight.value();
-                        if (fail1) {
-                            ts << " > current height: " << currentHeight << ".";
-                        } else if (fail2) {
-                            ts << ". TxNum: " << info.txNum << " >= " << p->txNumNext << ".";
-                        } else if (fail3) {
-                            ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
-                        } else if (fail4) {
-                            ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
-                        } else if (fail5) {
-                            ts << ". Token data does not match the ctxo token_data in the scripthash_unspent db.";
+                    // this is a deep test: only happens if -C / --checkdb is specified on CLI or in conf.
+                    const CompactTXO ctxo = CompactTXO(info.txNum, txo.outN);
+                    const QByteArray shuKey = mkShunspentKey(info.hashX, ctxo);
+                    static const QString errPrefix("Error reading scripthash_unspent");
+                    QByteArray tmpBa;
+                    SHUnspentValue shval;
+                    if (bool fail1 = false, fail2 = false, fail3 = false, fail4 = false, fail5 = false;
+                            (fail1 = (info.confirmedHeight.has_value() && int(*info.confirmedHeight) > currentHeight))
+                            || (fail2 = info.txNum >= p->txNumNext)
+                            || (fail3 = (tmpBa = GenericDBGet<QByteArray>(p->db.shunspent, shuKey, true, errPrefix, false, p->db.defReadOpts).value_or("")).isEmpty())
+                            || (fail4 = (!(shval = Deserialize<SHUnspentValue>(tmpBa)).valid || info.amount != shval.amount))
+                            || (fail5 = (info.tokenDataPtr != shval.tokenDataPtr))) {
+                        // TODO: reorg? Inconsisent db?  FIXME
+                        QString msg;
+                        {
+                            QTextStream ts(&msg);
+                            ts << "Inconsistent database: txo " << txo.toString() << " at height: "
+                               << info.confirmedHeight.value();
+                            if (fail1) {
+                                ts << " > current height: " << currentHeight << ".";
+                            } else if (fail2) {
+                                ts << ". TxNum: " << info.txNum << " >= " << p->txNumNext << ".";
+                            } else if (fail3) {
+                                ts << ". Failed to find ctxo " << ctxo.toString() << " in the scripthash_unspent db.";
+                            } else if (fail4) {
+                                ts << ". Utxo amount does not match the ctxo amount in the scripthash_unspent db.";
+                            } else if (fail5) {
+                                ts << ". Token data does not match the ctxo token_data in the scripthash_unspent db.";
+                            }
+                            ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
                         }
-                        ts << "\n\nThe database has been corrupted. Please delete the datadir and resynch to bitcoind.\n";
+                        throw DatabaseError(msg);
+                    }
+                    if (UNLIKELY(++pending == ScanProgress::kChunk)) {
+                        progress.add(pending);
+                        pending = 0;
+                        if (app() && app()->signalsCaught())
+                            throw UserInterrupted("User interrupted, aborting check");
                     }
-                    throw DatabaseError(msg);
-                }
-                if (0 == ++p->utxoCt % 100'000) {
-                    *(0 == p->utxoCt % 2'500'000 ? std::make_unique<Log>() : std::make_unique<Debug>())
-                            << "CheckDB: Verified " << p->utxoCt << " utxos ...";
-                } else if (0 == p->utxoCt % 1'000 && app() && app()->signalsCaught()) {
-                    throw UserInterrupted("User interrupted, aborting check");
                 }
-            }
+                if (!iter->status().ok())
+                    throw DatabaseError("Error iterating over the utxo set db: " + StatusString(iter->status()));
+                progress.add(pending);
+            }, 0, "CheckUTXOs");
+            p->utxoCt = progress.count();
 
             if (const auto metact = readUtxoCtFromDB();
                     // counts may be slightly off due to the dupe tx's outlined above -- after this is run
@@ -2560,9 +3909,6 @@ void Storage::loadCheckShunspentInDB()
 
     const Tic t0;
 
-    std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
-    if (!iter) throw DatabaseError("Unable to obtain an iterator to the scripthash unspent db");
-
     // Note: Before the BIP that imposed uniqueness on coinbase tx's,
     // Bitcoin coinbase tx's for heights 91842 and 91812 both have outpoint:
     //      d5d27987d2a3dfc724e359870c6644b40e497bdc0589a033220fe15429d88599:0
@@ -2579,53 +3925,68 @@ void Storage::loadCheckShunspentInDB()
 
     constexpr auto errMsg = "This may be due to either a database format mismatch or data corruption."
                             "\n\nDelete the datadir and resynch to bitcoind.\n";
-    size_t ctr = 0;
-    for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
-        const auto &[hashx, ctxo] = extractShunspentKey(iter->key());
-        if (!ctxo.isValid())
-            throw DatabaseError(QString("Read an invalid compact txo from the scripthash_unspent database. %1").arg(errMsg));
-        TXOInfo info;
-        {
-            SHUnspentValue shuval = Deserialize<SHUnspentValue>(FromSlice(iter->value()));
-            if (UNLIKELY(!shuval.valid || !bitcoin::MoneyRange(shuval.amount)))
-                throw DatabaseError(QString("Read an invalid SHUnspentValue from the scripthash_unspent database for scripthash: %1. %2")
-                                    .arg(QString(hashx.toHex()), errMsg));
-            info.txNum = ctxo.txNum();
-            info.hashX = hashx;
-            info.amount = shuval.amount;
-            info.confirmedHeight = heightForTxNum(ctxo.txNum());
-            info.tokenDataPtr = std::move(shuval.tokenDataPtr);
-        }
-        const TxHash txHash = hashForTxNum(ctxo.txNum(), true, nullptr, true).value_or(QByteArray()); // throws if missing
-        const TXO txo{txHash, ctxo.N()};
-        // look for this in the UTXO db
-        const auto optInfo = GenericDBGet<TXOInfo>(p->db.utxoset.get(), ToSlice(Serialize(txo)), true, "", false, p->db.defReadOpts);
-        if (!optInfo) {
-            // we permit the buggy utxos above to be off -- those are due to collisions in historical blockchain
-            if (!exceptionsDueToBitcoinBugs.count(txo))
-                throw DatabaseError(QString("The scripthash_unspent table is missing a corresponding entry in the UTXO table for TXO \"%1\". %2")
-                                    .arg(txo.toString(), errMsg));
-            else {
-                seenExceptions.insert(txo);
-                Debug() << "Seen exception: " << txo.toString() << ", height: " << info.confirmedHeight.value_or(0);
+    std::mutex seenExceptionsMut; // guards seenExceptions while the workers below run
+    // scripthash_unspent is keyed by HashX, so the scan can be sharded evenly across cores by key range
+    const auto ranges = SplitKeyspace(256);
+    ScanProgress progress([](size_t ct) { Log() << "CheckDB: Verified " << ct << " scripthash_unspent entries ..."; }, 200'000);
+    ParallelFor(ranges.size(), [&](const size_t r) {
+        RangeIter iter(p->db.shunspent, p->db.scanReadOpts, ranges[r]);
+        size_t pending = 0;
+        for ( ; iter->Valid(); iter->Next()) {
+            const auto &[hashx, ctxo] = extractShunspentKey(iter->key());
+            if (!ctxo.isValid())
+                throw DatabaseError(QString("Read an invalid compact txo from the scripthash_unspent database. %1").arg(errMsg));
+            TXOInfo info;
+            {
+                SHUnspentValue shuval = Deserialize<SHUnspentValue>(FromSlice(iter->value()));
+                if (UNLIKELY(!shuval.valid || !bitcoin::MoneyRange(shuval.amount)))
+                    throw DatabaseError(QString("Read an invalid SHUnspentValue from the scripthash_unspent database for scripthash: %1. %2")
+                                        .arg(QString(hashx.toHex()), errMsg));
+                info.txNum = ctxo.txNum();
+                info.hashX = hashx;
+                info.amount = shuval.amount;
+                info.confirmedHeight = heightForTxNum(ctxo.txNum());
+                info.tokenDataPtr = std::move(shuval.tokenDataPtr);
+            }
+            const TxHash txHash = hashForTxNum(ctxo.txNum(), true, nullptr, true).value_or(QByteArray()); // throws if missing
+            const TXO txo{txHash, ctxo.N()};
+            // look for this in the UTXO db
+            const auto optInfo = GenericDBGet<TXOInfo>(p->db.utxoset, ToSlice(Serialize(txo)), true, "", false, p->db.defReadOpts);
+            if (!optInfo) {
+                // we permit the buggy utxos above to be off -- those are due to collisions in historical blockchain
+                if (!exceptionsDueToBitcoinBugs.count(txo))
+                    throw DatabaseError(QString("The scripthash_unspent table is missing a corresponding entry in the UTXO table for TXO \"%1\". %2")
+                                        .arg(txo.toString(), errMsg));
+                else {
+                    std::unique_lock g(seenExceptionsMut);
+                    seenExceptions.insert(txo);
+                    Debug() << "Seen exception: " << txo.toString() << ", height: " << info.confirmedHeight.value_or(0);
+                }
             }
-        }
 
-        if (!info.isValid() || !optInfo->isValid() || *optInfo != info) {
-            // we permit the buggy utxos above to be off -- those are due to collisions in historical blockchain
-            if (!exceptionsDueToBitcoinBugs.count(txo))
-                throw DatabaseError(QString("TXO \"%1\" mismatch between scripthash_unspent and the UTXO table. %2")
-                                    .arg(txo.toString(), errMsg));
-            else {
-                seenExceptions.insert(txo);
-                Debug() << "Seen exception: " << txo.toString() << ", height: " << info.confirmedHeight.value_or(0);
+            if (!info.isValid() || !optInfo->isValid() || *optInfo != info) {
+                // we permit the buggy utxos above to be off -- those are due to collisions in historical blockchain
+                if (!exceptionsDueToBitcoinBugs.count(txo))
+                    throw DatabaseError(QString("TXO \"%1\" mismatch between scripthash_unspent and the UTXO table. %2")
+                                        .arg(txo.toString(), errMsg));
+                else {
+                    std::unique_lock g(seenExceptionsMut);
+                    seenExceptions.insert(txo);
+                    Debug() << "Seen exception: " << txo.toString() << ", height: " << info.confirmedHeight.value_or(0);
+                }
+            }
+            if (UNLIKELY(++pending == ScanProgress::kChunk)) {
+                progress.add(pending);
+                pending = 0;
+                if (app() && app()->signalsCaught())
+                    throw UserInterrupted("User interrupted, aborting check");
             }
         }
-        if (0 == ++ctr % 10000) {
-            *(0 == ctr % 200000 ? std::make_unique<Log>() : std::make_unique<Debug>())
-                    << "CheckDB: Verified " << ctr << " scripthash_unspent entries ...";
-        }
-    }
+        if (!iter->status().ok())
+            throw DatabaseError("Error iterating over the scripthash_unspent db: " + StatusString(iter->status()));
+        progress.add(pending);
+    }, 0, "CheckShunspent");
+    const size_t ctr = progress.count();
 
     if (const auto metact = readUtxoCtFromDB();
             // tolerate being off by as much as 2 in case the exceptional utxos get spent!
@@ -2646,7 +4007,7 @@ void Storage::loadCheckEarliestUndo()
     using UIntSet = std::set<uint32_t>;
     UIntSet swissCheeseDetector;
     {
-        std::unique_ptr<rocksdb::Iterator> iter(p->db.undo->NewIterator(p->db.defReadOpts));
+        std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(p->db.defReadOpts, p->db.undo.cf));
         if (!iter) throw DatabaseError("Unable to obtain an iterator to the undo db");
         for (iter->SeekToFirst(); iter->Valid(); iter->Next()) {
             const auto keySlice = iter->key();
@@ -2681,7 +4042,7 @@ void Storage::loadCheckEarliestUndo()
         // delete everything up until the first contiguous height we saw
         int delctr = 0;
         for (auto it = swissCheeseDetector.begin(); it != eraseUntil; ++delctr) {
-            GenericDBDelete(p->db.undo.get(), uint32_t(*it));
+            GenericDBDelete(p->db.undo, uint32_t(*it));
             it = swissCheeseDetector.erase(it);
         }
         p->earliestUndoHeight = !swissCheeseDetector.empty() ? *swissCheeseDetector.begin() : p->InvalidUndoHeight;
@@ -2702,7 +4063,7 @@ void Storage::loadCheckEarliestUndo()
     if (!swissCheeseDetector.empty()) {
         const uint32_t height = *swissCheeseDetector.rbegin();
         const QString errMsg(QString("Unable to read undo data for height %1").arg(height));
-        const UndoInfo undoInfo = GenericDBGetFailIfMissing<UndoInfo>(p->db.undo.get(), height, errMsg);
+        const UndoInfo undoInfo = GenericDBGetFailIfMissing<UndoInfo>(p->db.undo, height, errMsg);
         if (!undoInfo.isValid()) throw DatabaseFormatError(errMsg);
         Debug() << "Latest undo verified ok: " << undoInfo.toDebugString();
     }
@@ -2718,7 +4079,7 @@ void Storage::loadCheckEarliestUndo()
                   << "deleting " << n2del << Util::Pluralize(" oldest entry", n2del) << " ...";
         const Tic t1;
         for (unsigned i = 0; i < n2del; ++i)
-            GenericDBDelete(p->db.undo.get(), uint32_t(p->earliestUndoHeight++));
+            GenericDBDelete(p->db.undo, uint32_t(p->earliestUndoHeight++));
         Warning() << n2del << Util::Pluralize(" undo entry", n2del) << " deleted from db in " << t1.msecStr() << " msec";
     }
 }
@@ -2728,27 +4089,23 @@ bool Storage::hasUndo() const {
 }
 
 struct Storage::UTXOBatch::P {
-    rocksdb::WriteBatch utxosetBatch; ///< batch writes/deletes end up in the utxoset db (keyed off TXO)
-    rocksdb::WriteBatch shunspentBatch; ///< batch writes/deletes end up in the shunspent db (keyed off HashX+CompactTXO)
+    rocksdb::WriteBatch &batch; ///< the caller's batch; writes/deletes end up in the utxoset table (keyed off TXO) and the shunspent table (keyed off HashX+CompactTXO)
+    const DBTable utxoset, shunspent;
+    const DBTable tokenunspent; ///< token_unspent is always written straight to the batch (the UTXOCache doesn't cache it)
     int addCt = 0, rmCt = 0;
     bool defunct = false;
     UTXOCache *cache{}; ///< if not nullptr, there is a UTXOCache active and we should give it the batch writes.
 };
 
-Storage::UTXOBatch::UTXOBatch(UTXOCache *cache) : p(new P) { p->cache = cache; }
+Storage::UTXOBatch::UTXOBatch(const Storage &s, rocksdb::WriteBatch &batch, UTXOCache *cache)
+    : p(new P{batch, s.p->db.utxoset, s.p->db.shunspent, s.p->db.tokenunspent, 0, 0, false, cache}) {}
 Storage::UTXOBatch::UTXOBatch(UTXOBatch &&o) { p.swap(o.p); }
 
 void Storage::issueUpdates(UTXOBatch &b)
 {
-    static const QString errMsg1("Error issuing batch write to utxoset db for a utxo update"),
-                         errMsg2("Error issuing batch write to scripthash_unspent db for a utxo update");
     if (UNLIKELY(b.p->defunct))
         throw InternalError("Misuse of Storage::issueUpdates. Cannot issue the same updates using the same context more than once. FIXME!");
-    assert(bool(p->db.utxoset) && bool(p->db.shunspent));
-    if (!b.p->cache) {
-        GenericBatchWrite(p->db.utxoset.get(), b.p->utxosetBatch, errMsg1, p->db.defWriteOpts); // may throw
-        GenericBatchWrite(p->db.shunspent.get(), b.p->shunspentBatch, errMsg2, p->db.defWriteOpts); // may throw
-    }
+    // Note: the actual writes are already in the caller's WriteBatch (or in the UTXOCache), we just keep count here
     p->utxoCt += b.p->addCt - b.p->rmCt; // tally up adds and deletes
     b.p->defunct = true;
 }
@@ -2757,10 +4114,14 @@ void Storage::setInitialSync(bool b) {
     // take all locks now.. since this is a Big Deal.
     std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
     assert(bool(p->db.utxoset) && bool(p->db.shunspent));
+    p->initialSync = b;
     if (b && !p->db.utxoCache) {
         if (options->utxoCache > 0) {
             Log() << "fast-sync: Enabled; UTXO cache size set to " << options->utxoCache
                   << " bytes (available physical RAM: " << Util::getAvailablePhysicalRAM() << " bytes)";
+            // The UTXO set in the db is incomplete while the cache holds unflushed updates, so flag the db as dirty
+            // until the cache is flushed and deleted.
+            setDirty(true);
             p->db.utxoCache.reset(new UTXOCache("Storage UTXO Cache", p->db.utxoset, p->db.shunspent, p->db.defReadOpts, p->db.defWriteOpts));
             // Reserve about 3.6 million entries per GB of utxoCache memory given to us
             // We need to do this, despite the extra memory bloat, because it turns out rehashing is very painful.
@@ -2771,6 +4132,7 @@ void Storage::setInitialSync(bool b) {
     } else if (!b && p->db.utxoCache) {
         Log() << "Initial sync ended, flushing and deleting UTXO Cache ...";
         p->db.utxoCache.reset(); // implicitly flushes
+        setDirty(false);
     }
 }
 
@@ -2781,38 +4143,53 @@ void Storage::UTXOBatch::add(const TXO &txo, const TXOInfo &info, const CompactT
     if (!p->cache) {
         // Update db utxoset, keyed off txo -> txoinfo
         static const QString errMsgPrefix("Failed to add a utxo to the utxo batch");
-        GenericBatchPut(p->utxosetBatch, txo, info, errMsgPrefix); // may throw on failure
+        GenericBatchPut(p->batch, p->utxoset, txo, info, errMsgPrefix); // may throw on failure
 
         // Update the scripthash unspent. This is a very simple table which we scan by hashX prefix using
         // an iterator in listUnspent.  Each entry's key is prefixed with the HashX bytes (32) but suffixed with the
         // serialized CompactTXO bytes (8 or 9). Each entry's data is a 8-byte int64_t of the amount of the utxo to save
         // on lookup cost for getBalance().
         static const QString errMsgPrefix2("Failed to add an entry to the scripthash_unspent batch");
-        GenericBatchPut(p->shunspentBatch, shukey, shuval, errMsgPrefix2); // may throw, which is what we want
+        GenericBatchPut(p->batch, p->shunspent, shukey, shuval, errMsgPrefix2); // may throw, which is what we want
     } else {
         // put in cache (in case these get deleted later on, it's a win to do this rather than hit the DB, if using cache)
         p->cache->put(txo, info);
         p->cache->putShunspent(shukey, shuval);
     }
+    if (const auto *tok = info.tokenDataPtr.get()) {
+        // Update the token_unspent secondary index. Token UTXOs are a small minority so this is cheap, and since the
+        // db is marked dirty while a UTXOCache is active, it's fine that these writes bypass it.
+        static const QString errMsgPrefix3("Failed to add an entry to the token_unspent batch");
+        for (const char type : {kTokenByHashX, kTokenByCategory})
+            GenericBatchPut(p->batch, p->tokenunspent, mkTokenUnspentKey(type, info.hashX, tok->GetId(), ctxo), shuval,
+                            errMsgPrefix3);
+    }
 
     ++p->addCt;
 }
 
-void Storage::UTXOBatch::remove(const TXO &txo, const HashX &hashX, const CompactTXO &ctxo)
+void Storage::UTXOBatch::remove(const TXO &txo, const HashX &hashX, const CompactTXO &ctxo,
+                                const bitcoin::token::OutputData *tokenData)
 {
     if (!p->cache) {
         // enqueue delete from utxoset db -- may throw.
         static const QString errMsgPrefix("Failed to issue a batch delete for a utxo");
-        GenericBatchDelete(p->utxosetBatch, txo, errMsgPrefix);
+        GenericBatchDelete(p->batch, p->utxoset, txo, errMsgPrefix);
 
         // enqueue delete from scripthash_unspent db
         static const QString errMsgPrefix2("Failed to issue a batch delete for a utxo to the scripthash_unspent db");
-        GenericBatchDelete(p->shunspentBatch, mkShunspentKey(hashX, ctxo), errMsgPrefix2);
+        GenericBatchDelete(p->batch, p->shunspent, mkShunspentKey(hashX, ctxo), errMsgPrefix2);
     } else {
         // use cache which may end up doing no actual work if the utxo & shunspent was in cache and not yet committed to db
         p->cache->remove(txo);
         p->cache->removeShunspent(hashX, ctxo);
     }
+    if (tokenData) {
+        static const QString errMsgPrefix3("Failed to issue a batch delete for a utxo to the token_unspent db");
+        for (const char type : {kTokenByHashX, kTokenByCategory})
+            GenericBatchDelete(p->batch, p->tokenunspent, mkTokenUnspentKey(type, hashX, tokenData->GetId(), ctxo),
+                               errMsgPrefix3);
+    }
     ++p->rmCt;
 }
 
@@ -2822,7 +4199,7 @@ std::optional<TXOInfo> Storage::utxoGetFromDB(const TXO &txo, bool throwIfMissin
 {
     assert(bool(p->db.utxoset));
     static const QString errMsgPrefix("Failed to read a utxo from the utxo db");
-    return GenericDBGet<TXOInfo>(p->db.utxoset.get(), txo, !throwIfMissing, errMsgPrefix, false, p->db.defReadOpts);
+    return GenericDBGet<TXOInfo>(p->db.utxoset, txo, !throwIfMissing, errMsgPrefix, false, p->db.defReadOpts);
 }
 
 int64_t Storage::utxoSetSize() const { return p->utxoCt; }
@@ -2896,10 +4273,25 @@ std::optional<TXOInfo> Storage::utxoGet(const TXO &txo)
     return ret;
 }
 
+namespace {
+    /// Latency histogram for one of the stages of Storage::addBlock(), exported on the /metrics endpoint
+    Metrics::Histogram & addBlockStage(const QString &stage) {
+        return Metrics::histogram("fulcrum_addblock_stage_seconds", "Time spent in each stage of adding a block to the db",
+                                  "stage", stage);
+    }
+} // namespace
+
 void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserve, bool notifySubs)
 {
     assert(bool(ppb) && bool(p));
 
+    static Metrics::Histogram &hLocks = addBlockStage("locks"), &hMempool = addBlockStage("mempool"),
+                              &hTxNums = addBlockStage("txnums"), &hUtxo = addBlockStage("utxo"),
+                              &hHistory = addBlockStage("history"), &hUndo = addBlockStage("blkinfo_undo"),
+                              &hCommit = addBlockStage("commit"), &hPostCommit = addBlockStage("post_commit"),
+                              &hTotal = addBlockStage("total");
+    Metrics::LapTimer stageTimer;
+
     std::unique_ptr<UndoInfo> undo;
 
     if (saveUndo) {
@@ -2920,6 +4312,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
     {
         // take all locks now.. since this is a Big Deal. TODO: add more locks here?
         std::scoped_lock guard(p->blocksLock, p->headerVerifierLock, p->blkInfoLock, p->mempoolLock);
+        stageTimer.lap(hLocks);
 
         if (p->db.utxoCache && p->db.utxoCache->cacheMisses) {
             p->db.utxoCache->prefetch(ppb); // will prefetch inputs in a thread
@@ -2956,6 +4349,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             notify->scriptHashesAffected.merge(std::move(affected));
             notify->dspTxsAffected.merge(std::move(res.dspTxsAffected));
             // ^^ notify->txidsAffected is updated in the above loop
+            stageTimer.lap(hMempool);
         }
 
         const auto verifUndo = p->headerVerifier; // keep a copy of verifier state for undo purposes in case this fails
@@ -2978,7 +4372,10 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 rawHeader = p->headerVerifier.lastHeaderProcessed().second;
             }
 
-            setDirty(true); // <--  no turning back. if the app crashes unexpectedly while this is set, on next restart it will refuse to run and insist on a clean resynch.
+            // All of the db updates for this block go into this batch, which is committed atomically near the end of
+            // this function. The txNums and headers RecordFiles are appended-to before the commit; should we die
+            // before the commit, they are trimmed back to match the db on the next startup.
+            rocksdb::WriteBatch blockBatch;
 
             {  // add txnum -> txhash association to the TxNumsFile...
                 auto batch = p->txNumsFile->beginBatchAppend(); // may throw if io error in c'tor here.
@@ -2996,30 +4393,19 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             if (p->txNumNext != p->txNumsFile->numRecords())
                 throw InternalError("TxNum file and internal txNumNext counter disagree! FIXME!");
 
-            // Asynch task -- the future will automatically be awaited on scope end (even if we throw here!)
-            // NOTE: The assumption here is that ppb->txInfos is ok to share amongst threads -- that is, the assumption
-            // is that nothing mutates it.  If that changes, please re-examine this code.
-            CoTask::Future fut; // if valid, will auto-wait for us on scope end
-            if (ppb->txInfos.size() > 1000) {
-                // submit this to the co-task for blocks with enough txs
-                fut = p->blocksWorker->submitWork([&]{
-                    p->db.txhash2txnumMgr->insertForBlock(blockTxNum0, ppb->txInfos);
-                });
-            } else {
-                // otherwise just do the work ourselves immediately here since this is likely faster (less overhead)
-                p->db.txhash2txnumMgr->insertForBlock(blockTxNum0, ppb->txInfos);
-            }
+            p->db.txhash2txnumMgr->insertForBlock(blockBatch, blockTxNum0, ppb->txInfos);
+            stageTimer.lap(hTxNums);
 
             constexpr bool debugPrt = false;
 
             // update utxoSet & scritphash history
             {
-                std::unordered_set<HashX, HashHasher> newHashXInputsResolved;
+                std::unordered_set<Hash256, Hash256Hasher> newHashXInputsResolved;
                 newHashXInputsResolved.reserve(1024); ///< todo: tune this magic number?
 
                 {
                     // utxo batch block (updtes utxoset & scripthash_unspent tables)
-                    UTXOBatch utxoBatch{p->db.utxoCache.get()};
+                    UTXOBatch utxoBatch{*this, blockBatch, p->db.utxoCache.get()};
 
                     // reserve space in undo, if in saveUndo mode
                     if (undo) {
@@ -3028,7 +4414,8 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                     }
 
                     // add outputs
-                    for (const auto & [hashX, ag] : std::as_const(ppb->hashXAggregated)) {
+                    for (auto & [hashX256, ag] : ppb->hashXAggregated) {
+                        const HashX & hashX = ag.hashX = hashX256.toByteArray(); // shared by all the TXOInfos below
                         for (const auto oidx : ag.outs) {
                             const auto & out = ppb->outputs[oidx];
                             if (out.spentInInputIndex.has_value()) {
@@ -3064,22 +4451,23 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                     // add spends (process inputs)
                     unsigned inum = 0;
                     for (auto & in : ppb->inputs) {
-                        const TXO txo{in.prevoutHash, in.prevoutN};
+                        std::optional<TXOInfo> opt;
                         if (!inum) {
                             // coinbase.. skip
                         } else if (in.parentTxOutIdx.has_value()) {
                             // was an input that was spent in this block so it's ok to skip.. we never added it to utxo set
                             if constexpr (debugPrt)
-                                Debug() << "Skipping input " << txo.toString() << ", spent in this block (output # " << *in.parentTxOutIdx << ")";
-                        } else if (std::optional<TXOInfo> opt;
+                                Debug() << "Skipping input " << in.prevoutHash.toHex() << ":" << in.prevoutN << ", spent in this block (output # " << *in.parentTxOutIdx << ")";
+                        } else if (const TXO txo{in.prevoutHash.toByteArray(), in.prevoutN};
                                    (p->db.utxoCache && (opt = p->db.utxoCache->get(txo))) || (opt = utxoGetFromDB(txo))) {
                             const auto & info = *opt;
                             if (info.confirmedHeight.has_value() && *info.confirmedHeight != ppb->height) {
                                 // was a prevout from a previos block.. so the ppb didn't have it in the 'involving hashx' set..
                                 // mark the spend as having involved this hashX for this ppb now.
-                                auto & ag = ppb->hashXAggregated[info.hashX];
+                                const Hash256 hashX{info.hashX};
+                                auto & ag = ppb->hashXAggregated[hashX];
                                 ag.ins.emplace_back(inum);
-                                newHashXInputsResolved.insert(info.hashX);
+                                newHashXInputsResolved.insert(hashX);
                                 // mark its txidx
                                 if (auto & vec = ag.txNumsInvolvingHashX; vec.empty() || vec.back() != in.txIdx)
                                     vec.emplace_back(in.txIdx);
@@ -3093,7 +4481,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                                         << " HashX: " << info.hashX.toHex();
                             }
                             // delete from db
-                            utxoBatch.remove(txo, info.hashX, CompactTXO(info.txNum, txo.outN)); // delete from db
+                            utxoBatch.remove(txo, info.hashX, CompactTXO(info.txNum, txo.outN), info.tokenDataPtr.get()); // delete from db
                             if (undo) { // save undo info, if we are in saveUndo mode
                                 undo->delUndos.emplace_back(txo, info);
                             }
@@ -3109,8 +4497,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                         ++inum;
                     }
 
-                    // commit the utxoset updates now.. this issues the writes to the db and also updates
-                    // p->utxoCt. This may throw.
+                    // finalize the utxoset updates now.. this updates p->utxoCt. This may throw.
                     issueUpdates(utxoBatch);
                 }
 
@@ -3127,29 +4514,30 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
 
                 if constexpr (debugPrt)
                     Debug() << "utxoset size: " << utxoSetSize() << " block: " << ppb->height;
+                stageTimer.lap(hUtxo);
             }
 
             {
                 // now.. update the txNumsInvolvingHashX to be offset from txNum0 for this block, and save history to db table
-                // history is hashX -> TxNumVec (serialized) as a serities of 6-bytes txNums in blockchain order as they appeared.
+                // history is hashX -> TxNumVec (serialized) as delta + VarInt encoded txNums (see DeltaHist). Each
+                // block's txNums for a hashX are appended to its existing history by the HistoryMergeOperator.
                 if (notify)
                     // first, reserve space for notifications
                     notify->scriptHashesAffected.reserve(notify->scriptHashesAffected.size() + ppb->hashXAggregated.size());
-                rocksdb::WriteBatch batch;
                 for (auto & [hashX, ag] : ppb->hashXAggregated) {
-                    if (notify) notify->scriptHashesAffected.insert(hashX); // fast O(1) insertion because we reserved the right size above.
+                    if (ag.hashX.isEmpty()) // entries created above while resolving inputs haven't been materialized yet
+                        ag.hashX = hashX.toByteArray();
+                    if (notify) notify->scriptHashesAffected.insert(ag.hashX); // fast O(1) insertion because we reserved the right size above.
                     for (auto & txNum : ag.txNumsInvolvingHashX) {
                         txNum += blockTxNum0; // transform local txIdx to -> txNum (global mapping)
                     }
                     // save scripthash history for this hashX, by appending to existing history. Note that this uses
-                    // the 'ConcatOperator' class we defined in this file, which requires rocksdb be compiled with RTTI.
-                    if (auto st = batch.Merge(ToSlice(hashX), ToSlice(Serialize(ag.txNumsInvolvingHashX))); !st.ok())
+                    // the 'HistoryMergeOperator' class we defined in this file, which requires rocksdb be compiled with RTTI.
+                    if (auto st = blockBatch.Merge(p->db.shist.cf, ToSlice(hashX), ToSlice(Serialize(ag.txNumsInvolvingHashX))); !st.ok())
                         throw DatabaseError(QString("batch merge fail for hashX %1, block height %2: %3")
                                             .arg(QString(hashX.toHex())).arg(ppb->height).arg(StatusString(st)));
                 }
-                if (auto st = p->db.shist->Write(p->db.defWriteOpts, &batch) ; !st.ok())
-                    throw DatabaseError(QString("batch merge fail for block height %1: %2")
-                                        .arg(ppb->height).arg(StatusString(st)));
+                stageTimer.lap(hHistory);
             }
 
 
@@ -3167,11 +4555,11 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
 
                 const auto & blkInfo = p->blkInfos.back();
 
-                p->blkInfosByTxNum[blkInfo.txNum0] = unsigned(p->blkInfos.size()-1);
+                p->setTxNumHeightIndex(p->getTxNumHeightIndex()->withBlockAdded(blkInfo));
 
                 // save BlkInfo to db
                 static const QString blkInfoErrMsg("Error writing BlkInfo to db");
-                GenericDBPut(p->db.blkinfo.get(), uint32_t(ppb->height), blkInfo, blkInfoErrMsg, p->db.defWriteOpts);
+                GenericBatchPut(blockBatch, p->db.blkinfo, uint32_t(ppb->height), blkInfo, blkInfoErrMsg);
 
                 if (undo) {
                     // save blkInfo to undo information, if in saveUndo mode
@@ -3183,10 +4571,12 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
             if (undo) {
                 const auto t0 = Util::getTimeNS();
                 undo->hash = BTC::HashRev(rawHeader);
-                undo->scriptHashes = Util::keySet<decltype (undo->scriptHashes)>(ppb->hashXAggregated);
+                undo->scriptHashes.reserve(ppb->hashXAggregated.size());
+                for (const auto & [hashX, ag] : ppb->hashXAggregated)
+                    undo->scriptHashes.insert(ag.hashX);
                 static const QString errPrefix("Error saving undo info to undo db");
 
-                GenericDBPut(p->db.undo.get(), uint32_t(ppb->height), *undo, errPrefix, p->db.defWriteOpts); // save undo to db
+                GenericBatchPut(blockBatch, p->db.undo, uint32_t(ppb->height), *undo, errPrefix); // save undo to db
                 if (ppb->height < p->earliestUndoHeight) {
                     // remember earliest for delete clause below...
                     p->earliestUndoHeight = ppb->height;
@@ -3223,7 +4613,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 // keys as we catch up.  It's not the end of the world, as each call here is on the order of microseconds..
                 // but perhaps we need to see about fixing this to not do that.
                 static const QString errPrefix("Error deleting old/stale undo info from undo db");
-                GenericDBDelete(p->db.undo.get(), uint32_t(expireUndoHeight), errPrefix, p->db.defWriteOpts);
+                GenericBatchDelete(blockBatch, p->db.undo, uint32_t(expireUndoHeight), errPrefix);
                 p->earliestUndoHeight = unsigned(expireUndoHeight + 1);
                 if constexpr (debugPrt) DebugM("Deleted undo for block ", expireUndoHeight, ", earliest now ", p->earliestUndoHeight.load());
             }
@@ -3235,11 +4625,23 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
                 p->genesisHash = BTC::HashRev(rawHeader); // this variable is guarded by p->headerVerifierLock
             }
 
+            saveUtxoCt(blockBatch);
+            stageTimer.lap(hUndo);
+
+            // commit all of the above to the db in one atomic write
+            commitBlockBatch(blockBatch, QString("Failed to commit block %1 to the db").arg(ppb->height));
+            stageTimer.lap(hCommit);
+
+            if (p->hotHistory) {
+                // append this block's items to any cached hot histories (txNumsInvolvingHashX are global TxNums now)
+                for (const auto & [hashX, ag] : ppb->hashXAggregated)
+                    p->hotHistory->append(ag.hashX, ag.txNumsInvolvingHashX, int(ppb->height),
+                                          [&](TxNum n) -> const TxHash & { return ppb->txInfos[n - blockTxNum0].hash; });
+            }
+
             if (size_t limit; p->db.utxoCache && (limit = options->utxoCache) && p->db.utxoCache->memUsage() > limit)
                 p->db.utxoCache->limitSize(static_cast<size_t>(limit * 0.75) /* chop down to 3/4 size */);
-
-            saveUtxoCt();
-            setDirty(false);
+            stageTimer.lap(hPostCommit);
 
             undoVerifierOnScopeEnd.disable(); // indicate to the "Defer" object declared at the top of this function that it shouldn't undo anything anymore as we are happy now with the db state now.
         }
@@ -3254,6 +4656,7 @@ void Storage::addBlock(PreProcessedBlockPtr ppb, bool saveUndo, unsigned nReserv
         if (txsubsmgr && !notify->txidsAffected.empty())
             txsubsmgr->enqueueNotifications(std::move(notify->txidsAffected));
     }
+    stageTimer.total(hTotal);
 }
 
 BlockHeight Storage::undoLatestBlock(bool notifySubs)
@@ -3280,7 +4683,10 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
         // First, disable the UTXO Cache, if it happened to be enabled (implicitly causes it to flush to DB).
         // We must do this because the way the UTXO Cache works is fundamentally at odds with assumption we have
         // while we undo.
-        p->db.utxoCache.reset(); // if valid, delete causes implicit flush to DB
+        if (p->db.utxoCache) {
+            p->db.utxoCache.reset(); // delete causes implicit flush to DB
+            setDirty(false);
+        }
 
         // NOTE: For very full mempools, this clear has the potential to stall the app after the reorg
         // completes since the app will have to re-download the whole mempool state again.
@@ -3317,7 +4723,7 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             prevHeader = *opt;
         }
         const QString errMsg1 = QStringLiteral("Unable to retrieve undo info for %1").arg(tip);
-        auto undoOpt = GenericDBGet<UndoInfo>(p->db.undo.get(), uint32_t(tip), true, errMsg1, false, p->db.defReadOpts);
+        auto undoOpt = GenericDBGet<UndoInfo>(p->db.undo, uint32_t(tip), true, errMsg1, false, p->db.defReadOpts);
         if (!undoOpt.has_value())
             throw UndoInfoMissing(errMsg1);
         auto & undo = *undoOpt; // non-const because we swap out its scripthashes potentially below if notifySubs == true
@@ -3330,16 +4736,17 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
         {
             // all sanity check passed. Now, undo things in reverse order of what we did in addBlock above, rougly speaking
 
+            // All of the db updates for the undo go into this batch, which is committed atomically below. The
+            // RecordFiles (headers, txNums) are only truncated after the commit succeeds.
+            rocksdb::WriteBatch blockBatch;
+
             // first, undo the header
             p->headerVerifier.reset(prevHeight+1, prevHeader);
-            setDirty(true); // <-- no turning back. we clear this flag at the end
-            deleteHeadersPastHeight(prevHeight); // commit change to db
-            p->merkleCache->truncate(prevHeight+1); // this takes a length, not a height, which is always +1 the height
 
             // undo the blkInfo from the back
             p->blkInfos.pop_back();
-            p->blkInfosByTxNum.erase(undo.blkInfo.txNum0);
-            GenericDBDelete(p->db.blkinfo.get(), uint32_t(undo.height), "Failed to delete blkInfo in undoLatestBlock");
+            p->setTxNumHeightIndex(p->getTxNumHeightIndex()->withLatestBlockRemoved());
+            GenericBatchDelete(blockBatch, p->db.blkinfo, uint32_t(undo.height), "Failed to delete blkInfo in undoLatestBlock");
             // clear num2hash cache
             p->lruNum2Hash.clear();
             // remove block from txHashes cache
@@ -3347,15 +4754,13 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
 
             const auto txNum0 = undo.blkInfo.txNum0;
 
-            // Asynch task -- the future will automatically be awaited on scope end (even if we throw here!)
-            // Note: we await the result later down in this function before we truncate the txNumsFile. (Assumption
-            // here is that the txNumsFile has all the hashes we want to delete until the below operation is done).
-            CoTask::Future fut = p->blocksWorker->submitWork([&]{ p->db.txhash2txnumMgr->truncateForUndo(txNum0);});
+            // Note: this must happen before we truncate the txNumsFile below, since it reads the hashes being removed
+            p->db.txhash2txnumMgr->truncateForUndo(blockBatch, txNum0);
 
             // undo the scripthash histories
             for (const auto & sh : undo.scriptHashes) {
                 const QString shHex = Util::ToHexFast(sh);
-                const auto vec = GenericDBGetFailIfMissing<TxNumVec>(p->db.shist.get(), sh, QStringLiteral("Undo failed because we failed to retrieve the scripthash history for %1").arg(shHex), false, p->db.defReadOpts);
+                const auto vec = GenericDBGetFailIfMissing<TxNumVec>(p->db.shist, sh, QStringLiteral("Undo failed because we failed to retrieve the scripthash history for %1").arg(shHex), false, p->db.defReadOpts);
                 TxNumVec newVec;
                 newVec.reserve(vec.size());
                 for (const auto txNum : vec) {
@@ -3376,16 +4781,16 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
                 }
                 if (!newVec.empty()) {
                     // the sh still has some history, write it to db
-                    GenericDBPut(p->db.shist.get(), sh, newVec, errMsg, p->db.defWriteOpts);
+                    GenericBatchPut(blockBatch, p->db.shist, sh, newVec, errMsg);
                 } else {
                     // the sh in question lost all its history as a result of undo, just delete it from db to save space
-                    GenericDBDelete(p->db.shist.get(), sh, errMsg, p->db.defWriteOpts);
+                    GenericBatchDelete(blockBatch, p->db.shist, sh, errMsg);
                 }
             }
 
             {
                 // UTXO set update
-                UTXOBatch utxoBatch;
+                UTXOBatch utxoBatch{*this, blockBatch};
 
                 // now, undo the utxo deletions by re-adding them
                 for (const auto & [txo, info] : undo.delUndos) {
@@ -3396,16 +4801,19 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
                 // now, undo the utxo additions by deleting them
                 for (const auto & [txo, hashx, ctxo] : undo.addUndos) {
                     assert(ctxo.txNum() >= txNum0); // all of the additions must have been in this block or newer
-                    utxoBatch.remove(txo, hashx, ctxo); // may throw
+                    // The undo info lacks the token data needed to find its token_unspent entries, so read it back
+                    // from the utxoset (undo is infrequent, so the extra point-lookup per utxo is no big deal).
+                    const auto info = utxoGetFromDB(txo, false);
+                    utxoBatch.remove(txo, hashx, ctxo, info ? info->tokenDataPtr.get() : nullptr); // may throw
                 }
 
-                issueUpdates(utxoBatch); // may throw, updates p->utxoCt and issues write to db.
+                issueUpdates(utxoBatch); // may throw, updates p->utxoCt
             }
 
             if (p->earliestUndoHeight >= undo.height)
                 // oops, we're out of undos now!
                 p->earliestUndoHeight = p->InvalidUndoHeight;
-            GenericDBDelete(p->db.undo.get(), uint32_t(undo.height)); // make sure to delete this undo info since it was just applied.
+            GenericBatchDelete(blockBatch, p->db.undo, uint32_t(undo.height)); // make sure to delete this undo info since it was just applied.
 
             // add all tx hashes that we are rolling back to the notify set for the txSubsMgr
             if (notify) {
@@ -3413,10 +4821,14 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
                 notify->txidsAffected.insert(txHashes.begin(), txHashes.end());
             }
 
-            // Wait for the txhash2txnum truncate to finish before we proceed, since that co-task assumes the txNumsFile
-            // won't change.
-            if (fut.future.valid())
-                fut.future.get(); // this may throw if task threw
+            saveUtxoCt(blockBatch);
+
+            // commit all of the above to the db in one atomic write
+            commitBlockBatch(blockBatch, QString("Failed to commit undo of block %1 to the db").arg(undo.height));
+
+            if (p->hotHistory)
+                for (const auto & sh : undo.scriptHashes)
+                    p->hotHistory->truncate(sh, int(undo.height));
 
             // lastly, truncate the tx num file and re-set txNumNext to point to this block's txNum0 (thereby recycling it)
             assert(long(p->txNumNext) - long(txNum0) == long(undo.blkInfo.nTx));
@@ -3424,9 +4836,9 @@ BlockHeight Storage::undoLatestBlock(bool notifySubs)
             if (QString err; p->txNumsFile->truncate(txNum0, &err) != txNum0 || !err.isEmpty()) {
                 throw InternalError(QString("Failed to truncate txNumsFile to %1: %2").arg(txNum0).arg(err));
             }
-
-            saveUtxoCt();
-            setDirty(false); // phew. done.
+            // .. and the headers
+            deleteHeadersPastHeight(prevHeight);
+            p->merkleCache->truncate(prevHeight+1); // this takes a length, not a height, which is always +1 the height
 
             nSH = undo.scriptHashes.size();
 
@@ -3464,25 +4876,34 @@ void Storage::setDirty(bool dirtyFlag)
 {
     static const QString errPrefix("Error saving dirty flag to the meta db");
     const auto & val = dirtyFlag ? kTrue : kFalse;
-    GenericDBPut(p->db.meta.get(), kDirty, val, errPrefix, p->db.defWriteOpts);
+    GenericDBPut(p->db.meta, kDirty, val, errPrefix, p->db.defWriteOpts);
 }
 
 bool Storage::isDirty() const
 {
     static const QString errPrefix("Error reading dirty flag from the meta db");
-    return GenericDBGet<bool>(p->db.meta.get(), kDirty, true, errPrefix, false, p->db.defReadOpts).value_or(false);
+    return GenericDBGet<bool>(p->db.meta, kDirty, true, errPrefix, false, p->db.defReadOpts).value_or(false);
 }
 
-void Storage::saveUtxoCt()
+void Storage::saveUtxoCt(rocksdb::WriteBatch &batch)
 {
     static const QString errPrefix("Error writing the utxo count to the meta db");
     const int64_t ct = p->utxoCt.load();
-    GenericDBPut(p->db.meta.get(), kUtxoCount, ct, errPrefix, p->db.defWriteOpts);
+    GenericBatchPut(batch, p->db.meta, kUtxoCount, ct, errPrefix);
+}
+
+void Storage::commitBlockBatch(rocksdb::WriteBatch &batch, const QString &errMsg)
+{
+    // Sync the WAL on each commit so that a block, once added, survives a power failure. During the initial sync we
+    // skip this since it's slow and since we can always just re-download the latest block(s) from bitcoind anyway.
+    rocksdb::WriteOptions opts = p->db.defWriteOpts;
+    opts.sync = !p->initialSync;
+    GenericBatchWrite(p->db.rdb.get(), batch, errMsg, opts); // may throw
 }
 int64_t Storage::readUtxoCtFromDB() const
 {
     static const QString errPrefix("Error reading the utxo count from the meta db");
-    return GenericDBGet<int64_t>(p->db.meta.get(), kUtxoCount, true, errPrefix, false, p->db.defReadOpts).value_or(0LL);
+    return GenericDBGet<int64_t>(p->db.meta, kUtxoCount, true, errPrefix, false, p->db.defReadOpts).value_or(0LL);
 }
 
 
@@ -3500,6 +4921,7 @@ std::optional<TxHash> Storage::hashForTxNum(TxNum n, bool throwIfMissing, bool *
     static const QString kErrMsg ("Error reading TxHash for TxNum %1: %2");
     QString errStr;
     const auto bytes = p->txNumsFile->readRecord(n, &errStr);
+    Tracing::noteDbRead(!bytes.isEmpty(), size_t(bytes.size()));
     if (bytes.isEmpty()) {
         errStr = kErrMsg.arg(n).arg(errStr);
         if (throwIfMissing)
@@ -3517,21 +4939,7 @@ std::optional<TxHash> Storage::hashForTxNum(TxNum n, bool throwIfMissing, bool *
 
 std::optional<unsigned> Storage::heightForTxNum(TxNum n) const
 {
-    SharedLockGuard g(p->blkInfoLock);
-    return heightForTxNum_nolock(n);
-}
-
-std::optional<unsigned> Storage::heightForTxNum_nolock(TxNum n) const
-{
-    std::optional<unsigned> ret;
-    auto it = p->blkInfosByTxNum.upper_bound(n);  // O(logN) search; find the block *AFTER* n, then go back one to find the block in range
-    if (it != p->blkInfosByTxNum.begin()) {
-        --it;
-        const auto & bi = p->blkInfos[it->second];
-        if (n >= bi.txNum0 && n < bi.txNum0+bi.nTx)
-            ret = it->second;
-    }
-    return ret;
+    return p->getTxNumHeightIndex()->heightForTxNum(n); // lock-free
 }
 
 std::optional<TxHash> Storage::hashForHeightAndPos(BlockHeight height, unsigned posInBlock) const
@@ -3623,22 +5031,26 @@ auto Storage::getHistory(const HashX & hashX, bool conf, bool unconf) const -> H
         SharedLockGuard g(p->blocksLock);  // makes sure history doesn't mutate from underneath our feet
         if (conf) {
             static const QString err("Error retrieving history for a script hash");
-            auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist.get(), hashX, true, err, false, p->db.defReadOpts);
-            if (nums_opt.has_value()) {
+            if (auto cached = p->hotHistory ? p->hotHistory->get(hashX) : nullptr) {
+                // fast path: hot scripthash, already resolved (we hold blocksLock so it won't mutate while we copy)
+                IncrementCtrAndThrowIfExceedsMaxHistory(cached->size());
+                ret = *cached;
+            } else if (auto nums_opt = GenericDBGet<TxNumVec>(p->db.shist, hashX, true, err, false, p->db.defReadOpts);
+                       nums_opt.has_value()) {
                 auto & nums = *nums_opt;
                 IncrementCtrAndThrowIfExceedsMaxHistory(nums.size());
                 ret.reserve(nums.size());
-                // TODO: The below could use some optimization.  A batched version of both hashForTxNum and
-                // heightForTxNum are low-hanging fruit for optimization.  Each call to the below takes a shared lock
-                // then releases it, for each item.  I imagine batched versions would have significantly less overhead
-                // per item, which could add up to huge performance savings on large histories.  This is a very
-                // low hanging fruit for optimization -- thus I am leaving this comment here so I can remember to come
-                // back and optmize the below.  /TODO
-                for (auto num : nums) {
-                    auto hash = hashForTxNum(num).value(); // may throw, but that indicates some database inconsistency. we catch below
-                    auto height = heightForTxNum(num).value(); // may throw, same deal
+                // Heights are resolved in 1 batched pass; nums are sorted so consecutive items are usually in the
+                // same or the next block. TODO: hashForTxNum could use a batched version as well.
+                std::vector<std::optional<unsigned>> heights(nums.size());
+                p->getTxNumHeightIndex()->heightsForTxNums(nums.begin(), nums.end(), heights.begin());
+                for (size_t i = 0; i < nums.size(); ++i) {
+                    auto hash = hashForTxNum(nums[i]).value(); // may throw, but that indicates some database inconsistency. we catch below
+                    auto height = heights[i].value(); // may throw, same deal
                     ret.emplace_back(HistoryItem{hash, int(height), {}});
                 }
+                if (p->hotHistory)
+                    p->hotHistory->maybeAdmit(hashX, ret);
             }
         }
         if (unconf) {
@@ -3737,8 +5149,17 @@ auto Storage::listUnspent(const HashX & hashX, const TokenFilterOption tokenFilt
                 }
             } // release mempool lock
             { // begin confirmed/db search
-                std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
-                const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
+                // Token-only queries use the token_unspent index, which only has this hashX's token utxos
+                const bool onlyTokens = tokenFilter == TokenFilterOption::OnlyTokens,
+                           excludeTokens = tokenFilter == TokenFilterOption::ExcludeTokens;
+                const QByteArray tokenPrefix = onlyTokens ? mkTokenUnspentPrefix(kTokenByHashX, hashX) : QByteArray();
+                const auto ExtractCompactTXO = [onlyTokens](const rocksdb::Slice &key) {
+                    return onlyTokens ? extractTokenUnspentKey(key).second : extractCompactTXOFromShunspentKey(key);
+                };
+                TableIOScope ioScope(onlyTokens ? p->db.tokenunspent : p->db.shunspent);
+                std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(p->db.defReadOpts, onlyTokens ? p->db.tokenunspent.cf
+                                                                                                              : p->db.shunspent.cf));
+                const rocksdb::Slice prefix = onlyTokens ? ToSlice(tokenPrefix) : ToSlice(hashX); // points to data in tokenPrefix or hashX
 
                 // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
                 // See: https://github.com/facebook/rocksdb/wiki/Prefix-Seek-API-Changes#transition-to-the-new-usage
@@ -3748,25 +5169,30 @@ auto Storage::listUnspent(const HashX & hashX, const TokenFilterOption tokenFilt
                 constexpr size_t reserveBytes = 256u;
                 static_assert(sizeof(CTXOVec::value_type) < reserveBytes);
                 ctxoVec.reserve(reserveBytes / sizeof(CTXOVec::value_type)); // rough guess -- pre-allocate ~256 bytes
+                size_t nRows = 0, nBytes = 0; // for Tracing
+                Defer noteReads([&]{ Tracing::noteDbRead(nRows, nBytes); });
                 // we do it this way as two separate loops in order to avoid the expensive heightForTxNum lookups below in
                 // the case where the history is huge.
                 for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
                     IncrementCtrAndThrowIfExceedsMaxHistory();
+                    ++nRows, nBytes += key.size() + iter->value().size();
+                    if (excludeTokens && SHUnspentValueHasTokenData(iter->value()))
+                        continue; // skip without deserializing the token data
                     bool ok;
                     auto shval = Deserialize<SHUnspentValue>(FromSlice(iter->value()), &ok);
                     if (UNLIKELY(!ok || !shval.valid)) {
-                        auto ctxo = extractCompactTXOFromShunspentKey(key); /* may throw if size is bad, etc */
+                        auto ctxo = ExtractCompactTXO(key); /* may throw if size is bad, etc */
                         throw InternalError(QString("Bad SHUnspentValue in db for ctxo %1, script_hash: %2")
                                             .arg(ctxo.toString(), QString(hashX.toHex())));
                     }
                     if (UNLIKELY(!bitcoin::MoneyRange(shval.amount))) {
-                        auto ctxo = extractCompactTXOFromShunspentKey(key); /* may throw if size is bad, etc */
+                        auto ctxo = ExtractCompactTXO(key); /* may throw if size is bad, etc */
                         throw InternalError(QString("Out-of-range amount in db for ctxo %1, script_hash %2: %3")
                                             .arg(ctxo.toString(), QString(hashX.toHex())).arg(shval.amount / shval.amount.satoshi()));
                     }
                     if (ShouldFilter(shval.tokenDataPtr))
                         continue;
-                    auto ctxo = extractCompactTXOFromShunspentKey(key); /* may throw if size is bad, etc */
+                    auto ctxo = ExtractCompactTXO(key); /* may throw if size is bad, etc */
                     ctxoVec.emplace_back(std::move(ctxo), std::move(shval));
                 }
                 for (auto & [ctxo, shval] : ctxoVec) {
@@ -3810,16 +5236,28 @@ auto Storage::getBalance(const HashX &hashX, TokenFilterOption tokenFilter) cons
         // take shared lock (ensure history doesn't mutate from underneath our feet)
         SharedLockGuard g(p->blocksLock);
         {
-            // confirmed -- read from db using an iterator
-            std::unique_ptr<rocksdb::Iterator> iter(p->db.shunspent->NewIterator(p->db.defReadOpts));
-            const rocksdb::Slice prefix = ToSlice(hashX); // points to data in hashX
-
-            // Search table for all keys that start with hashx's bytes. Note: the loop end-condition is strange.
+            // confirmed -- read from db using an iterator. Token-only queries use the token_unspent index, which only
+            // has this hashX's token utxos.
+            const bool onlyTokens = tokenFilter == TokenFilterOption::OnlyTokens,
+                       excludeTokens = tokenFilter == TokenFilterOption::ExcludeTokens;
+            const QByteArray tokenPrefix = onlyTokens ? mkTokenUnspentPrefix(kTokenByHashX, hashX) : QByteArray();
+            TableIOScope ioScope(onlyTokens ? p->db.tokenunspent : p->db.shunspent);
+            std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(p->db.defReadOpts, onlyTokens ? p->db.tokenunspent.cf
+                                                                                                          : p->db.shunspent.cf));
+            const rocksdb::Slice prefix = onlyTokens ? ToSlice(tokenPrefix) : ToSlice(hashX); // points to data in tokenPrefix or hashX
+
+            // Search table for all keys that start with the prefix bytes. Note: the loop end-condition is strange.
             // See: https://github.com/facebook/rocksdb/wiki/Prefix-Seek-API-Changes#transition-to-the-new-usage
             rocksdb::Slice key;
+            size_t nRows = 0, nBytes = 0; // for Tracing
+            Defer noteReads([&]{ Tracing::noteDbRead(nRows, nBytes); });
             for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
                 IncrementCtrAndThrowIfExceedsMaxHistory(); // throw if we are iterating too much
-                const CompactTXO ctxo = extractCompactTXOFromShunspentKey(key); // may throw if key has the wrong size, etc
+                ++nRows, nBytes += key.size() + iter->value().size();
+                if (excludeTokens && SHUnspentValueHasTokenData(iter->value()))
+                    continue; // skip without deserializing the token data
+                const CompactTXO ctxo = onlyTokens ? extractTokenUnspentKey(key).second
+                                                   : extractCompactTXOFromShunspentKey(key); // may throw if key has the wrong size, etc
                 bool ok;
                 const auto & [valid, amount, tokenDataPtr] = Deserialize<SHUnspentValue>(FromSlice(iter->value()), &ok);
                 if (UNLIKELY(!ok || !valid))
@@ -3874,6 +5312,38 @@ auto Storage::getBalance(const HashX &hashX, TokenFilterOption tokenFilter) cons
     return ret;
 }
 
+auto Storage::getTokenHolders(const bitcoin::token::Id &category) const -> TokenHolders
+{
+    TokenHolders ret;
+    const QByteArray catBytes(reinterpret_cast<const char *>(category.begin()), int(category.size()));
+    SharedLockGuard g(p->blocksLock); // take shared lock (ensure the utxo set doesn't mutate from underneath our feet)
+    std::unique_ptr<rocksdb::Iterator> iter(p->db.rdb->NewIterator(p->db.defReadOpts, p->db.tokenunspent.cf));
+    const QByteArray prefixBytes = mkTokenUnspentPrefix(kTokenByCategory, catBytes);
+    const rocksdb::Slice prefix = ToSlice(prefixBytes);
+    rocksdb::Slice key;
+    // keys are 'c' + category + HashX + CompactTXO, so all of a holder's utxos are adjacent
+    size_t ct = 0;
+    for (iter->Seek(prefix); iter->Valid() && (key = iter->key()).starts_with(prefix); iter->Next()) {
+        if (UNLIKELY(++ct > options->maxHistory))
+            throw HistoryTooLarge(QString("Token UTXOs for category %1 exceed MaxHistory %2")
+                                  .arg(QString::fromStdString(category.GetHex())).arg(options->maxHistory));
+        auto [hashX, ctxo] = extractTokenUnspentKey(key); // may throw
+        bool ok;
+        const auto shval = Deserialize<SHUnspentValue>(FromSlice(iter->value()), &ok);
+        if (UNLIKELY(!ok || !shval.valid || !shval.tokenDataPtr))
+            throw DatabaseError(QString("Bad token_unspent value in db for ctxo %1 (%2)").arg(ctxo.toString(), QString(hashX.toHex())));
+        if (ret.empty() || ret.back().hashX != hashX)
+            ret.push_back(TokenHolder{std::move(hashX)});
+        auto & holder = ret.back();
+        ++holder.nUtxos;
+        holder.nNFTs += shval.tokenDataPtr->HasNFT();
+        holder.fungibleAmount += shval.tokenDataPtr->GetAmount().getint64();
+    }
+    if (!iter->status().ok())
+        throw DatabaseError(QString("Error scanning token_unspent: %1").arg(StatusString(iter->status())));
+    return ret;
+}
+
 std::vector<QByteArray> Storage::merkleCacheHelperFunc(unsigned int start, unsigned int count, QString *err)
 {
     auto vec = headersFromHeight_nolock_nocheck(start, count, err); // despite the name of this function, it does take a small lock internally and is thread-safe. we cannot use the public one as that would potentially cause a deadlock here
@@ -3975,13 +5445,13 @@ auto Storage::getTxHeights(const std::vector<TxHash> &txHashes) const -> TxHeigh
         }
     }
 
-    // next, transform all non-0 valid txNums to a height (below takes blkInfoLock which is ok to take after blocksLock)
-    SharedLockGuard g2(p->blkInfoLock);
+    // next, transform all non-0 valid txNums to a height
+    const auto idx = p->getTxNumHeightIndex();
     for (const auto & txNum : txNums) {
         ret.emplace_back();
         auto &optHeight = ret.back();
         if (txNum)
-            optHeight = *txNum ? heightForTxNum_nolock(*txNum) : 0; // transform to txNum -> height .. note that 0 already indicates mempool
+            optHeight = *txNum ? idx->heightForTxNum(*txNum) : 0; // transform to txNum -> height .. note that 0 already indicates mempool
     }
     return ret;
 }
@@ -3994,7 +5464,7 @@ auto Storage::getTxHeight(const TxHash &h) const -> std::optional<BlockHeight>
     SharedLockGuard g(p->blocksLock);
     const auto optTxNum = p->db.txhash2txnumMgr->find(h);
     if (optTxNum) {
-        // resolve txNum -> height; this ends up taking blkInfoLock (shared mode)
+        // resolve txNum -> height (lock-free)
         ret = heightForTxNum(*optTxNum);
     } else {
         // check mempool, this ends up taking the mempool lock (shared mode)
@@ -4007,11 +5477,17 @@ auto Storage::getTxHeight(const TxHash &h) const -> std::optional<BlockHeight>
 size_t Storage::dumpAllScriptHashes(QIODevice *outDev, unsigned int indent, unsigned int ilvl,
                                     const DumpProgressFunc &progFunc, size_t progInterval) const
 {
-    if (!outDev || !outDev->isWritable())
+    if (!outDev || !outDev->isWritable() || !p->db.shist)
         return 0;
-    SharedLockGuard g{p->blocksLock};
-    std::unique_ptr<rocksdb::Iterator> it {p->db.shist->NewIterator(p->db.defReadOpts)};
-    if (!it) return 0;
+    // We read from a snapshot, so that we need not hold blocksLock (and thus block block processing) while we dump
+    auto readOpts = p->db.scanReadOpts;
+    readOpts.fill_cache = false;
+    const auto snapshot = [&] {
+        SharedLockGuard g{p->blocksLock};
+        using CSnapshot = const rocksdb::Snapshot;
+        return std::shared_ptr<CSnapshot>(p->db.rdb->GetSnapshot(), [this](CSnapshot *s){ p->db.rdb->ReleaseSnapshot(s); });
+    }();
+    readOpts.snapshot = snapshot.get();
 
     const auto INDENT = [outDev, &ilvl, spaces = QByteArray(int(indent), ' ')] {
         for (size_t i = 0; i < ilvl; ++i)
@@ -4029,20 +5505,54 @@ size_t Storage::dumpAllScriptHashes(QIODevice *outDev, unsigned int indent, unsi
     ++ilvl;
     NL();
     if (progFunc) progFunc(0); // 0 = indicate operator began
+
+    // The key ranges are scanned (and hex-encoded) by worker threads, while we write out the finished ranges in order
+    // on this thread. Range i is done by worker i % nThreads, so at most nThreads ranges are buffered at any one time.
+    constexpr unsigned kNumRanges = 4096; // small enough ranges that the buffers stay small on mainnet
+    constexpr int hexLen = HashLen * 2;
+    const auto ranges = SplitKeyspace(kNumRanges);
+    const unsigned nThreads = std::max(Util::getNPhysicalProcessors(), 1u);
+    // NB: declaration order matters here. `stop` and `bufs` must outlive `futs` (whose d'tors wait for the workers),
+    // and `stopWorkers` must run before those d'tors, so that on exception the workers return early.
+    std::atomic_bool stop = false;
+    std::vector<std::unique_ptr<CoTask>> tasks;
+    std::vector<QByteArray> bufs(nThreads); // concatenated hex-encoded scripthashes
+    std::vector<CoTask::Future> futs(nThreads);
+    Defer stopWorkers([&stop] { stop = true; });
+    for (unsigned i = 0; i < nThreads; ++i)
+        tasks.push_back(std::make_unique<CoTask>(QString("DumpSH %1").arg(i)));
+    const auto Submit = [&](const size_t i) {
+        const size_t slot = i % nThreads;
+        futs[slot] = tasks[slot]->submitWork([this, &ranges, &readOpts, &stop, &buf = bufs[slot], i] {
+            buf.clear();
+            RangeIter it(p->db.shist, readOpts, ranges[i]);
+            for ( ; it->Valid() && !stop.load(std::memory_order_relaxed); it->Next())
+                if (const auto sh = it->key(); sh.size() == HashLen)
+                    buf.append(Util::ToHexFast(FromSlice(sh)));
+            if (!it->status().ok())
+                throw DatabaseError("Error iterating over the scripthash_history table: " + StatusString(it->status()));
+        });
+    };
+    for (size_t i = 0; i < nThreads && i < kNumRanges; ++i)
+        Submit(i);
     qint64 lastWriteCt = 0;
-    for (it->SeekToFirst(); it->Valid() && outDev && lastWriteCt > -1; it->Next()) {
-        const auto sh = it->key();
-        if (sh.size() == HashLen) {
+    for (size_t i = 0; i < kNumRanges && lastWriteCt > -1; ++i) {
+        const size_t slot = i % nThreads;
+        futs[slot].future.get(); // may throw
+        const QByteArray &buf = bufs[slot];
+        for (int pos = 0; pos + hexLen <= buf.size() && lastWriteCt > -1; pos += hexLen) {
             if (LIKELY(ctr)) {
                 outDev->putChar(',');
                 NL();
             }
             outDev->putChar('"');
-            lastWriteCt = outDev->write(Util::ToHexFast(FromSlice(sh)));
+            lastWriteCt = outDev->write(buf.constData() + pos, hexLen);
             outDev->putChar('"');
             if (UNLIKELY(!(++ctr % progInterval) && progFunc))
                 progFunc(ctr);
         }
+        if (const size_t next = i + nThreads; next < kNumRanges)
+            Submit(next);
     }
     --ilvl;
     if (ctr) NL();
@@ -4057,23 +5567,18 @@ auto Storage::calcUTXOSetStats(const DumpProgressFunc & progFunc, size_t progInt
 {
     UTXOSetStats ret;
     if (!p->db.utxoset || !p->db.shunspent) return ret;
-    auto readOpts_utxo = p->db.defReadOpts;
-    auto readOpts_shunspent = p->db.defReadOpts;
-    const auto [ss_utxo, ss_shunspent, bheight, bhash] = [&] {
+    auto readOpts = p->db.scanReadOpts;
+    readOpts.fill_cache = false;
+    const auto [snapshot, bheight, bhash] = [&] {
         SharedLockGuard g{p->blocksLock};
         using CSnapshot = const rocksdb::Snapshot;
-        auto s1 = std::shared_ptr<CSnapshot>(p->db.utxoset->GetSnapshot(),
-                                             [this](CSnapshot *ss){ p->db.utxoset->ReleaseSnapshot(ss); });
-        auto s2 = std::shared_ptr<CSnapshot>(p->db.utxoset->GetSnapshot(),
-                                             [this](CSnapshot *ss){ p->db.shunspent->ReleaseSnapshot(ss); });
+        // both tables live in the same db, so this one snapshot gives us a consistent view of both
+        auto ss = std::shared_ptr<CSnapshot>(p->db.rdb->GetSnapshot(),
+                                             [this](CSnapshot *s){ p->db.rdb->ReleaseSnapshot(s); });
         const auto & [height, hash] = latestTip(); // takes a subordinate lock to blocksLock
-        return std::tuple(s1, s2, height, hash);
+        return std::tuple(ss, height, hash);
     }();
-    readOpts_utxo.snapshot = ss_utxo.get();
-    readOpts_shunspent.snapshot = ss_shunspent.get();
-    std::unique_ptr<rocksdb::Iterator> it_utxo {p->db.utxoset->NewIterator(readOpts_utxo)};
-    std::unique_ptr<rocksdb::Iterator> it_shu {p->db.shunspent->NewIterator(readOpts_shunspent)};
-    if (!it_utxo || !it_shu) return ret;
+    readOpts.snapshot = snapshot.get();
 
     ret.block_height = bheight >= 0 ? BlockHeight(bheight) : 0;
     ret.block_hash = bhash;
@@ -4085,39 +5590,54 @@ auto Storage::calcUTXOSetStats(const DumpProgressFunc & progFunc, size_t progInt
     if (auto *a = ::app())
         conn = a->connect(a, &App::requestQuit, this, [&quitting] { quitting = true; }, Qt::DirectConnection);
 
-    auto UpdateProgress = [&, ctr = size_t{0u}]() mutable {
-        if (progInterval && (++ctr % progInterval == 0u) && progFunc) progFunc(ctr);
-        return !quitting;
+    // Both tables are split into the same fixed number of key ranges which are scanned in parallel. Each table's shasum
+    // is the sha256d of its ranges' sha256d's (in key order), so the result doesn't depend on the number of cores.
+    constexpr unsigned kNumRanges = 64;
+    const auto ranges = SplitKeyspace(kNumRanges);
+    struct RangeResult {
+        size_t ct{}, sizeBytes{};
+        std::array<uint8_t, HashLen> shasum{};
     };
-    {
+    std::vector<RangeResult> results(2 * kNumRanges); // utxoset ranges, followed by scripthash_unspent ranges
+    ScanProgress progress(progFunc, progInterval);
+    ParallelFor(results.size(), [&](const size_t i) {
+        const DBTable &table = i < kNumRanges ? p->db.utxoset : p->db.shunspent;
+        RangeResult &res = results[i];
         bitcoin::CHash256 hasher;
-        for (it_utxo->SeekToFirst(); it_utxo->Valid(); it_utxo->Next()) {
-            auto const k = it_utxo->key();
-            auto const v = it_utxo->value();
+        size_t pending = 0;
+        RangeIter it(table, readOpts, ranges[i % kNumRanges]);
+        for ( ; it->Valid(); it->Next()) {
+            auto const k = it->key();
+            auto const v = it->value();
             hasher.Write(reinterpret_cast<const uint8_t *>(k.data()), k.size());
             hasher.Write(reinterpret_cast<const uint8_t *>(v.data()), v.size());
-            ++ret.utxo_db_ct;
-            ret.utxo_db_size_bytes += k.size() + v.size();
-            if (UNLIKELY(!UpdateProgress())) { ret = UTXOSetStats{}; return ret; }
+            ++res.ct;
+            res.sizeBytes += k.size() + v.size();
+            if (UNLIKELY(++pending == ScanProgress::kChunk)) {
+                progress.add(pending);
+                pending = 0;
+                if (quitting) return;
+            }
         }
-        ret.utxo_db_shasum.resize(HashLen);
-        hasher.Finalize(reinterpret_cast<uint8_t *>(ret.utxo_db_shasum.data()));
-    }
-
-    {
+        if (!it->status().ok())
+            throw DatabaseError(QString("Error iterating over the %1 table: %2").arg(DBName(table), StatusString(it->status())));
+        progress.add(pending);
+        hasher.Finalize(res.shasum.data());
+    }, 0, "UTXOStats");
+    if (quitting) return UTXOSetStats{};
+
+    const auto Combine = [&results](size_t begin, size_t &ct, size_t &sizeBytes, QByteArray &shasum) {
         bitcoin::CHash256 hasher;
-        for (it_shu->SeekToFirst(); it_shu->Valid(); it_shu->Next()) {
-            auto const k = it_shu->key();
-            auto const v = it_shu->value();
-            hasher.Write(reinterpret_cast<const uint8_t *>(k.data()), k.size());
-            hasher.Write(reinterpret_cast<const uint8_t *>(v.data()), v.size());
-            ++ret.shunspent_db_ct;
-            ret.shunspent_db_size_bytes += k.size() + v.size();
-            if (UNLIKELY(!UpdateProgress())) { ret = UTXOSetStats{}; return ret; }
+        for (size_t i = begin; i < begin + kNumRanges; ++i) {
+            ct += results[i].ct;
+            sizeBytes += results[i].sizeBytes;
+            hasher.Write(results[i].shasum.data(), results[i].shasum.size());
         }
-        ret.shunspent_db_shasum.resize(HashLen);
-        hasher.Finalize(reinterpret_cast<uint8_t *>(ret.shunspent_db_shasum.data()));
-    }
+        shasum.resize(HashLen);
+        hasher.Finalize(reinterpret_cast<uint8_t *>(shasum.data()));
+    };
+    Combine(0, ret.utxo_db_ct, ret.utxo_db_size_bytes, ret.utxo_db_shasum);
+    Combine(kNumRanges, ret.shunspent_db_ct, ret.shunspent_db_size_bytes, ret.shunspent_db_shasum);
 
     return ret;
 }
@@ -4435,23 +5955,52 @@ namespace {
 
     template <> QByteArray Serialize(const TxNumVec &v)
     {
-        // this serializes a vector of TxNums to a compact representation (6 bytes, eg 48 bits per TxNum), in little endian byte order
-        constexpr auto compactSize = CompactTXO::compactTxNumSize(); /* 6 */
-        const size_t nBytes = v.size() * compactSize;
-        QByteArray ret(int(nBytes), Qt::Uninitialized);
-        if (UNLIKELY(nBytes != size_t(ret.size()))) {
+        // this serializes a vector of TxNums to the delta + VarInt encoding, see DeltaHist
+        const size_t maxBytes = v.size() * VarInt::maxSize;
+        QByteArray ret(int(maxBytes), Qt::Uninitialized);
+        if (UNLIKELY(maxBytes != size_t(ret.size()))) {
             throw DatabaseSerializationError(QString("Overflow or other error when attempting to serialize a TxNumVec"
-                                                     " of %1 bytes").arg(qulonglong(nBytes)));
+                                                     " of %1 bytes").arg(qulonglong(maxBytes)));
         }
-        std::byte *cur = reinterpret_cast<std::byte *>(ret.data());
-        for (const auto num : v) {
-            CompactTXO::txNumToCompactBytes(cur, num);
-            cur += compactSize;
+        std::byte * const begin = reinterpret_cast<std::byte *>(ret.data());
+        std::byte *cur = begin;
+        if (!v.empty()) {
+            cur = DeltaHist::WriteNum(cur, v.back());
+            for (size_t i = v.size() - 1; i > 0; --i) {
+                if (UNLIKELY(v[i-1] >= v[i]))
+                    throw DatabaseSerializationError("Attempted to serialize a TxNumVec that is not strictly ascending");
+                cur = DeltaHist::WriteNum(cur, v[i] - v[i-1]);
+            }
         }
+        ret.truncate(int(cur - begin));
         return ret;
     }
-    // this deserializes a vector of TxNums from a compact representation (6 bytes, eg 48 bits per TxNum), assuming little endian byte order
+    // this deserializes a vector of TxNums from the delta + VarInt encoding, see DeltaHist
     template <> TxNumVec Deserialize(const QByteArray &ba, bool *ok)
+    {
+        TxNumVec ret;
+        if (ok) *ok = false;
+        const auto *cur = reinterpret_cast<const std::byte *>(ba.constData()), * const end = cur + ba.size();
+        // first pass: count the numbers so that we can fill in the vector back-to-front in the second pass
+        size_t n = 0;
+        for (const std::byte *p = cur; p < end; ++n)
+            if (!DeltaHist::SkipNum(p, end)) return ret;
+        ret.resize(n);
+        uint64_t val, delta;
+        if (n && DeltaHist::ReadNum(cur, end, val)) {
+            ret[--n] = val;
+            while (n) {
+                if (!DeltaHist::ReadNum(cur, end, delta) || UNLIKELY(delta == 0 || delta > val)) {
+                    ret.clear();
+                    return ret;
+                }
+                ret[--n] = val -= delta;
+            }
+        }
+        if (ok) *ok = true;
+        return ret;
+    }
+    TxNumVec DeserializeLegacyTxNumVec(const QByteArray &ba, bool *ok)
     {
         constexpr auto compactSize = CompactTXO::compactTxNumSize(); /* 6 */
         const size_t blen = size_t(ba.length());
@@ -4507,6 +6056,12 @@ namespace {
 
 #ifdef ENABLE_TESTS
 #include "robin_hood/robin_hood.h"
+
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+
+#include <cmath>
+#include <numeric>
 namespace {
 
     template<size_t NB>
@@ -4590,5 +6145,483 @@ namespace {
               << " elapsed: " << t0.secsStr(2) << " sec";
     }
     const auto b1 = App::registerBench("txcol", findCollisions);
+
+    void testHistoryEncoding() {
+        QRandomGenerator rgen(42);
+        const auto RandomHistory = [&rgen](TxNum start, size_t n) {
+            TxNumVec v;
+            for (TxNum cur = start; v.size() < n; ) {
+                // mix of small and large gaps so that we exercise all of the VarInt lengths
+                const unsigned shift = rgen.bounded(41u);
+                cur += 1u + (rgen.generate64() & ((uint64_t{1} << shift) - 1u));
+                v.push_back(cur);
+            }
+            return v;
+        };
+        HistoryMergeOperator op;
+        op.legacyFormat = false;
+        size_t nBytes = 0, nNums = 0;
+        for (int iter = 0; iter < 2000; ++iter) {
+            TxNumVec all = RandomHistory(rgen.bounded(2u) ? 0 : rgen.generate64() >> 24u, 1u + rgen.bounded(300u));
+            // round-trip
+            bool ok;
+            const QByteArray enc = Serialize(all);
+            if (Deserialize<TxNumVec>(enc, &ok) != all || !ok)
+                throw Exception(QString("Round-trip failed for history of size %1").arg(all.size()));
+            nBytes += size_t(enc.size()); nNums += all.size();
+            // merging the encoded pieces of a history in order must produce the encoding of the whole history,
+            // regardless of whether the merges are full merges or partial merges of operands
+            const size_t split1 = rgen.bounded(unsigned(all.size())), split2 = split1 + rgen.bounded(unsigned(all.size() - split1));
+            const QByteArray a = Serialize(TxNumVec(all.begin(), all.begin() + split1)),
+                             b = Serialize(TxNumVec(all.begin() + split1, all.begin() + split2)),
+                             c = Serialize(TxNumVec(all.begin() + split2, all.end()));
+            std::string ab, abc, bc, abc2;
+            const rocksdb::Slice sa = ToSlice(a), sb = ToSlice(b), sc = ToSlice(c);
+            if (!op.Merge({}, &sa, sb, &ab, nullptr) || !op.Merge({}, &sb, sc, &bc, nullptr))
+                throw Exception("Merge returned false");
+            const rocksdb::Slice sab(ab), sbc(bc);
+            if (!op.Merge({}, &sab, sc, &abc, nullptr) || !op.Merge({}, &sa, sbc, &abc2, nullptr))
+                throw Exception("Merge returned false");
+            if (QByteArray::fromStdString(abc) != enc || QByteArray::fromStdString(abc2) != enc)
+                throw Exception(QString("Merge result mismatch for history of size %1 (split at %2, %3)")
+                                .arg(all.size()).arg(split1).arg(split2));
+        }
+        // out-of-order and duplicate TxNums must be rejected
+        {
+            const QByteArray a = Serialize(TxNumVec{5, 10}), b = Serialize(TxNumVec{10, 11});
+            const rocksdb::Slice sa = ToSlice(a), sb = ToSlice(b);
+            std::string out;
+            if (op.Merge({}, &sa, sb, &out, nullptr))
+                throw Exception("Merge of overlapping histories should have failed");
+            bool threw = false;
+            try { Serialize(TxNumVec{3, 2}); } catch (const DatabaseSerializationError &) { threw = true; }
+            if (!threw)
+                throw Exception("Serialize of a non-ascending TxNumVec should have thrown");
+        }
+        // the legacy format still decodes
+        {
+            const TxNumVec v{1, 0xffffff, 0xffffffffffull};
+            QByteArray legacy;
+            for (const auto n : v) {
+                std::array<std::byte, CompactTXO::compactTxNumSize()> buf;
+                CompactTXO::txNumToCompactBytes(buf.data(), n);
+                legacy.append(reinterpret_cast<const char *>(buf.data()), int(buf.size()));
+            }
+            bool ok;
+            if (DeserializeLegacyTxNumVec(legacy, &ok) != v || !ok)
+                throw Exception("Legacy TxNumVec decode failed");
+        }
+        Log() << "History encoding: " << nNums << " TxNums in " << nBytes << " bytes ("
+              << QString::number(double(nBytes) / double(nNums), 'f', 2) << " bytes/TxNum vs "
+              << CompactTXO::compactTxNumSize() << " for the legacy format)";
+    }
+    const auto t1 = App::registerTest("histenc", testHistoryEncoding);
+
+    /// Sorts `lats` (nanoseconds) and logs throughput and latency percentiles for a storage bench run
+    void logLatencies(const QString &what, size_t nThreads, std::vector<qint64> &lats, double elapsedSecs) {
+        if (lats.empty()) return;
+        std::sort(lats.begin(), lats.end());
+        const auto usecAt = [&lats](double pct) {
+            return QString::number(lats[std::min(lats.size() - 1, size_t(pct * lats.size()))] / 1e3, 'f', 1);
+        };
+        Log() << what << " (" << nThreads << Util::Pluralize(" thread", nThreads) << "): " << lats.size() << " ops in "
+              << QString::number(elapsedSecs, 'f', 3) << " secs, "
+              << QString::number(lats.size() / std::max(elapsedSecs, 1e-9), 'f', 1) << " ops/sec, latency (usec) p50: "
+              << usecAt(0.5) << ", p90: " << usecAt(0.9) << ", p99: " << usecAt(0.99) << ", max: "
+              << QString::number(lats.back() / 1e3, 'f', 1);
+    }
+
+    /// Builds a synthetic chain in a fresh datadir and measures the storage hot paths. The following environment
+    /// variables may be used to tune it:
+    ///   NSH       - number of distinct scripthashes (default: 20000)
+    ///   NBLOCKS   - number of blocks to add (default: 1000)
+    ///   NTXPB     - non-coinbase txs per block, each spending 1 coin and creating 2 (default: 200)
+    ///   ZIPF      - exponent of the Zipfian distribution of outputs (and queries) over scripthashes (default: 1.1)
+    ///   NQUERIES  - number of queries for each of the read benches (default: 20000)
+    ///   NTHREADS  - number of threads for the multi-threaded read benches (default: number of virtual cores)
+    ///   BENCH_DIR - datadir to use and keep, must be empty or not exist (default: a temp dir that is deleted after)
+    void benchStorage() {
+        const auto envNum = [](const char *name, double def) {
+            if (const char *v = std::getenv(name); v && *v) {
+                bool ok;
+                const double d = QString(v).toDouble(&ok);
+                if (!ok || d < 0.) throw BadArgs(QString("Bad value for env var %1: %2").arg(name, v));
+                return d;
+            }
+            return def;
+        };
+        const size_t nSH = std::max(size_t(envNum("NSH", 20'000)), size_t(1)),
+                     nBlocks = std::max(size_t(envNum("NBLOCKS", 1'000)), size_t(2)),
+                     nTxPerBlock = size_t(envNum("NTXPB", 200)),
+                     nQueries = std::max(size_t(envNum("NQUERIES", 20'000)), size_t(1)),
+                     nThreads = std::max(size_t(envNum("NTHREADS", Util::getNVirtualProcessors())), size_t(1)),
+                     nUndo = std::min(size_t(10), nBlocks - 1);
+        const double zipfS = envNum("ZIPF", 1.1);
+
+        std::unique_ptr<QTemporaryDir> tmpDir; // declared before `storage` so that it outlives it
+        QString datadir = QString::fromLocal8Bit(std::getenv("BENCH_DIR"));
+        if (datadir.isEmpty()) {
+            tmpDir = std::make_unique<QTemporaryDir>();
+            if (!tmpDir->isValid()) throw InternalError("Unable to create a temporary directory");
+            datadir = tmpDir->path();
+        } else if (QDir d(datadir); d.exists() && !d.isEmpty()) {
+            throw BadArgs(QString("BENCH_DIR %1 must be empty or not exist").arg(datadir));
+        } else if (!QDir().mkpath(datadir)) {
+            throw BadArgs(QString("Unable to create BENCH_DIR %1").arg(datadir));
+        }
+        Log() << "Scripthashes: " << nSH << ", blocks: " << nBlocks << ", txs/block: " << nTxPerBlock << ", zipf: "
+              << zipfS << ", queries: " << nQueries << ", threads: " << nThreads << ", datadir: " << datadir;
+
+        auto opts = std::make_shared<Options>();
+        opts->datadir = datadir;
+        opts->maxHistory = std::numeric_limits<int>::max(); // the most popular synthetic scripthashes have huge histories
+        auto storage = std::make_shared<Storage>(opts);
+        storage->startup();
+
+        // Scripthash k is picked with probability proportional to 1 / (k+1)^zipfS, both for outputs and for queries,
+        // so that the popular scripthashes (with the biggest histories) are also the most queried (as in real life).
+        std::vector<bitcoin::CScript> scripts(nSH);
+        std::vector<HashX> hashXs(nSH);
+        std::vector<double> cdf(nSH);
+        double cumWeight = 0.;
+        for (size_t k = 0; k < nSH; ++k) {
+            std::vector<uint8_t> h160(20);
+            std::memcpy(h160.data(), &k, sizeof(k));
+            scripts[k] << bitcoin::OP_DUP << bitcoin::OP_HASH160 << h160 << bitcoin::OP_EQUALVERIFY << bitcoin::OP_CHECKSIG;
+            hashXs[k] = BTC::HashXFromCScript(scripts[k]);
+            cdf[k] = cumWeight += 1. / std::pow(double(k + 1), zipfS);
+        }
+        QRandomGenerator rgen(42);
+        const auto zipfPick = [&] {
+            const auto it = std::upper_bound(cdf.begin(), cdf.end(), rgen.generateDouble() * cumWeight);
+            return std::min(size_t(it - cdf.begin()), nSH - 1);
+        };
+
+        // -- addBlock
+        struct SynthCoin { bitcoin::TxId txid; uint32_t n; };
+        std::vector<SynthCoin> spendable;
+        bitcoin::uint256 prevHash;
+        const auto makeBlock = [&](unsigned height) {
+            auto block = BTC::MakeTestBlock(prevHash, height);
+            std::vector<SynthCoin> newCoins;
+            const auto addTx = [&](bitcoin::CMutableTransaction &&mtx) {
+                block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(mtx)));
+                const auto & tx = *block.vtx.back();
+                for (uint32_t n = 0; n < tx.vout.size(); ++n)
+                    newCoins.push_back({tx.GetId(), n});
+            };
+            {
+                // coinbase, which also seeds the pool of spendable coins
+                auto cb = BTC::MakeTestCoinbase(height);
+                for (size_t i = 0; i < std::max<size_t>(nTxPerBlock / 2, 1); ++i)
+                    cb.vout.emplace_back(1000 * bitcoin::SATOSHI, scripts[zipfPick()]);
+                addTx(std::move(cb));
+            }
+            for (size_t i = 0; i < nTxPerBlock && !spendable.empty(); ++i) {
+                const auto idx = rgen.bounded(quint32(spendable.size()));
+                const SynthCoin coin = spendable[idx];
+                spendable[idx] = spendable.back();
+                spendable.pop_back();
+                bitcoin::CMutableTransaction mtx;
+                mtx.vin.emplace_back(bitcoin::COutPoint(coin.txid, coin.n));
+                mtx.vout.emplace_back(1000 * bitcoin::SATOSHI, scripts[zipfPick()]);
+                mtx.vout.emplace_back(1000 * bitcoin::SATOSHI, scripts[zipfPick()]);
+                addTx(std::move(mtx));
+            }
+            spendable.insert(spendable.end(), newCoins.begin(), newCoins.end()); // spendable starting with the next block
+            prevHash = block.GetHash();
+            return block;
+        };
+        const auto addBlock = [&storage](unsigned height, const bitcoin::CBlock &block, bool saveUndo) {
+            auto ppb = PreProcessedBlock::makeShared(height, block.vtx.size() * 200u /* estimate, for stats only */, block);
+            const auto t0 = Util::getTimeNS();
+            storage->addBlock(ppb, saveUndo);
+            return Util::getTimeNS() - t0;
+        };
+        std::vector<qint64> lats;
+        std::vector<bitcoin::CBlock> tipBlocks; // the last nUndo blocks, for re-adding after undoLatestBlock below
+        size_t nTxs = 0;
+        for (unsigned h = 0; h < nBlocks; ++h) {
+            const auto block = makeBlock(h);
+            const bool saveUndo = h + nUndo >= nBlocks;
+            nTxs += block.vtx.size();
+            lats.push_back(addBlock(h, block, saveUndo));
+            if (saveUndo) tipBlocks.push_back(block);
+            if (nBlocks >= 10 && (h + 1) % (nBlocks / 10) == 0) Debug() << "Added " << (h + 1) << "/" << nBlocks << " blocks ...";
+        }
+        const double addSecs = std::accumulate(lats.begin(), lats.end(), qint64(0)) / 1e9;
+        Log() << "Synthetic chain: " << nTxs << " txs, " << storage->utxoSetSize() << " utxos, "
+              << QString::number(nTxs / std::max(addSecs, 1e-9), 'f', 1) << " txs/sec added";
+        logLatencies("addBlock", 1, lats, addSecs);
+
+        // -- read paths: each runs `op(i)` for i in [0, nQueries), split into contiguous slices across the threads
+        const auto run = [&](const QString &name, const std::function<size_t(size_t)> &op) {
+            for (const size_t nThr : {size_t(1), nThreads}) {
+                std::vector<std::vector<qint64>> threadLats(nThr);
+                std::atomic_size_t sink{0}; // so that the results are "used"
+                std::mutex errMut;
+                QString err;
+                const Tic t0;
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < nThr; ++t) {
+                    threads.emplace_back([&, t] {
+                        auto & tl = threadLats[t];
+                        const size_t begin = nQueries * t / nThr, end = nQueries * (t + 1) / nThr;
+                        tl.reserve(end - begin);
+                        size_t localSink = 0;
+                        try {
+                            for (size_t i = begin; i < end; ++i) {
+                                const auto ts = Util::getTimeNS();
+                                localSink += op(i);
+                                tl.push_back(Util::getTimeNS() - ts);
+                            }
+                        } catch (const std::exception &e) {
+                            std::unique_lock g(errMut);
+                            err = e.what();
+                        }
+                        sink += localSink;
+                    });
+                }
+                for (auto & th : threads) th.join();
+                const double secs = t0.secs();
+                if (!err.isEmpty()) throw Exception(QString("%1: %2").arg(name, err));
+                std::vector<qint64> all;
+                for (auto & tl : threadLats) all.insert(all.end(), tl.begin(), tl.end());
+                logLatencies(name, nThr, all, secs);
+                if (nThreads == 1) break;
+            }
+        };
+        std::vector<size_t> qsh(nQueries);
+        std::vector<TxNum> qtxnum(nQueries);
+        for (size_t i = 0; i < nQueries; ++i) {
+            qsh[i] = zipfPick();
+            qtxnum[i] = rgen.bounded(quint32(nTxs));
+        }
+        using TFO = Storage::TokenFilterOption;
+        run("getHistory", [&](size_t i) { return storage->getHistory(hashXs[qsh[i]], true, false).size(); });
+        run("listUnspent", [&](size_t i) { return storage->listUnspent(hashXs[qsh[i]], TFO::IncludeTokens).size(); });
+        run("getBalance", [&](size_t i) {
+            return size_t(storage->getBalance(hashXs[qsh[i]], TFO::IncludeTokens).first / bitcoin::SATOSHI);
+        });
+        run("hashForTxNum", [&](size_t i) { return size_t(storage->hashForTxNum(qtxnum[i], true)->size()); });
+        constexpr size_t kTxHeightsBatch = 10; // a typical wallet asks for a handful of txs at a time
+        std::vector<std::vector<TxHash>> qtxhashes(nQueries);
+        for (size_t i = 0; i < nQueries; ++i)
+            for (size_t j = 0; j < kTxHeightsBatch; ++j)
+                qtxhashes[i].push_back(*storage->hashForTxNum(qtxnum[(i + j) % nQueries], true));
+        run(QString("getTxHeights (batches of %1)").arg(kTxHeightsBatch), [&](size_t i) {
+            return storage->getTxHeights(qtxhashes[i]).size();
+        });
+
+        // -- undoLatestBlock, then re-add the undone blocks (as happens after a reorg)
+        lats.clear();
+        for (size_t i = 0; i < nUndo; ++i) {
+            const Tic t0;
+            storage->undoLatestBlock();
+            lats.push_back(t0.nsec());
+        }
+        logLatencies("undoLatestBlock", 1, lats, std::accumulate(lats.begin(), lats.end(), qint64(0)) / 1e9);
+        lats.clear();
+        for (size_t i = 0; i < tipBlocks.size(); ++i)
+            lats.push_back(addBlock(unsigned(nBlocks - nUndo + i), tipBlocks[i], true));
+        logLatencies("addBlock (with undo info, after undo)", 1, lats,
+                     std::accumulate(lats.begin(), lats.end(), qint64(0)) / 1e9);
+    }
+    const auto b2 = App::registerBench("storage", benchStorage);
+
+    /// Builds a tiny chain with CashToken outputs in a temp datadir, and checks the token_unspent index via
+    /// getTokenHolders, and listUnspent/getBalance with token filtering, across a spend and its undo.
+    void testTokenIndex() {
+        QTemporaryDir tmpDir; // declared before `storage` so that it outlives it
+        if (!tmpDir.isValid()) throw InternalError("Unable to create a temporary directory");
+        auto opts = std::make_shared<Options>();
+        opts->datadir = tmpDir.path();
+        auto storage = std::make_shared<Storage>(opts);
+        storage->startup();
+
+        using bitcoin::token::OutputData, bitcoin::token::OutputDataPtr, bitcoin::token::SafeAmount;
+        const auto script = [](uint8_t k) {
+            return bitcoin::CScript() << bitcoin::OP_DUP << bitcoin::OP_HASH160 << std::vector<uint8_t>(20, k)
+                                      << bitcoin::OP_EQUALVERIFY << bitcoin::OP_CHECKSIG;
+        };
+        const auto scriptA = script(0xaa), scriptB = script(0xbb);
+        const HashX shA = BTC::HashXFromCScript(scriptA), shB = BTC::HashXFromCScript(scriptB);
+        const bitcoin::token::Id cat1(bitcoin::uint256S("11" + std::string(62, '0'))),
+                                 cat2(bitcoin::uint256S("22" + std::string(62, '0'))),
+                                 catNone(bitcoin::uint256S("33" + std::string(62, '0')));
+        const auto fungible = [](const bitcoin::token::Id &cat, int64_t amt) {
+            return OutputDataPtr(OutputData(cat, *SafeAmount::fromInt(amt)));
+        };
+        const auto nft = [](const bitcoin::token::Id &cat) {
+            return OutputDataPtr(OutputData(cat, *SafeAmount::fromInt(0), {}, true));
+        };
+
+        bitcoin::uint256 prevHash;
+        const auto addBlock = [&](unsigned height, std::vector<bitcoin::CMutableTransaction> txs, bool saveUndo) {
+            auto block = BTC::MakeTestBlock(prevHash, height);
+            for (auto & tx : txs)
+                block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(tx)));
+            storage->addBlock(PreProcessedBlock::makeShared(height, 1000, block), saveUndo);
+            prevHash = block.GetHash();
+            return block;
+        };
+        // block 0: A gets 100 of cat1 and a cat1 NFT, and plain BCH; B gets 50 of cat1 and 7 of cat2
+        auto cb0 = BTC::MakeTestCoinbase(0);
+        cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptA, fungible(cat1, 100));
+        cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptA, nft(cat1));
+        cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptA);
+        cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptB, fungible(cat1, 50));
+        cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptB, fungible(cat2, 7));
+        const auto block0 = addBlock(0, {cb0}, false);
+        // block 1: A sends its 100 cat1 to B
+        auto cb1 = BTC::MakeTestCoinbase(1);
+        bitcoin::CMutableTransaction send;
+        cb1.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptA);
+        send.vin.emplace_back(bitcoin::COutPoint(block0.vtx[0]->GetId(), 0));
+        send.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptB, fungible(cat1, 100));
+        addBlock(1, {cb1, send}, true);
+
+        using Expected = std::map<HashX, std::tuple<unsigned, unsigned, int64_t>>; // hashX -> {utxos, nfts, amount}
+        const auto check = [&](const bitcoin::token::Id &cat, const Expected &expected) {
+            const auto holders = storage->getTokenHolders(cat);
+            Expected got;
+            for (const auto & h : holders) {
+                if (!got.empty() && !(got.rbegin()->first < h.hashX))
+                    throw Exception("getTokenHolders: holders are not sorted by HashX");
+                got[h.hashX] = {h.nUtxos, h.nNFTs, h.fungibleAmount};
+            }
+            if (got != expected)
+                throw Exception(QString("getTokenHolders: unexpected holders for category %1")
+                                .arg(QString::fromStdString(cat.ToString())));
+        };
+        using TFO = Storage::TokenFilterOption;
+        const auto checkUnspent = [&](const HashX &sh, size_t nTok, size_t nNonTok) {
+            if (storage->listUnspent(sh, TFO::OnlyTokens).size() != nTok
+                    || storage->listUnspent(sh, TFO::ExcludeTokens).size() != nNonTok
+                    || storage->listUnspent(sh, TFO::IncludeTokens).size() != nTok + nNonTok)
+                throw Exception("listUnspent: unexpected token filtering results");
+            if (storage->getBalance(sh, TFO::OnlyTokens).first != int64_t(nTok) * 1000 * bitcoin::SATOSHI
+                    || storage->getBalance(sh, TFO::ExcludeTokens).first != int64_t(nNonTok) * 1000 * bitcoin::SATOSHI)
+                throw Exception("getBalance: unexpected token filtering results");
+        };
+
+        check(cat1, {{shA, {1, 1, 0}}, {shB, {2, 0, 150}}});
+        check(cat2, {{shB, {1, 0, 7}}});
+        check(catNone, {});
+        checkUnspent(shA, 1, 2);
+        checkUnspent(shB, 3, 0);
+        Log() << "getTokenHolders after spend: ok";
+
+        storage->undoLatestBlock();
+        check(cat1, {{shA, {2, 1, 100}}, {shB, {1, 0, 50}}});
+        check(cat2, {{shB, {1, 0, 7}}});
+        checkUnspent(shA, 2, 1);
+        checkUnspent(shB, 2, 0);
+        Log() << "getTokenHolders after undo: ok";
+    }
+    const auto t2 = App::registerTest("tokenindex", testTokenIndex);
+
+    /// Checks the frequency sketch of the HotHistoryCache, and that a cached history is admitted once hot, is appended
+    /// to by addBlock, and is truncated (and finally evicted) by undoLatestBlock, always matching the expected history.
+    void testHotHistory() {
+        {
+            auto hhc = std::make_unique<HotHistoryCache>(1'000'000); // large, so keep it off the stack
+            const auto key = [](uint8_t k) { return BTC::Hash(QByteArray(1, char(k))); };
+            const HashX hot = key(1), cold = key(2);
+            for (unsigned i = 0; i < 30; ++i)
+                hhc->get(hot);
+            hhc->get(cold);
+            if (hhc->frequency(hot) != 30 || hhc->frequency(cold) != 1 || hhc->frequency(key(3)) != 0)
+                throw Exception("HotHistoryCache: unexpected frequency estimates");
+            Storage::History hist(HotHistoryCache::kMinItems);
+            hhc->maybeAdmit(cold, hist);
+            hhc->maybeAdmit(hot, hist);
+            if (hhc->get(cold) || !hhc->get(hot))
+                throw Exception("HotHistoryCache: unexpected admission");
+            Log() << "HotHistoryCache frequency sketch & admission: ok";
+        }
+
+        QTemporaryDir tmpDir; // declared before `storage` so that it outlives it
+        if (!tmpDir.isValid()) throw InternalError("Unable to create a temporary directory");
+        auto opts = std::make_shared<Options>();
+        opts->datadir = tmpDir.path();
+        auto storage = std::make_shared<Storage>(opts);
+        storage->startup();
+
+        const auto script = [](uint8_t k) {
+            return bitcoin::CScript() << bitcoin::OP_DUP << bitcoin::OP_HASH160 << std::vector<uint8_t>(20, k)
+                                      << bitcoin::OP_EQUALVERIFY << bitcoin::OP_CHECKSIG;
+        };
+        const auto scriptF = script(0xf0), scriptH = script(0x40);
+        const HashX shH = BTC::HashXFromCScript(scriptH);
+        constexpr unsigned kNFund = 40; // so that shH's history is larger than kMinItems
+        Storage::History expected; // shH's history, as it should be returned by getHistory
+
+        bitcoin::uint256 prevHash;
+        const auto addBlock = [&](unsigned height, std::vector<bitcoin::CMutableTransaction> txs, bool saveUndo) {
+            auto block = BTC::MakeTestBlock(prevHash, height);
+            for (auto & tx : txs) {
+                block.vtx.push_back(bitcoin::MakeTransactionRef(std::move(tx)));
+                const auto & ref = *block.vtx.back();
+                if (std::any_of(ref.vout.begin(), ref.vout.end(), [&](const auto &out) { return out.scriptPubKey == scriptH; }))
+                    expected.push_back({BTC::Hash2ByteArrayRev(ref.GetHashRef()), int(height), {}});
+            }
+            storage->addBlock(PreProcessedBlock::makeShared(height, 1000, block), saveUndo);
+            prevHash = block.GetHash();
+            return block;
+        };
+        const auto cacheStat = [&](const char *name) {
+            return storage->statsSafe().toMap()["caches"].toMap()["Hot Cache: ScriptHash -> History"].toMap()[name].toLongLong();
+        };
+        const auto check = [&](const QString &when, qlonglong nItems) {
+            if (storage->getHistory(shH, true, false) != expected)
+                throw Exception(QString("getHistory: unexpected history %1").arg(when));
+            if (cacheStat("nItems") != nItems)
+                throw Exception(QString("HotHistoryCache: expected %1 cached histories %2").arg(nItems).arg(when));
+        };
+
+        // block 0 funds kNFund coins, block 1 spends each of them to shH in its own tx, blocks 2 & 3 pay shH too
+        auto cb0 = BTC::MakeTestCoinbase(0);
+        for (unsigned i = 0; i < kNFund; ++i)
+            cb0.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptF);
+        const auto block0 = addBlock(0, {cb0}, false);
+        std::vector<bitcoin::CMutableTransaction> txs1{BTC::MakeTestCoinbase(1)};
+        txs1.front().vout.emplace_back(1000 * bitcoin::SATOSHI, scriptF);
+        for (unsigned i = 0; i < kNFund; ++i) {
+            auto & tx = txs1.emplace_back();
+            tx.vin.emplace_back(bitcoin::COutPoint(block0.vtx[0]->GetId(), i));
+            tx.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptH);
+        }
+        addBlock(1, std::move(txs1), true);
+        const auto payH = [&](unsigned height) {
+            auto cb = BTC::MakeTestCoinbase(height);
+            cb.vout.emplace_back(1000 * bitcoin::SATOSHI, scriptH);
+            addBlock(height, {cb}, true);
+        };
+        payH(2);
+
+        check("before it is hot", 0);
+        for (unsigned i = 0; i < 30; ++i) // freq * nItems >= kMinScore
+            storage->getHistory(shH, true, false);
+        check("once hot", 1);
+        if (cacheStat("admits") != 1) throw Exception("HotHistoryCache: expected 1 admission");
+        Log() << "Hot history admission: ok";
+
+        const auto hits0 = cacheStat("~hits");
+        payH(3);
+        check("after addBlock", 1);
+        if (cacheStat("~hits") <= hits0) throw Exception("HotHistoryCache: appended history was not served from the cache");
+        Log() << "Hot history append on addBlock: ok";
+
+        for (int height = 3; height >= 1; --height) {
+            storage->undoLatestBlock();
+            expected.erase(std::remove_if(expected.begin(), expected.end(), [&](const auto &h) { return h.height >= height; }),
+                           expected.end());
+            // after undoing block 1 the history is below kMinItems, so it's evicted
+            check(QString("after undoing block %1").arg(height), height > 1 ? 1 : 0);
+        }
+        Log() << "Hot history truncation on undoLatestBlock: ok";
+    }
+    const auto t3 = App::registerTest("hothistory", testHotHistory);
 } // end anon namespace
 #endif
@@ -25,6 +25,7 @@
 
 
 #include "BlockProc.h"
+#include "LockStats.h"
 #include "Merkle.h"
 #include "Mempool.h"
 #include "Mgr.h"
@@ -48,6 +49,7 @@
 #include <vector>
 
 namespace BTC { class HeaderVerifier; } // fwd decl used below. #include "BTC.h" to see this type
+namespace rocksdb { class WriteBatch; } // fwd decl used below.
 
 /// Generic database error
 struct DatabaseError : public Exception { using Exception::Exception; ~DatabaseError() override; };
@@ -88,7 +90,7 @@ public:
     static QString rocksdbVersion();
 
     // locking types
-    using RWLock = std::shared_mutex;
+    using RWLock = LockStats::Sampled<std::shared_mutex>; ///< see LockStats.h; each lock is constructed with a name
     using Lock = std::mutex;
     using ExclusiveLockGuard = std::unique_lock<RWLock>;
     using SharedLockGuard = std::shared_lock<RWLock>;
@@ -189,7 +191,7 @@ public:
     /// Helper for TxNum. Resolve a 64-bit TxNum to a TxHash -- this may throw a DatabaseError if throwIfMissing=true (thread safe, takes no class-level locks)
     std::optional<TxHash> hashForTxNum(TxNum, bool throwIfMissng = false, bool *wasCached = nullptr, bool skipCache = false) const;
     /// Given a TxNum, returns the block height for the TxNum's block (if it exists).
-    /// Used to resolve scripthash_history -> block height for get_history. (thread safe, takes blkInfo lock)
+    /// Used to resolve scripthash_history -> block height for get_history. (thread safe, lock-free)
     std::optional<unsigned> heightForTxNum(TxNum) const;
     /// Given a block height and a position in the block (txIdx), return a TxHash.  Never throws. Returns !has_value if
     /// height/posInBlock pair is not found (or in very unlikely cases, if there was an underlying low-level error).
@@ -250,6 +252,20 @@ public:
     /// thread safe -- returns confirmd, unconfirmed balance for a scripthash
     std::pair<bitcoin::Amount, bitcoin::Amount> getBalance(const HashX &, TokenFilterOption) const;
 
+    /// A scripthash holding one or more (confirmed) utxos of a particular token category.
+    struct TokenHolder {
+        HashX hashX;
+        unsigned nUtxos = 0; ///< the number of utxos of the category held by hashX
+        unsigned nNFTs = 0; ///< the number of the above utxos that carry an NFT
+        int64_t fungibleAmount = 0; ///< total fungible token amount held (cannot overflow since supply is <= INT64_MAX)
+    };
+    using TokenHolders = std::vector<TokenHolder>;
+
+    /// Thread-safe. Returns the holders of a token category, sorted by HashX, by scanning only that category's
+    /// entries in the token_unspent index. Confirmed utxos only. Throws HistoryTooLarge if the category has more than
+    /// MaxHistory utxos, or DatabaseError on low-level db error. (Used by the `tokenholders` admin RPC.)
+    TokenHolders getTokenHolders(const bitcoin::token::Id &category) const;
+
     /// thread safe, called from controller when we are up-to-date
     void updateMerkleCache(unsigned height);
 
@@ -314,7 +330,8 @@ public:
     /// Thread-safe. Call this from any thread, but ideally call it from a threadPool worker thread, since it may take
     /// a while. Dumps all scripthashes as JSON data to output device outDev as an array of hex-encoded JSON strings,
     /// optionally indented by `indent*indentLevel` spaces. If indent is 0, the output will all be on 1 line with no
-    /// padding.
+    /// padding. Reads from a db snapshot, scanning key ranges in parallel (output is still in key order), so this does
+    /// not hold up block processing.
     size_t dumpAllScriptHashes(QIODevice *outDev, unsigned indent=0, unsigned indentLevel=0, const DumpProgressFunc & = {}, size_t progInterval = 100000) const;
 
     struct UTXOSetStats {
@@ -322,10 +339,13 @@ public:
         BlockHash block_hash;
         size_t utxo_db_ct{}, shunspent_db_ct{};
         size_t utxo_db_size_bytes{}, shunspent_db_size_bytes{};
-        QByteArray utxo_db_shasum, shunspent_db_shasum; // sha256d sum of all key/value pairs in both dbs
+        /// For each db: the sha256d of the sha256d sums of all of the key/value pairs in each of a fixed number of key
+        /// ranges (see calcUTXOSetStats in Storage.cpp)
+        QByteArray utxo_db_shasum, shunspent_db_shasum;
     };
     /// Thread-safe. Call this from any thread, but ideally call it from a threadPool worker thread, since it may take
-    /// a while. Will iterate over the entire utxoset db and scripthash_unspent db and return some stats. Used by
+    /// a while. Will iterate over the entire utxoset db and scripthash_unspent db (from a db snapshot, in parallel
+    /// across key ranges) and return some stats. The progress function may be called from worker threads. Used by
     /// the /debug HTTP endpoint.
     UTXOSetStats calcUTXOSetStats(const DumpProgressFunc & = {}, size_t progInterval = 100000) const;
 
@@ -360,6 +380,13 @@ public:
     /// lightweight mechanism intended to be used and "owned" by the Controller object *only*.
     [[nodiscard]] InitialSyncRAII setInitialSync() { return InitialSyncRAII{*this}; }
 
+    /// Thread-safe. Turns on/off the collection of rocksdb's internal statistics (tickers such as block cache hits &
+    /// bloom filter usefulness, and Get/MultiGet/Seek latency histograms), along with our per-table I/O counters for
+    /// the hot queries. These are reported in stats() and on the /metrics endpoint. Initially set from the "db_stats"
+    /// config setting; may be toggled at runtime via the "dbstats" admin RPC.
+    void setDBStatsEnabled(bool);
+    bool isDBStatsEnabled() const;
+
 protected:
     virtual Stats stats() const override; ///< from StatsMixin
 
@@ -374,15 +401,16 @@ protected:
     // -- the below are used inside addBlock (and undoLatestBlock) to maintain the UTXO set & Headers
     class UTXOCache;
 
-    /// Used to store (in an opaque fashion) the rocksdb::WriteBatch objects used for updating the db.
-    /// Called internally from addBlock and undoLatestBlock().
+    /// Used to enqueue (in an opaque fashion) the utxoset, scripthash_unspent & token_unspent updates to the rocksdb::WriteBatch that
+    /// is used for updating the db for a block. Called internally from addBlock and undoLatestBlock().
     struct UTXOBatch {
-        UTXOBatch(UTXOCache *cache = nullptr);
+        UTXOBatch(const Storage &, rocksdb::WriteBatch &batch, UTXOCache *cache = nullptr);
         UTXOBatch(UTXOBatch &&);
-        /// Enqueue an add of a utxo -- does not take effect in db until Storage::issueUpdates() is called -- may throw.
+        /// Enqueue an add of a utxo -- does not take effect in db until the batch is committed -- may throw.
         void add(const TXO &, const TXOInfo &, const CompactTXO &);
-        /// Enqueue a removal -- does not take effect in db until Storage::issueUpdates() is called -- may throw.
-        void remove(const TXO &, const HashX &, const CompactTXO &);
+        /// Enqueue a removal -- does not take effect in db until the batch is committed -- may throw. `tokenData` must
+        /// be the token data of the utxo being removed (if any), so that its token_unspent index entries are removed too.
+        void remove(const TXO &, const HashX &, const CompactTXO &, const bitcoin::token::OutputData *tokenData);
 
     private:
         friend class Storage;
@@ -392,9 +420,12 @@ protected:
         std::unique_ptr<P> p;
     };
 
-    /// Call this when finished to issue the updates queued up in the batch context to the db.
+    /// Call this when finished with a UTXOBatch. Tallies up the utxo count; the caller commits the actual batch.
     void issueUpdates(UTXOBatch &);
 
+    /// Atomically commits all of the db updates for a block (or a block undo) to the db. May throw.
+    void commitBlockBatch(rocksdb::WriteBatch &batch, const QString &errMsg);
+
 
     /// Internally called by addBlock. Call this with the heaverVerifier lock held.
     /// Appends header h to the database at height. Note that it is undefined to call this function
@@ -405,15 +436,15 @@ protected:
     /// Rewinds the headers until the latest header is at the specified height.  May throw on error.
     void deleteHeadersPastHeight(BlockHeight height);
 
-    /// This is set in addBlock and undoLatestBlock while we do a bunch of updates, then cleared when updates are done,
-    /// for each block. Thread-safe, may throw.
+    /// This is set while the --fast-sync UTXO cache is alive (and may hold UTXO updates not yet in the db), and cleared
+    /// after it is flushed and deleted. Thread-safe, may throw.
     void setDirty(bool dirtyFlag);
     /// If this is true on startup, we know the db must be inconsistent and we refuse to continue, exiting with an
     /// error. Thread-safe, may throw.
     bool isDirty() const;
 
-    /// Called by addBlock and undoLatestBlock to update the utxo_count in the Meta db. Thread-safe, may throw.
-    void saveUtxoCt();
+    /// Called by addBlock and undoLatestBlock to enqueue an update of the utxo_count in the meta table. May throw.
+    void saveUtxoCt(rocksdb::WriteBatch &batch);
     /// Reads the UtxoCt from the meta db. If they key is missing it will return 0.  May throw on low-level db error.
     int64_t readUtxoCtFromDB() const;
 
@@ -430,6 +461,8 @@ private:
     struct Pvt;
     const std::unique_ptr<Pvt> p;
 
+    QString dbStatsPrometheusText() const; ///< returns rocksdb statistics & per-table I/O in Prometheus format, or empty if disabled
+
     void save_impl(SaveSpec override = SaveItem::None); ///< may abort app on database failure (unlikely).
     void saveMeta_impl(); ///< This may throw if db error. Caller should hold locks or be in single-threaded mode.
 
@@ -450,11 +483,24 @@ private:
     /// Called from cleanup. Does some flushing and gently closes all open DBs.
     void gentlyCloseAllDBs();
 
+    /// Called from startup. If the datadir uses the old layout (one rocksdb instance per table), moves all the data into
+    /// the new single db, then deletes the old dbs. May throw.
+    void migrateLegacyDBs();
+
     /// Only does something if options->compactDBs is true (iff --compact-dbs specified on CLI)
     void compactAllDBs();
 
-    // Called by heightForTxNum which calls this with the blockInfo lock held
-    std::optional<unsigned> heightForTxNum_nolock(TxNum) const;
+    /// Called from startup. If the db tables were written by a version without bloom filters, compacts them once so
+    /// that all of the existing data gets filters. May throw.
+    void checkUpgradeTableFilters();
+
+    /// Called from checkUpgradeDBVersion() for db's older than v3. Rewrites all of scripthash_history from the old
+    /// 6-byte-per-TxNum format to the delta + VarInt encoding. Resumable if interrupted. May throw.
+    void upgradeHistoryEncoding();
+
+    /// Called from checkUpgradeDBVersion() for db's older than v4. Populates the token_unspent index from
+    /// scripthash_unspent. May throw.
+    void buildTokenIndex();
 };
 
 Q_DECLARE_OPERATORS_FOR_FLAGS(Storage::SaveSpec)
@@ -463,6 +509,10 @@ Q_DECLARE_OPERATORS_FOR_FLAGS(Storage::SaveSpec)
 
 Data model for Fulcrum:  (120 column editor width recommended here)
 
+All of the "RocksDB" tables below live in a single rocksdb instance in the "db" subdirectory of the datadir, with each
+table being its own column family. (Older versions used a separate rocksdb instance per table; such datadirs are migrated
+on startup, see Storage::migrateLegacyDBs()).
+
 RocksDB: "meta"
   Purpose:  metadata and sanity checks (see Storage.cpp)
 
@@ -498,8 +548,10 @@ RocksDB: "undo"
 RocksDB: "scripthash_history"
   Purpose: the place where the history is stored for eg scripthash_status and get_history
   Key: scripthash_raw_bytes (32 bytes)
-  -> values: An ordered list of unique txNums: 6-byte txNums (txNum [uint48] , ... ), for all tx's spending from or to
-  a scripthash.
+  -> values: An ordered list of unique txNums for all tx's spending from or to a scripthash, delta encoded newest-first
+  as VarInts: VarInt(last txNum), then VarInt(difference to the previous txNum) down to the first one. Appending a
+  block's txNums is done with a rocksdb merge (see HistoryMergeOperator in Storage.cpp). (DB versions < 3 stored plain
+  6-byte txNums (txNum [uint48], ...) here, which are converted on startup, see Storage::upgradeHistoryEncoding()).
 
 RocksDB: "utxoset"
   Purpose: serialize the UTXOSet structure as seen in the sources. loading this involves iterating over entire table.
@@ -513,6 +565,15 @@ RocksDB: "scripthash_unspent"
   using this scheme. I tried a read-modify-write approach (keying off just HashX) and it was painfully slow on synch.
   This is much faster to synch.
 
+RocksDB: "token_unspent"
+  Purpose: secondary index of the CashToken-bearing subset of scripthash_unspent, so that token-filtered listunspent
+  and get_balance, as well as category-level queries (e.g. Storage::getTokenHolders), only touch matching rows.
+  Keys: 'h' + scripthash_raw_bytes + category (32 bytes) + serialized CompactTXO (for per-scripthash queries)
+        'c' + category + scripthash_raw_bytes + serialized CompactTXO (for per-category queries)
+  Value: same as the corresponding scripthash_unspent value.
+  Comments: New in DB version 4; populated from scripthash_unspent on startup for older db's (see
+  Storage::buildTokenIndex()).
+
 RocksDB: "txhash2txnum"
   Key: The last 6 bytes of the txhash in question (txhash bytes being in big endian byte order, i.e. JSON byte order).
   Value: One or more serialized VarInts. Each VarInt represents a "TxNum" (which tells us where the actual hash lives
@@ -527,16 +588,16 @@ RocksDB: "txhash2txnum"
 
 A note about ACID: (atomic, consistent, isolated, durable)
 
-The above isn't 100% ACID. Abrupt program termination is ok (becasue rocksdb uses journaling internally), so long as
-we weren't in the middle of adding a block or applying a block undo which involves writing to more than 1 rocksdb
-database at once.  If abrupt termination occurs during these aforementioned critical times (unlikely, but possible),
-then the program will consider itself as having a "corrupt" database, and it will refuse to run the next time it is
-started and it will require the user to delete the datadir and resynch to bitcoind.  In practice this approach is less
-problematic than it sounds since a program crash or power outage would have to occur precisely within a specific ~20ms
-timespan (which happens once every ~10 minutes) when the program is busy committing a new block to the db.  There is a
-probability of 1 in 30,000 for a random power outage to occur during this time.  Given how rare power outages are, and
-how most servers use a battery backup anyway -- this is acceptable.  And what's more: the database is 100% rebuildable
-from bitcoind's data store anyway; so even in the unlikely event of database corruption, the user will be able to
-recover.
+All of the rocksdb updates for a block (or a block undo) are accumulated into a single WriteBatch which is committed
+atomically to all tables at once (and the WAL is synced, except during initial sync). So abrupt program termination at
+any point leaves the db at the previous block or at the new block, never in between.  The two RecordFiles are not part
+of that transaction, so they are ordered around it: they are appended-to before the commit when adding a block, and
+truncated after the commit when undoing a block.  Thus after an abrupt termination they may be ahead of the db, and on
+startup they are simply trimmed back to match the db (which is authoritative).
+
+The one exception is --fast-sync: the UTXO cache delays utxoset and scripthash_unspent writes while it is alive, so
+the db is flagged "dirty" for as long as the cache exists.  If abrupt termination occurs during a fast-sync, the program
+will refuse to run the next time it is started and it will require the user to delete the datadir and resynch to
+bitcoind.  The database is 100% rebuildable from bitcoind's data store anyway.
 
 */
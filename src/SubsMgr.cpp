@@ -17,6 +17,8 @@
 // <https://www.gnu.org/licenses/>.
 //
 #include "SubsMgr.h"
+#include "LockStats.h"
+#include "Metrics.h"
 #include "Util.h"
 
 #include "bitcoin/hash.h"
@@ -44,6 +46,7 @@ Subscription::~Subscription()
 
 namespace {
     using LockGuard = std::lock_guard<std::mutex>;
+    using PvtLockGuard = std::lock_guard<LockStats::Sampled<std::mutex>>;
     constexpr int kNotifTimerIntervalMS = 500; ///< we notify in batches at most once every 500ms .. this delay is ok because anyway we only receive mempool updates at most once per second.
     constexpr const char *kNotifTimerName = "NotificationTimer";
     constexpr int kRemoveZombiesTimerIntervalMS = 60000; ///< we remove zombie subs entries every minute
@@ -54,7 +57,7 @@ namespace {
 
 struct SubsMgr::Pvt
 {
-    std::mutex mut;
+    LockStats::Sampled<std::mutex> mut{"SubsMgr::mut"};
     std::unordered_map<HashX, SubsMgr::SubRef, HashHasher> subs;
     std::unordered_set<HashX, HashHasher> pendingNotificatons;
 
@@ -129,7 +132,7 @@ void SubsMgr::doNotifyAllPending()
     const bool useCache = useStatusCache();
     std::vector<SubRef> pending; // this ends up being the intersection of the sh's in p->pendingNotifications and p->subs
     {
-        LockGuard g(p->mut);
+        PvtLockGuard g(p->mut);
         const bool pendingWasEmpty = p->pendingNotificatons.empty();
         if (!pendingWasEmpty && !p->subs.empty()) {
             const size_t pnsize = p->pendingNotificatons.size(), subsize = p->subs.size();
@@ -210,6 +213,8 @@ void SubsMgr::doNotifyAllPending()
         }
     }
     if (ctr || ctrSH) {
+        Metrics::histogram("fulcrum_subs_notify_round_seconds", "Time taken by each round of subscription notifications"
+                           " that had pending subscribables", "subsmgr", objectName()).observeNS(t0.nsec());
         DebugM(__func__, ": ", ctr, Util::Pluralize(" client", ctr), ", ", ctrSH, Util::Pluralize(" subscribable", ctrSH),
                " in ", t0.msecStr(4), " msec");
     }
@@ -218,7 +223,7 @@ void SubsMgr::doNotifyAllPending()
 void SubsMgr::enqueueNotifications(std::unordered_set<HashX, HashHasher> &&s)
 {
     if (s.empty()) return;
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
     const bool wasEmpty = p->pendingNotificatons.empty();
     p->pendingNotificatons.merge(std::move(s));
     if (wasEmpty)
@@ -238,7 +243,7 @@ void SubsMgr::unsubscribeClientsForKeys(const std::unordered_set<HashX, HashHash
     matchedSubs.reserve(std::min(keys.size(), kRecommendedPendingNotificationsReserveSize));
     size_t subsSize;
     {
-        LockGuard g(p->mut);
+        PvtLockGuard g(p->mut);
         subsSize = p->subs.size();
         if (keys.size() < subsSize) {
             // iterate over keys
@@ -291,7 +296,7 @@ auto SubsMgr::getOrMakeSubRef(const HashX &key) -> std::pair<SubRef, bool>
         throw LimitReached(QString("Subs limit of %1 has been reached").arg(limit));
 
     std::pair<SubRef, bool> ret;
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
 
     if (auto it = p->subs.find(key); it != p->subs.end()) {
         ret.first = it->second;
@@ -307,7 +312,7 @@ auto SubsMgr::getOrMakeSubRef(const HashX &key) -> std::pair<SubRef, bool>
 auto SubsMgr::findExistingSubRef(const HashX &key) const -> SubRef
 {
     SubRef ret;
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
     if (auto it = p->subs.find(key); it != p->subs.end())
         ret = it->second;
     return ret;
@@ -446,7 +451,7 @@ bool SubsMgr::unsubscribe(RPC::ConnectionBase *c, const HashX &key, bool updateT
 
 int64_t SubsMgr::numActiveClientSubscriptions() const { return p->nClientSubsActive; }
 int64_t SubsMgr::numScripthashesSubscribed() const {
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
     return int64_t(p->subs.size());
 }
 
@@ -518,7 +523,7 @@ void SubsMgr::removeZombies(bool forced)
     const Tic t0;
     int ctr = 0;
     const auto now = Util::getTime();
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
     const auto total = p->subs.size();
     for (auto it = p->subs.begin(); it != p->subs.end(); /* */) {
         SubRef sub = it->second; // take a copy to increment refct so it doesn't get deleted before we unlock it (erase() below)...
@@ -545,7 +550,7 @@ std::unordered_set<HashX, HashHasher> SubsMgr::nonZombieKeysOlderThan(const int6
 {
     std::unordered_set<HashX, HashHasher> ret;
     const auto now = Util::getTime();
-    LockGuard g(p->mut);
+    PvtLockGuard g(p->mut);
     for (const auto & [key, sub] : p->subs) {
         LockGuard g(sub->mut);
         if (!sub->subscribedClientIds.empty() && now - sub->tsMsec > msec)
@@ -562,7 +567,7 @@ auto SubsMgr::debug(const StatsParams &params) const -> Stats
         QVariantMap subs;
         qulonglong collisions{}, largestBucket{}, medianBucket{}, medianNonzeroBucket{};
         {
-            LockGuard g(p->mut);
+            PvtLockGuard g(p->mut);
             for (const auto & [sh, sub] : p->subs) {
                 QVariantMap m2;
                 {
@@ -600,7 +605,7 @@ auto SubsMgr::stats() const -> Stats
 {
     QVariantMap ret;
     {
-        LockGuard g(p->mut);
+        PvtLockGuard g(p->mut);
         ret["subscriptions load factor"] = p->subs.load_factor();
         ret["subscriptions bucket count"] = qulonglong(p->subs.bucket_count());
         QVariantList l;
@@ -0,0 +1,194 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#include "Tracing.h"
+
+#include "Json/Json.h"
+
+#include <QDateTime>
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <mutex>
+
+namespace Tracing {
+
+    namespace detail { thread_local Span *current = nullptr; }
+
+    namespace {
+        std::atomic_bool enabled{false};
+        std::atomic<qint64> slowNS{0};
+        std::atomic<uint32_t> sampleThresh{0}; ///< a span is sampled if the hash of its trace id is < this
+        std::atomic_bool sampleAll{false};
+        std::atomic<uint64_t> nextTraceId{1};
+
+        constexpr size_t kMaxRecent = 1000; ///< the size of the /traces ring buffer
+        std::mutex recentMut;
+        std::deque<QVariantMap> recent; ///< newest at the front
+
+        bool shouldSample(uint64_t traceId) noexcept {
+            if (sampleAll.load(std::memory_order_relaxed)) return true;
+            // trace ids are sequential, so mix the bits (splitmix64 finalizer) to avoid any periodicity
+            uint64_t z = traceId + 0x9e3779b97f4a7c15ULL;
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            z ^= z >> 31;
+            return uint32_t(z) < sampleThresh.load(std::memory_order_relaxed);
+        }
+    } // namespace
+
+    void configure(double slowMSec, double sampleRate)
+    {
+        slowMSec = std::max(slowMSec, 0.);
+        sampleRate = std::clamp(sampleRate, 0., 1.);
+        slowNS = qint64(std::llround(slowMSec * 1e6));
+        sampleAll = sampleRate >= 1.;
+        sampleThresh = uint32_t(std::min(std::ldexp(sampleRate, 32), double(UINT32_MAX)));
+        enabled = slowMSec > 0. || sampleRate > 0.;
+    }
+
+    bool isEnabled() noexcept { return enabled.load(std::memory_order_relaxed); }
+
+    uint64_t newTraceId() noexcept {
+        if (LIKELY(!isEnabled())) return 0;
+        return nextTraceId.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    SpanPtr begin(uint64_t traceId, const QString &method, quint64 clientId, qint64 recvNS)
+    {
+        if (!traceId || !isEnabled()) return {};
+        auto ret = std::make_shared<Span>();
+        ret->traceId = traceId;
+        ret->method = method;
+        ret->clientId = clientId;
+        ret->sampled = shouldSample(traceId);
+        ret->recvNS = recvNS;
+        return ret;
+    }
+
+    QVariantMap Span::toMap() const
+    {
+        // Each stage is reported as the time elapsed since the previous stage that applied, in msec
+        QVariantMap stages;
+        qint64 prev = recvNS;
+        const auto stage = [&](const char *name, qint64 t) {
+            if (!t || !prev) return;
+            stages[name] = (t - prev) / 1e6;
+            prev = t;
+        };
+        stage("parse", dispatchNS);
+        stage("dispatch", enqueueNS);
+        stage("queue", startNS);
+        stage("exec", execDoneNS);
+        stage("handoff", respondNS);
+        stage("serialize", serializedNS);
+        stage("write", writtenNS);
+        return QVariantMap{
+            { "trace_id", qulonglong(traceId) },
+            { "method", method },
+            { "client_id", qulonglong(clientId) },
+            { "total_ms", recvNS && writtenNS ? (writtenNS - recvNS) / 1e6 : QVariant() },
+            { "stages_ms", stages },
+            { "db_reads", dbReads },
+            { "db_rows", qulonglong(dbRows) },
+            { "db_bytes", qulonglong(dbBytes) },
+            { "response_bytes", responseBytes },
+        };
+    }
+
+    void finish(const SpanPtr &span)
+    {
+        if (!span) return;
+        if (!span->writtenNS) span->writtenNS = Util::getTimeNS();
+        const qint64 slow = slowNS.load(std::memory_order_relaxed);
+        const bool isSlow = slow > 0 && span->writtenNS - span->recvNS >= slow;
+        if (!isSlow && !span->sampled) return;
+        auto m = span->toMap();
+        if (isSlow)
+            Warning() << "Slow request: " << Json::toUtf8(m, true).constData();
+        m["slow"] = isSlow;
+        m["finished"] = QDateTime::currentDateTimeUtc().toString(Qt::ISODateWithMs);
+        std::unique_lock g(recentMut);
+        recent.push_front(std::move(m));
+        if (recent.size() > kMaxRecent) recent.pop_back();
+    }
+
+    QVariantList recentSpans(size_t limit)
+    {
+        QVariantList ret;
+        std::unique_lock g(recentMut);
+        for (auto it = recent.cbegin(); it != recent.cend() && size_t(ret.size()) < limit; ++it)
+            ret.push_back(*it);
+        return ret;
+    }
+
+} // namespace Tracing
+
+#ifdef ENABLE_TESTS
+#include "App.h"
+
+namespace {
+    void test()
+    {
+        Defer restore([]{ Tracing::configure(0., 0.); });
+
+        Tracing::configure(0., 0.);
+        if (Tracing::isEnabled() || Tracing::newTraceId() != 0 || Tracing::begin(1, "x", 1, 1))
+            throw Exception("Tracing should be disabled");
+
+        // sample everything; check stage accounting and db read attribution
+        Tracing::configure(0., 1.);
+        const auto id = Tracing::newTraceId();
+        auto span = Tracing::begin(id, "test.method", 42, 1'000'000);
+        if (!span || !span->sampled)
+            throw Exception("Expected a sampled span");
+        span->dispatchNS = 2'000'000;
+        span->enqueueNS = 2'500'000;
+        span->startNS = 4'500'000;
+        {
+            Tracing::CurrentScope scope(span.get());
+            Tracing::noteDbRead(1, 100);
+            Tracing::noteDbRead(9, 900);
+        }
+        Tracing::noteDbRead(1, 1); // not attributed to anything
+        span->execDoneNS = 5'000'000;
+        span->writtenNS = 6'000'000;
+        Tracing::finish(span);
+        const auto spans = Tracing::recentSpans(1);
+        if (spans.size() != 1)
+            throw Exception("Expected 1 recent span");
+        const auto m = spans.front().toMap(), stages = m.value("stages_ms").toMap();
+        if (m.value("trace_id").toULongLong() != id || m.value("db_reads").toUInt() != 2 || m.value("db_rows").toUInt() != 10
+                || m.value("db_bytes").toUInt() != 1000 || m.value("total_ms").toDouble() != 5.
+                || stages.value("queue").toDouble() != 2. || stages.contains("serialize") || m.value("slow").toBool())
+            throw Exception(QString("Unexpected span: %1").arg(Json::toUtf8(m, true).constData()));
+
+        // ~1/4 of spans sampled
+        Tracing::configure(0., 0.25);
+        int nSampled = 0;
+        for (int i = 0; i < 10'000; ++i)
+            nSampled += Tracing::begin(Tracing::newTraceId(), "x", 1, 1)->sampled;
+        if (nSampled < 2'000 || nSampled > 3'000)
+            throw Exception(QString("Sampling rate is off: %1 / 10000").arg(nSampled));
+        Log() << "Tracing: all tests passed";
+    }
+
+    const auto test_ = App::registerTest("tracing", &test);
+} // namespace
+#endif
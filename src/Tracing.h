@@ -0,0 +1,107 @@
+//
+// Fulcrum - A fast & nimble SPV Server for Bitcoin Cash
+// Copyright (C) 2019-2022 Calin A. Culianu <calin.culianu@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program (see LICENSE.txt).  If not, see
+// <https://www.gnu.org/licenses/>.
+//
+#pragma once
+
+#include "Util.h"
+
+#include <QString>
+#include <QVariantList>
+#include <QVariantMap>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+/// Opt-in per-request tracing of Electrum RPC requests, for diagnosing tail latency.
+///
+/// When enabled (see the "trace_slow_ms" and "trace_sample_rate" config settings), each incoming RPC::Message is
+/// assigned a trace id, and ServerBase records a Span for it: timestamps for each stage the request went through,
+/// plus the number of db reads it did. Spans slower than the slow threshold are written to the log, and a sampled
+/// fraction of all spans are kept in a ring buffer that is served as JSON on the stats server's /traces endpoint.
+///
+/// When disabled, the only overhead is a relaxed atomic load per request and a thread_local null-pointer check
+/// per db read.
+namespace Tracing {
+
+    /// Sets the slow-request threshold (0 = don't log slow requests), and the fraction of requests to sample into
+    /// the /traces ring buffer (0.0 = none, 1.0 = all). Tracing is enabled if either is nonzero. Thread-safe.
+    void configure(double slowMSec, double sampleRate);
+    bool isEnabled() noexcept;
+
+    /// Returns a new unique trace id, or 0 if tracing is disabled. Thread-safe.
+    uint64_t newTraceId() noexcept;
+
+    /// The lifecycle of a single request. Timestamps are Util::getTimeNS() values; 0 means the stage didn't apply
+    /// (e.g. a request handled synchronously is never enqueued, and a response slurped up by a batch is never
+    /// written by itself). All members are only ever touched by one thread at a time: the client thread, or the
+    /// worker thread while the request executes in the thread pool (the thread pool synchronizes the hand-off).
+    struct Span {
+        uint64_t traceId = 0;
+        QString method;
+        quint64 clientId = 0;
+        bool sampled = false; ///< if true, this span will be put in the /traces ring buffer when it finishes
+
+        qint64 recvNS = 0; ///< JSON received by RPC::ConnectionBase::processJson()
+        qint64 dispatchNS = 0; ///< parsed, and dispatched to the method handler by ServerBase::onMessage()
+        qint64 enqueueNS = 0; ///< submitted to the thread pool (or to bitcoind)
+        qint64 startNS = 0; ///< started executing in a worker thread
+        qint64 execDoneNS = 0; ///< finished executing (or got a reply from bitcoind)
+        qint64 respondNS = 0; ///< back in the client thread, about to send the response
+        qint64 serializedNS = 0; ///< response serialized to JSON
+        qint64 writtenNS = 0; ///< response handed to the socket
+
+        unsigned dbReads = 0; ///< number of db point lookups + iterator positions
+        uint64_t dbRows = 0, dbBytes = 0; ///< rows (keys) and bytes (keys + values) read from the db
+        qint64 responseBytes = 0;
+
+        QVariantMap toMap() const;
+    };
+    using SpanPtr = std::shared_ptr<Span>;
+
+    /// Returns a new Span if tracing is enabled and `traceId` is nonzero, otherwise nullptr. Thread-safe.
+    SpanPtr begin(uint64_t traceId, const QString &method, quint64 clientId, qint64 recvNS);
+    /// Stamps span->writtenNS if not already set, logs the span if it was slow, and records it if it was sampled.
+    /// Thread-safe. No-op if span is null.
+    void finish(const SpanPtr &span);
+
+    /// Returns up to `limit` of the most recently finished sampled (or slow) spans, newest first. Thread-safe.
+    QVariantList recentSpans(size_t limit);
+
+    namespace detail { extern thread_local Span *current; }
+
+    /// While in scope, db reads done by this thread are attributed to `span` (which may be null).
+    class CurrentScope {
+        Span * const prev;
+    public:
+        explicit CurrentScope(Span *span) noexcept : prev(detail::current) { detail::current = span; }
+        ~CurrentScope() { detail::current = prev; }
+        CurrentScope(const CurrentScope &) = delete;
+        CurrentScope & operator=(const CurrentScope &) = delete;
+    };
+
+    /// Called by Storage for each db read done on behalf of a request. Cheap if tracing is off.
+    inline void noteDbRead(size_t rows, size_t bytes) noexcept {
+        if (Span *s = detail::current; UNLIKELY(s)) {
+            ++s->dbReads;
+            s->dbRows += rows;
+            s->dbBytes += bytes;
+        }
+    }
+
+} // namespace Tracing
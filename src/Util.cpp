@@ -58,10 +58,20 @@
 
 #include <QRegularExpression>
 
+#include <array>
 #include <cstring>             // for strerror
 #include <iostream>
 #include <mutex>
 #include <thread>
+#include <vector>
+
+// SIMD hex kernels (see ParseHexFast & ToHexFast) -- selected at runtime based on the CPU's capabilities
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  include <immintrin.h>
+#  define HAVE_HEX_SIMD 1
+#else
+#  define HAVE_HEX_SIMD 0
+#endif
 
 namespace Util {
     QString basename(const QString &s) {
@@ -194,6 +204,167 @@ namespace Util {
     unsigned getNPhysicalProcessors() { return std::thread::hardware_concurrency(); }
 #endif
 
+    namespace {
+        // -- Hex kernels. The SIMD versions are compiled for their instruction set via function target attributes, so
+        // the rest of the binary still runs on any x86-64 CPU; the best kernels for this CPU are picked at runtime.
+        //
+        // All decoders are strict: a char is valid only if it is one of [0-9a-fA-F], and the return value is false if
+        // any char was not (the output is then garbage). Callers that don't care may ignore the return value.
+
+        constexpr auto kUnhex = [] {
+            std::array<uint8_t, 256> t{};
+            for (auto & v : t) v = 0xff;
+            for (int i = 0; i < 10; ++i) t[size_t('0' + i)] = uint8_t(i);
+            for (int i = 0; i < 6; ++i) t[size_t('a' + i)] = t[size_t('A' + i)] = uint8_t(10 + i);
+            return t;
+        }();
+
+        constexpr char kHexDigits[] = "0123456789abcdef";
+
+        bool decodeHexScalar(const char *in, size_t nBytes, char *out) noexcept {
+            uint8_t bad = 0;
+            for (size_t i = 0; i < nBytes; ++i, in += 2) {
+                const uint8_t hi = kUnhex[uint8_t(in[0])], lo = kUnhex[uint8_t(in[1])];
+                bad |= hi | lo; // invalid chars map to 0xff, so any of them sets the high nibble here
+                out[i] = char((hi << 4) | (lo & 0xf));
+            }
+            return !(bad & 0xf0);
+        }
+
+        void encodeHexScalar(const uint8_t *in, size_t nBytes, char *out) noexcept {
+            static const char hexmap[513] =
+                "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f202122232425262728292a2b2c2d2e2f"
+                "303132333435363738393a3b3c3d3e3f404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+                "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f808182838485868788898a8b8c8d8e8f"
+                "909192939495969798999a9b9c9d9e9fa0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+                "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedfe0e1e2e3e4e5e6e7e8e9eaebecedeeef"
+                "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+            for (const uint8_t * const end = in + nBytes; in < end; ++in, out += 2) {
+                const char *nibbles = &hexmap[*in * 2];
+                out[0] = nibbles[0];
+                out[1] = nibbles[1];
+            }
+        }
+
+#if HAVE_HEX_SIMD
+        // -- SSSE3: 32 hex chars <-> 16 bytes per iteration
+
+        /// Maps each hex char in `v` to its value 0-15, and clears the corresponding byte of `valid` if it's not hex.
+        __attribute__((target("ssse3")))
+        inline __m128i hexNibbles128(__m128i v, __m128i &valid) noexcept {
+            const __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+            const __m128i l = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a')); // fold case
+            const __m128i isD = _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(9)), d); // d <= 9, unsigned
+            const __m128i isL = _mm_cmpeq_epi8(_mm_min_epu8(l, _mm_set1_epi8(5)), l); // l <= 5, unsigned
+            valid = _mm_and_si128(valid, _mm_or_si128(isD, isL));
+            return _mm_or_si128(_mm_and_si128(isD, d), _mm_and_si128(isL, _mm_add_epi8(l, _mm_set1_epi8(10))));
+        }
+
+        __attribute__((target("ssse3")))
+        bool decodeHexSSSE3(const char *in, size_t nBytes, char *out) noexcept {
+            const __m128i mul = _mm_set1_epi16(0x0110); // high nibble (first char) * 16 + low nibble (second char)
+            __m128i valid = _mm_set1_epi8(-1);
+            size_t i = 0;
+            for (; i + 16 <= nBytes; i += 16) {
+                const __m128i a = hexNibbles128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2*i)), valid);
+                const __m128i b = hexNibbles128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + 2*i + 16)), valid);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                                 _mm_packus_epi16(_mm_maddubs_epi16(a, mul), _mm_maddubs_epi16(b, mul)));
+            }
+            const bool tailOk = decodeHexScalar(in + 2*i, nBytes - i, out + i);
+            return tailOk && _mm_movemask_epi8(valid) == 0xffff;
+        }
+
+        __attribute__((target("ssse3")))
+        void encodeHexSSSE3(const uint8_t *in, size_t nBytes, char *out) noexcept {
+            const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i *>(kHexDigits));
+            const __m128i mask = _mm_set1_epi8(0x0f);
+            size_t i = 0;
+            for (; i + 16 <= nBytes; i += 16) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+                const __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+                const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2*i), _mm_unpacklo_epi8(hi, lo));
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 2*i + 16), _mm_unpackhi_epi8(hi, lo));
+            }
+            encodeHexScalar(in + i, nBytes - i, out + 2*i);
+        }
+
+        // -- AVX2: 64 hex chars <-> 32 bytes per iteration
+
+        __attribute__((target("avx2")))
+        inline __m256i hexNibbles256(__m256i v, __m256i &valid) noexcept {
+            const __m256i d = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+            const __m256i l = _mm256_sub_epi8(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+            const __m256i isD = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+            const __m256i isL = _mm256_cmpeq_epi8(_mm256_min_epu8(l, _mm256_set1_epi8(5)), l);
+            valid = _mm256_and_si256(valid, _mm256_or_si256(isD, isL));
+            return _mm256_or_si256(_mm256_and_si256(isD, d), _mm256_and_si256(isL, _mm256_add_epi8(l, _mm256_set1_epi8(10))));
+        }
+
+        __attribute__((target("avx2")))
+        bool decodeHexAVX2(const char *in, size_t nBytes, char *out) noexcept {
+            const __m256i mul = _mm256_set1_epi16(0x0110);
+            __m256i valid = _mm256_set1_epi8(-1);
+            size_t i = 0;
+            for (; i + 32 <= nBytes; i += 32) {
+                const __m256i a = hexNibbles256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2*i)), valid);
+                const __m256i b = hexNibbles256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + 2*i + 32)), valid);
+                // packus works within 128-bit lanes, so the qwords come out as a0 b0 a1 b1; put them back in order
+                const __m256i packed = _mm256_packus_epi16(_mm256_maddubs_epi16(a, mul), _mm256_maddubs_epi16(b, mul));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_permute4x64_epi64(packed, 0xd8));
+            }
+            const bool tailOk = decodeHexSSSE3(in + 2*i, nBytes - i, out + i);
+            return tailOk && uint32_t(_mm256_movemask_epi8(valid)) == 0xffffffffu;
+        }
+
+        __attribute__((target("avx2")))
+        void encodeHexAVX2(const uint8_t *in, size_t nBytes, char *out) noexcept {
+            const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(kHexDigits)));
+            const __m256i mask = _mm256_set1_epi8(0x0f);
+            size_t i = 0;
+            for (; i + 32 <= nBytes; i += 32) {
+                const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + i));
+                const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+                const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+                // unpack works within 128-bit lanes: u0 = bytes 0-7 | 16-23, u1 = bytes 8-15 | 24-31
+                const __m256i u0 = _mm256_unpacklo_epi8(hi, lo), u1 = _mm256_unpackhi_epi8(hi, lo);
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2*i), _mm256_permute2x128_si256(u0, u1, 0x20));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + 2*i + 32), _mm256_permute2x128_si256(u0, u1, 0x31));
+            }
+            encodeHexSSSE3(in + i, nBytes - i, out + 2*i);
+        }
+#endif // HAVE_HEX_SIMD
+
+        struct HexKernels {
+            bool (*decode)(const char *in, size_t nBytes, char *out) noexcept;
+            void (*encode)(const uint8_t *in, size_t nBytes, char *out) noexcept;
+            const char *name;
+        };
+
+        constexpr HexKernels kScalarHexKernels{decodeHexScalar, encodeHexScalar, "scalar"};
+
+        /// All the kernels this CPU can run, best last.
+        std::vector<HexKernels> supportedHexKernels() {
+            std::vector<HexKernels> ret{kScalarHexKernels};
+#if HAVE_HEX_SIMD
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("ssse3"))
+                ret.push_back({decodeHexSSSE3, encodeHexSSSE3, "ssse3"});
+            if (__builtin_cpu_supports("avx2"))
+                ret.push_back({decodeHexAVX2, encodeHexAVX2, "avx2"});
+#endif
+            return ret;
+        }
+
+        const HexKernels & hexKernels() {
+            static const HexKernels best = supportedHexKernels().back();
+            return best;
+        }
+    } // namespace
+
+    const char *hexImplName() { return hexKernels().name; }
+
     QByteArray ParseHexFast(const QByteArray &hex, bool checkDigits)
     {
         const int size = hex.size();
@@ -203,40 +374,9 @@ namespace Util {
             ret.clear();
             return ret;
         }
-        const char *d = hex.constData(), * const dend = d + size;
-        uint8_t c1, c2;
-        for (char *out = ret.data(); d < dend; d += 2, ++out) {
-            constexpr uint8_t offset_A = 'A' - 0xa,
-                              offset_a = 'a' - 0xa,
-                              offset_0 = '0';
-            // slightly unrolled loop, does 2 chars at a time
-            c1 = uint8_t(d[0]);
-            c2 = uint8_t(d[1]);
-
-            // c1
-            if (c1 <= '9') // this is the most likely for any random digit, so we check this first
-                c1 -= offset_0;
-            else if (c1 >= 'a') // next, we anticipate lcase, so we do this check first
-                c1 -= offset_a;
-            else // c1 >= 'A'
-                c1 -= offset_A;
-            // c2
-            if (c2 <= '9') // this is the most likely for any random digit, so we check this first
-                c2 -= offset_0;
-            else if (c2 >= 'a') // next, we anticipate lcase, so we do this check first
-                c2 -= offset_a;
-            else // c2 >= 'A'
-                c2 -= offset_A;
-
-
-            // The below is slowish... we can just accept bad hex data as 'corrupt' ...
-            // checkDigit = false allows us to skip this check, making this function >5x faster!
-            if (UNLIKELY(checkDigits && (c1 > 0xf || c2 > 0xf))) { // ensure data was actually in range
-                ret.clear();
-                break;
-            }
-            *out = char((c1 << 4) | c2);
-        }
+        const bool ok = hexKernels().decode(hex.constData(), size_t(size / 2), ret.data());
+        if (UNLIKELY(checkDigits && !ok))
+            ret.clear();
         return ret;
     }
 
@@ -249,23 +389,10 @@ namespace Util {
     }
     bool ToHexFastInPlace(const QByteArray &ba, char *out, size_t bufsz)
     {
-        static const char hexmap[513] =
-            "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f202122232425262728292a2b2c2d2e2f"
-            "303132333435363738393a3b3c3d3e3f404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
-            "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f808182838485868788898a8b8c8d8e8f"
-            "909192939495969798999a9b9c9d9e9fa0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
-            "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedfe0e1e2e3e4e5e6e7e8e9eaebecedeeef"
-            "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
-
         const int size = ba.size();
         if (bufsz < size_t(size*2))
             return false;
-        const uint8_t *cur = reinterpret_cast<const uint8_t *>(ba.constData()), * const end = cur + size;
-        for (const char *nibbles; cur < end; ++cur, out += 2) {
-            nibbles = &hexmap[*cur * 2];
-            out[0] = nibbles[0];
-            out[1] = nibbles[1];
-        }
+        hexKernels().encode(reinterpret_cast<const uint8_t *>(ba.constData()), size_t(size), out);
         return true;
     }
 
@@ -559,43 +686,27 @@ Log::~Log()
         using LTS = Options::LogTimestampMode;
         const LTS ltsMode = !ourApp ? Options::defaultLogTimeStampMode : ourApp->options->logTimestampMode;
         s.flush(); // does nothing probably..
-        // [timestamp]
-        // Note: we always want to log the timestamp, even in syslog mode.
-        // This is because if logging from a thread, log lines may be out-of-order.
-        // The timestamp is the only record of the actual order in which things
-        // occurred. Currently the timestamp is to 4 decimal places (hundreds of micros) in Uptime mode only.
-        // We do offer LogTimestampMode::None for users really wishing to suppress timestamp logging.
-        QString tsStr;
-        switch (ltsMode) {
-        case LTS::None:
-            break;
-        case LTS::Uptime: {
-            const auto unow = Util::getTimeNS()/1000LL;
-            tsStr = QString::asprintf("[%lld.%04d] ", unow/1000000LL, int((unow/100LL)%10000));
-        }
-            break;
-        case LTS::UTC:
-        case LTS::Local: {
-            const auto now = ltsMode == LTS::UTC ? QDateTime::currentDateTimeUtc() : QDateTime::currentDateTime();
-            tsStr = now.toString(u"[yyyy-MM-dd hh:mm:ss.zzz] ");
-        }
-            break;
-        }
-        // /[timestamp]
-        QString thrdStr;
+        // Only capture the raw ingredients here; the prefix is formatted by Logger::formatLine(), which runs on the
+        // logger's writer thread if async logging is active.
+        Logger::Line line;
+        line.level = level;
+        line.color = color;
+        line.tsMode = int(ltsMode);
+        line.uptimeNS = Util::getTimeNS();
+        if (ltsMode == LTS::Local || ltsMode == LTS::UTC)
+            line.epochMSec = QDateTime::currentMSecsSinceEpoch();
         if (QThread *th = QThread::currentThread(); th && ourApp && th != ourApp->thread()) {
-            QString thrdName = th->objectName();
-            if (thrdName.trimmed().isEmpty()) thrdName = QString::asprintf("%p", reinterpret_cast<void *>(QThread::currentThreadId()));
-            thrdStr = QStringLiteral("<%1> ").arg(thrdName);
+            line.thread = th->objectName();
+            if (line.thread.trimmed().isEmpty()) line.thread = QString::asprintf("%p", reinterpret_cast<void *>(QThread::currentThreadId()));
         }
+        line.text = std::move(str);
 
         Logger *logger = ourApp ? ourApp->logger() : nullptr;
 
-        QString theString = tsStr + thrdStr + (logger && logger->isaTTY() ? colorize(str, color) : str);
-
         if (logger) {
-            emit logger->log(level, theString);
+            logger->submit(std::move(line));
         } else {
+            const QString theString = Logger::formatLine(line, false);
             // just print to console for now..
             static std::mutex mut;
             {
@@ -639,9 +750,10 @@ QString Log::colorString(Color c) {
     return QString::asprintf("%s%s", prefix, suffix);
 }
 
+/* static */
 QString Log::colorize(const QString &str, Color c) {
-    QString colorStr = useColor && c != Normal ? colorString(c) : "";
-    QString normalStr = useColor && c != Normal ? colorString(Normal) : "";
+    QString colorStr = c != Normal ? colorString(c) : "";
+    QString normalStr = c != Normal ? colorString(Normal) : "";
     return colorStr + str + normalStr;
 }
 
@@ -710,6 +822,7 @@ Fatal::~Fatal()
 #include <QSet>
 
 #include <algorithm>
+#include <cctype>
 #include <list>
 #include <string>
 #include <unordered_map>
@@ -849,10 +962,79 @@ namespace {
             t0.fin();
             Log() << "bitcoind HexStr took: " << t0.usec() << " usec";
         }
+
+        // Finally, compare each of the hex kernels this CPU supports, on the same data
+        Log() << "Comparing hex kernels (in use: " << Util::hexImplName() << ") ...";
+        for (const auto & k : Util::supportedHexKernels()) {
+            QByteArray buf;
+            bool ok = true;
+            t0 = Tic();
+            for (const auto & hex : hexList) {
+                buf.resize(hex.size() / 2);
+                ok = k.decode(hex.constData(), size_t(buf.size()), buf.data()) && ok;
+            }
+            t0.fin();
+            if (!ok)
+                throw Exception(QString("The %1 kernel rejected valid hex").arg(k.name));
+            Log() << k.name << " decode took: " << t0.usec() << " usec";
+            t0 = Tic();
+            for (const auto & ba : vec1) {
+                buf.resize(ba.size() * 2);
+                k.encode(reinterpret_cast<const uint8_t *>(ba.constData()), size_t(ba.size()), buf.data());
+            }
+            t0.fin();
+            Log() << k.name << " encode took: " << t0.usec() << " usec";
+        }
     }
 
     const auto b1 = App::registerBench("hexparse", &BenchHexParse);
 
+    // ---test hex
+    void TestHex()
+    {
+        const auto kernels = Util::supportedHexKernels();
+        QStringList names;
+        for (const auto & k : kernels) names.push_back(k.name);
+        Log() << "Testing hex kernels: " << names.join(", ") << " (in use: " << Util::hexImplName() << ")";
+        // sizes chosen to hit each kernel's main loop, its tail, and the tails of the tails
+        for (int size = 0; size <= 200; ++size) {
+            QByteArray bin(size, Qt::Uninitialized);
+            Util::getRandomBytes(bin.data(), size);
+            const QByteArray hex = bin.toHex(), hexUpper = hex.toUpper();
+            if (Util::ToHexFast(bin) != hex || Util::ParseHexFast(hex, true) != bin || Util::ParseHexFast(hexUpper, true) != bin)
+                throw Exception(QString("Util hex functions failed for size %1").arg(size));
+            for (const auto & k : kernels) {
+                QByteArray out(size * 2, Qt::Uninitialized);
+                k.encode(reinterpret_cast<const uint8_t *>(bin.constData()), size_t(size), out.data());
+                if (out != hex)
+                    throw Exception(QString("%1 encode failed for size %2").arg(k.name).arg(size));
+                out.resize(size);
+                if (!k.decode(hexUpper.constData(), size_t(size), out.data()) || out != bin)
+                    throw Exception(QString("%1 decode failed for size %2").arg(k.name).arg(size));
+                // every invalid char, at every position, must be caught
+                if (!size) continue;
+                for (int c = 0; c < 256; ++c) {
+                    if (std::isxdigit(c)) continue;
+                    const int pos = (c * 7 + size) % hex.size();
+                    QByteArray bad = hex;
+                    bad[pos] = char(c);
+                    if (k.decode(bad.constData(), size_t(size), out.data()))
+                        throw Exception(QString("%1 decode accepted char %2 at pos %3 for size %4")
+                                        .arg(k.name).arg(c).arg(pos).arg(size));
+                }
+            }
+            if (size && !Util::ParseHexFast(hex.left(hex.size() - 1), true).isEmpty())
+                throw Exception("Odd-length hex should be rejected");
+        }
+        // the chars just outside the ranges, which a lax range check may let through
+        for (const char *bad : {"0:", "/0", "@0", "0G", "`0", "0g", ";;", "?f"})
+            if (!Util::ParseHexFast(bad, true).isEmpty())
+                throw Exception(QString("ParseHexFast accepted \"%1\"").arg(bad));
+        Log() << "Hex tests passed";
+    }
+
+    const auto t0 = App::registerTest("hex", &TestHex);
+
     // ---test keyset
     void TestKeySetAndValueSet() {
         const std::map<QString, QString> map{
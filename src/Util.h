@@ -94,11 +94,13 @@ public:
     template <class ...Args>
     Log & operator()(Args&& ...args) {  ((*this) << ... << args); return *this; }
 
+    /// Wraps `str` in the ANSI escape codes for color `c` (used by the Logger when logging to a tty)
+    static QString colorize(const QString &str, Color c);
+
 protected:
     static QString colorString(Color c);
-    QString colorize(const QString &, Color c);
 
-    bool colorOverridden = false, useColor = true;
+    bool colorOverridden = false;
     int level = 0;
     Color color = Normal;
     QString str = "";
@@ -589,8 +591,8 @@ namespace Util {
     /// Does not throw any exceptions.  Returns an empty QByteArray on error, or a QByteArray that is
     /// the hex decoded version of its input on success.
     ///
-    /// Note 1: If checkDigits=true this function is about 5x slower but it does detect invalid characters and returns
-    ///         an empty QByteArray on malformed input.
+    /// Note 1: If checkDigits=true this function detects invalid characters and returns an empty QByteArray on
+    ///         malformed input. Validation is folded into the decode loop, so this costs next to nothing.
     /// Note 2: If checkDigits=false, this function is blazingly fast. However it may return garbage/nonsense
     ///         data if the input contains any non-hex digits (including spaces!).
     /// Note 3: Whitespace is *never* skipped -- the input data must be nothing but hex digits, lower or upprcase is ok.
@@ -600,6 +602,9 @@ namespace Util {
     /// More efficient, if less convenient version of above. Operates on a buffer in-place.  Make sure bufsz is at least
     /// 2x the length of bytes.  `buf` must not overlap with `bytes`.
     bool ToHexFastInPlace(const QByteArray & bytes, char *buf, size_t bufsz);
+    /// The above hex functions use SIMD kernels if the CPU supports them, picked at runtime on first use. Returns the
+    /// name of the kernels in use: "avx2", "ssse3", or "scalar".
+    const char *hexImplName();
 
     /// For each item in a QByteArray Container, hex encode each item using Util::ToHexFast().
     template <typename Container,
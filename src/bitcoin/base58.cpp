@@ -106,7 +106,10 @@ bool DecodeBase58(const char *psz, std::vector<uint8_t> &vch) {
     return true;
 }
 #else
-// Calin's 15% faster implementation here
+// Faster implementation. Like the original it accumulates the value as a big number, but in little-endian 32-bit
+// limbs rather than bytes, and consumes 5 base58 digits per multiply-add pass over it (58^5 < 2^32). For a typical
+// 34-char address that is ~7 passes over at most 7 limbs, versus 34 passes over up to 25 bytes. Digits are looked up
+// via b58CarryTable rather than by calling strchr() on pszBase58.
 bool DecodeBase58(const char *psz, std::vector<uint8_t> &vch) {
     // Skip leading spaces.
     while (*psz && IsSpace(*psz)) {
@@ -114,34 +117,47 @@ bool DecodeBase58(const char *psz, std::vector<uint8_t> &vch) {
     }
     // Skip and count leading '1's.
     int zeroes = 0;
-    int length = 0;
     while (*psz == '1') {
         zeroes++;
         psz++;
     }
-    // Allocate enough space in big-endian base256 representation.
-    // log(58) / log(256), rounded up.
-    int size = strlen(psz) * 733 / 1000 + 1;
-    std::vector<uint8_t> b256(size);
+    const char *end = psz;
+    while (*end && !IsSpace(*end)) {
+        end++;
+    }
+    // log(58) / log(2^32) = 0.18306, rounded up; the stack buffer covers anything up to ~170 digits.
+    const size_t maxLimbs = size_t(end - psz) * 1831 / 10000 + 1;
+    std::array<uint32_t, 32> stackLimbs;
+    std::vector<uint32_t> heapLimbs;
+    uint32_t *limbs = stackLimbs.data();
+    if (maxLimbs > stackLimbs.size()) {
+        heapLimbs.resize(maxLimbs);
+        limbs = heapLimbs.data();
+    }
+    size_t nLimbs = 0;
     // Process the characters.
-    while (*psz && !IsSpace(*psz)) {
-        // Decode base58 character
-        int carry = b58CarryTable[uint8_t(*psz)];
-        if (carry < 0) {
-            // invalid character
-            return false;
+    while (psz < end) {
+        // Decode up to 5 base58 characters at once
+        uint64_t mul = 1, carry = 0;
+        for (int k = 0; k < 5 && psz < end; ++k, ++psz) {
+            const int digit = b58CarryTable[uint8_t(*psz)];
+            if (digit < 0) {
+                // invalid character
+                return false;
+            }
+            carry = carry * 58 + uint64_t(digit);
+            mul *= 58;
         }
-        // Apply "b256 = b256 * 58 + ch".
-        int i = 0;
-        for (std::vector<uint8_t>::reverse_iterator it = b256.rbegin();
-             (carry != 0 || i < length) && (it != b256.rend()); ++it, ++i) {
-            carry += 58 * (*it);
-            *it = carry % 256;
-            carry /= 256;
+        // Apply "limbs = limbs * mul + carry".
+        for (size_t i = 0; i < nLimbs; ++i) {
+            carry += uint64_t(limbs[i]) * mul;
+            limbs[i] = uint32_t(carry);
+            carry >>= 32;
+        }
+        if (carry) {
+            assert(nLimbs < maxLimbs);
+            limbs[nLimbs++] = uint32_t(carry);
         }
-        assert(carry == 0);
-        length = i;
-        psz++;
     }
     // Skip trailing spaces.
     while (IsSpace(*psz)) {
@@ -150,15 +166,17 @@ bool DecodeBase58(const char *psz, std::vector<uint8_t> &vch) {
     if (*psz != 0) {
         return false;
     }
-    // Skip leading zeroes in b256.
-    std::vector<uint8_t>::iterator it = b256.begin() + (size - length);
-    while (it != b256.end() && *it == 0)
-        it++;
-    // Copy result into output vector.
-    vch.reserve(zeroes + (b256.end() - it));
+    // Copy result into output vector, big-endian, skipping leading zeroes of the most significant limb.
+    vch.reserve(zeroes + nLimbs * 4);
     vch.assign(zeroes, 0x00);
-    while (it != b256.end()) {
-        vch.push_back(*(it++));
+    bool leading = true;
+    for (size_t i = nLimbs; i-- > 0; ) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            const uint8_t byte = uint8_t(limbs[i] >> shift);
+            if (leading && !byte) continue;
+            leading = false;
+            vch.push_back(byte);
+        }
     }
     return true;
 }
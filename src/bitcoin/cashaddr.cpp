@@ -6,6 +6,8 @@
 #include "cashaddr.h"
 #include "utilvector.h"
 
+#include <array>
+
 #ifdef __clang__
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wconversion"
@@ -38,12 +40,60 @@ const int8_t CHARSET_REV[128] = {
     -1, -1, 29, -1, 24, 13, 25, 9,  8,  23, -1, 18, 22, 31, 27, 19, -1, 1,  0,
     3,  16, 11, 28, 12, 14, 6,  4,  2,  -1, -1, -1, -1, -1};
 
+/**
+ * {c0}k(x) for every possible 5-bit value of c0, with k(x) as defined in
+ * PolyMod below. Each entry is the XOR of {2^n}k(x) for all bits n set in c0,
+ * so that each step of the checksum computation is a single table lookup
+ * rather than 5 data-dependent branches.
+ */
+constexpr std::array<uint64_t, 32> POLYMOD_TABLE = [] {
+    constexpr uint64_t gen[5] = {
+        // k(x) = {19}*x^7 + {3}*x^6 + {25}*x^5 + {11}*x^4 + {25}*x^3 +
+        //        {3}*x^2 + {19}*x + {1}
+        0x98f2bc8e61,
+        // {2}k(x) = {15}*x^7 + {6}*x^6 + {27}*x^5 + {22}*x^4 + {27}*x^3 +
+        //           {6}*x^2 + {15}*x + {2}
+        0x79b76d99e2,
+        // {4}k(x) = {30}*x^7 + {12}*x^6 + {31}*x^5 + {5}*x^4 + {31}*x^3 +
+        //           {12}*x^2 + {30}*x + {4}
+        0xf33e5fb3c4,
+        // {8}k(x) = {21}*x^7 + {24}*x^6 + {23}*x^5 + {10}*x^4 + {23}*x^3 +
+        //           {24}*x^2 + {21}*x + {8}
+        0xae2eabe2a8,
+        // {16}k(x) = {3}*x^7 + {25}*x^6 + {7}*x^5 + {20}*x^4 + {7}*x^3 +
+        //            {25}*x^2 + {3}*x + {16}
+        0x1e4f43e470,
+    };
+    std::array<uint64_t, 32> t{};
+    for (unsigned c0 = 0; c0 < 32; ++c0) {
+        for (unsigned n = 0; n < 5; ++n) {
+            if ((c0 >> n) & 1) {
+                t[c0] ^= gen[n];
+            }
+        }
+    }
+    return t;
+}();
+
+/**
+ * Feeds one 5-bit value into the checksum state `c` (see PolyMod below).
+ */
+inline uint64_t PolyModStep(uint64_t c, uint8_t d) {
+    const uint8_t c0 = c >> 35;
+    return (((c & 0x07ffffffff) << 5) ^ d) ^ POLYMOD_TABLE[c0];
+}
+
 /**
  * This function will compute what 8 5-bit values to XOR into the last 8 input
  * values, in order to make the checksum 0. These 8 values are packed together
  * in a single 40-bit integer. The higher bits correspond to earlier values.
+ *
+ * The values checksummed are the expanded `prefix` (the lower 5 bits of each of
+ * its characters, followed by a 0 separator), then `v`, then `nZeroes` zeroes.
+ * They are fed in directly rather than concatenated into a temporary vector.
  */
-uint64_t PolyMod(const data &v) {
+uint64_t PolyMod(const std::string &prefix, const data &v,
+                 size_t nZeroes = 0) {
     /**
      * The input is interpreted as a list of coefficients of a polynomial over F
      * = GF(32), with an implicit 1 in front. If the input is [v0,v1,v2,v3,v4],
@@ -76,68 +126,40 @@ uint64_t PolyMod(const data &v) {
      * corresponds to 1 mod (x), and after processing 2 inputs of v, it
      * corresponds to x^2 + v0*x + v1 mod g(x). As 1 mod g(x) = 1, that is the
      * starting value for `c`.
+     *
+     * Each step of the loop updates `c` to correspond to a polynomial with one
+     * extra term. If the initial value of `c` consists of the coefficients of
+     * c(x) = f(x) mod g(x), we modify it to correspond to
+     * c'(x) = (f(x) * x + d) mod g(x), where d is the next input to process.
+     *
+     * Simplifying:
+     * c'(x) = (f(x) * x + d) mod g(x)
+     *         ((f(x) mod g(x)) * x + d) mod g(x)
+     *         (c(x) * x + d) mod g(x)
+     * If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to
+     * compute
+     * c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + d
+     *                                                             mod g(x)
+     *       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + d
+     *                                                             mod g(x)
+     *       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 +
+     *                                                             c5*x + d
+     * If we call (x^6 mod g(x)) = k(x), this can be written as
+     * c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + d) + c0*k(x)
+     *
+     * PolyModStep computes c1*x^5 + ... + d by shifting out c0 and XORing in
+     * d, and then adds c0*k(x), which it looks up in POLYMOD_TABLE.
      */
     uint64_t c = 1;
+    for (const char ch : prefix) {
+        c = PolyModStep(c, ch & 0x1f);
+    }
+    c = PolyModStep(c, 0);
     for (uint8_t d : v) {
-        /**
-         * We want to update `c` to correspond to a polynomial with one extra
-         * term. If the initial value of `c` consists of the coefficients of
-         * c(x) = f(x) mod g(x), we modify it to correspond to
-         * c'(x) = (f(x) * x + d) mod g(x), where d is the next input to
-         * process.
-         *
-         * Simplifying:
-         * c'(x) = (f(x) * x + d) mod g(x)
-         *         ((f(x) mod g(x)) * x + d) mod g(x)
-         *         (c(x) * x + d) mod g(x)
-         * If c(x) = c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5, we want to
-         * compute
-         * c'(x) = (c0*x^5 + c1*x^4 + c2*x^3 + c3*x^2 + c4*x + c5) * x + d
-         *                                                             mod g(x)
-         *       = c0*x^6 + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + d
-         *                                                             mod g(x)
-         *       = c0*(x^6 mod g(x)) + c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 +
-         *                                                             c5*x + d
-         * If we call (x^6 mod g(x)) = k(x), this can be written as
-         * c'(x) = (c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + d) + c0*k(x)
-         */
-
-        // First, determine the value of c0:
-        uint8_t c0 = c >> 35;
-
-        // Then compute c1*x^5 + c2*x^4 + c3*x^3 + c4*x^2 + c5*x + d:
-        c = ((c & 0x07ffffffff) << 5) ^ d;
-
-        // Finally, for each set bit n in c0, conditionally add {2^n}k(x):
-        if (c0 & 0x01) {
-            // k(x) = {19}*x^7 + {3}*x^6 + {25}*x^5 + {11}*x^4 + {25}*x^3 +
-            //        {3}*x^2 + {19}*x + {1}
-            c ^= 0x98f2bc8e61;
-        }
-
-        if (c0 & 0x02) {
-            // {2}k(x) = {15}*x^7 + {6}*x^6 + {27}*x^5 + {22}*x^4 + {27}*x^3 +
-            //           {6}*x^2 + {15}*x + {2}
-            c ^= 0x79b76d99e2;
-        }
-
-        if (c0 & 0x04) {
-            // {4}k(x) = {30}*x^7 + {12}*x^6 + {31}*x^5 + {5}*x^4 + {31}*x^3 +
-            //           {12}*x^2 + {30}*x + {4}
-            c ^= 0xf33e5fb3c4;
-        }
-
-        if (c0 & 0x08) {
-            // {8}k(x) = {21}*x^7 + {24}*x^6 + {23}*x^5 + {10}*x^4 + {23}*x^3 +
-            //           {24}*x^2 + {21}*x + {8}
-            c ^= 0xae2eabe2a8;
-        }
-
-        if (c0 & 0x10) {
-            // {16}k(x) = {3}*x^7 + {25}*x^6 + {7}*x^5 + {20}*x^4 + {7}*x^3 +
-            //            {25}*x^2 + {3}*x + {16}
-            c ^= 0x1e4f43e470;
-        }
+        c = PolyModStep(c, d);
+    }
+    for (size_t i = 0; i < nZeroes; ++i) {
+        c = PolyModStep(c, 0);
     }
 
     /**
@@ -160,36 +182,19 @@ inline uint8_t LowerCase(uint8_t c) {
     return c | 0x20;
 }
 
-/**
- * Expand the address prefix for the checksum computation.
- */
-data ExpandPrefix(const std::string &prefix) {
-    data ret;
-    ret.resize(prefix.size() + 1);
-    for (size_t i = 0; i < prefix.size(); ++i) {
-        ret[i] = prefix[i] & 0x1f;
-    }
-
-    ret[prefix.size()] = 0;
-    return ret;
-}
-
 /**
  * Verify a checksum.
  */
 bool VerifyChecksum(const std::string &prefix, const data &payload) {
-    return PolyMod(Cat(ExpandPrefix(prefix), payload)) == 0;
+    return PolyMod(prefix, payload) == 0;
 }
 
 /**
  * Create a checksum.
  */
 data CreateChecksum(const std::string &prefix, const data &payload) {
-    data enc = Cat(ExpandPrefix(prefix), payload);
-    // Append 8 zeroes.
-    enc.resize(enc.size() + 8);
-    // Determine what to XOR into those 8 zeroes.
-    uint64_t mod = PolyMod(enc);
+    // Append 8 zeroes, and determine what to XOR into them.
+    uint64_t mod = PolyMod(prefix, payload, 8);
     data ret(8);
     for (size_t i = 0; i < 8; ++i) {
         // Convert the 5-bit groups in mod to checksum values.